@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -273,6 +274,9 @@ enum gptoss_status GPTOSS_ABI gptoss_context_reset(
 /*
  * Pre-process the tokens in the Context and generate probability distribution over the next token.
  *
+ * Tokens are processed in chunks of the model's maximum batch size. If the call is aborted or times out, the chunks
+ * that completed stay in the KV cache, and the next call continues after them.
+ *
  * @param context Context object created by gptoss_context_create.
  *
  * On success, returns gptoss_status_success, otherwise returns an error code.
@@ -280,6 +284,40 @@ enum gptoss_status GPTOSS_ABI gptoss_context_reset(
 enum gptoss_status GPTOSS_ABI gptoss_context_process(
     gptoss_context_t context);
 
+/*
+ * Aborts the blocking call in progress on the Context, or the next one if no call is in progress.
+ *
+ * Applies to gptoss_context_process, gptoss_context_score, and the sampling functions, including speculative sampling.
+ * The aborted call skips its remaining GPU work and returns gptoss_status_aborted. Tokens sampled before the abort
+ * stay in the context and are returned to the caller. Asynchronous requests and gptoss_batch_step are not affected.
+ * In gptoss_context_sample_speculative, the abort of the target context takes effect after the draft model finishes
+ * the draft tokens of the current round.
+ *
+ * Unlike other functions, this function may be called from any thread while another thread uses the Context.
+ *
+ * @param context Context object created by gptoss_context_create.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_abort(
+    gptoss_context_t context);
+
+/*
+ * Sets the time limit for each blocking call on the Context.
+ *
+ * Applies to the same functions as gptoss_context_abort. A call that runs out of time stops as if aborted, but
+ * returns gptoss_status_timeout. The deadline is checked while waiting for the GPU, about every 100 microseconds. The
+ * time limit of the target context in gptoss_context_sample_speculative includes sampling from the draft model.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param timeout_seconds Time limit in seconds. Must be non-negative. Specify 0 to remove the time limit.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_timeout(
+    gptoss_context_t context,
+    double timeout_seconds);
+
 /*
  * Generate a token probability distribution over the next token conditioned on the Context.
  *
@@ -298,6 +336,460 @@ enum gptoss_status GPTOSS_ABI gptoss_context_sample(
     uint32_t* tokens_out,
     size_t* num_tokens_out);
 
+/*
+ * Samples tokens like gptoss_context_sample, and also returns the log-probability of each sampled token and the
+ * num_top_logprobs most likely alternatives.
+ *
+ * Log-probabilities are computed at temperature 1.0 from the log-sum-exp of the unembedding pass that samples the
+ * token, and include the logit biases and token mask of the Context. Unlike gptoss_context_sample, this function waits
+ * for every token to complete before sampling the next one.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param num_top_logprobs Number of most likely tokens to return for every sampled token. Must not exceed 256.
+ * @param tokens_out Pointer to the array where the generated tokens will be stored. Must have max_tokens elements.
+ * @param logprobs_out Pointer to the array where the log-probabilities of the generated tokens will be stored. Must
+ *                     have max_tokens elements.
+ * @param top_tokens_out Pointer to the array where the most likely tokens will be stored, num_top_logprobs per
+ *                       generated token in descending order of probability. Must have max_tokens * num_top_logprobs
+ *                       elements. Missing tokens (e.g. excluded by the token mask) are stored as UINT32_MAX.
+ * @param top_logprobs_out Pointer to the array where the log-probabilities of the most likely tokens will be stored.
+ *                         Must have max_tokens * num_top_logprobs elements.
+ * @param num_tokens_out Pointer to the variable where the number of generated tokens will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_with_logprobs(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    uint32_t num_top_logprobs,
+    uint32_t* tokens_out,
+    float* logprobs_out,
+    uint32_t* top_tokens_out,
+    float* top_logprobs_out,
+    size_t* num_tokens_out);
+
+/*
+ * Samples tokens like gptoss_context_sample, and delivers each token to a callback as soon as it is sampled.
+ *
+ * Every token is computed in a separate GPU submission, and several submissions are queued ahead of the token being
+ * delivered, so streaming does not stall the GPU between tokens. The callback runs on the calling thread and may stop
+ * sampling early; tokens already queued behind the last delivered token are then discarded from the Context. At most
+ * min(max_tokens, remaining context space) tokens are sampled.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param callback Function to call with every sampled token, or NULL.
+ * @param user_data Pointer passed to the callback.
+ * @param tokens_out Pointer to the array where the generated tokens will be stored. Must have max_tokens elements.
+ * @param num_tokens_out Pointer to the variable where the number of generated tokens will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_streaming(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    gptoss_token_callback_t callback,
+    void* user_data,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out);
+
+/*
+ * Appends tokens to the Context and computes the log-probability of each of them conditioned on all preceding tokens.
+ *
+ * All tokens are scored in batched passes of the model, without sampling. Log-probabilities are computed at
+ * temperature 1.0 and ignore the logit biases and token mask of the Context.
+ *
+ * @param context Context object created by gptoss_context_create. Must contain at least one token.
+ * @param num_tokens Number of tokens to be appended and scored.
+ * @param tokens Pointer to the array of tokens to be appended and scored.
+ * @param logprobs_out Pointer to the array where the log-probabilities of the tokens will be stored. Must have
+ *                     num_tokens elements.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code and leaves the tokens of the Context
+ * unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_score(
+    gptoss_context_t context,
+    size_t num_tokens,
+    const uint32_t* tokens,
+    float* logprobs_out);
+
+/*
+ * Samples tokens from the Context with speculative decoding: a smaller draft model proposes tokens, and the Context's
+ * model verifies all of them in a single batched pass.
+ *
+ * Every verified position is sampled with the same random numbers as in gptoss_context_sample, and draft tokens are
+ * accepted while they match the verified samples. Thus, the generated tokens are identical to those of
+ * gptoss_context_sample with the same temperature and seed, and each round produces between 1 and
+ * num_draft_tokens + 1 tokens. The draft context samples with its own top-k and min-p settings, which should match
+ * those of the Context to maximize the acceptance rate. Grammar constraints are not supported.
+ *
+ * @param context Context object created by gptoss_context_create. Must contain at least one token.
+ * @param draft_context Context object for the draft model, which must share the vocabulary with the Context's model.
+ *                      Its tokens are replaced with the tokens of the Context in every round.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param num_draft_tokens Maximum number of tokens to draft in each round.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param tokens_out Pointer to the array where the generated tokens will be stored. Must have max_tokens elements.
+ * @param num_tokens_out Pointer to the variable where the number of generated tokens will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_speculative(
+    gptoss_context_t context,
+    gptoss_context_t draft_context,
+    float temperature,
+    uint64_t seed,
+    size_t num_draft_tokens,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out);
+
+/*
+ * Samples tokens from the Context with prompt lookup decoding: draft tokens are copied from the continuation of the
+ * latest earlier occurrence of the longest n-gram (up to 4 tokens) that ends the Context, and verified in a single
+ * batched pass.
+ *
+ * The generated tokens are identical to those of gptoss_context_sample with the same temperature and seed. Prompt
+ * lookup speeds up sampling when the output copies spans of the Context, e.g. in code editing or retrieval-augmented
+ * generation, and needs no draft model. The first call on a Context allocates the n-gram index, which takes 16 to 32
+ * bytes per token of the context length. Grammar constraints are not supported.
+ *
+ * @param context Context object created by gptoss_context_create. Must contain at least one token.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param num_draft_tokens Maximum number of tokens to draft in each round.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param tokens_out Pointer to the array where the generated tokens will be stored. Must have max_tokens elements.
+ * @param num_tokens_out Pointer to the variable where the number of generated tokens will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_prompt_lookup(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t num_draft_tokens,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out);
+
+/*
+ * Samples tokens from the Context with self-speculative decoding: a reduced version of the Context's model, which
+ * runs only the first blocks and fewer experts per token, proposes tokens that the full model verifies in a single
+ * batched pass.
+ *
+ * The draft shares the weights and the KV cache of the Context, so it needs no extra memory. The generated tokens are
+ * identical to those of gptoss_context_sample with the same temperature and seed. Grammar constraints are not
+ * supported.
+ *
+ * @param context Context object created by gptoss_context_create. Must contain at least one token.
+ * @param num_draft_blocks Number of leading transformer blocks that the draft runs. Must be between 1 and the number
+ *                         of blocks in the model.
+ * @param num_draft_experts Number of experts per token in the draft. Must be between 1 and the number of active
+ *                          experts in the model.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param num_draft_tokens Maximum number of tokens to draft in each round.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param tokens_out Pointer to the array where the generated tokens will be stored. Must have max_tokens elements.
+ * @param num_tokens_out Pointer to the variable where the number of generated tokens will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_self_speculative(
+    gptoss_context_t context,
+    uint32_t num_draft_blocks,
+    uint32_t num_draft_experts,
+    float temperature,
+    uint64_t seed,
+    size_t num_draft_tokens,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out);
+
+/*
+ * Submits the processing of the tokens in the Context to the GPU without waiting for it to complete.
+ *
+ * Subsequent calls on the Context, including other asynchronous calls, may be issued immediately: the submitted work
+ * runs in order. Blocking functions on the Context first wait for all submitted work to complete.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param callback Function to call when the processing completes, or NULL.
+ * @param user_data Pointer passed to the callback.
+ * @param request_out Pointer to the Request object that will be created.
+ *                    Must be released with gptoss_request_release.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Request in the request_out argument.
+ * On failure, returns an error code and stores a null pointer in the request_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_process_async(
+    gptoss_context_t context,
+    gptoss_request_callback_t callback,
+    void* user_data,
+    gptoss_request_t* request_out);
+
+/*
+ * Submits the sampling of tokens from the Context to the GPU without waiting for it to complete.
+ *
+ * The sampled tokens are identical to those of gptoss_context_sample with the same arguments, and are appended to the
+ * Context as soon as the function returns, so that further tokens may be appended or sampled right away. Exactly
+ * min(max_tokens, remaining context space) tokens are sampled. Grammar constraints, stop tokens, and stop sequences are
+ * not supported.
+ *
+ * @param context Context object created by gptoss_context_create. Must contain at least one token.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param max_tokens Maximum number of tokens to generate.
+ * @param callback Function to call when the sampling completes, or NULL.
+ * @param user_data Pointer passed to the callback.
+ * @param request_out Pointer to the Request object that will be created. The sampled tokens can be retrieved with
+ *                    gptoss_request_get_tokens after completion. Must be released with gptoss_request_release.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Request in the request_out argument.
+ * On failure, returns an error code and stores a null pointer in the request_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_async(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    gptoss_request_callback_t callback,
+    void* user_data,
+    gptoss_request_t* request_out);
+
+/*
+ * Checks whether the work of a Request completed, without blocking.
+ *
+ * @param request Request object created by gptoss_context_process_async or gptoss_context_sample_async.
+ * @param completed_out Pointer to the variable where the completion flag will be stored.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_request_poll(
+    gptoss_request_t request,
+    bool* completed_out);
+
+/*
+ * Blocks until the work of a Request completes.
+ *
+ * The callback of the Request may still be running when this function returns.
+ *
+ * @param request Request object created by gptoss_context_process_async or gptoss_context_sample_async.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_request_wait(
+    gptoss_request_t request);
+
+/*
+ * Retrieves the tokens sampled by a completed Request.
+ *
+ * @param request Request object created by gptoss_context_sample_async. Must have completed.
+ * @param tokens_out Pointer to the array where the sampled tokens will be stored.
+ * @param max_tokens Maximum number of tokens to store in tokens_out.
+ * @param num_tokens_out Pointer to the variable where the number of sampled tokens will be stored. Requests created
+ *                       by gptoss_context_process_async sample no tokens.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ * If max_tokens is less than the number of sampled tokens, returns gptoss_status_insufficient_memory.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_request_get_tokens(
+    gptoss_request_t request,
+    uint32_t* tokens_out,
+    size_t max_tokens,
+    size_t* num_tokens_out);
+
+/*
+ * Increments a Request object's reference count.
+ *
+ * @param request Pointer to the Request object created by gptoss_context_process_async or gptoss_context_sample_async.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_request_retain(
+    gptoss_request_t request);
+
+/*
+ * Decrements a Request object's reference count and possibly releases associated resources.
+ *
+ * Releasing a Request does not cancel its work.
+ *
+ * @param request Pointer to the Request object created by gptoss_context_process_async or gptoss_context_sample_async.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_request_release(
+    gptoss_request_t request);
+
+/*
+ * Advances several Contexts of the same model by one step in a single batched pass of the model.
+ *
+ * The pass processes up to max_step_tokens pending (not yet processed) tokens of the Contexts and samples one token for
+ * some of them. Contexts without pending tokens other than the last one sample first. Then, every Context with a
+ * pending prefill either processes all of it and samples, if it fits into the remaining budget of the step, or
+ * processes a chunk of the remaining budget and continues in a later step. Thus, long prompts are prefilled in chunks
+ * interleaved with the decoding of other Contexts, and the budget bounds the duration of a step.
+ *
+ * The weights are read once per step for all Contexts, while attention runs over the KV cache of each Context. Every
+ * Context samples with its own top-k and min-p settings, and the sampled tokens are identical to those of
+ * gptoss_context_sample with the same temperature and seed. Grammar constraints, logit biases, token masks, stop
+ * tokens, and stop sequences are not supported.
+ *
+ * @param num_contexts Number of Contexts in the batch. Must be at least 1.
+ * @param contexts Pointer to the array of distinct Context objects created by gptoss_context_create for the same
+ *                 Model. Each Context must contain at least one token and have space for one more token.
+ * @param max_step_tokens Maximum number of tokens to process in the step. Specify 0 to use the maximum batch size of
+ *                        the Model. Values above the maximum batch size are clamped to it.
+ * @param temperature Sampling temperature. Must be non-negative.
+ * @param seed Random number generator seed to use for sampling.
+ * @param tokens_out Pointer to the array where the sampled tokens will be stored. Must have num_contexts elements.
+ *                   Contexts that did not sample a token in this step get UINT32_MAX.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_batch_step(
+    size_t num_contexts,
+    const gptoss_context_t* contexts,
+    size_t max_step_tokens,
+    float temperature,
+    uint64_t seed,
+    uint32_t* tokens_out);
+
+/*
+ * Restricts sampling in gptoss_context_sample to the top_k most likely tokens.
+ *
+ * Applies only to sampling with non-zero temperature.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param top_k Number of most likely tokens to sample from. Must not exceed 256. Specify 0 to disable the filter.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_top_k(
+    gptoss_context_t context,
+    uint32_t top_k);
+
+/*
+ * Restricts sampling in gptoss_context_sample to tokens with probability at least min_p times the probability of
+ * the most likely token.
+ *
+ * Applies only to sampling with non-zero temperature.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param min_p Minimum relative probability. Must be in the [0.0, 1.0] range. Specify 0.0 to disable the filter.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_min_p(
+    gptoss_context_t context,
+    float min_p);
+
+/*
+ * Adds per-token biases to the unembedding outputs of the Context object.
+ *
+ * Biases apply to the argmax, sampling, and log-probabilities of all subsequently processed tokens, and replace
+ * the biases from any previous call. Biases for repeated token IDs are summed. A bias of -INFINITY excludes the token.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param num_biases Number of elements in the token_ids and biases arrays. Specify 0 to remove all biases.
+ * @param token_ids Pointer to the array of token IDs to bias. Each token ID must be less than the vocabulary size.
+ * @param biases Pointer to the array of biases to add to the unembedding outputs of the matching token IDs.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_logit_bias(
+    gptoss_context_t context,
+    size_t num_biases,
+    const uint32_t* token_ids,
+    const float* biases);
+
+/*
+ * Restricts the unembedding outputs of the Context object to the allowed tokens.
+ *
+ * Disallowed tokens get -INFINITY unembedding outputs for all subsequently processed tokens, and are never produced
+ * by the argmax or sampling. The mask replaces the mask from any previous call.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param token_mask Pointer to the bitmask of allowed tokens, with (vocabulary size + 31) / 32 elements. Token ID t
+ *                   is allowed if bit (t % 32) of token_mask[t / 32] is set. At least one token must be allowed.
+ *                   Specify NULL to allow all tokens.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_token_mask(
+    gptoss_context_t context,
+    const uint32_t* token_mask);
+
+/*
+ * Constrains tokens sampled by gptoss_context_sample to the language of a Grammar object.
+ *
+ * Before sampling each token, the context computes the mask of tokens allowed by the grammar and uses it in place of
+ * the mask set by gptoss_context_set_token_mask. Sampled tokens are accepted into the grammar. Sampling stops early
+ * after a terminating special token (<|return|>, <|end|>, or <|call|>), which is allowed only once the grammar matched.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param grammar Grammar object created by gptoss_grammar_create for the tokenizer of the context's model.
+ *                Specify NULL to remove the grammar constraint.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_grammar(
+    gptoss_context_t context,
+    gptoss_grammar_t grammar);
+
+/*
+ * Stops sampling after any of the given tokens.
+ *
+ * Applies to gptoss_context_sample, gptoss_context_sample_with_logprobs, gptoss_context_sample_streaming, and the
+ * speculative sampling functions. The stop token is returned as the last sampled token, and the steps encoded after it
+ * are skipped on the GPU. Speculative sampling checks the accepted tokens after each verification pass, and discards
+ * the tokens after the stop. gptoss_context_sample_async and gptoss_batch_step reject Contexts with stop tokens. The
+ * stop tokens replace the stop tokens from any previous call.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param num_stop_tokens Number of elements in the stop_tokens array. Specify 0 to remove all stop tokens.
+ * @param stop_tokens Pointer to the array of stop token IDs. Each token ID must be less than the vocabulary size.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_stop_tokens(
+    gptoss_context_t context,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens);
+
+/*
+ * Stops sampling once the bytes of the sampled tokens contain any of the given byte sequences.
+ *
+ * Applies to the same functions as gptoss_context_set_stop_tokens. Sequences are matched against the bytes of the
+ * tokens sampled by each call, and may span several tokens. The token that completes a sequence is returned as the
+ * last sampled token, so the returned text may extend past the end of the sequence within that token. Special tokens
+ * have no bytes and break sequences. The stop sequences replace the stop sequences from any previous call.
+ *
+ * @param context Context object created by gptoss_context_create.
+ * @param num_stop_sequences Number of elements in the stop_sequences and stop_sequence_sizes arrays. Specify 0 to
+ *                           remove all stop sequences.
+ * @param stop_sequences Pointer to the array of pointers to the stop sequences.
+ * @param stop_sequence_sizes Pointer to the array of sizes of the stop sequences, in bytes. Must be non-zero.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_context_set_stop_sequences(
+    gptoss_context_t context,
+    size_t num_stop_sequences,
+    const char* const* stop_sequences,
+    const size_t* stop_sequence_sizes);
+
 /*
  * Increments a Context object's reference count.
  *
@@ -318,6 +810,85 @@ enum gptoss_status GPTOSS_ABI gptoss_context_retain(
 enum gptoss_status GPTOSS_ABI gptoss_context_release(
     gptoss_context_t context);
 
+/*
+ * Creates a Grammar object from a grammar in EBNF notation.
+ *
+ * The grammar is a sequence of rules "name ::= alternatives", where alternatives are separated by "|", and each
+ * alternative is a sequence of rule names, "string" literals, [byte] classes (with ranges and ^ negation), "." (any
+ * byte), and (groups), each optionally followed by "*", "+", or "?". Literals and classes support \n, \r, \t, and
+ * \xHH escapes. Comments start with "#". The grammar matches byte sequences, starting from the "root" rule.
+ * Left-recursive rules are not supported.
+ *
+ * @param tokenizer Tokenizer object of the model to constrain.
+ * @param grammar Pointer to the grammar text.
+ * @param grammar_size Size of the grammar text, in bytes.
+ * @param grammar_out Pointer to the Grammar object that will be created.
+ *                    Must be released with gptoss_grammar_release.
+ *
+ * On success, returns gptoss_status_success and saves a pointer to the created Grammar in the grammar_out argument.
+ * On failure, returns an error code and stores a null pointer in the grammar_out argument.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_grammar_create(
+    gptoss_tokenizer_t tokenizer,
+    const char* grammar,
+    size_t grammar_size,
+    gptoss_grammar_t* grammar_out);
+
+/*
+ * Computes the mask of tokens that the Grammar object allows next.
+ *
+ * @param grammar Grammar object created by gptoss_grammar_create.
+ * @param token_mask_out Pointer to the array of (number of tokens + 31) / 32 elements where the mask will be stored.
+ *                       Token ID t is allowed if bit (t % 32) of token_mask_out[t / 32] is set.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_grammar_get_token_mask(
+    gptoss_grammar_t grammar,
+    uint32_t* token_mask_out);
+
+/*
+ * Advances the Grammar object past a token.
+ *
+ * @param grammar Grammar object created by gptoss_grammar_create.
+ * @param token_id Token ID to accept. Must be allowed by the grammar.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code and leaves the grammar unchanged.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_grammar_accept_token(
+    gptoss_grammar_t grammar,
+    uint32_t token_id);
+
+/*
+ * Resets the Grammar object to the state before any tokens were accepted.
+ *
+ * @param grammar Grammar object created by gptoss_grammar_create.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_grammar_reset(
+    gptoss_grammar_t grammar);
+
+/*
+ * Increments a Grammar object's reference count.
+ *
+ * @param grammar Pointer to the Grammar object created by gptoss_grammar_create.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_grammar_retain(
+    gptoss_grammar_t grammar);
+
+/*
+ * Decrements a Grammar object's reference count and possibly releases associated resources.
+ *
+ * @param grammar Pointer to the Grammar object created by gptoss_grammar_create.
+ *
+ * On success, returns gptoss_status_success, otherwise returns an error code.
+ */
+enum gptoss_status GPTOSS_ABI gptoss_grammar_release(
+    gptoss_grammar_t grammar);
+
 /*
  * Creates a Sampler object.
  *
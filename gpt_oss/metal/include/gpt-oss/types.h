@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 /*
  * Status codes returned by GPT-OSS API functions.
  */
@@ -13,6 +16,8 @@ enum gptoss_status {
     gptoss_status_insufficient_resources = 6,
     gptoss_status_unsupported_system = 7,
     gptoss_status_context_overflow = 8,
+    gptoss_status_aborted = 9,
+    gptoss_status_timeout = 10,
 };
 
 enum gptoss_special_token {
@@ -50,6 +55,35 @@ typedef struct gptoss_tokenizer* gptoss_tokenizer_t;
  */
 typedef struct gptoss_context* gptoss_context_t;
 
+/*
+ * Grammar is an opaque container comprised of:
+ * - Compiled grammar rules
+ * - Parser state after the tokens accepted so far
+ *
+ * Grammar objects are bound to a tokenizer, and can be used with any context of a model with that tokenizer.
+ */
+typedef struct gptoss_grammar* gptoss_grammar_t;
+
+/*
+ * Request is an opaque handle for work submitted to the GPU by gptoss_context_process_async or
+ * gptoss_context_sample_async. It tracks the completion of the work and holds the tokens it sampled.
+ */
+typedef struct gptoss_request* gptoss_request_t;
+
+/*
+ * Function called once when the work of a Request completes.
+ *
+ * The callback runs on an internal thread and must not call other functions on the Context of the Request.
+ */
+typedef void (*gptoss_request_callback_t)(gptoss_request_t request, void* user_data);
+
+/*
+ * Function called with every token sampled by gptoss_context_sample_streaming, in order, as soon as it is sampled.
+ *
+ * Returns true to continue sampling, or false to stop after this token.
+ */
+typedef bool (*gptoss_token_callback_t)(uint32_t token, void* user_data);
+
 /*
  * Sampler is an opaque container for sampling parameters:
  * - Temperature
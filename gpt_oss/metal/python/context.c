@@ -120,19 +120,28 @@ static PyObject* PyGPTOSSContext_process(PyGPTOSSContext* self) {
 }
 
 static PyObject* PyGPTOSSContext_sample(PyGPTOSSContext* self, PyObject* args, PyObject* kwargs) {
-    static char *kwlist[] = {"max_output_tokens", "temperature", "seed", NULL};
+    static char *kwlist[] = {"max_output_tokens", "temperature", "seed", "top_k", "min_p", NULL};
     PyObject* token_list_obj = NULL;
     uint32_t* token_ptr = NULL;
 
     unsigned int max_output_tokens = 0;
     unsigned long long seed = 0;
     float temperature = 1.0f;
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|$fK", kwlist,
-            &max_output_tokens, &temperature, &seed))
+    unsigned int top_k = 0;
+    float min_p = 0.0f;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|$fKIf", kwlist,
+            &max_output_tokens, &temperature, &seed, &top_k, &min_p))
     {
         return NULL;
     }
 
+    if (gptoss_context_set_top_k(self->handle, (uint32_t) top_k) != gptoss_status_success ||
+        gptoss_context_set_min_p(self->handle, min_p) != gptoss_status_success)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid top_k or min_p sampling parameter");
+        return NULL;
+    }
+
     token_ptr = (uint32_t*) PyMem_Malloc(max_output_tokens * sizeof(uint32_t));
     if (token_ptr == NULL) {
         goto error;
@@ -170,6 +179,66 @@ error:
     return NULL;
 }
 
+static PyObject* PyGPTOSSContext_score(PyGPTOSSContext* self, PyObject* tokens_arg) {
+    PyObject* tokens_seq_obj = NULL;
+    PyObject* logprob_list_obj = NULL;
+    uint32_t* token_ptr = NULL;
+    float* logprob_ptr = NULL;
+
+    tokens_seq_obj = PySequence_Fast(tokens_arg, "expected a sequence of integer tokens");
+    if (tokens_seq_obj == NULL) {
+        return NULL;
+    }
+
+    const size_t num_tokens = (size_t) PySequence_Fast_GET_SIZE(tokens_seq_obj);
+    token_ptr = (uint32_t*) PyMem_Malloc(num_tokens * sizeof(uint32_t));
+    logprob_ptr = (float*) PyMem_Malloc(num_tokens * sizeof(float));
+    if (token_ptr == NULL || logprob_ptr == NULL) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (size_t t = 0; t < num_tokens; t++) {
+        const unsigned long token = PyLong_AsUnsignedLong(PySequence_Fast_GET_ITEM(tokens_seq_obj, (Py_ssize_t) t));
+        if (PyErr_Occurred()) {
+            goto error;
+        }
+        token_ptr[t] = (uint32_t) token;
+    }
+
+    const enum gptoss_status status = gptoss_context_score(self->handle, num_tokens, token_ptr, logprob_ptr);
+    if (status != gptoss_status_success) {
+        // TODO: set exception
+        goto error;
+    }
+
+    logprob_list_obj = PyList_New((Py_ssize_t) num_tokens);
+    if (logprob_list_obj == NULL) {
+        goto error;
+    }
+
+    for (size_t t = 0; t < num_tokens; t++) {
+        PyObject* logprob_obj = PyFloat_FromDouble((double) logprob_ptr[t]);
+        if (logprob_obj == NULL) {
+            goto error;
+        }
+
+        PyList_SET_ITEM(logprob_list_obj, (Py_ssize_t) t, logprob_obj);
+    }
+
+    PyMem_Free(token_ptr);
+    PyMem_Free(logprob_ptr);
+    Py_DECREF(tokens_seq_obj);
+    return logprob_list_obj;
+
+error:
+    PyMem_Free(token_ptr);
+    PyMem_Free(logprob_ptr);
+    Py_XDECREF(tokens_seq_obj);
+    Py_XDECREF(logprob_list_obj);
+    return NULL;
+}
+
 static PyObject* PyGPTOSSContext_reset(PyGPTOSSContext* self) {
     const enum gptoss_status status = gptoss_context_reset(self->handle);
     if (status != gptoss_status_success) {
@@ -185,6 +254,7 @@ static PyMethodDef PyGPTOSSContext_methods[] = {
     {"append", (PyCFunction) PyGPTOSSContext_append, METH_O, "Append bytes to the Context"},
     {"process", (PyCFunction) PyGPTOSSContext_process, METH_NOARGS, "Process tokens in the Context"},
     {"sample", (PyCFunction) PyGPTOSSContext_sample, METH_VARARGS | METH_KEYWORDS, "Sample token predictions from the Context"},
+    {"score", (PyCFunction) PyGPTOSSContext_score, METH_O, "Append tokens to the Context and return their log-probabilities"},
     {"reset", (PyCFunction) PyGPTOSSContext_reset, METH_NOARGS, "Discard the content of the Context"},
     {NULL},
 };
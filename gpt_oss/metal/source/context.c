@@ -1,18 +1,22 @@
 #include <assert.h>
 #include <float.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <gpt-oss.h>
 
 #include "internal/datatype.h"
+#include "internal/grammar.h"
 #include "internal/model.h"
 #include "internal/metal.h"
 #include "internal/metal-kernels.h"
 #include "internal/log.h"
+#include "internal/math.h"
 #include "internal/rng.h"
 
 
@@ -64,6 +68,11 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
     if (status != gptoss_status_success) {
         goto cleanup;
     }
+    // KV splits are only used while the (token, Q head group) pairs times splits fit into max_threadgroups.
+    status = gptoss_metal_buffer_create(&model->device, model->max_threadgroups * (model->head_dim + 2) * model->sdpa_threadgroup_qmul * sizeof(float), NULL, &context->sdpa_partial_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
     status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->num_experts * sizeof(float), NULL, &context->gate_activation_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
@@ -80,6 +89,20 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
     if (status != gptoss_status_success) {
         goto cleanup;
     }
+    status = gptoss_metal_buffer_create(&model->device, (model->num_experts + 1) * sizeof(uint32_t), NULL, &context->expert_offset_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->num_active_experts * sizeof(uint32_t), NULL, &context->expert_assignment_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_metal_buffer_create(&model->device,
+        EXPERT_GROUP_MAX_TASKS(model->max_batch_tokens * model->num_active_experts, model->num_experts) * sizeof(struct gptoss_expert_group_task),
+        NULL, &context->expert_task_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
 
     // Input/output buffers
     status = gptoss_metal_buffer_create(&model->device, sizeof(struct gptoss_control), NULL, &context->control_buffer);
@@ -94,15 +117,27 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->vocabulary_size * sizeof(float), NULL, &context->prob_buffer);
+    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * sizeof(uint64_t), NULL, &context->argmax_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->max_threadgroups * sizeof(float), NULL, &context->sum_buffer);
+    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * model->max_threadgroups * 2 * sizeof(float), NULL, &context->lse_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_buffer_create(&model->device, model->max_batch_tokens * sizeof(uint64_t), NULL, &context->argmax_buffer);
+    status = gptoss_metal_buffer_create(&model->device, model->max_threadgroups * GPTOSS_MAX_TOP_K * 2 * sizeof(uint32_t), NULL, &context->sample_candidate_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_metal_buffer_create(&model->device, model->vocabulary_size * sizeof(float), NULL, &context->logit_bias_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_metal_buffer_create(&model->device, math_ceil_div(model->vocabulary_size, 32) * sizeof(uint32_t), NULL, &context->token_mask_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_metal_buffer_create(&model->device, math_ceil_div(model->vocabulary_size, 32) * sizeof(uint32_t), NULL, &context->stop_token_mask_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
@@ -110,13 +145,20 @@ enum gptoss_status GPTOSS_ABI gptoss_context_create(
     if (status != gptoss_status_success) {
         goto cleanup;
     }
+    status = gptoss_metal_buffer_create(&model->device, context_length * (model->head_dim / 2) * 2 * sizeof(float), NULL, &context->rope_table_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
 
     context->kvcache_size = context->kvcache_buffer.size;
     context->allocation_size = 
         context->residual_activation_buffer.size + context->rmsnorm_activation_buffer.size +
-        context->qkv_activation_buffer.size + context->sdpa_activation_buffer.size +
+        context->qkv_activation_buffer.size + context->sdpa_activation_buffer.size + context->sdpa_partial_buffer.size +
         context->gate_activation_buffer.size + context->expert_activation_buffer.size + context->swiglu_activation_buffer.size + context->moe_activation_buffer.size +
-        context->token_buffer.size + context->kvcache_buffer.size + context->score_buffer.size + context->argmax_buffer.size;
+        context->expert_offset_buffer.size + context->expert_assignment_buffer.size + context->expert_task_buffer.size +
+        context->token_buffer.size + context->kvcache_buffer.size + context->score_buffer.size + context->argmax_buffer.size +
+        context->lse_buffer.size + context->sample_candidate_buffer.size + context->logit_bias_buffer.size +
+        context->token_mask_buffer.size + context->stop_token_mask_buffer.size + context->rope_table_buffer.size;
 
     context->model = model;
     gptoss_model_retain(model);
@@ -144,12 +186,121 @@ enum gptoss_status GPTOSS_ABI gptoss_context_get_max_tokens(
     return gptoss_status_success;
 }
 
+static uint64_t get_monotonic_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * UINT64_C(1000000000) + (uint64_t) ts.tv_nsec;
+}
+
+// Ends a blocking call started with begin_call.
+static void end_call(
+    gptoss_context_t context)
+{
+    // Wait for a concurrent gptoss_context_abort to finish writing the abort flag, so that it can't leak into the
+    // next call.
+    unsigned int expected_state = gptoss_call_state_running;
+    while (!atomic_compare_exchange_weak_explicit(&context->call_state, &expected_state, gptoss_call_state_idle,
+        memory_order_seq_cst, memory_order_relaxed))
+    {
+        expected_state = gptoss_call_state_running;
+    }
+    atomic_store_explicit(&context->abort_requested, false, memory_order_relaxed);
+}
+
+// Starts a blocking call that gptoss_context_abort may cancel, and starts its deadline. Returns gptoss_status_aborted
+// if an abort was requested while no call was running. Each successful begin_call must be paired with end_call.
+static enum gptoss_status begin_call(
+    gptoss_context_t context)
+{
+    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+    control->abort = 0;
+    context->deadline_ns = context->timeout_ns != 0 ? get_monotonic_time_ns() + context->timeout_ns : 0;
+
+    // From here on, gptoss_context_abort sets the abort flag of the command buffers of this call.
+    atomic_store_explicit(&context->call_state, gptoss_call_state_running, memory_order_seq_cst);
+    if (atomic_load_explicit(&context->abort_requested, memory_order_seq_cst)) {
+        end_call(context);
+        return gptoss_status_aborted;
+    }
+    return gptoss_status_success;
+}
+
+// Waits for a command buffer of a call started with begin_call. Returns gptoss_status_aborted if gptoss_context_abort
+// was called, or gptoss_status_timeout if the deadline of the call passed, before the command buffer completed. In
+// both cases, the kernels after that point were skipped and the results of the command buffer are invalid.
+static enum gptoss_status wait_command_buffer(
+    gptoss_context_t context,
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    bool timed_out = false;
+    if (context->deadline_ns != 0) {
+        for (;;) {
+            bool completed = false;
+            const enum gptoss_status status = gptoss_metal_command_buffer_is_completed(command_buffer, &completed);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+            if (completed) {
+                break;
+            }
+
+            const uint64_t time_ns = get_monotonic_time_ns();
+            if (time_ns >= context->deadline_ns) {
+                struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+                control->abort = 1;
+                timed_out = true;
+                break;
+            }
+            const uint64_t sleep_ns = math_min(context->deadline_ns - time_ns, GPTOSS_DEADLINE_POLL_INTERVAL_NS);
+            nanosleep(&(struct timespec) { .tv_sec = 0, .tv_nsec = (long) sleep_ns }, NULL);
+        }
+    }
+
+    const enum gptoss_status status = gptoss_metal_command_buffer_wait_completion(command_buffer, NULL);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    if (atomic_load_explicit(&context->abort_requested, memory_order_seq_cst)) {
+        return gptoss_status_aborted;
+    }
+    return timed_out ? gptoss_status_timeout : gptoss_status_success;
+}
+
+// Returns gptoss_status_aborted if gptoss_context_abort was called, or gptoss_status_timeout if the deadline passed,
+// during a call started with begin_call. Checked between steps of a call that don't wait for a command buffer of the
+// context.
+static enum gptoss_status get_call_status(
+    gptoss_context_t context)
+{
+    if (atomic_load_explicit(&context->abort_requested, memory_order_seq_cst)) {
+        return gptoss_status_aborted;
+    }
+    if (context->deadline_ns != 0 && get_monotonic_time_ns() >= context->deadline_ns) {
+        return gptoss_status_timeout;
+    }
+    return gptoss_status_success;
+}
+
+// Waits for the work submitted by the asynchronous functions, so that the host can access the context's buffers.
+static void finish_pending_request(
+    gptoss_context_t context)
+{
+    struct gptoss_request* request = context->pending_request;
+    if (request != NULL) {
+        gptoss_metal_command_buffer_wait_completion(&request->command_buffer, NULL);
+        context->pending_request = NULL;
+        gptoss_request_release(request);
+    }
+}
+
 enum gptoss_status GPTOSS_ABI gptoss_context_get_tokens(
     gptoss_context_t context,
     uint32_t* tokens_out,
     size_t max_tokens,
     size_t* num_tokens_out)
 {
+    finish_pending_request(context);
+
     *num_tokens_out = context->num_tokens;
     if (max_tokens < context->num_tokens) {
         return gptoss_status_insufficient_memory;
@@ -161,15 +312,465 @@ enum gptoss_status GPTOSS_ABI gptoss_context_get_tokens(
     return gptoss_status_success;
 }
 
+// Extends the (cos, sin) RoPE table to cover at least num_tokens positions. The table is built lazily in chunks of
+// GPTOSS_ROPE_TABLE_CHUNK_SIZE positions so that short conversations don't pay for the full context length upfront.
+// Positions never change their rotation, so entries stay valid across gptoss_context_reset.
+static void extend_rope_table(
+    struct gptoss_context* context,
+    size_t num_tokens)
+{
+    if (num_tokens <= context->num_rope_table_tokens) {
+        return;
+    }
+
+    const struct gptoss_model* model = context->model;
+    const size_t num_pairs = model->head_dim / 2;
+    const double yarn_multiplier = (double) model->yarn_multiplier;
+    const size_t table_end = math_min(math_round_up_po2(num_tokens, GPTOSS_ROPE_TABLE_CHUNK_SIZE), context->max_tokens);
+    float* table = (float*) context->rope_table_buffer.ptr;
+    for (size_t t = context->num_rope_table_tokens; t < table_end; t++) {
+        for (size_t i = 0; i < num_pairs; i++) {
+            const double phi = (double) t * model->rope_inv_freq[i];
+            table[(t * num_pairs + i) * 2 + 0] = (float) (cos(phi) * yarn_multiplier);
+            table[(t * num_pairs + i) * 2 + 1] = (float) (sin(phi) * yarn_multiplier);
+        }
+    }
+    context->num_rope_table_tokens = table_end;
+}
+
+// Encodes the attention of num_q_tokens consecutive tokens, starting at position token_offset in kv_context, over the
+// KV cache of kv_context. Q is read from row q_row_offset of the QKV activations of the context, and the attention
+// output is written to row output_row_offset of its SDPA activations.
+static enum gptoss_status encode_attention(
+    gptoss_context_t context,
+    gptoss_context_t kv_context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    uint32_t n,
+    size_t q_row_offset,
+    size_t output_row_offset,
+    size_t num_q_tokens,
+    size_t token_offset)
+{
+    const struct gptoss_model* model = context->model;
+    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+    const size_t sdpa_dim = model->head_dim * model->num_heads;
+
+    enum gptoss_status status = gptoss_status_success;
+    if (num_q_tokens >= SDPA_PREFILL_Bq) {
+        // Prefill: tiles of Q tokens share each KV tile loaded into threadgroup memory.
+        status = gptoss_metal_command_buffer_encode_launch_f32_sdpa_prefill(
+            command_buffer,
+            &model->f32_sdpa_prefill_fn,
+            &context->qkv_activation_buffer,
+            /*q_offset=*/attn_qkv_dim * q_row_offset * sizeof(float),
+            &kv_context->kvcache_buffer,
+            /*kv_offset=*/n * model->num_kv_heads * kv_context->max_tokens * 2 * model->head_dim * sizeof(float),
+            &model->shared_weight_buffer,
+            /*s_offset=*/model->attn_sdpa_sink_offset + model->per_block_shared_weights_size * n,
+            &context->sdpa_activation_buffer,
+            /*output_offset=*/sdpa_dim * output_row_offset * sizeof(float),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            /*window=*/n % 2 == 0 ? model->attention_window : UINT32_MAX,
+            /*kv_stride=*/2 * kv_context->max_tokens * model->head_dim,
+            num_q_tokens,
+            token_offset,
+            model->num_heads, model->num_kv_heads, model->head_dim,
+            model->sdpa_threadgroup_qmul);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_sdpa_prefill kernel launch");
+            return status;
+        }
+    } else {
+        const uint32_t window = n % 2 == 0 ? model->attention_window : UINT32_MAX;
+        // With few query tokens, (token, Q head group) pairs alone do not occupy the GPU on long contexts:
+        // split the attended KV range across threadgroups and merge the partial softmax states afterwards.
+        const size_t num_sdpa_pairs = num_q_tokens * (model->num_heads / model->sdpa_threadgroup_qmul);
+        size_t num_kv_splits = 1;
+        if (num_sdpa_pairs < model->max_threadgroups) {
+            const size_t num_attended_tokens = math_min(token_offset + num_q_tokens, window);
+            num_kv_splits = math_min(model->max_threadgroups / num_sdpa_pairs,
+                math_max(num_attended_tokens / GPTOSS_SDPA_MIN_KV_SPLIT_SIZE, 1));
+        }
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_sdpa(
+            command_buffer,
+            &model->f32_sdpa_fn,
+            &context->qkv_activation_buffer,
+            /*q_offset=*/attn_qkv_dim * q_row_offset * sizeof(float),
+            &kv_context->kvcache_buffer,
+            /*kv_offset=*/n * model->num_kv_heads * kv_context->max_tokens * 2 * model->head_dim * sizeof(float),
+            &model->shared_weight_buffer,
+            /*s_offset=*/model->attn_sdpa_sink_offset + model->per_block_shared_weights_size * n,
+            &context->sdpa_activation_buffer,
+            /*output_offset=*/sdpa_dim * output_row_offset * sizeof(float),
+            &context->sdpa_partial_buffer,
+            /*partial_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            window,
+            /*kv_stride=*/2 * kv_context->max_tokens * model->head_dim,
+            num_q_tokens,
+            token_offset,
+            model->num_heads, model->num_kv_heads, model->head_dim,
+            model->sdpa_threadgroup_qmul, num_kv_splits);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_sdpa kernel launch");
+            return status;
+        }
+        if (num_kv_splits > 1) {
+            status = gptoss_metal_command_buffer_encode_launch_f32_sdpa_reduce(
+                command_buffer,
+                &model->f32_sdpa_reduce_fn,
+                &context->sdpa_partial_buffer,
+                /*partial_offset=*/0,
+                &context->sdpa_activation_buffer,
+                /*output_offset=*/sdpa_dim * output_row_offset * sizeof(float),
+                &context->control_buffer,
+                /*control_offset=*/0,
+                num_q_tokens,
+                model->num_heads, model->num_kv_heads, model->head_dim,
+                model->sdpa_threadgroup_qmul, num_kv_splits);
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode f32_sdpa_reduce kernel launch");
+                return status;
+            }
+        }
+    }
+    return gptoss_status_success;
+}
+
+// Encodes the attention output projection and the MoE MLP of block n for the last num_block_output_tokens of the
+// input_batch_size tokens in the activation buffers of the context, and adds both to the residual stream.
+static enum gptoss_status encode_block_output(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    uint32_t n,
+    size_t input_batch_size,
+    size_t num_block_output_tokens,
+    uint32_t num_active_experts)
+{
+    const struct gptoss_model* model = context->model;
+    const size_t dense_matmul_kernel_token_multiple_constraint = 64;
+    const bool all_experts = num_active_experts == model->num_active_experts;
+    const struct gptoss_metal_function* topk_softmax_fn =
+        all_experts ? &model->f32_topk_softmax_fn : &model->f32_topk_softmax_generic_fn;
+    const struct gptoss_metal_function* accumulate_fn =
+        all_experts ? &model->f32_accumulate_fn : &model->f32_accumulate_generic_fn;
+
+    enum gptoss_status status = gptoss_status_success;
+    if (input_batch_size % dense_matmul_kernel_token_multiple_constraint == 0) {
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_attn_output(
+            command_buffer,
+            &model->f32_bf16w_dense_matmul_attn_output_fn,
+            &context->sdpa_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->attn_out_weight_offset + model->per_block_shared_weights_size * n,
+            &model->shared_weight_buffer,
+            /*bias_offset=*/model->attn_out_bias_offset + model->per_block_shared_weights_size * n,
+            &context->residual_activation_buffer,
+            /*output_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/num_block_output_tokens,
+            /*num_cols=*/model->num_heads * model->head_dim,
+            /*num_rows=*/model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_dense_matmul_attn_output kernel launch");
+            return status;
+        }
+    } else {
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
+            command_buffer,
+            &model->f32_bf16w_matmul_fn,
+            model->attn_out_threadgroup_size,
+            &context->sdpa_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->attn_out_weight_offset + model->per_block_shared_weights_size * n,
+            &model->shared_weight_buffer,
+            /*bias_offset=*/model->attn_out_bias_offset + model->per_block_shared_weights_size * n,
+            &context->residual_activation_buffer,
+            /*output_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/num_block_output_tokens,
+            /*num_cols=*/model->num_heads * model->head_dim,
+            /*num_rows=*/model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_add kernel launch");
+            return status;
+        }
+    }
+    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
+        command_buffer,
+        &model->f32_bf16w_rmsnorm_fn,
+        &context->residual_activation_buffer,
+        /*input_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
+        &model->shared_weight_buffer,
+        /*weight_offset=*/model->mlp_rmsnorm_gain_offset + model->per_block_shared_weights_size * n,
+        &context->rmsnorm_activation_buffer,
+        /*output_offset=*/0,
+        &context->control_buffer,
+        /*control_offset=*/0,
+        num_block_output_tokens,
+        model->embedding_dim,
+        model->rmsnorm_epsilon);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
+        return status;
+    }
+    if (input_batch_size % dense_matmul_kernel_token_multiple_constraint == 0) {
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_mlp_gate(
+            command_buffer,
+            &model->f32_bf16w_dense_matmul_mlp_gate_fn,
+            &context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->mlp_gate_weight_offset + model->per_block_shared_weights_size * n,
+            &model->shared_weight_buffer,
+            /*bias_offset=*/model->mlp_gate_bias_offset + model->per_block_shared_weights_size * n,
+            &context->gate_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            num_block_output_tokens,
+            model->embedding_dim,
+            model->num_experts);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_dense_matmul_mlp_gate kernel launch");
+            return status;
+        }
+    } else {
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
+            command_buffer,
+            &model->f32_bf16w_matmul_fn,
+            model->mlp_gate_threadgroup_size,
+            &context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->mlp_gate_weight_offset + model->per_block_shared_weights_size * n,
+            &model->shared_weight_buffer,
+            /*bias_offset=*/model->mlp_gate_bias_offset + model->per_block_shared_weights_size * n,
+            &context->gate_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/num_block_output_tokens,
+            /*num_cols=*/model->embedding_dim,
+            /*num_rows=*/model->num_experts);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul kernel launch");
+            return status;
+        }
+    }
+
+    status = gptoss_metal_command_buffer_encode_launch_f32_topk(
+        command_buffer,
+        topk_softmax_fn,
+        &context->gate_activation_buffer, /*input_offset=*/0,
+        &context->expert_activation_buffer, /*output_offset=*/0,
+        &context->control_buffer, /*control_offset=*/0,
+        num_block_output_tokens,
+        model->num_experts,
+        num_active_experts);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_topk_softmax kernel launch");
+        return status;
+    }
+
+    // With enough tokens per expert, group the tokens by expert, so that each expert's weights are read once per
+    // group of up to MOE_GROUP_Bt tokens rather than once per token.
+    const bool group_experts = model->num_experts <= EXPERT_GROUP_MAX_EXPERTS &&
+        num_block_output_tokens * num_active_experts >= model->num_experts * GPTOSS_MOE_GROUP_MIN_TOKENS_PER_EXPERT;
+    if (group_experts) {
+        status = gptoss_metal_command_buffer_encode_launch_expert_group(
+            command_buffer,
+            &model->expert_group_fn,
+            &context->expert_activation_buffer,
+            /*expert_offset=*/0,
+            &context->expert_offset_buffer,
+            /*expert_offset_offset=*/0,
+            &context->expert_assignment_buffer,
+            /*expert_assignment_offset=*/0,
+            &context->expert_task_buffer,
+            /*expert_task_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            num_block_output_tokens,
+            model->num_experts,
+            num_active_experts);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode expert_group kernel launch");
+            return status;
+        }
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul_swiglu(
+            command_buffer,
+            &model->f32_mf4w_moe_grouped_matmul_swiglu_fn,
+            model->mlp_swiglu_threadgroup_size,
+            &context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_task_buffer,
+            /*expert_task_offset=*/0,
+            &context->expert_assignment_buffer,
+            /*expert_assignment_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_block_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_scale_offset=*/model->mlp_swiglu_scale_offset,
+            &model->block_weight_buffers[n],
+            /*bias_offset=*/model->mlp_swiglu_bias_offset,
+            &context->swiglu_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->swiglu_limit,
+            model->per_expert_block_weight_size,
+            num_block_output_tokens,
+            model->num_experts,
+            num_active_experts,
+            model->embedding_dim,
+            model->mlp_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul_swiglu kernel launch");
+            return status;
+        }
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul(
+            command_buffer,
+            &model->f32_mf4w_moe_grouped_matmul_fn,
+            model->mlp_out_threadgroup_size,
+            &context->swiglu_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_task_buffer,
+            /*expert_task_offset=*/0,
+            &context->expert_assignment_buffer,
+            /*expert_assignment_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_block_offset=*/model->mlp_out_block_offset,
+            &model->block_weight_buffers[n],
+            /*weight_scale_offset=*/model->mlp_out_scale_offset,
+            &model->block_weight_buffers[n],
+            /*bias_offset=*/model->mlp_out_bias_offset,
+            &context->moe_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->per_expert_block_weight_size,
+            num_block_output_tokens,
+            model->num_experts,
+            num_active_experts,
+            model->mlp_dim,
+            model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul kernel launch");
+            return status;
+        }
+    } else {
+        status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
+            command_buffer,
+            &model->f32_mf4w_moe_matmul_swiglu_fn,
+            model->mlp_swiglu_threadgroup_size,
+            &context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_activation_buffer,
+            /*expert_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_block_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_scale_offset=*/model->mlp_swiglu_scale_offset,
+            &model->block_weight_buffers[n],
+            /*bias_offset=*/model->mlp_swiglu_bias_offset,
+            &context->swiglu_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->swiglu_limit,
+            model->per_expert_block_weight_size,
+            num_block_output_tokens,
+            num_active_experts,
+            model->embedding_dim,
+            model->mlp_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_swiglu kernel launch");
+            return status;
+        }
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
+            command_buffer,
+            &model->f32_mf4w_moe_matmul_fn,
+            model->mlp_out_threadgroup_size,
+            &context->swiglu_activation_buffer,
+            /*input_offset=*/0,
+            &context->expert_activation_buffer,
+            /*expert_offset=*/0,
+            &model->block_weight_buffers[n],
+            /*weight_block_offset=*/model->mlp_out_block_offset,
+            &model->block_weight_buffers[n],
+            /*weight_scale_offset=*/model->mlp_out_scale_offset,
+            &model->block_weight_buffers[n],
+            /*bias_offset=*/model->mlp_out_bias_offset,
+            &context->moe_activation_buffer,
+            /*output_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            model->per_expert_block_weight_size,
+            num_block_output_tokens,
+            num_active_experts,
+            model->mlp_dim,
+            model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul kernel launch");
+            return status;
+        }
+    }
+
+    status = gptoss_metal_command_buffer_encode_launch_f32_accumulate(
+        command_buffer,
+        accumulate_fn,
+        model->mlp_acc_threadgroup_size,
+        model->max_threadgroups,
+        &context->moe_activation_buffer,
+        /*input_offset=*/0,
+        &context->expert_activation_buffer,
+        /*expert_offset=*/0,
+        &context->residual_activation_buffer,
+        /*output_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
+        &context->control_buffer,
+        /*control_offset=*/0,
+        model->embedding_dim,
+        num_block_output_tokens,
+        num_active_experts);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode f32_accumulate kernel launch");
+        return status;
+    }
+    return gptoss_status_success;
+}
+
 // Prefill: input_tokens_offset = number of tokens in KV cache, num_input_tokens > 0, num_output_tokens = 0.
 // Sampling: input_tokens_offset = number of tokens in the context - 1, num_input_tokens = 1, num_output_tokens = 1.
 // Perplexity: input_tokens_offset = 0, num_input_tokens > 1, num_output_tokens = num_input_tokens.
-static enum gptoss_status process_tokens(
+// Unembedding scores are written to score_buffer only if output_scores is set. With a non-zero temperature,
+// argmax_buffer receives a Gumbel-max sample at that temperature instead of the argmax of the scores.
+// If unconstrained is set, the logit bias and the token mask of the context are not applied, so that the scores are
+// the model's own.
+// Self-speculative drafts run only the first num_blocks blocks with num_active_experts experts per token; the KV cache
+// entries they write are overwritten when the drafted tokens are verified.
+static enum gptoss_status process_tokens_ex(
     gptoss_context_t context,
     struct gptoss_metal_command_buffer* command_buffer,
     size_t input_tokens_offset,
     size_t num_input_tokens,
-    size_t num_output_tokens)
+    size_t num_output_tokens,
+    bool output_scores,
+    float temperature,
+    uint64_t rng_seed,
+    bool unconstrained,
+    uint32_t num_blocks,
+    uint32_t num_active_experts)
 {
     assert(num_input_tokens != 0);
     assert(num_input_tokens <= context->max_batch_tokens);
@@ -180,9 +781,11 @@ static enum gptoss_status process_tokens(
     enum gptoss_status status = gptoss_status_success;
     const struct gptoss_model* model = context->model;
 
-    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+    assert(num_blocks != 0 && num_blocks <= model->num_blocks);
+    assert(num_active_experts != 0 && num_active_experts <= model->num_active_experts);
 
     const size_t input_tokens_end = input_tokens_offset + num_input_tokens;
+    extend_rope_table(context, input_tokens_end);
     for (size_t input_batch_start = input_tokens_offset;
         input_batch_start < input_tokens_end;
         input_batch_start += model->max_batch_tokens)
@@ -209,8 +812,8 @@ static enum gptoss_status process_tokens(
             GPTOSS_LOG_ERROR("failed to encode bf16_f32_embeddings kernel launch");
             return status;
         }
-        for (uint32_t n = 0; n < model->num_blocks; n++) {
-            const bool last_block = n + 1 == model->num_blocks;
+        for (uint32_t n = 0; n < num_blocks; n++) {
+            const bool last_block = n + 1 == num_blocks;
             const size_t num_block_output_tokens = last_block ? output_batch_size : input_batch_size;
 
             status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
@@ -232,7 +835,7 @@ static enum gptoss_status process_tokens(
                 return status;
             }
 
-            if (input_batch_size % dense_matmul_kernel_token_multiple_constraint == 0) {
+            if (input_batch_size % dense_matmul_kernel_token_multiple_constraint == 0 && model->head_dim == QKV_Bn) {
                 status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_qkv(
                     command_buffer,
                     &model->f32_bf16w_dense_matmul_qkv_fn,
@@ -244,56 +847,23 @@ static enum gptoss_status process_tokens(
                     /*bias_offset=*/model->attn_qkv_bias_offset + model->per_block_shared_weights_size * n,
                     &context->qkv_activation_buffer,
                     /*output_offset=*/0,
+                    &context->kvcache_buffer,
+                    /*kv_offset=*/n * model->num_kv_heads * context->max_tokens * 2 * model->head_dim * sizeof(float),
+                    &context->rope_table_buffer,
+                    /*rope_table_offset=*/0,
                     &context->control_buffer,
                     /*control_offset=*/0,
                     /*num_tokens=*/input_batch_size,
                     /*num_cols=*/model->embedding_dim,
-                    /*num_rows=*/attn_qkv_dim);
+                    /*num_q_heads=*/model->num_heads,
+                    /*num_kv_heads=*/model->num_kv_heads,
+                    /*attn_head_dim=*/model->head_dim,
+                    /*token_offset=*/input_batch_start,
+                    /*max_tokens=*/context->max_tokens);
                 if (status != gptoss_status_success) {
                     GPTOSS_LOG_ERROR("failed to encode f32_bf16w_dense_matmul_qkv kernel launch");
                     return status;
                 }
-
-                status = gptoss_metal_command_buffer_encode_launch_f32_rope(
-                    command_buffer,
-                    &model->f32_rope_fn,
-                    /*threadgroup_size=*/32,
-                    &context->qkv_activation_buffer,
-                    /*input_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    model->rope_theta,
-                    model->interpolation_scale,
-                    model->yarn_offset,
-                    model->yarn_scale,
-                    model->yarn_multiplier,
-                    input_batch_size,
-                    model->num_heads,
-                    model->num_kv_heads,
-                    model->head_dim,
-                    /*token_offset=*/input_batch_start);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_rope kernel launch");
-                    return status;
-                }
-
-                for (uint32_t t = 0; t < input_batch_size; t++) {
-                    for (uint32_t kv = 0; kv < 2; kv++) {
-                        for (uint32_t h = 0; h < model->num_kv_heads; h++) {
-                            status = gptoss_metal_command_buffer_encode_copy_buffer(
-                                command_buffer,
-                                &context->qkv_activation_buffer,
-                                /*input_offset=*/(t * attn_qkv_dim + (model->num_heads + kv * model->num_kv_heads + h) * model->head_dim) * sizeof(float),
-                                &context->kvcache_buffer,
-                                /*output_offset=*/(((n * model->num_kv_heads + h) * context->max_tokens + input_batch_start + t) * 2 + kv) * model->head_dim * sizeof(float),
-                                /*size=*/model->head_dim * sizeof(float));
-                            if (status != gptoss_status_success) {
-                                GPTOSS_LOG_ERROR("failed to encode copy of token %" PRIu32 " to KV cache", t);
-                                return status;
-                            }
-                        }
-                    }
-                }
             } else {
                 status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qkv(
                     command_buffer,
@@ -309,6 +879,8 @@ static enum gptoss_status process_tokens(
                     /*output_offset=*/0,
                     &context->kvcache_buffer,
                     /*kv_offset=*/n * model->num_kv_heads * context->max_tokens * 2 * model->head_dim * sizeof(float),
+                    &context->rope_table_buffer,
+                    /*rope_table_offset=*/0,
                     &context->control_buffer,
                     /*control_offset=*/0,
                     /*num_tokens=*/input_batch_size,
@@ -317,12 +889,7 @@ static enum gptoss_status process_tokens(
                     /*num_kv_heads=*/model->num_kv_heads,
                     /*attn_head_dim=*/model->head_dim,
                     /*token_offset=*/input_batch_start,
-                    /*max_tokens=*/context->max_tokens,
-                    /*rope_base=*/model->rope_theta,
-                    /*interpolation_scale=*/model->interpolation_scale,
-                    /*yarn_offset=*/model->yarn_offset,
-                    /*yarn_scale=*/model->yarn_scale,
-                    /*yarn_multiplier=*/model->yarn_multiplier);
+                    /*max_tokens=*/context->max_tokens);
                 if (status != gptoss_status_success) {
                     GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_qkv kernel launch");
                     return status;
@@ -330,272 +897,25 @@ static enum gptoss_status process_tokens(
             }
 
             if (num_block_output_tokens != 0) {
-                status = gptoss_metal_command_buffer_encode_launch_f32_sdpa(
-                    command_buffer,
-                    &model->f32_sdpa_q8_d64_fn,
-                    &context->qkv_activation_buffer,
-                    /*q_offset=*/attn_qkv_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                    &context->kvcache_buffer,
-                    /*kv_offset=*/n * model->num_kv_heads * context->max_tokens * 2 * model->head_dim * sizeof(float),
-                    &model->shared_weight_buffer,
-                    /*s_offset=*/model->attn_sdpa_sink_offset + model->per_block_shared_weights_size * n,
-                    &context->sdpa_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    /*window=*/n % 2 == 0 ? model->attention_window : UINT32_MAX,
-                    /*kv_stride=*/2 * context->max_tokens * model->head_dim,
-                    num_block_output_tokens,
-                    input_batch_start + input_batch_size - num_block_output_tokens,
-                    model->num_heads, model->num_kv_heads, model->head_dim);
+                status = encode_attention(
+                    context, context, command_buffer, n,
+                    /*q_row_offset=*/input_batch_size - num_block_output_tokens,
+                    /*output_row_offset=*/0,
+                    /*num_q_tokens=*/num_block_output_tokens,
+                    /*token_offset=*/input_batch_start + input_batch_size - num_block_output_tokens);
                 if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_sdpa kernel launch");
                     return status;
                 }
 
-                if (input_batch_size % dense_matmul_kernel_token_multiple_constraint == 0) {
-                    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_attn_output(
-                        command_buffer,
-                        &model->f32_bf16w_dense_matmul_attn_output_fn,
-                        &context->sdpa_activation_buffer,
-                        /*input_offset=*/0,
-                        &model->shared_weight_buffer,
-                        /*weight_offset=*/model->attn_out_weight_offset + model->per_block_shared_weights_size * n,
-                        &model->shared_weight_buffer,
-                        /*bias_offset=*/model->attn_out_bias_offset + model->per_block_shared_weights_size * n,
-                        &context->residual_activation_buffer,
-                        /*output_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                        &context->control_buffer,
-                        /*control_offset=*/0,
-                        /*num_tokens=*/num_block_output_tokens,
-                        /*num_cols=*/model->num_heads * model->head_dim,
-                        /*num_rows=*/model->embedding_dim);
-                    if (status != gptoss_status_success) {
-                        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_dense_matmul_attn_output kernel launch");
-                        return status;
-                    }
-                } else {
-                    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
-                        command_buffer,
-                        &model->f32_bf16w_matmul_fn,
-                        model->attn_out_threadgroup_size,
-                        &context->sdpa_activation_buffer,
-                        /*input_offset=*/0,
-                        &model->shared_weight_buffer,
-                        /*weight_offset=*/model->attn_out_weight_offset + model->per_block_shared_weights_size * n,
-                        &model->shared_weight_buffer,
-                        /*bias_offset=*/model->attn_out_bias_offset + model->per_block_shared_weights_size * n,
-                        &context->residual_activation_buffer,
-                        /*output_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                        &context->control_buffer,
-                        /*control_offset=*/0,
-                        /*num_tokens=*/num_block_output_tokens,
-                        /*num_cols=*/model->num_heads * model->head_dim,
-                        /*num_rows=*/model->embedding_dim);
-                    if (status != gptoss_status_success) {
-                        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_add kernel launch");
-                        return status;
-                    }
-                }
-                status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
-                    command_buffer,
-                    &model->f32_bf16w_rmsnorm_fn,
-                    &context->residual_activation_buffer,
-                    /*input_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                    &model->shared_weight_buffer,
-                    /*weight_offset=*/model->mlp_rmsnorm_gain_offset + model->per_block_shared_weights_size * n,
-                    &context->rmsnorm_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    num_block_output_tokens,
-                    model->embedding_dim,
-                    model->rmsnorm_epsilon);
+                status = encode_block_output(
+                    context, command_buffer, n, input_batch_size, num_block_output_tokens, num_active_experts);
                 if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
                     return status;
                 }
-                if (input_batch_size % dense_matmul_kernel_token_multiple_constraint == 0) {
-                    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_mlp_gate(
-                        command_buffer,
-                        &model->f32_bf16w_dense_matmul_mlp_gate_fn,
-                        &context->rmsnorm_activation_buffer,
-                        /*input_offset=*/0,
-                        &model->shared_weight_buffer,
-                        /*weight_offset=*/model->mlp_gate_weight_offset + model->per_block_shared_weights_size * n,
-                        &model->shared_weight_buffer,
-                        /*bias_offset=*/model->mlp_gate_bias_offset + model->per_block_shared_weights_size * n,
-                        &context->gate_activation_buffer,
-                        /*output_offset=*/0,
-                        &context->control_buffer,
-                        /*control_offset=*/0,
-                        num_block_output_tokens,
-                        model->embedding_dim,
-                        model->num_experts);
-                    if (status != gptoss_status_success) {
-                        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_dense_matmul_mlp_gate kernel launch");
-                        return status;
-                    }
-                } else {
-                    status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
-                        command_buffer,
-                        &model->f32_bf16w_matmul_fn,
-                        model->mlp_gate_threadgroup_size,
-                        &context->rmsnorm_activation_buffer,
-                        /*input_offset=*/0,
-                        &model->shared_weight_buffer,
-                        /*weight_offset=*/model->mlp_gate_weight_offset + model->per_block_shared_weights_size * n,
-                        &model->shared_weight_buffer,
-                        /*bias_offset=*/model->mlp_gate_bias_offset + model->per_block_shared_weights_size * n,
-                        &context->gate_activation_buffer,
-                        /*output_offset=*/0,
-                        &context->control_buffer,
-                        /*control_offset=*/0,
-                        /*num_tokens=*/num_block_output_tokens,
-                        /*num_cols=*/model->embedding_dim,
-                        /*num_rows=*/model->num_experts);
-                    if (status != gptoss_status_success) {
-                        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul kernel launch");
-                        return status;
-                    }
-                }
-
-                const char* kernel_name = NULL;
-                switch (model->num_experts) {
-                    case 32:
-                        kernel_name = "f32_topk_softmax_e32_k4_fn";
-                        status = gptoss_metal_command_buffer_encode_launch_f32_topk(
-                            command_buffer,
-                            &model->f32_topk_softmax_e32_k4_fn,
-                            &context->gate_activation_buffer, /*input_offset=*/0,
-                            &context->expert_activation_buffer, /*output_offset=*/0,
-                            &context->control_buffer, /*control_offset=*/0,
-                            num_block_output_tokens,
-                            model->num_experts,
-                            model->num_active_experts);
-                        break;
-                    case 128:
-                        kernel_name = "f32_topk_softmax_e128_k4_fn";
-                        status = gptoss_metal_command_buffer_encode_launch_f32_topk(
-                            command_buffer,
-                            &model->f32_topk_softmax_e128_k4_fn,
-                            &context->gate_activation_buffer, /*input_offset=*/0,
-                            &context->expert_activation_buffer, /*output_offset=*/0,
-                            &context->control_buffer, /*control_offset=*/0,
-                            num_block_output_tokens,
-                            model->num_experts,
-                            model->num_active_experts);
-                        break;
-                    default:
-                        status = gptoss_status_unsupported_argument;
-                        GPTOSS_LOG_ERROR("missing Top-K kernel for %" PRIu32 " experts", model->num_experts);
-                        return status;
-                }
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode %s kernel launch", kernel_name);
-                    return status;
-                }
-
-                status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
-                    command_buffer,
-                    &model->f32_mf4w_moe_matmul_swiglu_fn,
-                    model->mlp_swiglu_threadgroup_size,
-                    &context->rmsnorm_activation_buffer,
-                    /*input_offset=*/0,
-                    &context->expert_activation_buffer,
-                    /*expert_offset=*/0,
-                    &model->block_weight_buffers[n],
-                    /*weight_block_offset=*/0,
-                    &model->block_weight_buffers[n],
-                    /*weight_scale_offset=*/model->mlp_swiglu_scale_offset,
-                    &model->block_weight_buffers[n],
-                    /*bias_offset=*/model->mlp_swiglu_bias_offset,
-                    &context->swiglu_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    model->swiglu_limit,
-                    model->per_expert_block_weight_size,
-                    num_block_output_tokens,
-                    model->num_active_experts,
-                    model->embedding_dim,
-                    model->mlp_dim);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_swiglu kernel launch");
-                    return status;
-                }
-
-                status = gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
-                    command_buffer,
-                    &model->f32_mf4w_moe_matmul_fn,
-                    model->mlp_out_threadgroup_size,
-                    &context->swiglu_activation_buffer,
-                    /*input_offset=*/0,
-                    &context->expert_activation_buffer,
-                    /*expert_offset=*/0,
-                    &model->block_weight_buffers[n],
-                    /*weight_block_offset=*/model->mlp_out_block_offset,
-                    &model->block_weight_buffers[n],
-                    /*weight_scale_offset=*/model->mlp_out_scale_offset,
-                    &model->block_weight_buffers[n],
-                    /*bias_offset=*/model->mlp_out_bias_offset,
-                    &context->moe_activation_buffer,
-                    /*output_offset=*/0,
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    model->per_expert_block_weight_size,
-                    num_block_output_tokens,
-                    model->num_active_experts,
-                    model->mlp_dim,
-                    model->embedding_dim);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul kernel launch");
-                    return status;
-                }
-
-                status = gptoss_metal_command_buffer_encode_launch_f32_accumulate(
-                    command_buffer,
-                    &model->f32_accumulate_e4_fn,
-                    model->mlp_acc_threadgroup_size,
-                    model->max_threadgroups,
-                    &context->moe_activation_buffer,
-                    /*input_offset=*/0,
-                    &context->expert_activation_buffer,
-                    /*expert_offset=*/0,
-                    &context->residual_activation_buffer,
-                    /*output_offset=*/model->embedding_dim * (input_batch_size - num_block_output_tokens) * sizeof(float),
-                    &context->control_buffer,
-                    /*control_offset=*/0,
-                    model->embedding_dim,
-                    num_block_output_tokens,
-                    model->num_active_experts);
-                if (status != gptoss_status_success) {
-                    GPTOSS_LOG_ERROR("failed to encode f32_accumulate kernel launch");
-                    return status;
-                }
-            }
-        }
+            }
+        }
 
         if (output_batch_size != 0) {
-            status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
-                command_buffer,
-                &model->f32_bf16w_rmsnorm_fn,
-                &context->residual_activation_buffer,
-                /*input_offset=*/model->embedding_dim * (input_batch_size - output_batch_size) * sizeof(float),
-                &model->shared_weight_buffer,
-                /*weight_offset=*/model->rmsnorm_weight_offset,
-                &context->rmsnorm_activation_buffer,
-                /*output_offset=*/0,
-                &context->control_buffer,
-                /*control_offset=*/0,
-                /*num_tokens=*/output_batch_size,
-                /*num_channels=*/model->embedding_dim,
-                model->rmsnorm_epsilon);
-            if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
-                return status;
-            }
-
             status = gptoss_metal_command_buffer_encode_fill_buffer(
                 command_buffer,
                 &context->argmax_buffer,
@@ -607,39 +927,248 @@ static enum gptoss_status process_tokens(
                 return status;
             }
 
-            status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
+            status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_unembedding(
                 command_buffer,
-                &model->f32_bf16w_unembedding_fn,
+                &model->f32_bf16w_rmsnorm_unembedding_fn,
                 model->unembedding_threadgroup_size,
                 model->max_threadgroups,
-                &context->rmsnorm_activation_buffer,
-                /*input_offset=*/0,
+                &context->residual_activation_buffer,
+                /*input_offset=*/model->embedding_dim * (input_batch_size - output_batch_size) * sizeof(float),
+                &model->shared_weight_buffer,
+                /*norm_weight_offset=*/model->rmsnorm_weight_offset,
                 &model->shared_weight_buffer,
                 /*weight_offset=*/model->unembedding_weight_offset,
                 &context->score_buffer,
                 /*output_offset=*/0,
                 &context->argmax_buffer,
                 /*argmax_offset=*/0,
+                &context->lse_buffer,
+                /*lse_offset=*/0,
+                &context->logit_bias_buffer,
+                /*bias_offset=*/0,
+                &context->token_mask_buffer,
+                /*token_mask_offset=*/0,
                 &context->control_buffer,
                 /*control_offset=*/0,
                 /*num_tokens=*/output_batch_size,
                 /*num_cols=*/model->embedding_dim,
-                /*num_rows=*/model->vocabulary_size);
+                /*num_rows=*/model->vocabulary_size,
+                model->rmsnorm_epsilon,
+                output_scores,
+                temperature,
+                rng_seed,
+                /*rng_offset=*/input_batch_end - output_batch_size + 1,
+                context->has_logit_bias && !unconstrained,
+                context->has_token_mask && !unconstrained,
+                &context->num_lse_partials);
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_unembedding kernel launch");
+                return status;
+            }
+        }
+    }
+    return gptoss_status_success;
+}
+
+// Encodes a decode step of the full model, i.e. process_tokens for one input token at input_tokens_offset and one output
+// token, by replaying context->decode_plan. The plan is recorded by the first decode step with all weight offsets and
+// buffer bindings resolved, and later steps only patch the token position and sampling parameters into it. Attention
+// is encoded anew on every step, as its launch shape depends on the number of tokens in the KV cache.
+static enum gptoss_status encode_decode_plan(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t input_tokens_offset,
+    bool output_scores,
+    float temperature,
+    uint64_t rng_seed,
+    bool unconstrained)
+{
+    const struct gptoss_model* model = context->model;
+    struct gptoss_metal_command_list* plan = &context->decode_plan;
+
+    if (!(temperature >= 0.0f)) {
+        GPTOSS_LOG_ERROR("invalid temperature %f", temperature);
+        return gptoss_status_invalid_argument;
+    }
+
+    enum gptoss_status status = gptoss_status_success;
+    if (plan->num_commands == 0) {
+        struct gptoss_metal_command_buffer recording_command_buffer = {0};
+        gptoss_metal_command_buffer_create_recording(plan, &recording_command_buffer);
+        status = process_tokens_ex(
+            context, &recording_command_buffer, input_tokens_offset,
+            /*num_input_tokens=*/1, /*num_output_tokens=*/1, output_scores, temperature, rng_seed, unconstrained,
+            model->num_blocks, model->num_active_experts);
+        gptoss_metal_command_buffer_release(&recording_command_buffer);
+        if (status != gptoss_status_success) {
+            gptoss_metal_command_list_clear(plan);
+            return status;
+        }
+        context->decode_plan_num_lse_partials = context->num_lse_partials;
+    }
+
+    extend_rope_table(context, input_tokens_offset + 1);
+    uint32_t n = 0;
+    for (size_t i = 0; i < plan->num_commands; i++) {
+        const struct gptoss_metal_command* command = &plan->commands[i];
+        void* params = plan->params + command->params_offset;
+        if (command->function == &model->f32_sdpa_fn) {
+            status = encode_attention(
+                context, context, command_buffer, n++,
+                /*q_row_offset=*/0,
+                /*output_row_offset=*/0,
+                /*num_q_tokens=*/1,
+                /*token_offset=*/input_tokens_offset);
             if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_bf16w_unembedding kernel launch");
                 return status;
             }
+            continue;
+        } else if (command->function == &model->f32_sdpa_reduce_fn) {
+            // Encoded by encode_attention along with f32_sdpa if the KV range is split.
+            continue;
+        } else if (command->function == &model->bf16_f32_embeddings_fn) {
+            plan->buffer_offsets[command->buffers_offset] = input_tokens_offset * sizeof(uint32_t);
+        } else if (command->function == &model->f32_bf16w_matmul_qkv_fn) {
+            struct gptoss_qkv_args* args = (struct gptoss_qkv_args*) params;
+            args->token_offset = (uint32_t) input_tokens_offset;
+        } else if (command->function == &model->f32_bf16w_rmsnorm_unembedding_fn) {
+            struct gptoss_rmsnorm_unembedding_args* args = (struct gptoss_rmsnorm_unembedding_args*) params;
+            args->output_scores = output_scores;
+            args->rng_seed = rng_seed;
+            args->rng_offset = (uint32_t) input_tokens_offset + 1;
+            args->inv_temperature = temperature != 0.0f ? 1.0f / temperature : 0.0f;
+            args->apply_logit_bias = context->has_logit_bias && !unconstrained;
+            args->apply_token_mask = context->has_token_mask && !unconstrained;
+        }
+
+        status = gptoss_metal_command_buffer_encode_command(command_buffer, plan, i);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode command %zu of decode plan", i);
+            return status;
         }
     }
+    context->num_lse_partials = context->decode_plan_num_lse_partials;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status process_tokens(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t input_tokens_offset,
+    size_t num_input_tokens,
+    size_t num_output_tokens,
+    bool output_scores,
+    float temperature,
+    uint64_t rng_seed,
+    bool unconstrained)
+{
+    if (num_input_tokens == 1 && num_output_tokens == 1) {
+        return encode_decode_plan(context, command_buffer, input_tokens_offset, output_scores, temperature, rng_seed,
+            unconstrained);
+    }
+    return process_tokens_ex(
+        context, command_buffer, input_tokens_offset, num_input_tokens, num_output_tokens, output_scores, temperature,
+        rng_seed, unconstrained, context->model->num_blocks, context->model->num_active_experts);
+}
+
+static uint32_t hash_ngram(
+    const uint32_t* tokens,
+    size_t length)
+{
+    // FNV-1a over the n-gram length and tokens
+    uint64_t hash = (UINT64_C(0xCBF29CE484222325) ^ length) * UINT64_C(0x100000001B3);
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ tokens[i]) * UINT64_C(0x100000001B3);
+    }
+    return (uint32_t) (hash ^ (hash >> 32));
+}
+
+// Allocates the n-gram table on the first use of prompt lookup decoding. The table has at least as many slots as
+// indexed n-grams.
+static enum gptoss_status create_ngram_table(
+    gptoss_context_t context)
+{
+    if (context->ngram_table != NULL) {
+        return gptoss_status_success;
+    }
+
+    size_t ngram_table_size = 1;
+    while (ngram_table_size < context->max_tokens * GPTOSS_PROMPT_LOOKUP_MAX_NGRAM) {
+        ngram_table_size *= 2;
+    }
+    context->ngram_table = calloc(ngram_table_size, sizeof(uint32_t));
+    if (context->ngram_table == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for n-gram table", ngram_table_size * sizeof(uint32_t));
+        return gptoss_status_insufficient_memory;
+    }
+    context->ngram_table_size = ngram_table_size;
+    context->num_ngram_indexed_tokens = 0;
     return gptoss_status_success;
 }
 
+// Indexes the n-grams followed by tokens that were added to the context since the last update. Does nothing until
+// the n-gram table is allocated, and then the first update indexes all tokens.
+static void update_ngram_index(
+    gptoss_context_t context)
+{
+    if (context->ngram_table == NULL) {
+        return;
+    }
+
+    const uint32_t* tokens = (const uint32_t*) context->token_buffer.ptr;
+    const size_t table_mask = context->ngram_table_size - 1;
+    for (size_t t = math_max(context->num_ngram_indexed_tokens, 1); t < context->num_tokens; t++) {
+        const size_t max_length = math_min(t, GPTOSS_PROMPT_LOOKUP_MAX_NGRAM);
+        for (size_t length = 1; length <= max_length; length++) {
+            context->ngram_table[hash_ngram(tokens + t - length, length) & table_mask] = (uint32_t) t;
+        }
+    }
+    context->num_ngram_indexed_tokens = context->num_tokens;
+}
+
+// Proposes up to max_draft_tokens draft tokens after the last token of the context by copying the continuation of the
+// latest earlier occurrence of the longest matching suffix. Returns the number of draft tokens written to the token
+// buffer after the last token.
+static size_t lookup_draft_tokens(
+    gptoss_context_t context,
+    size_t max_draft_tokens)
+{
+    update_ngram_index(context);
+    if (max_draft_tokens == 0) {
+        return 0;
+    }
+
+    uint32_t* tokens = (uint32_t*) context->token_buffer.ptr;
+    const size_t num_tokens = context->num_tokens;
+    const size_t table_mask = context->ngram_table_size - 1;
+    for (size_t length = math_min(num_tokens, GPTOSS_PROMPT_LOOKUP_MAX_NGRAM); length != 0; length--) {
+        const uint32_t* suffix = tokens + num_tokens - length;
+        // Table entries may be stale or collide, so check that the n-gram actually occurs before the position.
+        const size_t position = context->ngram_table[hash_ngram(suffix, length) & table_mask];
+        if (position < length || position >= num_tokens) {
+            continue;
+        }
+        if (memcmp(tokens + position - length, suffix, length * sizeof(uint32_t)) != 0) {
+            continue;
+        }
+
+        // Copy token by token: a continuation that runs into the suffix repeats the copied tokens.
+        for (size_t i = 0; i < max_draft_tokens; i++) {
+            tokens[num_tokens + i] = tokens[position + i];
+        }
+        return max_draft_tokens;
+    }
+    return 0;
+}
+
 enum gptoss_status GPTOSS_ABI gptoss_context_append_chars(
     gptoss_context_t context,
     const char* text,
     size_t text_length,
     size_t* num_tokens_out)
 {
+    finish_pending_request(context);
+
     enum gptoss_status status = gptoss_status_success;
     const struct gptoss_model* model = context->model;
     const struct gptoss_tokenizer* tokenizer = model->tokenizer;
@@ -699,6 +1228,8 @@ enum gptoss_status GPTOSS_ABI gptoss_context_append_tokens(
     size_t num_tokens,
     const uint32_t* tokens)
 {
+    finish_pending_request(context);
+
     const struct gptoss_model* model = context->model;
 
     // Validate all tokens
@@ -741,6 +1272,7 @@ enum gptoss_status GPTOSS_ABI gptoss_context_append_tokens(
             num_tokens -= num_tokens_to_copy;
         }
     }
+    update_ngram_index(context);
 
     return status;
 }
@@ -748,147 +1280,2042 @@ enum gptoss_status GPTOSS_ABI gptoss_context_append_tokens(
 enum gptoss_status GPTOSS_ABI gptoss_context_process(
     gptoss_context_t context)
 {
-    if (context->num_tokens > context->num_kv_tokens) {
-        struct gptoss_metal_command_buffer command_buffer = {0};
+    finish_pending_request(context);
 
-        enum gptoss_status status = gptoss_metal_command_buffer_create(&context->model->command_queue, &command_buffer);
-        if (status != gptoss_status_success) {
-            goto cleanup;
+    if (context->num_tokens <= context->num_kv_tokens) {
+        return gptoss_status_success;
+    }
+
+    enum gptoss_status status = begin_call(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    // Each chunk of up to max_batch_tokens tokens runs in its own command buffer, so that an aborted prefill keeps the
+    // chunks that completed. The next chunk is committed before waiting for the previous one to keep the GPU busy.
+    struct gptoss_metal_command_buffer command_buffers[2] = {0};
+    bool committed[2] = {false, false};
+    const size_t max_chunk_tokens = context->model->max_batch_tokens;
+    const size_t num_prefill_tokens = context->num_tokens - context->num_kv_tokens;
+    const size_t num_chunks = math_ceil_div(num_prefill_tokens, max_chunk_tokens);
+    const size_t prefill_start = context->num_kv_tokens;
+    for (size_t chunk = 0; chunk <= num_chunks; chunk++) {
+        if (chunk < num_chunks) {
+            struct gptoss_metal_command_buffer* command_buffer = &command_buffers[chunk % 2];
+            status = gptoss_metal_command_buffer_create(&context->model->command_queue, command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+
+            const size_t chunk_start = prefill_start + chunk * max_chunk_tokens;
+            status = process_tokens(
+                context,
+                command_buffer,
+                /*input_tokens_offset=*/chunk_start,
+                /*num_input_tokens=*/math_min(max_chunk_tokens, context->num_tokens - chunk_start),
+                /*num_output_tokens=*/0,
+                /*output_scores=*/false,
+                /*temperature=*/0.0f,
+                /*rng_seed=*/0,
+                /*unconstrained=*/false);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+
+            status = gptoss_metal_command_buffer_commit(command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            committed[chunk % 2] = true;
         }
 
-        struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
-        control->abort = 0;
+        if (chunk != 0) {
+            struct gptoss_metal_command_buffer* command_buffer = &command_buffers[(chunk - 1) % 2];
+            status = wait_command_buffer(context, command_buffer);
+            committed[(chunk - 1) % 2] = false;
+            gptoss_metal_command_buffer_release(command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            context->num_kv_tokens = math_min(prefill_start + chunk * max_chunk_tokens, context->num_tokens);
+        }
+    }
+
+cleanup:
+    for (size_t i = 0; i < 2; i++) {
+        if (committed[i]) {
+            // Aborted or failed: don't leave work in flight.
+            gptoss_metal_command_buffer_wait_completion(&command_buffers[i], NULL);
+        }
+        gptoss_metal_command_buffer_release(&command_buffers[i]);
+    }
+    end_call(context);
+    return status;
+}
+
+// Merges the per-threadgroup (max, sum of exp) pairs of output token output_index of the last unembedding into the
+// log-sum-exp of its scores.
+static float get_output_lse(
+    gptoss_context_t context,
+    size_t output_index)
+{
+    const float* lse = (const float*) context->lse_buffer.ptr + output_index * context->num_lse_partials * 2;
+    float max_score = -INFINITY;
+    for (uint32_t i = 0; i < context->num_lse_partials; i++) {
+        max_score = fmaxf(max_score, lse[i * 2]);
+    }
+    if (max_score == -INFINITY) {
+        return -INFINITY;
+    }
+
+    double sum_exp = 0.0;
+    for (uint32_t i = 0; i < context->num_lse_partials; i++) {
+        if (lse[i * 2 + 1] != 0.0f) {
+            sum_exp += (double) lse[i * 2 + 1] * exp((double) (lse[i * 2] - max_score));
+        }
+    }
+    return max_score + (float) log(sum_exp);
+}
+
+struct logprob_candidate {
+    uint32_t token;
+    uint32_t score_bits;
+};
+
+// Orders candidates by descending score, then by ascending token ID, with empty candidates last.
+static int compare_logprob_candidates(const void* a_ptr, const void* b_ptr) {
+    const struct logprob_candidate* a = (const struct logprob_candidate*) a_ptr;
+    const struct logprob_candidate* b = (const struct logprob_candidate*) b_ptr;
+    if (a->token == UINT32_MAX || b->token == UINT32_MAX) {
+        return (a->token == UINT32_MAX) - (b->token == UINT32_MAX);
+    }
+    float a_score, b_score;
+    memcpy(&a_score, &a->score_bits, sizeof(float));
+    memcpy(&b_score, &b->score_bits, sizeof(float));
+    if (a_score != b_score) {
+        return a_score > b_score ? -1 : 1;
+    }
+    return (a->token > b->token) - (a->token < b->token);
+}
+
+// Computes the log-probability of the token from output token output_index of the last unembedding, and the
+// num_top_logprobs most likely tokens and their log-probabilities from the num_candidates top-k candidates that
+// gptoss_f32_sample_filter stored to sample_candidate_buffer. Missing top tokens are stored as UINT32_MAX with
+// -INFINITY log-probabilities.
+static void store_logprobs(
+    gptoss_context_t context,
+    size_t output_index,
+    uint32_t token,
+    uint32_t num_top_logprobs,
+    uint32_t num_candidates,
+    float* logprob_out,
+    uint32_t* top_tokens_out,
+    float* top_logprobs_out)
+{
+    const float lse = get_output_lse(context, output_index);
+    const float* scores = (const float*) context->score_buffer.ptr + output_index * context->model->vocabulary_size;
+    *logprob_out = scores[token] - lse;
+
+    if (num_top_logprobs != 0) {
+        struct logprob_candidate* candidates = (struct logprob_candidate*) context->sample_candidate_buffer.ptr;
+        qsort(candidates, num_candidates, sizeof(struct logprob_candidate), compare_logprob_candidates);
+        for (uint32_t i = 0; i < num_top_logprobs; i++) {
+            if (i < num_candidates && candidates[i].token != UINT32_MAX) {
+                top_tokens_out[i] = candidates[i].token;
+                top_logprobs_out[i] = scores[candidates[i].token] - lse;
+            } else {
+                top_tokens_out[i] = UINT32_MAX;
+                top_logprobs_out[i] = -INFINITY;
+            }
+        }
+    }
+}
+
+// Encodes the processing of the pending tokens of the context and the sampling of the next token into
+// token_buffer[num_tokens]. Does not advance num_tokens. The scores of the token are kept for filtering if
+// output_scores is true.
+static enum gptoss_status encode_sample_token(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    float temperature,
+    uint64_t rng_seed,
+    bool output_scores)
+{
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
 
+    // Top-k and min-p filtering need the scores and their plain argmax. Otherwise, the unembedding itself produces
+    // the greedy or Gumbel-max sampled token.
+    const bool filter_scores = temperature != 0.0f && (context->top_k != 0 || context->min_p != 0.0f);
+
+    if (context->num_kv_tokens < context->num_tokens) {
         status = process_tokens(
             context,
-            &command_buffer,
+            command_buffer,
             /*input_tokens_offset=*/context->num_kv_tokens,
             /*num_input_tokens=*/context->num_tokens - context->num_kv_tokens,
-            /*num_output_tokens=*/0);
+            /*num_output_tokens=*/1,
+            /*output_scores=*/filter_scores || output_scores,
+            /*temperature=*/filter_scores ? 0.0f : temperature,
+            rng_seed,
+            /*unconstrained=*/false);
+        context->num_kv_tokens = context->num_tokens;
+    } else {
+        status = process_tokens(
+            context,
+            command_buffer,
+            /*input_tokens_offset=*/context->num_tokens - 1,
+            /*num_input_tokens=*/1,
+            /*num_output_tokens=*/1,
+            /*output_scores=*/filter_scores || output_scores,
+            /*temperature=*/filter_scores ? 0.0f : temperature,
+            rng_seed,
+            /*unconstrained=*/false);
+    }
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    if (filter_scores) {
+        uint32_t num_candidates = 0;
+        status = gptoss_metal_command_buffer_encode_launch_f32_sample_filter(
+            command_buffer,
+            &model->f32_sample_filter_fn,
+            /*threadgroup_size=*/512,
+            model->max_threadgroups,
+            &context->score_buffer,
+            /*score_offset=*/0,
+            &context->argmax_buffer,
+            /*argmax_offset=*/0,
+            &context->sample_candidate_buffer,
+            /*candidate_offset=*/0,
+            &context->control_buffer,
+            /*control_offset=*/0,
+            rng_seed,
+            /*rng_offset=*/context->num_tokens,
+            /*num_channels=*/model->vocabulary_size,
+            temperature,
+            context->top_k,
+            context->min_p,
+            &num_candidates);
         if (status != gptoss_status_success) {
-            goto cleanup;
+            GPTOSS_LOG_ERROR("failed to encode f32_sample_filter kernel launch");
+            return status;
         }
 
-        status = gptoss_metal_command_buffer_commit(&command_buffer);
+        status = gptoss_metal_command_buffer_encode_launch_f32_sample_candidates(
+            command_buffer,
+            &model->f32_sample_candidates_fn,
+            /*threadgroup_size=*/1024,
+            &context->sample_candidate_buffer,
+            /*candidate_offset=*/0,
+            &context->token_buffer,
+            /*token_offset=*/context->num_tokens * sizeof(uint32_t),
+            &context->control_buffer,
+            /*control_offset=*/0,
+            rng_seed,
+            /*rng_offset=*/context->num_tokens,
+            num_candidates,
+            temperature,
+            context->top_k);
         if (status != gptoss_status_success) {
-            goto cleanup;
+            GPTOSS_LOG_ERROR("failed to encode f32_sample_candidates kernel launch");
+            return status;
         }
-
-        status = gptoss_metal_command_buffer_wait_completion(&command_buffer, NULL);
+    } else {
+        // The unembedding leaves the greedy or Gumbel-max sampled token in the low word of the packed argmax.
+        status = gptoss_metal_command_buffer_encode_copy_buffer(
+            command_buffer,
+            &context->argmax_buffer,
+            /*input_offset=*/0,
+            &context->token_buffer,
+            /*output_offset=*/context->num_tokens * sizeof(uint32_t),
+            /*size=*/sizeof(uint32_t));
         if (status != gptoss_status_success) {
-            goto cleanup;
+            GPTOSS_LOG_ERROR("failed to encode copy buffer");
+            return status;
+        }
+    }
+    return status;
+}
+
+// Encodes the check of the token just sampled into token_buffer[num_tokens] against the stop tokens. A stop token
+// aborts the rest of the command buffer.
+static enum gptoss_status encode_check_stop_token(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer)
+{
+    if (!context->has_stop_tokens) {
+        return gptoss_status_success;
+    }
+
+    const enum gptoss_status status = gptoss_metal_command_buffer_encode_launch_check_stop_token(
+        command_buffer,
+        &context->model->check_stop_token_fn,
+        &context->token_buffer,
+        /*token_offset=*/context->num_tokens * sizeof(uint32_t),
+        &context->stop_token_mask_buffer,
+        /*stop_token_mask_offset=*/0,
+        &context->control_buffer,
+        /*control_offset=*/0,
+        context->model->vocabulary_size);
+    if (status != gptoss_status_success) {
+        GPTOSS_LOG_ERROR("failed to encode check_stop_token kernel launch");
+    }
+    return status;
+}
+
+// Returns whether sampling stops after the token: it is a stop token, or its bytes complete a stop sequence together
+// with the bytes of the tokens sampled before it in the current call. Must be called on every sampled token in order.
+static bool is_stop_token(
+    gptoss_context_t context,
+    uint32_t token)
+{
+    if (context->has_stop_tokens) {
+        const uint32_t* stop_token_mask = (const uint32_t*) context->stop_token_mask_buffer.ptr;
+        if (token < context->model->vocabulary_size && (stop_token_mask[token / 32] & (UINT32_C(1) << (token % 32))) != 0) {
+            return true;
         }
+    }
+    if (context->num_stop_sequences == 0) {
+        return false;
+    }
 
-        context->num_kv_tokens = context->num_tokens;
+    const struct gptoss_tokenizer* tokenizer = context->model->tokenizer;
+    if (token >= tokenizer->num_text_tokens) {
+        // Special tokens have no bytes, and separate the text before and after them.
+        context->stop_tail_size = 0;
+        return false;
+    }
 
-cleanup:
-        gptoss_metal_command_buffer_release(&command_buffer);
-        return status;
+    // Reading unaligned uint16_t
+    const char* token_ptr = tokenizer->tokens_ptr + tokenizer->token_offsets[token];
+    uint16_t token_length;
+    memcpy(&token_length, token_ptr, sizeof(token_length));
+    const char* token_bytes = token_ptr + sizeof(uint16_t);
+
+    const char* tail = context->stop_tail;
+    const size_t tail_size = context->stop_tail_size;
+    for (size_t i = 0; i < context->num_stop_sequences; i++) {
+        const char* sequence = context->stop_sequence_data + context->stop_sequence_offsets[i];
+        const size_t sequence_size = context->stop_sequence_offsets[i + 1] - context->stop_sequence_offsets[i];
+        // Try every end of the sequence within the token: its suffix must match the token bytes before the end, and
+        // the rest of it the end of the tail.
+        for (size_t end = 1; end <= token_length; end++) {
+            const size_t num_token_bytes = math_min(sequence_size, end);
+            const size_t num_tail_bytes = sequence_size - num_token_bytes;
+            if (num_tail_bytes > tail_size) {
+                continue;
+            }
+            if (memcmp(sequence + num_tail_bytes, token_bytes + end - num_token_bytes, num_token_bytes) == 0 &&
+                memcmp(sequence, tail + tail_size - num_tail_bytes, num_tail_bytes) == 0)
+            {
+                return true;
+            }
+        }
     }
-    
-    return gptoss_status_success;
+
+    // Keep the last max_stop_sequence_size - 1 bytes: longer suffixes can't be part of a future match.
+    const size_t tail_capacity = context->max_stop_sequence_size - 1;
+    if (token_length >= tail_capacity) {
+        memcpy(context->stop_tail, token_bytes + token_length - tail_capacity, tail_capacity);
+        context->stop_tail_size = tail_capacity;
+    } else {
+        const size_t num_kept_bytes = math_min(tail_size, tail_capacity - token_length);
+        memmove(context->stop_tail, context->stop_tail + tail_size - num_kept_bytes, num_kept_bytes);
+        memcpy(context->stop_tail + num_kept_bytes, token_bytes, token_length);
+        context->stop_tail_size = num_kept_bytes + token_length;
+    }
+    return false;
 }
 
-enum gptoss_status GPTOSS_ABI gptoss_context_sample(
+// Implements gptoss_context_sample and gptoss_context_sample_with_logprobs. If logprobs_out is NULL, no
+// log-probabilities are computed.
+static enum gptoss_status sample_tokens(
     gptoss_context_t context,
     float temperature,
     uint64_t seed,
     size_t max_tokens,
+    uint32_t num_top_logprobs,
     uint32_t* tokens_out,
+    float* logprobs_out,
+    uint32_t* top_tokens_out,
+    float* top_logprobs_out,
     size_t* num_tokens_out)
 {
+    finish_pending_request(context);
+
     enum gptoss_status status = gptoss_status_success;
     const struct gptoss_model* model = context->model;
     struct gptoss_metal_command_buffer command_buffer = {0};
 
     *num_tokens_out = 0;
 
+    if (max_tokens != 0 && context->num_tokens == context->max_tokens) {
+        GPTOSS_LOG_ERROR("context is full (%zu tokens)", context->max_tokens);
+        return gptoss_status_context_overflow;
+    }
+    max_tokens = math_min(max_tokens, context->max_tokens - context->num_tokens);
+
     const uint32_t num_original_tokens = context->num_tokens;
+    const size_t num_original_kv_tokens = context->num_kv_tokens;
+    // Number of sampled tokens whose command buffer completed.
+    size_t num_completed_tokens = 0;
+
+    status = begin_call(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
 
     status = gptoss_metal_command_buffer_create(&context->model->command_queue, &command_buffer);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
 
-    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+    context->stop_tail_size = 0;
+
+    const bool output_logprobs = logprobs_out != NULL;
+    const uint64_t rng_seed = seed + UINT64_C(0x123456789ABCDEF);
+    struct gptoss_grammar* grammar = context->grammar;
+    for (size_t t = 0; t < max_tokens; t++) {
+        if (grammar != NULL) {
+            // The command buffer for the previous token completed, so the token mask buffer can be overwritten.
+            status = gptoss_grammar_get_token_mask(grammar, (uint32_t*) context->token_mask_buffer.ptr);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            context->has_token_mask = true;
+        }
+
+        status = encode_sample_token(context, &command_buffer, temperature, rng_seed, output_logprobs);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        uint32_t num_logprob_candidates = 0;
+        if (output_logprobs && num_top_logprobs != 0) {
+            // Reuse the radix selection of the top-k filter to reduce the scores to a superset of the top tokens.
+            status = gptoss_metal_command_buffer_encode_launch_f32_sample_filter(
+                &command_buffer,
+                &model->f32_sample_filter_fn,
+                /*threadgroup_size=*/512,
+                model->max_threadgroups,
+                &context->score_buffer,
+                /*score_offset=*/0,
+                &context->argmax_buffer,
+                /*argmax_offset=*/0,
+                &context->sample_candidate_buffer,
+                /*candidate_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                rng_seed,
+                /*rng_offset=*/context->num_tokens,
+                /*num_channels=*/model->vocabulary_size,
+                /*temperature=*/1.0f,
+                /*top_k=*/num_top_logprobs,
+                /*min_p=*/0.0f,
+                &num_logprob_candidates);
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode f32_sample_filter kernel launch");
+                goto cleanup;
+            }
+        }
+
+        status = encode_check_stop_token(context, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        context->num_tokens += 1;
+        context->num_kv_tokens = context->num_tokens;
+
+        if (grammar != NULL || output_logprobs) {
+            // The token mask for the next token depends on the sampled token, and the next token overwrites the
+            // scores and log-sum-exp partials.
+            gptoss_metal_command_buffer_commit(&command_buffer);
+            status = wait_command_buffer(context, &command_buffer);
+            gptoss_metal_command_buffer_release(&command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            num_completed_tokens = t + 1;
+
+            const uint32_t token = ((const uint32_t*) context->token_buffer.ptr)[context->num_tokens - 1];
+            if (output_logprobs) {
+                store_logprobs(context, /*output_index=*/0, token, num_top_logprobs, num_logprob_candidates,
+                    logprobs_out + t, top_tokens_out + t * num_top_logprobs, top_logprobs_out + t * num_top_logprobs);
+            }
+            if (grammar != NULL) {
+                status = gptoss_grammar_accept_token(grammar, token);
+                if (status != gptoss_status_success) {
+                    goto cleanup;
+                }
+            }
+
+            status = gptoss_metal_command_buffer_create(&context->model->command_queue, &command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            if ((grammar != NULL && grammar->terminated) || is_stop_token(context, token)) {
+                break;
+            }
+        }
+    }
+
+    gptoss_metal_command_buffer_commit(&command_buffer);
+    status = wait_command_buffer(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    const uint32_t* token_ptr = (const uint32_t*) context->token_buffer.ptr;
+    uint32_t num_generated_tokens = context->num_tokens - num_original_tokens;
+    if (grammar == NULL && !output_logprobs) {
+        // A stop token aborted the steps after it, and a stop sequence may have completed before the last step.
+        // Trim the context after the first stop; the next call recomputes the KV cache entry of the last token.
+        for (uint32_t t = 0; t < num_generated_tokens; t++) {
+            if (is_stop_token(context, token_ptr[num_original_tokens + t])) {
+                num_generated_tokens = t + 1;
+                break;
+            }
+        }
+        context->num_tokens = num_original_tokens + num_generated_tokens;
+        context->num_kv_tokens = context->num_tokens;
+    }
+    memcpy(tokens_out, token_ptr + num_original_tokens, num_generated_tokens * sizeof(uint32_t));
+    *num_tokens_out = num_generated_tokens;
+
+cleanup:
+    gptoss_metal_command_buffer_release(&command_buffer);
+    if (status != gptoss_status_success) {
+        // Keep only the tokens that completed. The KV cache holds the pending tokens before the call only if the first
+        // token completed; as usual, the next call recomputes the entry of the last token.
+        context->num_tokens = num_original_tokens + num_completed_tokens;
+        context->num_kv_tokens = num_completed_tokens != 0 ? context->num_tokens : num_original_kv_tokens;
+        memcpy(tokens_out, (const uint32_t*) context->token_buffer.ptr + num_original_tokens,
+            num_completed_tokens * sizeof(uint32_t));
+        *num_tokens_out = num_completed_tokens;
+    }
+    end_call(context);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    if (context->num_stop_sequences != 0) {
+        // Stop sequences are matched on the host, so sample in separate submissions that can stop at every token.
+        return gptoss_context_sample_streaming(context, temperature, seed, max_tokens, /*callback=*/NULL,
+            /*user_data=*/NULL, tokens_out, num_tokens_out);
+    }
+    return sample_tokens(context, temperature, seed, max_tokens, /*num_top_logprobs=*/0, tokens_out,
+        /*logprobs_out=*/NULL, /*top_tokens_out=*/NULL, /*top_logprobs_out=*/NULL, num_tokens_out);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_with_logprobs(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    uint32_t num_top_logprobs,
+    uint32_t* tokens_out,
+    float* logprobs_out,
+    uint32_t* top_tokens_out,
+    float* top_logprobs_out,
+    size_t* num_tokens_out)
+{
+    *num_tokens_out = 0;
+    if (num_top_logprobs > GPTOSS_MAX_TOP_K) {
+        GPTOSS_LOG_ERROR("number of top log-probabilities (%" PRIu32 ") exceeds the maximum of %u",
+            num_top_logprobs, GPTOSS_MAX_TOP_K);
+        return gptoss_status_invalid_argument;
+    }
+    return sample_tokens(context, temperature, seed, max_tokens, num_top_logprobs, tokens_out,
+        logprobs_out, top_tokens_out, top_logprobs_out, num_tokens_out);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_streaming(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    gptoss_token_callback_t callback,
+    void* user_data,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    finish_pending_request(context);
+
+    enum gptoss_status status = gptoss_status_success;
+    // Every token gets its own command buffer, so that it can be delivered as soon as it completes, while up to
+    // GPTOSS_SAMPLE_STREAM_DEPTH tokens are queued on the GPU behind it.
+    struct gptoss_metal_command_buffer command_buffers[GPTOSS_SAMPLE_STREAM_DEPTH] = {0};
+    size_t num_submitted_tokens = 0;
+    size_t num_delivered_tokens = 0;
+
+    *num_tokens_out = 0;
+
+    if (max_tokens != 0 && context->num_tokens == context->max_tokens) {
+        GPTOSS_LOG_ERROR("context is full (%zu tokens)", context->max_tokens);
+        return gptoss_status_context_overflow;
+    }
+    max_tokens = math_min(max_tokens, context->max_tokens - context->num_tokens);
+
+    const size_t num_original_tokens = context->num_tokens;
+    const size_t num_original_kv_tokens = context->num_kv_tokens;
+
+    status = begin_call(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    context->stop_tail_size = 0;
+
+    const uint64_t rng_seed = seed + UINT64_C(0x123456789ABCDEF);
+    struct gptoss_grammar* grammar = context->grammar;
+    bool stop = false;
+    while (num_delivered_tokens < max_tokens && !stop) {
+        // With a grammar, the token mask for the next token depends on the last sampled token.
+        const size_t max_tokens_in_flight = grammar != NULL ? 1 : GPTOSS_SAMPLE_STREAM_DEPTH;
+        if (num_submitted_tokens < max_tokens && num_submitted_tokens - num_delivered_tokens < max_tokens_in_flight) {
+            if (grammar != NULL) {
+                status = gptoss_grammar_get_token_mask(grammar, (uint32_t*) context->token_mask_buffer.ptr);
+                if (status != gptoss_status_success) {
+                    goto cleanup;
+                }
+                context->has_token_mask = true;
+            }
+
+            struct gptoss_metal_command_buffer* command_buffer =
+                &command_buffers[num_submitted_tokens % GPTOSS_SAMPLE_STREAM_DEPTH];
+            status = gptoss_metal_command_buffer_create(&context->model->command_queue, command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+
+            status = encode_sample_token(context, command_buffer, temperature, rng_seed, /*output_scores=*/false);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            // A stop token also turns the steps queued behind it into no-ops.
+            status = encode_check_stop_token(context, command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            context->num_tokens += 1;
+            context->num_kv_tokens = context->num_tokens;
+
+            status = gptoss_metal_command_buffer_commit(command_buffer);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            num_submitted_tokens += 1;
+            continue;
+        }
+
+        struct gptoss_metal_command_buffer* command_buffer =
+            &command_buffers[num_delivered_tokens % GPTOSS_SAMPLE_STREAM_DEPTH];
+        status = wait_command_buffer(context, command_buffer);
+        gptoss_metal_command_buffer_release(command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        const uint32_t token = ((const uint32_t*) context->token_buffer.ptr)[num_original_tokens + num_delivered_tokens];
+        if (grammar != NULL) {
+            status = gptoss_grammar_accept_token(grammar, token);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            stop = grammar->terminated;
+        }
+        if (is_stop_token(context, token)) {
+            stop = true;
+        }
+        tokens_out[num_delivered_tokens++] = token;
+        if (callback != NULL && !callback(token, user_data)) {
+            stop = true;
+        }
+    }
+
+cleanup:
+    // Drain the tokens in flight. Tokens that were not delivered are dropped from the context: their positions are
+    // recomputed by the next call. Their kernels exit early, as on abort, since their results are discarded.
+    if (num_submitted_tokens > num_delivered_tokens) {
+        struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+        control->abort = 1;
+    }
+    for (size_t t = num_delivered_tokens; t < num_delivered_tokens + GPTOSS_SAMPLE_STREAM_DEPTH; t++) {
+        struct gptoss_metal_command_buffer* command_buffer = &command_buffers[t % GPTOSS_SAMPLE_STREAM_DEPTH];
+        if (command_buffer->object != NULL) {
+            if (t < num_submitted_tokens) {
+                gptoss_metal_command_buffer_wait_completion(command_buffer, NULL);
+            }
+            gptoss_metal_command_buffer_release(command_buffer);
+        }
+    }
+    context->num_tokens = num_original_tokens + num_delivered_tokens;
+    context->num_kv_tokens = num_delivered_tokens != 0 ? context->num_tokens : num_original_kv_tokens;
+    *num_tokens_out = num_delivered_tokens;
+    end_call(context);
+    return status;
+}
+
+static void complete_request(
+    void* user_data)
+{
+    struct gptoss_request* request = (struct gptoss_request*) user_data;
+    if (request->callback != NULL) {
+        request->callback(request, request->user_data);
+    }
+    // Drop the reference held by the in-flight command buffer.
+    gptoss_request_release(request);
+}
+
+// Creates a request with a new command buffer, and room for max_tokens sampled tokens.
+static enum gptoss_status create_request(
+    gptoss_context_t context,
+    size_t max_tokens,
+    gptoss_request_callback_t callback,
+    void* user_data,
+    struct gptoss_request** request_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_request* request = NULL;
+
+    request = malloc(sizeof(struct gptoss_request));
+    if (request == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for Request object", sizeof(struct gptoss_request));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+    memset(request, 0, sizeof(struct gptoss_request));
+
+    atomic_store_explicit(&request->ref_count, 1, memory_order_relaxed);
+    request->callback = callback;
+    request->user_data = user_data;
+
+    if (max_tokens != 0) {
+        status = gptoss_metal_buffer_create(&context->model->device, max_tokens * sizeof(uint32_t), NULL,
+            &request->token_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+
+    status = gptoss_metal_command_buffer_create(&context->model->command_queue, &request->command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    *request_out = request;
+    request = NULL;
+
+cleanup:
+    gptoss_request_release(request);
+    return status;
+}
+
+// Commits the command buffer of the request, and makes it the pending request of the context.
+static enum gptoss_status submit_request(
+    gptoss_context_t context,
+    struct gptoss_request* request)
+{
+    // The in-flight command buffer holds a reference until the completion handler runs.
+    gptoss_request_retain(request);
+    enum gptoss_status status = gptoss_metal_command_buffer_add_completion_handler(
+        &request->command_buffer, complete_request, request);
+    if (status != gptoss_status_success) {
+        gptoss_request_release(request);
+        return status;
+    }
+
+    status = gptoss_metal_command_buffer_commit(&request->command_buffer);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    gptoss_request_retain(request);
+    gptoss_request_release(context->pending_request);  // does nothing if there is no pending request
+    context->pending_request = request;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_process_async(
+    gptoss_context_t context,
+    gptoss_request_callback_t callback,
+    void* user_data,
+    gptoss_request_t* request_out)
+{
+    *request_out = NULL;
+
+    struct gptoss_request* request = NULL;
+    enum gptoss_status status = create_request(context, /*max_tokens=*/0, callback, user_data, &request);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    if (context->num_tokens > context->num_kv_tokens) {
+        struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+        control->abort = 0;
+
+        status = process_tokens(
+            context,
+            &request->command_buffer,
+            /*input_tokens_offset=*/context->num_kv_tokens,
+            /*num_input_tokens=*/context->num_tokens - context->num_kv_tokens,
+            /*num_output_tokens=*/0,
+            /*output_scores=*/false,
+            /*temperature=*/0.0f,
+            /*rng_seed=*/0,
+            /*unconstrained=*/false);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+
+    status = submit_request(context, request);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    context->num_kv_tokens = context->num_tokens;
+
+    *request_out = request;
+    request = NULL;
+
+cleanup:
+    gptoss_request_release(request);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_async(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    gptoss_request_callback_t callback,
+    void* user_data,
+    gptoss_request_t* request_out)
+{
+    *request_out = NULL;
+
+    if (context->grammar != NULL) {
+        GPTOSS_LOG_ERROR("asynchronous sampling does not support grammar constraints");
+        return gptoss_status_unsupported_argument;
+    }
+    if (context->has_stop_tokens || context->num_stop_sequences != 0) {
+        GPTOSS_LOG_ERROR("asynchronous sampling does not support stop tokens and stop sequences");
+        return gptoss_status_unsupported_argument;
+    }
+    if (context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("asynchronous sampling requires at least one token in the context");
+        return gptoss_status_invalid_state;
+    }
+    if (max_tokens != 0 && context->num_tokens == context->max_tokens) {
+        GPTOSS_LOG_ERROR("context is full (%zu tokens)", context->max_tokens);
+        return gptoss_status_context_overflow;
+    }
+    max_tokens = math_min(max_tokens, context->max_tokens - context->num_tokens);
+
+    const size_t num_original_tokens = context->num_tokens;
+    const size_t num_original_kv_tokens = context->num_kv_tokens;
+    struct gptoss_request* request = NULL;
+    enum gptoss_status status = create_request(context, max_tokens, callback, user_data, &request);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+    control->abort = 0;
+
+    const uint64_t rng_seed = seed + UINT64_C(0x123456789ABCDEF);
+    for (size_t t = 0; t < max_tokens; t++) {
+        status = encode_sample_token(context, &request->command_buffer, temperature, rng_seed,
+            /*output_scores=*/false);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        context->num_tokens += 1;
+        context->num_kv_tokens = context->num_tokens;
+    }
+
+    if (max_tokens != 0) {
+        // Copy the sampled tokens out, so they remain valid after the context moves on.
+        status = gptoss_metal_command_buffer_encode_copy_buffer(
+            &request->command_buffer,
+            &context->token_buffer,
+            /*input_offset=*/num_original_tokens * sizeof(uint32_t),
+            &request->token_buffer,
+            /*output_offset=*/0,
+            /*size=*/max_tokens * sizeof(uint32_t));
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode copy buffer");
+            goto cleanup;
+        }
+    }
+
+    status = submit_request(context, request);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    request->num_tokens = max_tokens;
+
+    *request_out = request;
+    request = NULL;
+
+cleanup:
+    if (request != NULL) {
+        // Nothing was submitted, so the context is left as it was.
+        context->num_tokens = num_original_tokens;
+        context->num_kv_tokens = num_original_kv_tokens;
+    }
+    gptoss_request_release(request);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_request_poll(
+    gptoss_request_t request,
+    bool* completed_out)
+{
+    return gptoss_metal_command_buffer_is_completed(&request->command_buffer, completed_out);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_request_wait(
+    gptoss_request_t request)
+{
+    return gptoss_metal_command_buffer_wait_completion(&request->command_buffer, NULL);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_request_get_tokens(
+    gptoss_request_t request,
+    uint32_t* tokens_out,
+    size_t max_tokens,
+    size_t* num_tokens_out)
+{
+    *num_tokens_out = request->num_tokens;
+    if (max_tokens < request->num_tokens) {
+        return gptoss_status_insufficient_memory;
+    }
+
+    bool completed = false;
+    enum gptoss_status status = gptoss_metal_command_buffer_is_completed(&request->command_buffer, &completed);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    if (!completed) {
+        GPTOSS_LOG_ERROR("request has not completed");
+        return gptoss_status_invalid_state;
+    }
+
+    if (request->num_tokens != 0) {
+        memcpy(tokens_out, request->token_buffer.ptr, request->num_tokens * sizeof(uint32_t));
+    }
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_request_retain(
+    gptoss_request_t request)
+{
+    atomic_fetch_add_explicit(&request->ref_count, 1, memory_order_relaxed);
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_request_release(
+    gptoss_request_t request)
+{
+    if (request != NULL) {
+        if (atomic_fetch_sub_explicit(&request->ref_count, 1, memory_order_acq_rel) == 1) {
+            gptoss_metal_command_buffer_release(&request->command_buffer);
+            gptoss_metal_buffer_release(&request->token_buffer);
+
+            memset(request, 0, sizeof(struct gptoss_request));
+            free(request);
+        }
+    }
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_score(
+    gptoss_context_t context,
+    size_t num_tokens,
+    const uint32_t* tokens,
+    float* logprobs_out)
+{
+    finish_pending_request(context);
+
+    const struct gptoss_model* model = context->model;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+
+    if (context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("scoring requires a non-empty context");
+        return gptoss_status_invalid_state;
+    }
+    if (num_tokens > context->max_tokens - context->num_tokens) {
+        GPTOSS_LOG_ERROR("scoring %zu tokens would overflow the context of %zu tokens with %zu tokens",
+            num_tokens, context->max_tokens, context->num_tokens);
+        return gptoss_status_context_overflow;
+    }
+
+    enum gptoss_status status = begin_call(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    const size_t num_original_tokens = context->num_tokens;
+    const size_t num_original_kv_tokens = context->num_kv_tokens;
+    status = gptoss_context_append_tokens(context, num_tokens, tokens);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    // Output i of each chunk comes from input token output_start + i and predicts the token after it.
+    const uint32_t* input_tokens = (const uint32_t*) context->token_buffer.ptr;
+    size_t output_start = num_original_tokens - 1;
+    while (output_start + 1 < context->num_tokens) {
+        const size_t num_outputs = math_min(model->max_batch_tokens, context->num_tokens - 1 - output_start);
+
+        status = gptoss_metal_command_buffer_create(&model->command_queue, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        if (context->num_kv_tokens < output_start) {
+            status = process_tokens(
+                context,
+                &command_buffer,
+                /*input_tokens_offset=*/context->num_kv_tokens,
+                /*num_input_tokens=*/output_start - context->num_kv_tokens,
+                /*num_output_tokens=*/0,
+                /*output_scores=*/false,
+                /*temperature=*/0.0f,
+                /*rng_seed=*/0,
+                /*unconstrained=*/false);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+        }
+
+        status = process_tokens(
+            context,
+            &command_buffer,
+            /*input_tokens_offset=*/output_start,
+            /*num_input_tokens=*/num_outputs,
+            /*num_output_tokens=*/num_outputs,
+            /*output_scores=*/true,
+            /*temperature=*/0.0f,
+            /*rng_seed=*/0,
+            /*unconstrained=*/true);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        status = gptoss_metal_command_buffer_commit(&command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        status = wait_command_buffer(context, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        gptoss_metal_command_buffer_release(&command_buffer);
+
+        const float* scores = (const float*) context->score_buffer.ptr;
+        for (size_t i = 0; i < num_outputs; i++) {
+            const uint32_t token = input_tokens[output_start + i + 1];
+            logprobs_out[output_start + i - (num_original_tokens - 1)] =
+                scores[i * model->vocabulary_size + token] - get_output_lse(context, i);
+        }
+        context->num_kv_tokens = output_start + num_outputs;
+        output_start += num_outputs;
+    }
+
+cleanup:
+    gptoss_metal_command_buffer_release(&command_buffer);
+    if (status != gptoss_status_success) {
+        // Drop the appended tokens; KV entries past the original tokens may have been overwritten.
+        context->num_tokens = num_original_tokens;
+        context->num_kv_tokens = math_min(num_original_kv_tokens, num_original_tokens);
+    }
+    end_call(context);
+    return status;
+}
+
+// Processes the tokens before the last token of the context that are not in the KV cache.
+static enum gptoss_status encode_process_prefix(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer)
+{
+    const size_t num_tokens = context->num_tokens;
+    assert(num_tokens != 0);
+    const size_t num_kv_tokens = math_min(context->num_kv_tokens, num_tokens - 1);
+    if (num_kv_tokens < num_tokens - 1) {
+        const enum gptoss_status status = process_tokens(
+            context,
+            command_buffer,
+            /*input_tokens_offset=*/num_kv_tokens,
+            /*num_input_tokens=*/num_tokens - 1 - num_kv_tokens,
+            /*num_output_tokens=*/0,
+            /*output_scores=*/false,
+            /*temperature=*/0.0f,
+            /*rng_seed=*/0,
+            /*unconstrained=*/false);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+    return gptoss_status_success;
+}
+
+// Verifies the num_draft_tokens tokens in the token buffer after the last token of the context. The last token and
+// the draft tokens are processed in a single batch, and every position is sampled with the same random numbers
+// (rng_offset is its position) that gptoss_context_sample would use. The samples are left in the low words of
+// argmax_buffer for accept_draft_tokens. The KV cache must hold all tokens before the last one by the time the
+// verification runs.
+static enum gptoss_status encode_verify_draft_tokens(
+    gptoss_context_t context,
+    struct gptoss_metal_command_buffer* command_buffer,
+    size_t num_draft_tokens,
+    float temperature,
+    uint64_t rng_seed)
+{
+    const struct gptoss_model* model = context->model;
+    const size_t num_tokens = context->num_tokens;
+    assert(num_tokens != 0);
+    assert(num_tokens + num_draft_tokens < context->max_tokens);
+    assert(num_draft_tokens < model->max_batch_tokens);
+
+    const bool filter_scores = temperature != 0.0f && (context->top_k != 0 || context->min_p != 0.0f);
+    const size_t num_verify_tokens = num_draft_tokens + 1;
+    enum gptoss_status status = process_tokens(
+        context,
+        command_buffer,
+        /*input_tokens_offset=*/num_tokens - 1,
+        /*num_input_tokens=*/num_verify_tokens,
+        /*num_output_tokens=*/num_verify_tokens,
+        /*output_scores=*/filter_scores,
+        /*temperature=*/filter_scores ? 0.0f : temperature,
+        rng_seed,
+        /*unconstrained=*/false);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    if (filter_scores) {
+        for (size_t i = 0; i < num_verify_tokens; i++) {
+            uint32_t num_candidates = 0;
+            status = gptoss_metal_command_buffer_encode_launch_f32_sample_filter(
+                command_buffer,
+                &model->f32_sample_filter_fn,
+                /*threadgroup_size=*/512,
+                model->max_threadgroups,
+                &context->score_buffer,
+                /*score_offset=*/i * model->vocabulary_size * sizeof(float),
+                &context->argmax_buffer,
+                /*argmax_offset=*/i * sizeof(uint64_t),
+                &context->sample_candidate_buffer,
+                /*candidate_offset=*/0,
+                &context->control_buffer,
+                /*control_offset=*/0,
+                rng_seed,
+                /*rng_offset=*/num_tokens + i,
+                /*num_channels=*/model->vocabulary_size,
+                temperature,
+                context->top_k,
+                context->min_p,
+                &num_candidates);
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode f32_sample_filter kernel launch");
+                return status;
+            }
+
+            // Store the sampled token in the low word of the packed argmax, where the unfiltered path leaves it.
+            status = gptoss_metal_command_buffer_encode_launch_f32_sample_candidates(
+                command_buffer,
+                &model->f32_sample_candidates_fn,
+                /*threadgroup_size=*/1024,
+                &context->sample_candidate_buffer,
+                /*candidate_offset=*/0,
+                &context->argmax_buffer,
+                /*token_offset=*/i * sizeof(uint64_t),
+                &context->control_buffer,
+                /*control_offset=*/0,
+                rng_seed,
+                /*rng_offset=*/num_tokens + i,
+                num_candidates,
+                temperature,
+                context->top_k);
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode f32_sample_candidates kernel launch");
+                return status;
+            }
+        }
+    }
+    return gptoss_status_success;
+}
+
+// Accepts draft tokens while they match the samples of the completed verification, and replaces the first mismatching
+// draft token with the sample, so the context is extended with exactly the tokens that non-speculative sampling would
+// produce. If all draft tokens are accepted, the sample after the last one comes for free. Returns the number of
+// accepted draft tokens.
+static size_t accept_draft_tokens(
+    gptoss_context_t context,
+    size_t num_draft_tokens)
+{
+    const size_t num_tokens = context->num_tokens;
+    uint32_t* input_tokens = (uint32_t*) context->token_buffer.ptr;
+    const uint64_t* sampled_tokens = (const uint64_t*) context->argmax_buffer.ptr;
+    size_t num_accepted_tokens = 0;
+    while (num_accepted_tokens < num_draft_tokens &&
+        (uint32_t) sampled_tokens[num_accepted_tokens] == input_tokens[num_tokens + num_accepted_tokens])
+    {
+        num_accepted_tokens += 1;
+    }
+    input_tokens[num_tokens + num_accepted_tokens] = (uint32_t) sampled_tokens[num_accepted_tokens];
+
+    // KV cache entries of rejected draft tokens are invalidated, and get overwritten when their positions are
+    // processed again. As in gptoss_context_sample, the last token is reprocessed by the next call.
+    context->num_tokens = num_tokens + num_accepted_tokens + 1;
+    context->num_kv_tokens = context->num_tokens;
+    return num_accepted_tokens;
+}
+
+// Checks the tokens from first_token to the end of the context, which speculative sampling accepted, against the stop
+// tokens and stop sequences, and trims the context after the first stop. Returns whether sampling stops.
+static bool trim_at_stop_token(
+    gptoss_context_t context,
+    size_t first_token)
+{
+    if (!context->has_stop_tokens && context->num_stop_sequences == 0) {
+        return false;
+    }
+    const uint32_t* tokens = (const uint32_t*) context->token_buffer.ptr;
+    for (size_t t = first_token; t < context->num_tokens; t++) {
+        if (is_stop_token(context, tokens[t])) {
+            context->num_tokens = t + 1;
+            context->num_kv_tokens = context->num_tokens;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Verifies and accepts the num_draft_tokens tokens in the token buffer after the last token of the context. Must be
+// called within a call started with begin_call.
+static enum gptoss_status verify_draft_tokens(
+    gptoss_context_t context,
+    size_t num_draft_tokens,
+    float temperature,
+    uint64_t rng_seed)
+{
+    struct gptoss_metal_command_buffer command_buffer = {0};
+    enum gptoss_status status = gptoss_metal_command_buffer_create(&context->model->command_queue, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = encode_process_prefix(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = encode_verify_draft_tokens(context, &command_buffer, num_draft_tokens, temperature, rng_seed);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    status = gptoss_metal_command_buffer_commit(&command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = wait_command_buffer(context, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    accept_draft_tokens(context, num_draft_tokens);
+
+cleanup:
+    gptoss_metal_command_buffer_release(&command_buffer);
+    return status;
+}
+
+// Samples draft tokens in the draft context within the deadline of the call in progress on the target context. An
+// abort of the target context takes effect when the draft tokens are sampled.
+static enum gptoss_status sample_draft_tokens(
+    gptoss_context_t context,
+    gptoss_context_t draft_context,
+    float temperature,
+    uint64_t seed,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    *num_tokens_out = 0;
+    enum gptoss_status status = get_call_status(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    // Limit the draft call to the time left until the deadline of the target call.
+    const uint64_t draft_timeout_ns = draft_context->timeout_ns;
+    if (context->deadline_ns != 0) {
+        const uint64_t time_ns = get_monotonic_time_ns();
+        if (time_ns >= context->deadline_ns) {
+            return gptoss_status_timeout;
+        }
+        const uint64_t remaining_ns = context->deadline_ns - time_ns;
+        draft_context->timeout_ns = draft_timeout_ns != 0 ? math_min(draft_timeout_ns, remaining_ns) : remaining_ns;
+    }
+    status = gptoss_context_sample(draft_context, temperature, seed, max_tokens, tokens_out, num_tokens_out);
+    draft_context->timeout_ns = draft_timeout_ns;
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    return get_call_status(context);
+}
+
+// Drops the tokens of the context after the first num_tokens. As with gptoss_context_reset, the KV cache entries of the
+// dropped tokens are reused if the same tokens are appended again.
+static void truncate_tokens(
+    gptoss_context_t context,
+    size_t num_tokens)
+{
+    assert(num_tokens <= context->num_tokens);
+    context->num_tokens = num_tokens;
+    context->num_ngram_indexed_tokens = math_min(context->num_ngram_indexed_tokens, num_tokens);
+}
+
+// Returns the maximum number of tokens to draft for the next verification pass.
+static size_t get_max_draft_tokens(
+    gptoss_context_t context,
+    size_t num_draft_tokens,
+    size_t num_remaining_tokens)
+{
+    assert(num_remaining_tokens != 0);
+    assert(context->num_tokens < context->max_tokens);
+    num_draft_tokens = math_min(num_draft_tokens, num_remaining_tokens - 1);
+    num_draft_tokens = math_min(num_draft_tokens, context->max_tokens - context->num_tokens - 1);
+    return math_min(num_draft_tokens, context->model->max_batch_tokens - 1);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_speculative(
+    gptoss_context_t context,
+    gptoss_context_t draft_context,
+    float temperature,
+    uint64_t seed,
+    size_t num_draft_tokens,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    finish_pending_request(context);
+    finish_pending_request(draft_context);
+
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
+
+    *num_tokens_out = 0;
+
+    if (draft_context == context) {
+        GPTOSS_LOG_ERROR("draft context must differ from the target context");
+        return gptoss_status_invalid_argument;
+    }
+    if (draft_context->model->vocabulary_size != model->vocabulary_size) {
+        GPTOSS_LOG_ERROR("draft model vocabulary size %" PRIu32 " does not match target model vocabulary size %" PRIu32,
+            draft_context->model->vocabulary_size, model->vocabulary_size);
+        return gptoss_status_invalid_argument;
+    }
+    if (context->grammar != NULL || draft_context->grammar != NULL) {
+        GPTOSS_LOG_ERROR("speculative sampling does not support grammar constraints");
+        return gptoss_status_unsupported_argument;
+    }
+    if (context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("speculative sampling requires a non-empty context");
+        return gptoss_status_invalid_state;
+    }
+
+    status = begin_call(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    context->stop_tail_size = 0;
+
+    const size_t num_original_tokens = context->num_tokens;
+    const uint64_t rng_seed = seed + UINT64_C(0x123456789ABCDEF);
+    uint32_t* input_tokens = (uint32_t*) context->token_buffer.ptr;
+    // Number of leading tokens of the draft context known to match the target context.
+    size_t num_synced_tokens = 0;
+    uint32_t* draft_tokens = NULL;
+    if (num_draft_tokens != 0) {
+        draft_tokens = malloc(num_draft_tokens * sizeof(uint32_t));
+        if (draft_tokens == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate %zu bytes for draft tokens", num_draft_tokens * sizeof(uint32_t));
+            status = gptoss_status_insufficient_memory;
+            goto cleanup;
+        }
+    }
+
+    while (context->num_tokens - num_original_tokens < max_tokens && context->num_tokens < context->max_tokens) {
+        const size_t num_tokens = context->num_tokens;
+        size_t num_round_draft_tokens =
+            get_max_draft_tokens(context, num_draft_tokens, max_tokens - (num_tokens - num_original_tokens));
+        num_round_draft_tokens = math_min(num_round_draft_tokens, math_sub_sat(draft_context->max_tokens, num_tokens));
+
+        if (num_round_draft_tokens != 0) {
+            // Sync the draft context to the target tokens. The tokens before num_synced_tokens already match, so only
+            // the tail after the first mismatch is replaced, and the draft KV cache is reused up to that point.
+            const uint32_t* draft_input_tokens = (const uint32_t*) draft_context->token_buffer.ptr;
+            const size_t max_common_tokens = math_min(draft_context->num_tokens, num_tokens);
+            size_t num_common_tokens = math_min(num_synced_tokens, max_common_tokens);
+            while (num_common_tokens < max_common_tokens &&
+                draft_input_tokens[num_common_tokens] == input_tokens[num_common_tokens])
+            {
+                num_common_tokens += 1;
+            }
+            truncate_tokens(draft_context, num_common_tokens);
+            status = gptoss_context_append_tokens(draft_context, num_tokens - num_common_tokens,
+                input_tokens + num_common_tokens);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            num_synced_tokens = num_tokens;
+
+            size_t num_sampled_draft_tokens = 0;
+            status = sample_draft_tokens(context, draft_context, temperature, seed, num_round_draft_tokens,
+                draft_tokens, &num_sampled_draft_tokens);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+            // The draft model stops early on the stop tokens and stop sequences of the draft context.
+            num_round_draft_tokens = num_sampled_draft_tokens;
+            // gptoss_context_sample does not compute the KV cache entries of the last sampled token, so it must be
+            // reprocessed if the next round appends tokens after it.
+            draft_context->num_kv_tokens = math_min(draft_context->num_kv_tokens, draft_context->num_tokens - 1);
+
+            memcpy(input_tokens + num_tokens, draft_tokens, num_round_draft_tokens * sizeof(uint32_t));
+        }
+
+        status = verify_draft_tokens(context, num_round_draft_tokens, temperature, rng_seed);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        if (trim_at_stop_token(context, num_tokens)) {
+            break;
+        }
+    }
+
+cleanup:
+    free(draft_tokens);
+    end_call(context);
+
+    // Tokens accepted in the completed rounds stay in the context, even if a later round failed or was aborted.
+    const size_t num_generated_tokens = context->num_tokens - num_original_tokens;
+    memcpy(tokens_out, input_tokens + num_original_tokens, num_generated_tokens * sizeof(uint32_t));
+    *num_tokens_out = num_generated_tokens;
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_prompt_lookup(
+    gptoss_context_t context,
+    float temperature,
+    uint64_t seed,
+    size_t num_draft_tokens,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    finish_pending_request(context);
+
+    *num_tokens_out = 0;
+
+    if (context->grammar != NULL) {
+        GPTOSS_LOG_ERROR("prompt lookup sampling does not support grammar constraints");
+        return gptoss_status_unsupported_argument;
+    }
+    if (context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("prompt lookup sampling requires a non-empty context");
+        return gptoss_status_invalid_state;
+    }
+
+    enum gptoss_status status = create_ngram_table(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    status = begin_call(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    context->stop_tail_size = 0;
+
+    const size_t num_original_tokens = context->num_tokens;
+    const uint64_t rng_seed = seed + UINT64_C(0x123456789ABCDEF);
+    while (context->num_tokens - num_original_tokens < max_tokens && context->num_tokens < context->max_tokens) {
+        const size_t num_tokens = context->num_tokens;
+        const size_t num_round_draft_tokens = lookup_draft_tokens(context,
+            get_max_draft_tokens(context, num_draft_tokens, max_tokens - (num_tokens - num_original_tokens)));
+
+        status = verify_draft_tokens(context, num_round_draft_tokens, temperature, rng_seed);
+        if (status != gptoss_status_success || trim_at_stop_token(context, num_tokens)) {
+            break;
+        }
+    }
+    end_call(context);
+
+    // Tokens accepted in the completed rounds stay in the context, even if a later round failed or was aborted.
+    const uint32_t* input_tokens = (const uint32_t*) context->token_buffer.ptr;
+    const size_t num_generated_tokens = context->num_tokens - num_original_tokens;
+    memcpy(tokens_out, input_tokens + num_original_tokens, num_generated_tokens * sizeof(uint32_t));
+    *num_tokens_out = num_generated_tokens;
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_sample_self_speculative(
+    gptoss_context_t context,
+    uint32_t num_draft_blocks,
+    uint32_t num_draft_experts,
+    float temperature,
+    uint64_t seed,
+    size_t num_draft_tokens,
+    size_t max_tokens,
+    uint32_t* tokens_out,
+    size_t* num_tokens_out)
+{
+    finish_pending_request(context);
+
+    enum gptoss_status status = gptoss_status_success;
+    const struct gptoss_model* model = context->model;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+
+    *num_tokens_out = 0;
+
+    if (num_draft_blocks == 0 || num_draft_blocks > model->num_blocks) {
+        GPTOSS_LOG_ERROR("number of draft blocks (%" PRIu32 ") must be in [1, %" PRIu32 "]",
+            num_draft_blocks, model->num_blocks);
+        return gptoss_status_invalid_argument;
+    }
+    if (num_draft_experts == 0 || num_draft_experts > model->num_active_experts) {
+        GPTOSS_LOG_ERROR("number of draft experts (%" PRIu32 ") must be in [1, %" PRIu32 "]",
+            num_draft_experts, model->num_active_experts);
+        return gptoss_status_invalid_argument;
+    }
+    if (context->grammar != NULL) {
+        GPTOSS_LOG_ERROR("self-speculative sampling does not support grammar constraints");
+        return gptoss_status_unsupported_argument;
+    }
+    if (context->num_tokens == 0) {
+        GPTOSS_LOG_ERROR("self-speculative sampling requires a non-empty context");
+        return gptoss_status_invalid_state;
+    }
+
+    status = begin_call(context);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    context->stop_tail_size = 0;
+
+    const size_t num_original_tokens = context->num_tokens;
+    const uint64_t rng_seed = seed + UINT64_C(0x123456789ABCDEF);
+    while (context->num_tokens - num_original_tokens < max_tokens && context->num_tokens < context->max_tokens) {
+        const size_t num_tokens = context->num_tokens;
+        const size_t num_round_draft_tokens =
+            get_max_draft_tokens(context, num_draft_tokens, max_tokens - (num_tokens - num_original_tokens));
+
+        status = gptoss_metal_command_buffer_create(&model->command_queue, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        status = encode_process_prefix(context, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        // Draft tokens one at a time with the reduced model, feeding each one back through the token buffer on the
+        // GPU, so that drafting and verification complete in a single command buffer.
+        for (size_t i = 0; i < num_round_draft_tokens; i++) {
+            status = process_tokens_ex(
+                context,
+                &command_buffer,
+                /*input_tokens_offset=*/num_tokens - 1 + i,
+                /*num_input_tokens=*/1,
+                /*num_output_tokens=*/1,
+                /*output_scores=*/false,
+                temperature,
+                rng_seed,
+                /*unconstrained=*/false,
+                num_draft_blocks,
+                num_draft_experts);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+
+            status = gptoss_metal_command_buffer_encode_copy_buffer(
+                &command_buffer,
+                &context->argmax_buffer,
+                /*input_offset=*/0,
+                &context->token_buffer,
+                /*output_offset=*/(num_tokens + i) * sizeof(uint32_t),
+                /*size=*/sizeof(uint32_t));
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode copy buffer");
+                goto cleanup;
+            }
+        }
+
+        status = encode_verify_draft_tokens(context, &command_buffer, num_round_draft_tokens, temperature, rng_seed);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+
+        status = gptoss_metal_command_buffer_commit(&command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        status = wait_command_buffer(context, &command_buffer);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+        gptoss_metal_command_buffer_release(&command_buffer);
+
+        accept_draft_tokens(context, num_round_draft_tokens);
+        if (trim_at_stop_token(context, num_tokens)) {
+            break;
+        }
+    }
+
+cleanup:
+    gptoss_metal_command_buffer_release(&command_buffer);
+    end_call(context);
+
+    // Tokens accepted in the completed rounds stay in the context, even if a later round failed or was aborted.
+    const uint32_t* input_tokens = (const uint32_t*) context->token_buffer.ptr;
+    const size_t num_generated_tokens = context->num_tokens - num_original_tokens;
+    memcpy(tokens_out, input_tokens + num_original_tokens, num_generated_tokens * sizeof(uint32_t));
+    *num_tokens_out = num_generated_tokens;
+    return status;
+}
+
+// Consecutive rows of a multi-context batch that hold tokens [token_offset, token_offset + num_tokens) of one context.
+struct batch_segment {
+    gptoss_context_t context;
+    size_t context_index;
+    size_t row_offset;
+    size_t token_offset;
+    size_t num_tokens;
+};
+
+// Work of one context in a batch step: a chunk of its pending prefill tokens, and whether it samples a token.
+struct batch_plan {
+    size_t prefill_start;
+    size_t num_prefill_tokens;
+    bool decode;
+};
+
+// Schedules at most max_step_tokens rows (max_batch_tokens if 0) of the pending tokens of the contexts for one batch
+// step. Contexts without pending prefill decode first, so that long prefills can't delay their next tokens. Then every
+// context with pending prefill either processes all of it and decodes, if it fits into the remaining rows, or
+// processes a chunk of the remaining rows and continues in the next step.
+static void schedule_batch_step(
+    size_t num_contexts,
+    const gptoss_context_t* contexts,
+    size_t max_step_tokens,
+    struct batch_plan* plans,
+    size_t* num_rows_out,
+    size_t* num_decode_rows_out)
+{
+    const struct gptoss_model* model = contexts[0]->model;
+    const size_t num_step_tokens = max_step_tokens != 0 ?
+        math_min(max_step_tokens, model->max_batch_tokens) : model->max_batch_tokens;
+
+    size_t num_rows = 0;
+    size_t num_decode_rows = 0;
+    for (size_t i = 0; i < num_contexts; i++) {
+        const gptoss_context_t context = contexts[i];
+        const size_t prefill_start = math_min(context->num_kv_tokens, context->num_tokens - 1);
+        plans[i] = (struct batch_plan) {
+            .prefill_start = prefill_start,
+            .num_prefill_tokens = 0,
+            .decode = false,
+        };
+        if (prefill_start + 1 == context->num_tokens && num_rows < num_step_tokens) {
+            plans[i].decode = true;
+            num_rows += 1;
+            num_decode_rows += 1;
+        }
+    }
+    for (size_t i = 0; i < num_contexts && num_rows < num_step_tokens; i++) {
+        const size_t num_pending_prefill_tokens = contexts[i]->num_tokens - 1 - plans[i].prefill_start;
+        if (num_pending_prefill_tokens == 0) {
+            continue;
+        }
+        const size_t num_remaining_rows = num_step_tokens - num_rows;
+        if (num_pending_prefill_tokens < num_remaining_rows) {
+            plans[i].num_prefill_tokens = num_pending_prefill_tokens;
+            plans[i].decode = true;
+            num_rows += num_pending_prefill_tokens + 1;
+            num_decode_rows += 1;
+        } else {
+            plans[i].num_prefill_tokens = num_remaining_rows;
+            num_rows += num_remaining_rows;
+        }
+    }
+    *num_rows_out = num_rows;
+    *num_decode_rows_out = num_decode_rows;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_batch_step(
+    size_t num_contexts,
+    const gptoss_context_t* contexts,
+    size_t max_step_tokens,
+    float temperature,
+    uint64_t seed,
+    uint32_t* tokens_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_metal_command_buffer command_buffer = {0};
+    struct batch_segment* segments = NULL;
+    struct batch_plan* plans = NULL;
+
+    if (num_contexts == 0) {
+        GPTOSS_LOG_ERROR("batch step requires at least one context");
+        return gptoss_status_invalid_argument;
+    }
+
+    // The batch runs in the activation and sampling buffers of the first context.
+    const gptoss_context_t batch_context = contexts[0];
+    const struct gptoss_model* model = batch_context->model;
+    for (size_t i = 0; i < num_contexts; i++) {
+        const gptoss_context_t context = contexts[i];
+        finish_pending_request(context);
+        tokens_out[i] = UINT32_MAX;
+        if (context->model != model) {
+            GPTOSS_LOG_ERROR("context %zu of the batch uses a different model", i);
+            return gptoss_status_invalid_argument;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (contexts[j] == context) {
+                GPTOSS_LOG_ERROR("context %zu of the batch duplicates context %zu", i, j);
+                return gptoss_status_invalid_argument;
+            }
+        }
+        if (context->num_tokens == 0) {
+            GPTOSS_LOG_ERROR("context %zu of the batch is empty", i);
+            return gptoss_status_invalid_state;
+        }
+        if (context->num_tokens >= context->max_tokens) {
+            GPTOSS_LOG_ERROR("context %zu of the batch is full (%zu tokens)", i, context->max_tokens);
+            return gptoss_status_context_overflow;
+        }
+        if (context->grammar != NULL || context->has_logit_bias || context->has_token_mask) {
+            GPTOSS_LOG_ERROR("grammar constraints, logit biases, and token masks are not supported in batch steps");
+            return gptoss_status_unsupported_argument;
+        }
+        if (context->has_stop_tokens || context->num_stop_sequences != 0) {
+            GPTOSS_LOG_ERROR("stop tokens and stop sequences are not supported in batch steps");
+            return gptoss_status_unsupported_argument;
+        }
+    }
+
+    // Each context contributes at most one segment of pending prefill tokens and one decode row.
+    segments = malloc(2 * num_contexts * sizeof(struct batch_segment));
+    if (segments == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for batch segments", 2 * num_contexts * sizeof(struct batch_segment));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+    plans = malloc(num_contexts * sizeof(struct batch_plan));
+    if (plans == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for batch plans", num_contexts * sizeof(struct batch_plan));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+
+    size_t num_rows = 0;
+    size_t num_decode_rows = 0;
+    schedule_batch_step(num_contexts, contexts, max_step_tokens, plans, &num_rows, &num_decode_rows);
+
+    // Prefill rows go first, and the decode rows follow as a contiguous block for the unembedding.
+    size_t num_prefill_segments = 0;
+    size_t row_offset = 0;
+    for (size_t i = 0; i < num_contexts; i++) {
+        if (plans[i].num_prefill_tokens != 0) {
+            segments[num_prefill_segments++] = (struct batch_segment) {
+                .context = contexts[i],
+                .context_index = i,
+                .row_offset = row_offset,
+                .token_offset = plans[i].prefill_start,
+                .num_tokens = plans[i].num_prefill_tokens,
+            };
+            row_offset += plans[i].num_prefill_tokens;
+        }
+    }
+    const size_t num_prefill_rows = row_offset;
+    size_t num_segments = num_prefill_segments;
+    for (size_t i = 0; i < num_contexts; i++) {
+        if (plans[i].decode) {
+            segments[num_segments++] = (struct batch_segment) {
+                .context = contexts[i],
+                .context_index = i,
+                .row_offset = row_offset++,
+                .token_offset = contexts[i]->num_tokens - 1,
+                .num_tokens = 1,
+            };
+        }
+    }
+    assert(row_offset == num_rows);
+    assert(num_segments - num_prefill_segments == num_decode_rows);
+
+    status = gptoss_metal_command_buffer_create(&model->command_queue, &command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    struct gptoss_control* control = (struct gptoss_control*) batch_context->control_buffer.ptr;
     control->abort = 0;
 
-    for (size_t t = 0; t < max_tokens; t++) {
-        if (context->num_kv_tokens < context->num_tokens) {
-            status = process_tokens(
-                context,
-                &command_buffer,
-                /*input_tokens_offset=*/context->num_kv_tokens,
-                /*num_input_tokens=*/context->num_tokens - context->num_kv_tokens,
-                /*num_output_tokens=*/1);
-            context->num_kv_tokens = context->num_tokens;
-        } else {
-            status = process_tokens(
-                context,
+    const size_t attn_qkv_dim = model->head_dim * (model->num_heads + 2 * model->num_kv_heads);
+    for (size_t s = 0; s < num_segments; s++) {
+        const struct batch_segment* segment = &segments[s];
+        extend_rope_table(segment->context, segment->token_offset + segment->num_tokens);
+
+        status = gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings(
+            &command_buffer,
+            &model->bf16_f32_embeddings_fn,
+            model->embeddings_threadgroup_size,
+            &segment->context->token_buffer,
+            segment->token_offset * sizeof(uint32_t),
+            &model->shared_weight_buffer,
+            /*weight_offset=*/0,
+            &batch_context->residual_activation_buffer,
+            /*output_offset=*/model->embedding_dim * segment->row_offset * sizeof(float),
+            &batch_context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/segment->num_tokens,
+            /*num_channels=*/model->embedding_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode bf16_f32_embeddings kernel launch");
+            goto cleanup;
+        }
+    }
+
+    for (uint32_t n = 0; n < model->num_blocks; n++) {
+        // The last block only needs the outputs of the decode rows.
+        const bool last_block = n + 1 == model->num_blocks;
+        const size_t num_block_output_tokens = last_block ? num_decode_rows : num_rows;
+        const size_t first_output_row = num_rows - num_block_output_tokens;
+
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
+            &command_buffer,
+            &model->f32_bf16w_rmsnorm_fn,
+            &batch_context->residual_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->attn_rmsnorm_gain_offset + model->per_block_shared_weights_size * n,
+            &batch_context->rmsnorm_activation_buffer,
+            /*output_offset=*/0,
+            &batch_context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/num_rows,
+            /*num_channels=*/model->embedding_dim,
+            model->rmsnorm_epsilon);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm kernel launch");
+            goto cleanup;
+        }
+
+        // The fused QKV kernels write K and V to the KV cache of a single context, so the batch computes QKV for all
+        // rows at once, and scatters K and V to the KV caches of their contexts afterwards.
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
+            &command_buffer,
+            &model->f32_bf16w_matmul_fn,
+            model->attn_qkv_threadgroup_size,
+            &batch_context->rmsnorm_activation_buffer,
+            /*input_offset=*/0,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->attn_qkv_weight_offset + model->per_block_shared_weights_size * n,
+            &model->shared_weight_buffer,
+            /*bias_offset=*/model->attn_qkv_bias_offset + model->per_block_shared_weights_size * n,
+            &batch_context->qkv_activation_buffer,
+            /*output_offset=*/0,
+            &batch_context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/num_rows,
+            /*num_cols=*/model->embedding_dim,
+            /*num_rows=*/attn_qkv_dim);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul kernel launch");
+            goto cleanup;
+        }
+
+        for (size_t s = 0; s < num_segments; s++) {
+            const struct batch_segment* segment = &segments[s];
+            status = gptoss_metal_command_buffer_encode_launch_f32_rope_kv_scatter(
                 &command_buffer,
-                /*input_tokens_offset=*/context->num_tokens - 1,
-                /*num_input_tokens=*/1,
-                /*num_output_tokens=*/1);
+                &model->f32_rope_kv_scatter_fn,
+                /*threadgroup_size=*/0,
+                &batch_context->qkv_activation_buffer,
+                /*activations_offset=*/attn_qkv_dim * segment->row_offset * sizeof(float),
+                &segment->context->kvcache_buffer,
+                /*kv_offset=*/n * model->num_kv_heads * segment->context->max_tokens * 2 * model->head_dim * sizeof(float),
+                &segment->context->rope_table_buffer,
+                /*rope_table_offset=*/0,
+                &batch_context->control_buffer,
+                /*control_offset=*/0,
+                /*num_tokens=*/segment->num_tokens,
+                /*num_q_heads=*/model->num_heads,
+                /*num_kv_heads=*/model->num_kv_heads,
+                /*attn_head_dim=*/model->head_dim,
+                /*token_offset=*/segment->token_offset,
+                /*max_tokens=*/segment->context->max_tokens);
+            if (status != gptoss_status_success) {
+                GPTOSS_LOG_ERROR("failed to encode f32_rope_kv_scatter kernel launch");
+                goto cleanup;
+            }
+        }
+
+        for (size_t s = 0; s < num_segments; s++) {
+            const struct batch_segment* segment = &segments[s];
+            if (segment->row_offset < first_output_row) {
+                continue;
+            }
+            status = encode_attention(
+                batch_context, segment->context, &command_buffer, n,
+                /*q_row_offset=*/segment->row_offset,
+                /*output_row_offset=*/segment->row_offset - first_output_row,
+                /*num_q_tokens=*/segment->num_tokens,
+                /*token_offset=*/segment->token_offset);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+        }
+
+        if (num_block_output_tokens != 0) {
+            status = encode_block_output(
+                batch_context, &command_buffer, n, num_rows, num_block_output_tokens, model->num_active_experts);
+            if (status != gptoss_status_success) {
+                goto cleanup;
+            }
+        }
+    }
+
+    const uint64_t rng_seed = seed + UINT64_C(0x123456789ABCDEF);
+    if (num_decode_rows != 0) {
+        status = gptoss_metal_command_buffer_encode_fill_buffer(
+            &command_buffer,
+            &batch_context->argmax_buffer,
+            /*offset=*/0,
+            /*size=*/sizeof(uint64_t) * num_decode_rows,
+            /*fill_value=*/0xFF);
+        if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode fill buffer command");
+            goto cleanup;
         }
+
+        // Gumbel-max noise depends on the position of the sampled token, which differs between the decode rows, so
+        // the unembedding only produces scores and argmaxes, and every row is sampled separately.
+        status = gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_unembedding(
+            &command_buffer,
+            &model->f32_bf16w_rmsnorm_unembedding_fn,
+            model->unembedding_threadgroup_size,
+            model->max_threadgroups,
+            &batch_context->residual_activation_buffer,
+            /*input_offset=*/model->embedding_dim * num_prefill_rows * sizeof(float),
+            &model->shared_weight_buffer,
+            /*norm_weight_offset=*/model->rmsnorm_weight_offset,
+            &model->shared_weight_buffer,
+            /*weight_offset=*/model->unembedding_weight_offset,
+            &batch_context->score_buffer,
+            /*output_offset=*/0,
+            &batch_context->argmax_buffer,
+            /*argmax_offset=*/0,
+            &batch_context->lse_buffer,
+            /*lse_offset=*/0,
+            &batch_context->logit_bias_buffer,
+            /*bias_offset=*/0,
+            &batch_context->token_mask_buffer,
+            /*token_mask_offset=*/0,
+            &batch_context->control_buffer,
+            /*control_offset=*/0,
+            /*num_tokens=*/num_decode_rows,
+            /*num_cols=*/model->embedding_dim,
+            /*num_rows=*/model->vocabulary_size,
+            model->rmsnorm_epsilon,
+            /*output_scores=*/temperature != 0.0f,
+            /*temperature=*/0.0f,
+            rng_seed,
+            /*rng_offset=*/0,
+            /*has_logit_bias=*/false,
+            /*has_token_mask=*/false,
+            &batch_context->num_lse_partials);
         if (status != gptoss_status_success) {
+            GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_unembedding kernel launch");
             goto cleanup;
         }
+    }
 
+    for (size_t s = num_prefill_segments; s < num_segments; s++) {
+        const gptoss_context_t context = segments[s].context;
+        const size_t i = s - num_prefill_segments;
         if (temperature != 0.0f) {
-            assert(context->num_processed_tokens != 0);
-            uint32_t num_threadgroups = 0;
-            uint32_t num_dims_per_threadgroup = 0;
-            status = gptoss_metal_command_buffer_encode_launch_f32_softmax(
+            // With top_k = 0 and min_p = 0, the filter leaves the per-threadgroup Gumbel-max samples, and the
+            // candidates kernel picks the same token as the Gumbel-max sampling of the unembedding.
+            uint32_t num_candidates = 0;
+            status = gptoss_metal_command_buffer_encode_launch_f32_sample_filter(
                 &command_buffer,
-                &model->f32_softmax_fn,
+                &model->f32_sample_filter_fn,
                 /*threadgroup_size=*/512,
                 model->max_threadgroups,
-                &context->score_buffer,
-                /*score_offset=*/0,
-                &context->argmax_buffer,
-                /*argmax_offset=*/0,
-                &context->prob_buffer,
-                /*prob_offset=*/0,
-                &context->sum_buffer,
-                /*sum_offset=*/0,
-                &context->control_buffer,
+                &batch_context->score_buffer,
+                /*score_offset=*/model->vocabulary_size * i * sizeof(float),
+                &batch_context->argmax_buffer,
+                /*argmax_offset=*/i * sizeof(uint64_t),
+                &batch_context->sample_candidate_buffer,
+                /*candidate_offset=*/0,
+                &batch_context->control_buffer,
                 /*control_offset=*/0,
-                model->vocabulary_size,
-                /*num_tokens=*/1,
+                rng_seed,
+                /*rng_offset=*/context->num_tokens,
+                /*num_channels=*/model->vocabulary_size,
                 temperature,
-                &num_threadgroups,
-                &num_dims_per_threadgroup);
+                context->top_k,
+                context->min_p,
+                &num_candidates);
             if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_softmax kernel launch");
+                GPTOSS_LOG_ERROR("failed to encode f32_sample_filter kernel launch");
                 goto cleanup;
             }
 
-            status = gptoss_metal_command_buffer_encode_launch_f32_sample(
+            status = gptoss_metal_command_buffer_encode_launch_f32_sample_candidates(
                 &command_buffer,
-                &model->f32_sample_fn,
-                /*min_threadgroup_size=*/512,
-                &context->prob_buffer,
-                /*prob_offset=*/0,
-                &context->sum_buffer,
-                /*sum_offset=*/0,
+                &model->f32_sample_candidates_fn,
+                /*threadgroup_size=*/1024,
+                &batch_context->sample_candidate_buffer,
+                /*candidate_offset=*/0,
                 &context->token_buffer,
                 /*token_offset=*/context->num_tokens * sizeof(uint32_t),
-                &context->control_buffer,
+                &batch_context->control_buffer,
                 /*control_offset=*/0,
-                /*rng_seed=*/seed + UINT64_C(0x123456789ABCDEF),
+                rng_seed,
                 /*rng_offset=*/context->num_tokens,
-                /*num_blocks=*/num_threadgroups,
-                /*num_channels=*/model->vocabulary_size,
-                /*num_channels_per_block=*/num_dims_per_threadgroup);
+                num_candidates,
+                temperature,
+                context->top_k);
             if (status != gptoss_status_success) {
-                GPTOSS_LOG_ERROR("failed to encode f32_sample kernel launch");
+                GPTOSS_LOG_ERROR("failed to encode f32_sample_candidates kernel launch");
                 goto cleanup;
             }
         } else {
+            // The packed argmax holds the greedy token in its low word.
             status = gptoss_metal_command_buffer_encode_copy_buffer(
                 &command_buffer,
-                &context->argmax_buffer,
-                /*input_offset=*/0,
+                &batch_context->argmax_buffer,
+                /*input_offset=*/i * sizeof(uint64_t),
                 &context->token_buffer,
                 /*output_offset=*/context->num_tokens * sizeof(uint32_t),
                 /*size=*/sizeof(uint32_t));
@@ -897,27 +3324,283 @@ enum gptoss_status GPTOSS_ABI gptoss_context_sample(
                 goto cleanup;
             }
         }
+    }
+
+    status = gptoss_metal_command_buffer_commit(&command_buffer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    // If the step failed, the Contexts keep their state from before the step.
+    status = gptoss_metal_command_buffer_wait_completion(&command_buffer, NULL);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    for (size_t s = 0; s < num_prefill_segments; s++) {
+        segments[s].context->num_kv_tokens = segments[s].token_offset + segments[s].num_tokens;
+    }
+    for (size_t s = num_prefill_segments; s < num_segments; s++) {
+        const gptoss_context_t context = segments[s].context;
+        tokens_out[segments[s].context_index] = ((const uint32_t*) context->token_buffer.ptr)[context->num_tokens];
         context->num_tokens += 1;
         context->num_kv_tokens = context->num_tokens;
     }
 
-    gptoss_metal_command_buffer_commit(&command_buffer);
-    gptoss_metal_command_buffer_wait_completion(&command_buffer, NULL);
+cleanup:
+    gptoss_metal_command_buffer_release(&command_buffer);
+    free(plans);
+    free(segments);
+    return status;
+}
 
-    const uint32_t* token_ptr = (const uint32_t*) context->token_buffer.ptr;
-    const uint32_t num_generated_tokens = context->num_tokens - num_original_tokens;
-    memcpy(tokens_out, token_ptr + num_original_tokens, num_generated_tokens * sizeof(uint32_t));
-    *num_tokens_out = num_generated_tokens;
+enum gptoss_status GPTOSS_ABI gptoss_context_set_top_k(
+    gptoss_context_t context,
+    uint32_t top_k)
+{
+    if (top_k > GPTOSS_MAX_TOP_K) {
+        GPTOSS_LOG_ERROR("unsupported top-k value %" PRIu32 ": at most %d is supported", top_k, GPTOSS_MAX_TOP_K);
+        return gptoss_status_unsupported_argument;
+    }
+    context->top_k = top_k;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_min_p(
+    gptoss_context_t context,
+    float min_p)
+{
+    if (!(min_p >= 0.0f && min_p <= 1.0f)) {
+        GPTOSS_LOG_ERROR("invalid min-p value %f: must be in [0.0, 1.0] range", min_p);
+        return gptoss_status_invalid_argument;
+    }
+    context->min_p = min_p;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_logit_bias(
+    gptoss_context_t context,
+    size_t num_biases,
+    const uint32_t* token_ids,
+    const float* biases)
+{
+    finish_pending_request(context);
+
+    const uint32_t num_vocabulary_tokens = context->model->vocabulary_size;
+    for (size_t i = 0; i < num_biases; i++) {
+        if (token_ids[i] >= num_vocabulary_tokens) {
+            GPTOSS_LOG_ERROR("invalid token ID %" PRIu32 " in logit bias: must be less than %" PRIu32,
+                token_ids[i], num_vocabulary_tokens);
+            return gptoss_status_invalid_argument;
+        }
+        if (isnan(biases[i])) {
+            GPTOSS_LOG_ERROR("invalid logit bias for token ID %" PRIu32 ": must not be NaN", token_ids[i]);
+            return gptoss_status_invalid_argument;
+        }
+    }
+
+    float* bias_ptr = (float*) context->logit_bias_buffer.ptr;
+    memset(bias_ptr, 0, context->logit_bias_buffer.size);
+    for (size_t i = 0; i < num_biases; i++) {
+        bias_ptr[token_ids[i]] += biases[i];
+    }
+    context->has_logit_bias = num_biases != 0;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_token_mask(
+    gptoss_context_t context,
+    const uint32_t* token_mask)
+{
+    finish_pending_request(context);
+
+    if (token_mask == NULL) {
+        context->has_token_mask = false;
+        return gptoss_status_success;
+    }
+
+    const uint32_t num_vocabulary_tokens = context->model->vocabulary_size;
+    const size_t num_mask_words = math_ceil_div(num_vocabulary_tokens, 32);
+    bool has_allowed_tokens = false;
+    for (size_t i = 0; i < num_mask_words; i++) {
+        uint32_t mask_word = token_mask[i];
+        if (i == num_mask_words - 1 && num_vocabulary_tokens % 32 != 0) {
+            // Ignore bits past the end of the vocabulary
+            mask_word &= (UINT32_C(1) << (num_vocabulary_tokens % 32)) - 1;
+        }
+        has_allowed_tokens |= mask_word != 0;
+    }
+    if (!has_allowed_tokens) {
+        GPTOSS_LOG_ERROR("invalid token mask: at least one token must be allowed");
+        return gptoss_status_invalid_argument;
+    }
+
+    memcpy(context->token_mask_buffer.ptr, token_mask, num_mask_words * sizeof(uint32_t));
+    context->has_token_mask = true;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_stop_tokens(
+    gptoss_context_t context,
+    size_t num_stop_tokens,
+    const uint32_t* stop_tokens)
+{
+    finish_pending_request(context);
+
+    const uint32_t num_vocabulary_tokens = context->model->vocabulary_size;
+    for (size_t i = 0; i < num_stop_tokens; i++) {
+        if (stop_tokens[i] >= num_vocabulary_tokens) {
+            GPTOSS_LOG_ERROR("invalid stop token ID %" PRIu32 ": must be less than %" PRIu32,
+                stop_tokens[i], num_vocabulary_tokens);
+            return gptoss_status_invalid_argument;
+        }
+    }
+
+    uint32_t* stop_token_mask = (uint32_t*) context->stop_token_mask_buffer.ptr;
+    memset(stop_token_mask, 0, context->stop_token_mask_buffer.size);
+    for (size_t i = 0; i < num_stop_tokens; i++) {
+        stop_token_mask[stop_tokens[i] / 32] |= UINT32_C(1) << (stop_tokens[i] % 32);
+    }
+    context->has_stop_tokens = num_stop_tokens != 0;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_stop_sequences(
+    gptoss_context_t context,
+    size_t num_stop_sequences,
+    const char* const* stop_sequences,
+    const size_t* stop_sequence_sizes)
+{
+    finish_pending_request(context);
+
+    enum gptoss_status status = gptoss_status_success;
+    char* stop_sequence_data = NULL;
+    size_t* stop_sequence_offsets = NULL;
+    char* stop_tail = NULL;
+
+    size_t total_size = 0;
+    size_t max_size = 0;
+    for (size_t i = 0; i < num_stop_sequences; i++) {
+        if (stop_sequence_sizes[i] == 0) {
+            GPTOSS_LOG_ERROR("invalid stop sequence %zu: must not be empty", i);
+            return gptoss_status_invalid_argument;
+        }
+        total_size += stop_sequence_sizes[i];
+        max_size = math_max(max_size, stop_sequence_sizes[i]);
+    }
+
+    if (num_stop_sequences != 0) {
+        stop_sequence_data = malloc(total_size);
+        if (stop_sequence_data == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate %zu bytes for stop sequences", total_size);
+            status = gptoss_status_insufficient_memory;
+            goto cleanup;
+        }
+        stop_sequence_offsets = malloc((num_stop_sequences + 1) * sizeof(size_t));
+        if (stop_sequence_offsets == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate %zu bytes for stop sequence offsets",
+                (num_stop_sequences + 1) * sizeof(size_t));
+            status = gptoss_status_insufficient_memory;
+            goto cleanup;
+        }
+        stop_tail = malloc(max_size);
+        if (stop_tail == NULL) {
+            GPTOSS_LOG_ERROR("failed to allocate %zu bytes for stop sequence matching", max_size);
+            status = gptoss_status_insufficient_memory;
+            goto cleanup;
+        }
+
+        size_t offset = 0;
+        for (size_t i = 0; i < num_stop_sequences; i++) {
+            stop_sequence_offsets[i] = offset;
+            memcpy(stop_sequence_data + offset, stop_sequences[i], stop_sequence_sizes[i]);
+            offset += stop_sequence_sizes[i];
+        }
+        stop_sequence_offsets[num_stop_sequences] = offset;
+    }
+
+    free(context->stop_sequence_data);
+    free(context->stop_sequence_offsets);
+    free(context->stop_tail);
+    context->stop_sequence_data = stop_sequence_data;
+    context->stop_sequence_offsets = stop_sequence_offsets;
+    context->stop_tail = stop_tail;
+    context->num_stop_sequences = num_stop_sequences;
+    context->max_stop_sequence_size = max_size;
+    context->stop_tail_size = 0;
+    stop_sequence_data = NULL;
+    stop_sequence_offsets = NULL;
+    stop_tail = NULL;
 
 cleanup:
-    gptoss_metal_command_buffer_release(&command_buffer);
+    free(stop_sequence_data);
+    free(stop_sequence_offsets);
+    free(stop_tail);
     return status;
 }
 
+enum gptoss_status GPTOSS_ABI gptoss_context_set_grammar(
+    gptoss_context_t context,
+    gptoss_grammar_t grammar)
+{
+    finish_pending_request(context);
+
+    if (grammar != NULL) {
+        if (grammar->tokenizer != context->model->tokenizer) {
+            GPTOSS_LOG_ERROR("grammar was created for a different tokenizer");
+            return gptoss_status_invalid_argument;
+        }
+        gptoss_grammar_retain(grammar);
+    }
+    gptoss_grammar_release(context->grammar);  // does nothing if grammar is NULL
+    context->grammar = grammar;
+    context->has_token_mask = false;
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_set_timeout(
+    gptoss_context_t context,
+    double timeout_seconds)
+{
+    if (!(timeout_seconds >= 0.0)) {
+        GPTOSS_LOG_ERROR("invalid timeout %f: must be non-negative", timeout_seconds);
+        return gptoss_status_invalid_argument;
+    }
+    const double timeout_ns = timeout_seconds * 1.0e+9;
+    if (timeout_seconds == 0.0 || timeout_ns >= 0x1.0p+63) {
+        // Timeouts of centuries are as good as no timeout.
+        context->timeout_ns = 0;
+    } else {
+        // Round sub-nanosecond timeouts up, as 0 disables the timeout.
+        context->timeout_ns = timeout_ns >= 1.0 ? (uint64_t) timeout_ns : 1;
+    }
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_context_abort(
+    gptoss_context_t context)
+{
+    atomic_store_explicit(&context->abort_requested, true, memory_order_seq_cst);
+
+    // Only set the abort flag while a call is running: begin_call clears it, and end_call waits for this write.
+    unsigned int expected_state = gptoss_call_state_running;
+    if (atomic_compare_exchange_strong_explicit(&context->call_state, &expected_state, gptoss_call_state_aborting,
+        memory_order_seq_cst, memory_order_seq_cst))
+    {
+        struct gptoss_control* control = (struct gptoss_control*) context->control_buffer.ptr;
+        control->abort = 1;
+        atomic_store_explicit(&context->call_state, gptoss_call_state_running, memory_order_seq_cst);
+    }
+    return gptoss_status_success;
+}
+
 enum gptoss_status GPTOSS_ABI gptoss_context_reset(
     gptoss_context_t context)
 {
+    finish_pending_request(context);
+
     context->num_tokens = 0;
+    // Tokens added after the reset may differ, so they are indexed again.
+    context->num_ngram_indexed_tokens = 0;
 
     // Note: context->num_kv_tokens is not reset and context->input_tokens_buffer is not cleared.
     // If the subsequently added tokens match the tokens already in the KV cache, we reuse the KV cache.
@@ -937,25 +3620,41 @@ enum gptoss_status GPTOSS_ABI gptoss_context_release(
 {
     if (context != NULL) {
         if (atomic_fetch_sub_explicit(&context->ref_count, 1, memory_order_acq_rel) == 1) {
+            finish_pending_request(context);
+
             // Activation buffers
             gptoss_metal_buffer_release(&context->residual_activation_buffer);
             gptoss_metal_buffer_release(&context->rmsnorm_activation_buffer);
             gptoss_metal_buffer_release(&context->qkv_activation_buffer);
             gptoss_metal_buffer_release(&context->sdpa_activation_buffer);
+            gptoss_metal_buffer_release(&context->sdpa_partial_buffer);
             gptoss_metal_buffer_release(&context->gate_activation_buffer);
             gptoss_metal_buffer_release(&context->expert_activation_buffer);
             gptoss_metal_buffer_release(&context->swiglu_activation_buffer);
             gptoss_metal_buffer_release(&context->moe_activation_buffer);
+            gptoss_metal_buffer_release(&context->expert_offset_buffer);
+            gptoss_metal_buffer_release(&context->expert_assignment_buffer);
+            gptoss_metal_buffer_release(&context->expert_task_buffer);
 
             // Input/output buffers
             gptoss_metal_buffer_release(&context->control_buffer);
             gptoss_metal_buffer_release(&context->token_buffer);
             gptoss_metal_buffer_release(&context->score_buffer);
-            gptoss_metal_buffer_release(&context->prob_buffer);
-            gptoss_metal_buffer_release(&context->sum_buffer);
             gptoss_metal_buffer_release(&context->argmax_buffer);
+            gptoss_metal_buffer_release(&context->lse_buffer);
+            gptoss_metal_buffer_release(&context->sample_candidate_buffer);
+            gptoss_metal_buffer_release(&context->logit_bias_buffer);
+            gptoss_metal_buffer_release(&context->token_mask_buffer);
+            gptoss_metal_buffer_release(&context->stop_token_mask_buffer);
             gptoss_metal_buffer_release(&context->kvcache_buffer);
-
+            gptoss_metal_buffer_release(&context->rope_table_buffer);
+
+            gptoss_grammar_release(context->grammar);
+            free(context->stop_sequence_data);
+            free(context->stop_sequence_offsets);
+            free(context->stop_tail);
+            free(context->ngram_table);
+            gptoss_metal_command_list_release(&context->decode_plan);
             gptoss_model_release(context->model);
 
             memset(context, 0, sizeof(struct gptoss_context));
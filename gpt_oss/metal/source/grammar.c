@@ -0,0 +1,1344 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <gpt-oss.h>
+
+#include "internal/grammar.h"
+#include "internal/log.h"
+#include "internal/math.h"
+#include "internal/model.h"
+
+
+// Special tokens that end a message, and are allowed once the grammar matched.
+static const enum gptoss_special_token terminating_special_tokens[] = {
+    gptoss_special_token_return,
+    gptoss_special_token_end,
+    gptoss_special_token_call,
+};
+
+static enum gptoss_status ensure_capacity(
+    void** data,
+    size_t* capacity,
+    size_t required_capacity,
+    size_t element_size)
+{
+    if (required_capacity <= *capacity) {
+        return gptoss_status_success;
+    }
+
+    const size_t new_capacity = math_max(required_capacity, math_max(*capacity * 2, 16));
+    void* new_data = realloc(*data, new_capacity * element_size);
+    if (new_data == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for grammar", new_capacity * element_size);
+        return gptoss_status_insufficient_memory;
+    }
+    *data = new_data;
+    *capacity = new_capacity;
+    return gptoss_status_success;
+}
+
+// --- Grammar compilation
+
+struct element_array {
+    struct gptoss_grammar_element* data;
+    size_t size;
+    size_t capacity;
+};
+
+struct grammar_rule {
+    // Name of the rule in the grammar text, or NULL for rules generated for groups and repetitions.
+    const char* name;
+    size_t name_length;
+    struct element_array elements;
+    bool defined;
+};
+
+struct grammar_parser {
+    const char* text_start;
+    const char* ptr;
+    const char* end;
+
+    struct grammar_rule* rules;
+    size_t num_rules;
+    size_t rules_capacity;
+
+    uint32_t (*byte_sets)[8];
+    size_t num_byte_sets;
+    size_t byte_sets_capacity;
+};
+
+static enum gptoss_status element_array_append(
+    struct element_array* array,
+    enum gptoss_grammar_element_type type,
+    uint32_t value)
+{
+    enum gptoss_status status = ensure_capacity(
+        (void**) &array->data, &array->capacity, array->size + 1, sizeof(struct gptoss_grammar_element));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    array->data[array->size++] = (struct gptoss_grammar_element) {.type = type, .value = value};
+    return gptoss_status_success;
+}
+
+static enum gptoss_status element_array_append_range(
+    struct element_array* array,
+    const struct gptoss_grammar_element* elements,
+    size_t num_elements)
+{
+    enum gptoss_status status = ensure_capacity(
+        (void**) &array->data, &array->capacity, array->size + num_elements, sizeof(struct gptoss_grammar_element));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    memcpy(array->data + array->size, elements, num_elements * sizeof(struct gptoss_grammar_element));
+    array->size += num_elements;
+    return gptoss_status_success;
+}
+
+static void parser_error(const struct grammar_parser* parser, const char* message) {
+    GPTOSS_LOG_ERROR("invalid grammar at offset %zu: %s", (size_t) (parser->ptr - parser->text_start), message);
+}
+
+static bool is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+}
+
+static void skip_space(struct grammar_parser* parser) {
+    while (parser->ptr != parser->end) {
+        const char c = *parser->ptr;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            parser->ptr++;
+        } else if (c == '#') {
+            while (parser->ptr != parser->end && *parser->ptr != '\n') {
+                parser->ptr++;
+            }
+        } else {
+            break;
+        }
+    }
+}
+
+static size_t parse_name_length(const struct grammar_parser* parser, const char* ptr) {
+    const char* name_end = ptr;
+    while (name_end != parser->end && is_name_char(*name_end)) {
+        name_end++;
+    }
+    return (size_t) (name_end - ptr);
+}
+
+// Checks if the parser is at the start of the next rule definition ("name ::=").
+static bool at_rule_definition(const struct grammar_parser* parser) {
+    const size_t name_length = parse_name_length(parser, parser->ptr);
+    if (name_length == 0) {
+        return false;
+    }
+    struct grammar_parser lookahead = *parser;
+    lookahead.ptr += name_length;
+    skip_space(&lookahead);
+    return (size_t) (lookahead.end - lookahead.ptr) >= 3 && memcmp(lookahead.ptr, "::=", 3) == 0;
+}
+
+static enum gptoss_status add_rule(
+    struct grammar_parser* parser,
+    const char* name,
+    size_t name_length,
+    uint32_t* rule_out)
+{
+    enum gptoss_status status = ensure_capacity(
+        (void**) &parser->rules, &parser->rules_capacity, parser->num_rules + 1, sizeof(struct grammar_rule));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    parser->rules[parser->num_rules] = (struct grammar_rule) {.name = name, .name_length = name_length};
+    *rule_out = (uint32_t) parser->num_rules++;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status get_named_rule(
+    struct grammar_parser* parser,
+    const char* name,
+    size_t name_length,
+    uint32_t* rule_out)
+{
+    for (size_t r = 0; r < parser->num_rules; r++) {
+        const struct grammar_rule* rule = &parser->rules[r];
+        if (rule->name != NULL && rule->name_length == name_length && memcmp(rule->name, name, name_length) == 0) {
+            *rule_out = (uint32_t) r;
+            return gptoss_status_success;
+        }
+    }
+    return add_rule(parser, name, name_length, rule_out);
+}
+
+// Adds a rule with the given elements (including the final end element) and takes ownership of them.
+static enum gptoss_status define_generated_rule(
+    struct grammar_parser* parser,
+    struct element_array* elements,
+    uint32_t* rule_out)
+{
+    enum gptoss_status status = add_rule(parser, NULL, 0, rule_out);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    parser->rules[*rule_out].elements = *elements;
+    parser->rules[*rule_out].defined = true;
+    *elements = (struct element_array) {0};
+    return gptoss_status_success;
+}
+
+static enum gptoss_status add_byte_set(
+    struct grammar_parser* parser,
+    const uint32_t byte_set[8],
+    uint32_t* byte_set_out)
+{
+    for (size_t i = 0; i < parser->num_byte_sets; i++) {
+        if (memcmp(parser->byte_sets[i], byte_set, sizeof(uint32_t[8])) == 0) {
+            *byte_set_out = (uint32_t) i;
+            return gptoss_status_success;
+        }
+    }
+
+    enum gptoss_status status = ensure_capacity(
+        (void**) &parser->byte_sets, &parser->byte_sets_capacity, parser->num_byte_sets + 1, sizeof(uint32_t[8]));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    memcpy(parser->byte_sets[parser->num_byte_sets], byte_set, sizeof(uint32_t[8]));
+    *byte_set_out = (uint32_t) parser->num_byte_sets++;
+    return gptoss_status_success;
+}
+
+static int parse_hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Parses a single, possibly escaped, byte of a string literal or byte class.
+static bool parse_byte(struct grammar_parser* parser, uint8_t* byte_out) {
+    if (parser->ptr == parser->end) {
+        parser_error(parser, "unexpected end of grammar");
+        return false;
+    }
+    if (*parser->ptr != '\\') {
+        *byte_out = (uint8_t) *parser->ptr++;
+        return true;
+    }
+
+    parser->ptr++;
+    if (parser->ptr == parser->end) {
+        parser_error(parser, "unexpected end of grammar in escape sequence");
+        return false;
+    }
+    const char c = *parser->ptr++;
+    switch (c) {
+        case 'n':
+            *byte_out = '\n';
+            return true;
+        case 'r':
+            *byte_out = '\r';
+            return true;
+        case 't':
+            *byte_out = '\t';
+            return true;
+        case 'x':
+        {
+            if (parser->end - parser->ptr < 2) {
+                parser_error(parser, "incomplete \\x escape sequence");
+                return false;
+            }
+            const int hi = parse_hex_digit(parser->ptr[0]);
+            const int lo = parse_hex_digit(parser->ptr[1]);
+            if (hi < 0 || lo < 0) {
+                parser_error(parser, "invalid \\x escape sequence");
+                return false;
+            }
+            parser->ptr += 2;
+            *byte_out = (uint8_t) (hi * 16 + lo);
+            return true;
+        }
+        default:
+            if (is_name_char(c)) {
+                parser_error(parser, "unsupported escape sequence");
+                return false;
+            }
+            *byte_out = (uint8_t) c;
+            return true;
+    }
+}
+
+static enum gptoss_status parse_alternatives(struct grammar_parser* parser, struct element_array* out, size_t nesting);
+
+// Parses a single item of a sequence, without repetition operators.
+static enum gptoss_status parse_primary(struct grammar_parser* parser, struct element_array* out, size_t nesting) {
+    enum gptoss_status status = gptoss_status_success;
+    const char c = *parser->ptr;
+    if (c == '"') {
+        parser->ptr++;
+        while (parser->ptr != parser->end && *parser->ptr != '"') {
+            uint8_t byte;
+            if (!parse_byte(parser, &byte)) {
+                return gptoss_status_invalid_argument;
+            }
+            uint32_t byte_set[8] = {0};
+            byte_set[byte / 32] = UINT32_C(1) << (byte % 32);
+            uint32_t byte_set_index;
+            status = add_byte_set(parser, byte_set, &byte_set_index);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+            status = element_array_append(out, gptoss_grammar_element_byte_set, byte_set_index);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+        }
+        if (parser->ptr == parser->end) {
+            parser_error(parser, "unterminated string literal");
+            return gptoss_status_invalid_argument;
+        }
+        parser->ptr++;
+        return gptoss_status_success;
+    } else if (c == '[' || c == '.') {
+        uint32_t byte_set[8] = {0};
+        parser->ptr++;
+        if (c == '.') {
+            memset(byte_set, 0xFF, sizeof(byte_set));
+        } else {
+            bool negated = false;
+            if (parser->ptr != parser->end && *parser->ptr == '^') {
+                negated = true;
+                parser->ptr++;
+            }
+            while (parser->ptr != parser->end && *parser->ptr != ']') {
+                uint8_t first, last;
+                if (!parse_byte(parser, &first)) {
+                    return gptoss_status_invalid_argument;
+                }
+                last = first;
+                if (parser->end - parser->ptr >= 2 && parser->ptr[0] == '-' && parser->ptr[1] != ']') {
+                    parser->ptr++;
+                    if (!parse_byte(parser, &last)) {
+                        return gptoss_status_invalid_argument;
+                    }
+                    if (last < first) {
+                        parser_error(parser, "invalid byte range");
+                        return gptoss_status_invalid_argument;
+                    }
+                }
+                for (uint32_t byte = first; byte <= last; byte++) {
+                    byte_set[byte / 32] |= UINT32_C(1) << (byte % 32);
+                }
+            }
+            if (parser->ptr == parser->end) {
+                parser_error(parser, "unterminated byte class");
+                return gptoss_status_invalid_argument;
+            }
+            parser->ptr++;
+            if (negated) {
+                for (uint32_t i = 0; i < 8; i++) {
+                    byte_set[i] = ~byte_set[i];
+                }
+            }
+        }
+        uint32_t byte_set_index;
+        status = add_byte_set(parser, byte_set, &byte_set_index);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        return element_array_append(out, gptoss_grammar_element_byte_set, byte_set_index);
+    } else if (c == '(') {
+        if (nesting >= GPTOSS_GRAMMAR_MAX_STACK_DEPTH) {
+            parser_error(parser, "groups are nested too deeply");
+            return gptoss_status_unsupported_argument;
+        }
+        parser->ptr++;
+        struct element_array group = {0};
+        status = parse_alternatives(parser, &group, nesting + 1);
+        if (status == gptoss_status_success) {
+            skip_space(parser);
+            if (parser->ptr == parser->end || *parser->ptr != ')') {
+                parser_error(parser, "expected )");
+                status = gptoss_status_invalid_argument;
+            } else {
+                parser->ptr++;
+                status = element_array_append(&group, gptoss_grammar_element_end, 0);
+            }
+        }
+        uint32_t group_rule;
+        if (status == gptoss_status_success) {
+            status = define_generated_rule(parser, &group, &group_rule);
+        }
+        free(group.data);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        return element_array_append(out, gptoss_grammar_element_rule_ref, group_rule);
+    } else {
+        const size_t name_length = parse_name_length(parser, parser->ptr);
+        if (name_length == 0) {
+            parser_error(parser, "unexpected character");
+            return gptoss_status_invalid_argument;
+        }
+        uint32_t rule;
+        status = get_named_rule(parser, parser->ptr, name_length, &rule);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        parser->ptr += name_length;
+        return element_array_append(out, gptoss_grammar_element_rule_ref, rule);
+    }
+}
+
+// Rewrites the item in out->data[item_start:] for a repetition operator:
+// - x* becomes R with R ::= x R | (empty)
+// - x+ becomes x R with R ::= x R | (empty)
+// - x? becomes R with R ::= x | (empty)
+static enum gptoss_status apply_repetition(
+    struct grammar_parser* parser,
+    struct element_array* out,
+    size_t item_start,
+    char op)
+{
+    enum gptoss_status status = gptoss_status_success;
+    struct element_array repetition = {0};
+    uint32_t repetition_rule;
+
+    // Reserve the rule first, as its body refers to it.
+    status = add_rule(parser, NULL, 0, &repetition_rule);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = element_array_append_range(&repetition, out->data + item_start, out->size - item_start);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    if (op != '?') {
+        status = element_array_append(&repetition, gptoss_grammar_element_rule_ref, repetition_rule);
+        if (status != gptoss_status_success) {
+            goto cleanup;
+        }
+    }
+    status = element_array_append(&repetition, gptoss_grammar_element_alt, 0);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = element_array_append(&repetition, gptoss_grammar_element_end, 0);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    parser->rules[repetition_rule].elements = repetition;
+    parser->rules[repetition_rule].defined = true;
+    repetition = (struct element_array) {0};
+
+    if (op != '+') {
+        out->size = item_start;
+    }
+    status = element_array_append(out, gptoss_grammar_element_rule_ref, repetition_rule);
+
+cleanup:
+    free(repetition.data);
+    return status;
+}
+
+static enum gptoss_status parse_sequence(struct grammar_parser* parser, struct element_array* out, size_t nesting) {
+    for (;;) {
+        skip_space(parser);
+        if (parser->ptr == parser->end) {
+            return gptoss_status_success;
+        }
+        const char c = *parser->ptr;
+        if (c == '|' || c == ')' || at_rule_definition(parser)) {
+            return gptoss_status_success;
+        }
+
+        const size_t item_start = out->size;
+        enum gptoss_status status = parse_primary(parser, out, nesting);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        skip_space(parser);
+        if (parser->ptr != parser->end && (*parser->ptr == '*' || *parser->ptr == '+' || *parser->ptr == '?')) {
+            const char op = *parser->ptr++;
+            status = apply_repetition(parser, out, item_start, op);
+            if (status != gptoss_status_success) {
+                return status;
+            }
+        }
+    }
+}
+
+static enum gptoss_status parse_alternatives(struct grammar_parser* parser, struct element_array* out, size_t nesting) {
+    for (;;) {
+        enum gptoss_status status = parse_sequence(parser, out, nesting);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        if (parser->ptr == parser->end || *parser->ptr != '|') {
+            return gptoss_status_success;
+        }
+        parser->ptr++;
+        status = element_array_append(out, gptoss_grammar_element_alt, 0);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+}
+
+static enum gptoss_status parse_grammar(struct grammar_parser* parser) {
+    for (;;) {
+        skip_space(parser);
+        if (parser->ptr == parser->end) {
+            return gptoss_status_success;
+        }
+        if (!at_rule_definition(parser)) {
+            parser_error(parser, "expected rule definition");
+            return gptoss_status_invalid_argument;
+        }
+
+        const size_t name_length = parse_name_length(parser, parser->ptr);
+        uint32_t rule;
+        enum gptoss_status status = get_named_rule(parser, parser->ptr, name_length, &rule);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        if (parser->rules[rule].defined) {
+            parser_error(parser, "duplicate rule definition");
+            return gptoss_status_invalid_argument;
+        }
+        parser->ptr += name_length;
+        skip_space(parser);
+        parser->ptr += 3;  // ::=
+
+        struct element_array elements = {0};
+        status = parse_alternatives(parser, &elements, 0);
+        if (status == gptoss_status_success) {
+            if (parser->ptr != parser->end && *parser->ptr == ')') {
+                parser_error(parser, "unexpected )");
+                status = gptoss_status_invalid_argument;
+            } else {
+                status = element_array_append(&elements, gptoss_grammar_element_end, 0);
+            }
+        }
+        if (status != gptoss_status_success) {
+            free(elements.data);
+            return status;
+        }
+        parser->rules[rule].elements = elements;
+        parser->rules[rule].defined = true;
+    }
+}
+
+// Detects rules that can reference themselves before matching any byte, which would expand indefinitely.
+static bool find_left_recursion(
+    const struct grammar_parser* parser,
+    const bool* nullable,
+    uint8_t* visit_state,
+    uint32_t rule)
+{
+    if (visit_state[rule] == 1) {
+        return true;
+    }
+    if (visit_state[rule] == 2) {
+        return false;
+    }
+    visit_state[rule] = 1;
+    const struct element_array* elements = &parser->rules[rule].elements;
+    bool at_alternative_start = true;
+    for (size_t i = 0; i < elements->size; i++) {
+        const struct gptoss_grammar_element* element = &elements->data[i];
+        if (element->type == gptoss_grammar_element_alt || element->type == gptoss_grammar_element_end) {
+            at_alternative_start = true;
+        } else if (at_alternative_start) {
+            if (element->type == gptoss_grammar_element_rule_ref) {
+                if (find_left_recursion(parser, nullable, visit_state, element->value)) {
+                    return true;
+                }
+                at_alternative_start = nullable[element->value];
+            } else {
+                at_alternative_start = false;
+            }
+        }
+    }
+    visit_state[rule] = 2;
+    return false;
+}
+
+static enum gptoss_status validate_rules(const struct grammar_parser* parser) {
+    enum gptoss_status status = gptoss_status_success;
+    const size_t num_rules = parser->num_rules;
+    bool* nullable = NULL;
+    uint8_t* visit_state = NULL;
+
+    for (size_t r = 0; r < num_rules; r++) {
+        if (!parser->rules[r].defined) {
+            GPTOSS_LOG_ERROR("invalid grammar: undefined rule %.*s",
+                (int) parser->rules[r].name_length, parser->rules[r].name);
+            status = gptoss_status_invalid_argument;
+            goto cleanup;
+        }
+    }
+
+    nullable = calloc(num_rules, sizeof(bool));
+    visit_state = calloc(num_rules, sizeof(uint8_t));
+    if (nullable == NULL || visit_state == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for grammar validation", num_rules * (sizeof(bool) + 1));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+
+    // A rule is nullable if one of its alternatives consists of only references to nullable rules.
+    bool updated = true;
+    while (updated) {
+        updated = false;
+        for (size_t r = 0; r < num_rules; r++) {
+            if (nullable[r]) {
+                continue;
+            }
+            const struct element_array* elements = &parser->rules[r].elements;
+            bool alternative_nullable = true;
+            for (size_t i = 0; i < elements->size && !nullable[r]; i++) {
+                const struct gptoss_grammar_element* element = &elements->data[i];
+                switch (element->type) {
+                    case gptoss_grammar_element_alt:
+                    case gptoss_grammar_element_end:
+                        if (alternative_nullable) {
+                            nullable[r] = true;
+                            updated = true;
+                        }
+                        alternative_nullable = true;
+                        break;
+                    case gptoss_grammar_element_rule_ref:
+                        alternative_nullable &= nullable[element->value];
+                        break;
+                    case gptoss_grammar_element_byte_set:
+                        alternative_nullable = false;
+                        break;
+                }
+            }
+        }
+    }
+
+    for (size_t r = 0; r < num_rules; r++) {
+        if (find_left_recursion(parser, nullable, visit_state, (uint32_t) r)) {
+            if (parser->rules[r].name != NULL) {
+                GPTOSS_LOG_ERROR("unsupported grammar: rule %.*s is left-recursive",
+                    (int) parser->rules[r].name_length, parser->rules[r].name);
+            } else {
+                GPTOSS_LOG_ERROR("unsupported grammar: left-recursive repetition of a possibly empty item");
+            }
+            status = gptoss_status_unsupported_argument;
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    free(nullable);
+    free(visit_state);
+    return status;
+}
+
+// --- Pushdown automaton
+
+static void stacks_clear(struct gptoss_grammar_stacks* stacks) {
+    stacks->num_positions = 0;
+    stacks->num_stacks = 0;
+}
+
+static void stacks_free(struct gptoss_grammar_stacks* stacks) {
+    free(stacks->positions);
+    free(stacks->offsets);
+    memset(stacks, 0, sizeof(struct gptoss_grammar_stacks));
+}
+
+static size_t stacks_begin(const struct gptoss_grammar_stacks* stacks, size_t s) {
+    return stacks->offsets[s];
+}
+
+static size_t stacks_end(const struct gptoss_grammar_stacks* stacks, size_t s) {
+    return s + 1 < stacks->num_stacks ? stacks->offsets[s + 1] : stacks->num_positions;
+}
+
+static bool stacks_has_empty(const struct gptoss_grammar_stacks* stacks) {
+    for (size_t s = 0; s < stacks->num_stacks; s++) {
+        if (stacks_begin(stacks, s) == stacks_end(stacks, s)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool stacks_equal(
+    const struct gptoss_grammar_stacks* a,
+    size_t a_stack,
+    const struct gptoss_grammar_stacks* b,
+    size_t b_stack,
+    size_t num_stacks)
+{
+    for (size_t s = 0; s < num_stacks; s++) {
+        const size_t a_begin = stacks_begin(a, a_stack + s);
+        const size_t b_begin = stacks_begin(b, b_stack + s);
+        const size_t depth = stacks_end(a, a_stack + s) - a_begin;
+        if (stacks_end(b, b_stack + s) - b_begin != depth ||
+            (depth != 0 && memcmp(a->positions + a_begin, b->positions + b_begin, depth * sizeof(uint32_t)) != 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t stacks_hash(const struct gptoss_grammar_stacks* stacks) {
+    // FNV-1a over stack depths and positions
+    uint64_t hash = UINT64_C(0xCBF29CE484222325);
+    for (size_t s = 0; s < stacks->num_stacks; s++) {
+        const size_t begin = stacks_begin(stacks, s);
+        const size_t end = stacks_end(stacks, s);
+        hash = (hash ^ (uint64_t) (end - begin)) * UINT64_C(0x100000001B3);
+        for (size_t i = begin; i < end; i++) {
+            hash = (hash ^ (uint64_t) stacks->positions[i]) * UINT64_C(0x100000001B3);
+        }
+    }
+    return hash;
+}
+
+static enum gptoss_status stacks_append(
+    struct gptoss_grammar_stacks* stacks,
+    const uint32_t* stack,
+    size_t depth)
+{
+    enum gptoss_status status = ensure_capacity(
+        (void**) &stacks->positions, &stacks->positions_capacity, stacks->num_positions + depth, sizeof(uint32_t));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    status = ensure_capacity(
+        (void**) &stacks->offsets, &stacks->offsets_capacity, stacks->num_stacks + 1, sizeof(uint32_t));
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    if (depth != 0) {
+        memcpy(stacks->positions + stacks->num_positions, stack, depth * sizeof(uint32_t));
+    }
+    stacks->offsets[stacks->num_stacks++] = (uint32_t) stacks->num_positions;
+    stacks->num_positions += depth;
+    return gptoss_status_success;
+}
+
+// Adds a stack to the set, unless an identical stack is already present.
+static enum gptoss_status stacks_add(
+    struct gptoss_grammar_stacks* stacks,
+    const uint32_t* stack,
+    size_t depth)
+{
+    for (size_t s = 0; s < stacks->num_stacks; s++) {
+        const size_t begin = stacks_begin(stacks, s);
+        if (stacks_end(stacks, s) - begin == depth &&
+            (depth == 0 || memcmp(stacks->positions + begin, stack, depth * sizeof(uint32_t)) == 0))
+        {
+            return gptoss_status_success;
+        }
+    }
+    return stacks_append(stacks, stack, depth);
+}
+
+static void stacks_swap(struct gptoss_grammar_stacks* a, struct gptoss_grammar_stacks* b) {
+    const struct gptoss_grammar_stacks tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static bool is_alternative_end(const struct gptoss_grammar* grammar, uint32_t position) {
+    const uint32_t type = grammar->elements[position].type;
+    return type == gptoss_grammar_element_end || type == gptoss_grammar_element_alt;
+}
+
+static enum gptoss_status expand_stack(
+    const struct gptoss_grammar* grammar,
+    uint32_t* stack,
+    size_t depth,
+    struct gptoss_grammar_stacks* out);
+
+// Pushes each alternative of a rule at stack[base] and expands the resulting stacks.
+static enum gptoss_status expand_rule(
+    const struct gptoss_grammar* grammar,
+    uint32_t* stack,
+    size_t base,
+    uint32_t rule,
+    struct gptoss_grammar_stacks* out)
+{
+    if (base >= GPTOSS_GRAMMAR_MAX_STACK_DEPTH) {
+        GPTOSS_LOG_ERROR("grammar parse stack exceeds the maximum depth of %d", GPTOSS_GRAMMAR_MAX_STACK_DEPTH);
+        return gptoss_status_unsupported_argument;
+    }
+
+    uint32_t position = grammar->rule_offsets[rule];
+    for (;;) {
+        stack[base] = position;
+        const enum gptoss_status status = expand_stack(grammar, stack, base + 1, out);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        while (!is_alternative_end(grammar, position)) {
+            position++;
+        }
+        if (grammar->elements[position].type == gptoss_grammar_element_end) {
+            return gptoss_status_success;
+        }
+        position++;
+    }
+}
+
+// Expands the top of the stack until it is a byte set, and adds the resulting stacks to the set. Modifies stack
+// entries above depth - 1 as scratch space, and restores stack[0:depth] before returning.
+static enum gptoss_status expand_stack(
+    const struct gptoss_grammar* grammar,
+    uint32_t* stack,
+    size_t depth,
+    struct gptoss_grammar_stacks* out)
+{
+    if (depth == 0) {
+        return stacks_add(out, stack, 0);
+    }
+
+    const uint32_t position = stack[depth - 1];
+    const struct gptoss_grammar_element* element = &grammar->elements[position];
+    switch (element->type) {
+        case gptoss_grammar_element_end:
+        case gptoss_grammar_element_alt:
+            // Matched the alternative: continue in the referencing rule
+            return expand_stack(grammar, stack, depth - 1, out);
+        case gptoss_grammar_element_byte_set:
+            return stacks_add(out, stack, depth);
+    }
+    assert(element->type == gptoss_grammar_element_rule_ref);
+
+    // Continue after the reference once the referenced rule is matched. If the reference ends the alternative, the
+    // referenced rule replaces it on the stack instead, so right recursion does not grow the stack.
+    size_t base = depth - 1;
+    if (!is_alternative_end(grammar, position + 1)) {
+        stack[depth - 1] = position + 1;
+        base = depth;
+    }
+    const enum gptoss_status status = expand_rule(grammar, stack, base, element->value, out);
+    stack[depth - 1] = position;
+    return status;
+}
+
+// Computes the parse stacks after matching a byte from stacks [first_stack, first_stack + num_stacks) of a set.
+static enum gptoss_status advance_stacks(
+    const struct gptoss_grammar* grammar,
+    const struct gptoss_grammar_stacks* stacks,
+    size_t first_stack,
+    size_t num_stacks,
+    uint8_t byte,
+    struct gptoss_grammar_stacks* out)
+{
+    stacks_clear(out);
+    uint32_t* stack = grammar->scratch_stack;
+    for (size_t s = first_stack; s < first_stack + num_stacks; s++) {
+        const size_t begin = stacks_begin(stacks, s);
+        const size_t depth = stacks_end(stacks, s) - begin;
+        if (depth == 0) {
+            continue;
+        }
+
+        const uint32_t top_position = stacks->positions[begin + depth - 1];
+        const uint32_t* byte_set = grammar->byte_sets[grammar->elements[top_position].value];
+        if ((byte_set[byte / 32] & (UINT32_C(1) << (byte % 32))) == 0) {
+            continue;
+        }
+
+        memcpy(stack, stacks->positions + begin, depth * sizeof(uint32_t));
+        stack[depth - 1] = top_position + 1;
+        const enum gptoss_status status = expand_stack(grammar, stack, depth, out);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+    return gptoss_status_success;
+}
+
+static enum gptoss_status init_stacks(struct gptoss_grammar* grammar) {
+    stacks_clear(&grammar->stacks);
+    grammar->terminated = false;
+    return expand_rule(grammar, grammar->scratch_stack, 0, grammar->root_rule, &grammar->stacks);
+}
+
+// --- State cache
+
+static size_t state_num_stacks(const struct gptoss_grammar* grammar, uint32_t state) {
+    return grammar->state_offsets[state + 1] - grammar->state_offsets[state];
+}
+
+static void clear_state_cache(struct gptoss_grammar* grammar) {
+    for (size_t i = 0; i < grammar->num_states; i++) {
+        free(grammar->state_masks[i]);
+    }
+    grammar->num_states = 0;
+    grammar->num_state_masks = 0;
+    stacks_clear(&grammar->state_stacks);
+    if (grammar->state_table != NULL) {
+        memset(grammar->state_table, 0xFF, grammar->state_table_size * sizeof(uint32_t));
+    }
+    if (grammar->transition_keys != NULL) {
+        memset(grammar->transition_keys, 0xFF, grammar->transition_table_size * sizeof(uint64_t));
+    }
+    grammar->num_transitions = 0;
+}
+
+static enum gptoss_status grow_state_table(struct gptoss_grammar* grammar) {
+    const size_t table_size = math_max(grammar->state_table_size * 2, 1024);
+    uint32_t* table = malloc(table_size * sizeof(uint32_t));
+    if (table == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for grammar state table", table_size * sizeof(uint32_t));
+        return gptoss_status_insufficient_memory;
+    }
+    memset(table, 0xFF, table_size * sizeof(uint32_t));
+    for (size_t state = 0; state < grammar->num_states; state++) {
+        size_t slot = (size_t) grammar->state_hashes[state] & (table_size - 1);
+        while (table[slot] != UINT32_MAX) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        table[slot] = (uint32_t) state;
+    }
+    free(grammar->state_table);
+    grammar->state_table = table;
+    grammar->state_table_size = table_size;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status grow_states(struct gptoss_grammar* grammar) {
+    const size_t states_capacity = math_max(grammar->states_capacity * 2, 1024);
+    uint32_t* state_offsets = realloc(grammar->state_offsets, states_capacity * sizeof(uint32_t));
+    if (state_offsets != NULL) {
+        grammar->state_offsets = state_offsets;
+    }
+    uint64_t* state_hashes = realloc(grammar->state_hashes, states_capacity * sizeof(uint64_t));
+    if (state_hashes != NULL) {
+        grammar->state_hashes = state_hashes;
+    }
+    uint32_t** state_masks = realloc(grammar->state_masks, states_capacity * sizeof(uint32_t*));
+    if (state_masks != NULL) {
+        grammar->state_masks = state_masks;
+    }
+    if (state_offsets == NULL || state_hashes == NULL || state_masks == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate memory for %zu grammar states", states_capacity);
+        return gptoss_status_insufficient_memory;
+    }
+    grammar->states_capacity = states_capacity;
+    return gptoss_status_success;
+}
+
+// Returns the ID of the cached state with the given stacks, and adds it to the cache if needed.
+static enum gptoss_status intern_state(
+    struct gptoss_grammar* grammar,
+    const struct gptoss_grammar_stacks* stacks,
+    uint32_t* state_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+    if ((grammar->num_states + 1) * 2 > grammar->state_table_size) {
+        status = grow_state_table(grammar);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    const uint64_t hash = stacks_hash(stacks);
+    const size_t table_mask = grammar->state_table_size - 1;
+    size_t slot = (size_t) hash & table_mask;
+    for (;; slot = (slot + 1) & table_mask) {
+        const uint32_t state = grammar->state_table[slot];
+        if (state == UINT32_MAX) {
+            break;
+        }
+        if (grammar->state_hashes[state] == hash && state_num_stacks(grammar, state) == stacks->num_stacks &&
+            stacks_equal(&grammar->state_stacks, grammar->state_offsets[state], stacks, 0, stacks->num_stacks))
+        {
+            *state_out = state;
+            return gptoss_status_success;
+        }
+    }
+
+    const size_t state = grammar->num_states;
+    if (state + 2 > grammar->states_capacity) {
+        status = grow_states(grammar);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    for (size_t s = 0; s < stacks->num_stacks; s++) {
+        const size_t begin = stacks_begin(stacks, s);
+        status = stacks_append(&grammar->state_stacks, stacks->positions + begin, stacks_end(stacks, s) - begin);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+    grammar->state_offsets[state] = (uint32_t) (grammar->state_stacks.num_stacks - stacks->num_stacks);
+    grammar->state_offsets[state + 1] = (uint32_t) grammar->state_stacks.num_stacks;
+    grammar->state_hashes[state] = hash;
+    grammar->state_masks[state] = NULL;
+    grammar->state_table[slot] = (uint32_t) state;
+    grammar->num_states = state + 1;
+    *state_out = (uint32_t) state;
+    return gptoss_status_success;
+}
+
+static enum gptoss_status grow_transition_table(struct gptoss_grammar* grammar) {
+    const size_t table_size = math_max(grammar->transition_table_size * 2, 4096);
+    uint64_t* keys = malloc(table_size * sizeof(uint64_t));
+    uint32_t* states = malloc(table_size * sizeof(uint32_t));
+    if (keys == NULL || states == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for grammar transition table",
+            table_size * (sizeof(uint64_t) + sizeof(uint32_t)));
+        free(keys);
+        free(states);
+        return gptoss_status_insufficient_memory;
+    }
+    memset(keys, 0xFF, table_size * sizeof(uint64_t));
+    for (size_t i = 0; i < grammar->transition_table_size; i++) {
+        const uint64_t key = grammar->transition_keys[i];
+        if (key != UINT64_MAX) {
+            size_t slot = (size_t) ((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (table_size - 1);
+            while (keys[slot] != UINT64_MAX) {
+                slot = (slot + 1) & (table_size - 1);
+            }
+            keys[slot] = key;
+            states[slot] = grammar->transition_states[i];
+        }
+    }
+    free(grammar->transition_keys);
+    free(grammar->transition_states);
+    grammar->transition_keys = keys;
+    grammar->transition_states = states;
+    grammar->transition_table_size = table_size;
+    return gptoss_status_success;
+}
+
+// Returns the cached state after matching a byte from a cached state.
+static enum gptoss_status get_transition(
+    struct gptoss_grammar* grammar,
+    uint32_t state,
+    uint8_t byte,
+    uint32_t* state_out)
+{
+    enum gptoss_status status = gptoss_status_success;
+    if ((grammar->num_transitions + 1) * 2 > grammar->transition_table_size) {
+        status = grow_transition_table(grammar);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+    }
+
+    const uint64_t key = ((uint64_t) state << 8) | (uint64_t) byte;
+    const size_t table_mask = grammar->transition_table_size - 1;
+    size_t slot = (size_t) ((key * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & table_mask;
+    for (; grammar->transition_keys[slot] != UINT64_MAX; slot = (slot + 1) & table_mask) {
+        if (grammar->transition_keys[slot] == key) {
+            *state_out = grammar->transition_states[slot];
+            return gptoss_status_success;
+        }
+    }
+
+    struct gptoss_grammar_stacks* next_stacks = &grammar->scratch_stacks[0];
+    status = advance_stacks(
+        grammar, &grammar->state_stacks, grammar->state_offsets[state], state_num_stacks(grammar, state), byte,
+        next_stacks);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    uint32_t next_state;
+    status = intern_state(grammar, next_stacks, &next_state);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    grammar->transition_keys[slot] = key;
+    grammar->transition_states[slot] = next_state;
+    grammar->num_transitions += 1;
+    *state_out = next_state;
+    return gptoss_status_success;
+}
+
+static bool is_terminating_token(const struct gptoss_tokenizer* tokenizer, uint32_t token_id) {
+    for (size_t i = 0; i < sizeof(terminating_special_tokens) / sizeof(terminating_special_tokens[0]); i++) {
+        if (tokenizer->special_token_id[(uint32_t) terminating_special_tokens[i] - 1] == token_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_grammar_create(
+    gptoss_tokenizer_t tokenizer,
+    const char* grammar_text,
+    size_t grammar_size,
+    gptoss_grammar_t* grammar_out)
+{
+    *grammar_out = NULL;
+
+    enum gptoss_status status = gptoss_status_success;
+    struct gptoss_grammar* grammar = NULL;
+    struct grammar_parser parser = {
+        .text_start = grammar_text,
+        .ptr = grammar_text,
+        .end = grammar_text + grammar_size,
+    };
+
+    if (tokenizer->trie_nodes == NULL) {
+        GPTOSS_LOG_ERROR("tokenizer has no token trie");
+        status = gptoss_status_invalid_state;
+        goto cleanup;
+    }
+
+    status = parse_grammar(&parser);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = validate_rules(&parser);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    uint32_t root_rule = UINT32_MAX;
+    for (size_t r = 0; r < parser.num_rules; r++) {
+        const struct grammar_rule* rule = &parser.rules[r];
+        if (rule->name != NULL && rule->name_length == 4 && memcmp(rule->name, "root", 4) == 0) {
+            root_rule = (uint32_t) r;
+        }
+    }
+    if (root_rule == UINT32_MAX) {
+        GPTOSS_LOG_ERROR("invalid grammar: missing root rule");
+        status = gptoss_status_invalid_argument;
+        goto cleanup;
+    }
+
+    grammar = malloc(sizeof(struct gptoss_grammar));
+    if (grammar == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for Grammar object", sizeof(struct gptoss_grammar));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+    memset(grammar, 0, sizeof(struct gptoss_grammar));
+    atomic_store_explicit(&grammar->ref_count, 1, memory_order_relaxed);
+
+    // Flatten the rules into a single array of elements
+    size_t num_elements = 0;
+    for (size_t r = 0; r < parser.num_rules; r++) {
+        num_elements += parser.rules[r].elements.size;
+    }
+    grammar->elements = malloc(num_elements * sizeof(struct gptoss_grammar_element));
+    grammar->rule_offsets = malloc(parser.num_rules * sizeof(uint32_t));
+    grammar->trie_states = malloc(((size_t) tokenizer->max_token_length + 1) * sizeof(uint32_t));
+    grammar->scratch_stack = malloc(GPTOSS_GRAMMAR_MAX_STACK_DEPTH * sizeof(uint32_t));
+    if (grammar->elements == NULL || grammar->rule_offsets == NULL || grammar->trie_states == NULL ||
+        grammar->scratch_stack == NULL)
+    {
+        GPTOSS_LOG_ERROR("failed to allocate memory for grammar with %zu elements", num_elements);
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+    num_elements = 0;
+    for (size_t r = 0; r < parser.num_rules; r++) {
+        const struct element_array* elements = &parser.rules[r].elements;
+        grammar->rule_offsets[r] = (uint32_t) num_elements;
+        memcpy(grammar->elements + num_elements, elements->data, elements->size * sizeof(struct gptoss_grammar_element));
+        num_elements += elements->size;
+    }
+    grammar->num_elements = (uint32_t) num_elements;
+    grammar->num_rules = (uint32_t) parser.num_rules;
+    grammar->root_rule = root_rule;
+    grammar->byte_sets = parser.byte_sets;
+    grammar->num_byte_sets = (uint32_t) parser.num_byte_sets;
+    parser.byte_sets = NULL;
+
+    status = init_stacks(grammar);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    grammar->tokenizer = tokenizer;
+    gptoss_tokenizer_retain(tokenizer);
+    *grammar_out = grammar;
+    grammar = NULL;
+
+cleanup:
+    for (size_t r = 0; r < parser.num_rules; r++) {
+        free(parser.rules[r].elements.data);
+    }
+    free(parser.rules);
+    free(parser.byte_sets);
+    gptoss_grammar_release(grammar);
+    return status;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_grammar_get_token_mask(
+    gptoss_grammar_t grammar,
+    uint32_t* token_mask_out)
+{
+    const struct gptoss_tokenizer* tokenizer = grammar->tokenizer;
+    const uint32_t num_tokens = tokenizer->num_text_tokens + tokenizer->num_special_tokens;
+    const size_t num_mask_words = math_ceil_div(num_tokens, 32);
+    if (grammar->terminated) {
+        // The grammar no longer constrains the output
+        memset(token_mask_out, 0xFF, num_mask_words * sizeof(uint32_t));
+        return gptoss_status_success;
+    }
+
+    if (grammar->num_states > GPTOSS_GRAMMAR_MAX_CACHED_STATES ||
+        grammar->num_transitions > GPTOSS_GRAMMAR_MAX_CACHED_TRANSITIONS)
+    {
+        clear_state_cache(grammar);
+    }
+    uint32_t state;
+    enum gptoss_status status = intern_state(grammar, &grammar->stacks, &state);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+    if (grammar->state_masks[state] != NULL) {
+        memcpy(token_mask_out, grammar->state_masks[state], num_mask_words * sizeof(uint32_t));
+        return gptoss_status_success;
+    }
+    memset(token_mask_out, 0, num_mask_words * sizeof(uint32_t));
+
+    // Walk the token trie in pre-order, following the cached transitions from the state after the parent prefix, and
+    // skip subtrees whose prefix the grammar does not match.
+    const struct gptoss_token_trie_node* nodes = tokenizer->trie_nodes;
+    const uint32_t num_nodes = tokenizer->num_trie_nodes;
+    uint32_t* trie_states = grammar->trie_states;
+    trie_states[0] = state;
+    for (uint32_t i = 0; i < num_nodes; ) {
+        const struct gptoss_token_trie_node* node = &nodes[i];
+        uint32_t node_state;
+        status = get_transition(grammar, trie_states[node->depth - 1], node->byte, &node_state);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        if (state_num_stacks(grammar, node_state) == 0) {
+            i = node->subtree_end;
+            continue;
+        }
+        trie_states[node->depth] = node_state;
+        if (node->token_id != UINT32_MAX) {
+            token_mask_out[node->token_id / 32] |= UINT32_C(1) << (node->token_id % 32);
+        }
+        i++;
+    }
+
+    if (stacks_has_empty(&grammar->stacks)) {
+        for (size_t i = 0; i < sizeof(terminating_special_tokens) / sizeof(terminating_special_tokens[0]); i++) {
+            const uint32_t token_id = tokenizer->special_token_id[(uint32_t) terminating_special_tokens[i] - 1];
+            if (token_id != UINT32_MAX) {
+                token_mask_out[token_id / 32] |= UINT32_C(1) << (token_id % 32);
+            }
+        }
+    }
+
+    if (grammar->num_state_masks < GPTOSS_GRAMMAR_MAX_CACHED_MASKS) {
+        uint32_t* state_mask = malloc(num_mask_words * sizeof(uint32_t));
+        if (state_mask != NULL) {
+            memcpy(state_mask, token_mask_out, num_mask_words * sizeof(uint32_t));
+            grammar->state_masks[state] = state_mask;
+            grammar->num_state_masks += 1;
+        }
+    }
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_grammar_accept_token(
+    gptoss_grammar_t grammar,
+    uint32_t token_id)
+{
+    const struct gptoss_tokenizer* tokenizer = grammar->tokenizer;
+    if (grammar->terminated) {
+        return gptoss_status_success;
+    }
+    if (token_id >= tokenizer->num_text_tokens) {
+        if (!is_terminating_token(tokenizer, token_id) || !stacks_has_empty(&grammar->stacks)) {
+            GPTOSS_LOG_ERROR("token %" PRIu32 " is not allowed by the grammar", token_id);
+            return gptoss_status_invalid_argument;
+        }
+        grammar->terminated = true;
+        return gptoss_status_success;
+    }
+
+    // Reading unaligned uint16_t
+    const char* token_ptr = tokenizer->tokens_ptr + tokenizer->token_offsets[token_id];
+    uint16_t token_length;
+    memcpy(&token_length, token_ptr, sizeof(token_length));
+    const uint8_t* token_bytes = (const uint8_t*) token_ptr + sizeof(uint16_t);
+
+    // Alternate between two scratch stack sets, and keep the current state unless the whole token matches.
+    const struct gptoss_grammar_stacks* stacks = &grammar->stacks;
+    for (uint16_t i = 0; i < token_length; i++) {
+        struct gptoss_grammar_stacks* next_stacks = &grammar->scratch_stacks[i % 2];
+        const enum gptoss_status status =
+            advance_stacks(grammar, stacks, /*first_stack=*/0, stacks->num_stacks, token_bytes[i], next_stacks);
+        if (status != gptoss_status_success) {
+            return status;
+        }
+        if (next_stacks->num_stacks == 0) {
+            GPTOSS_LOG_ERROR("token %" PRIu32 " is not allowed by the grammar", token_id);
+            return gptoss_status_invalid_argument;
+        }
+        stacks = next_stacks;
+    }
+    if (token_length != 0) {
+        stacks_swap(&grammar->stacks, &grammar->scratch_stacks[(token_length - 1) % 2]);
+    }
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_grammar_reset(
+    gptoss_grammar_t grammar)
+{
+    return init_stacks(grammar);
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_grammar_retain(
+    gptoss_grammar_t grammar)
+{
+    atomic_fetch_add_explicit(&grammar->ref_count, 1, memory_order_relaxed);
+    return gptoss_status_success;
+}
+
+enum gptoss_status GPTOSS_ABI gptoss_grammar_release(
+    gptoss_grammar_t grammar)
+{
+    if (grammar != NULL) {
+        if (atomic_fetch_sub_explicit(&grammar->ref_count, 1, memory_order_acq_rel) == 1) {
+            clear_state_cache(grammar);
+            stacks_free(&grammar->stacks);
+            stacks_free(&grammar->state_stacks);
+            stacks_free(&grammar->scratch_stacks[0]);
+            stacks_free(&grammar->scratch_stacks[1]);
+            free(grammar->state_offsets);
+            free(grammar->state_hashes);
+            free(grammar->state_masks);
+            free(grammar->state_table);
+            free(grammar->transition_keys);
+            free(grammar->transition_states);
+            free(grammar->trie_states);
+            free(grammar->scratch_stack);
+            free(grammar->elements);
+            free(grammar->rule_offsets);
+            free(grammar->byte_sets);
+            gptoss_tokenizer_release(grammar->tokenizer);  // does nothing if tokenizer is NULL
+
+            memset(grammar, 0, sizeof(struct gptoss_grammar));
+            free(grammar);
+        }
+    }
+    return gptoss_status_success;
+}
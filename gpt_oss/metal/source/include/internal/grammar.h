@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef __cplusplus
+    #include <stdatomic.h>
+#endif
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <gpt-oss/types.h>
+
+
+// Maximum depth of a grammar parse stack, i.e. nesting of non-tail rule references.
+#define GPTOSS_GRAMMAR_MAX_STACK_DEPTH 1024
+// The state cache is cleared before computing a token mask once it holds more states or transitions.
+#define GPTOSS_GRAMMAR_MAX_CACHED_STATES 65536
+#define GPTOSS_GRAMMAR_MAX_CACHED_TRANSITIONS (1 << 22)
+// Maximum number of states with a cached token mask.
+#define GPTOSS_GRAMMAR_MAX_CACHED_MASKS 256
+
+// Node of the byte trie over the text tokens of a tokenizer. Nodes are stored in pre-order, so the subtree of node i
+// spans nodes [i + 1, subtree_end).
+struct gptoss_token_trie_node {
+    // ID of the token whose byte sequence ends at this node, or UINT32_MAX if there is none.
+    uint32_t token_id;
+    // Index of the first node after the subtree of this node.
+    uint32_t subtree_end;
+    // Length of the byte sequence ending at this node (1 for children of the root).
+    uint16_t depth;
+    // Last byte of the byte sequence ending at this node.
+    uint8_t byte;
+};
+
+enum gptoss_grammar_element_type {
+    // End of the last alternative of a rule.
+    gptoss_grammar_element_end = 0,
+    // End of an alternative, followed by another alternative of the same rule.
+    gptoss_grammar_element_alt = 1,
+    // Reference to the rule with index value.
+    gptoss_grammar_element_rule_ref = 2,
+    // Any byte in the byte set with index value.
+    gptoss_grammar_element_byte_set = 3,
+};
+
+struct gptoss_grammar_element {
+    uint32_t type;
+    uint32_t value;
+};
+
+// Set of parse stacks of the pushdown automaton. Stack s is positions[offsets[s]:offsets[s + 1]] (with
+// offsets[num_stacks] = num_positions), from the bottom to the top. Each entry is an index into the grammar elements,
+// and the top entry of a non-empty stack is always a byte set. An empty stack means the input matched the grammar.
+struct gptoss_grammar_stacks {
+    uint32_t* positions;
+    uint32_t* offsets;
+    size_t num_positions;
+    size_t num_stacks;
+    size_t positions_capacity;
+    size_t offsets_capacity;
+};
+
+struct gptoss_grammar {
+#ifndef __cplusplus
+    atomic_uint_least64_t ref_count;
+#else
+    uint_least64_t ref_count;
+#endif
+
+    struct gptoss_tokenizer* tokenizer;
+
+    // Rule r starts at elements[rule_offsets[r]], with alternatives separated by alt elements and ending with an end
+    // element.
+    struct gptoss_grammar_element* elements;
+    uint32_t* rule_offsets;
+    uint32_t (*byte_sets)[8];  // 256-bit masks
+    uint32_t num_elements;
+    uint32_t num_rules;
+    uint32_t num_byte_sets;
+    uint32_t root_rule;
+
+    // Parse stacks after the accepted tokens.
+    struct gptoss_grammar_stacks stacks;
+    // Whether a terminating special token was accepted.
+    bool terminated;
+
+    // Cache of the parse stack sets reached while computing token masks, which makes a lazily built DFA over bytes.
+    // Cached state i consists of stacks [state_offsets[i], state_offsets[i + 1]) in state_stacks.
+    struct gptoss_grammar_stacks state_stacks;
+    uint32_t* state_offsets;
+    uint64_t* state_hashes;
+    uint32_t** state_masks;  // token mask of each cached state, or NULL if not cached
+    size_t num_states;
+    size_t states_capacity;
+    size_t num_state_masks;
+    // Open-addressing hash table of cached state IDs, UINT32_MAX for empty slots.
+    uint32_t* state_table;
+    size_t state_table_size;
+    // Open-addressing hash table of transitions from (state << 8 | byte) keys, UINT64_MAX for empty slots, to states.
+    uint64_t* transition_keys;
+    uint32_t* transition_states;
+    size_t transition_table_size;
+    size_t num_transitions;
+
+    // Cached states after each prefix of the current token trie path.
+    uint32_t* trie_states;
+    // Scratch space for stack sets and a single stack.
+    struct gptoss_grammar_stacks scratch_stacks[2];
+    uint32_t* scratch_stack;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum gptoss_status gptoss_tokenizer_build_trie(
+    struct gptoss_tokenizer* tokenizer);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
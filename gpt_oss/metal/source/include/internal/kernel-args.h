@@ -23,6 +23,19 @@
 #define MLP_GATE_Sg_Bm 16
 #define MLP_GATE_Sg_Bn 16
 
+#define SDPA_PREFILL_Bq 16
+#define SDPA_PREFILL_Bk 32
+
+#define SDPA_MAX_HEAD_DIM 256
+
+// Maximum number of tokens of one expert group that share each weight read in grouped MoE matmuls.
+#define MOE_GROUP_Bt 8
+#define EXPERT_GROUP_MAX_EXPERTS 256
+// Upper bound on the number of expert group tasks for a batch: every expert splits its assignments into chunks of up
+// to MOE_GROUP_Bt, so at most one chunk per expert is partial.
+#define EXPERT_GROUP_MAX_TASKS(num_assignments, num_experts) \
+    (((num_assignments) + MOE_GROUP_Bt - 1) / MOE_GROUP_Bt + (num_experts))
+
 struct gptoss_expert_prediction {
     uint32_t expert_id;
     float score;
@@ -33,14 +46,27 @@ struct gptoss_control {
 };
 
 struct gptoss_topk_args {
-    uint32_t num_vecs_per_token;
+    uint32_t num_experts;
+    uint32_t num_active_experts;
 };
 
 struct gptoss_sdpa_args {
     uint32_t qkv_dim;
+    uint32_t num_q_tokens;
     uint32_t num_kv_tokens;
     uint32_t kv_stride;
     uint32_t window;
+    uint32_t num_kv_splits;
+    uint32_t kv_split_size;
+    uint32_t kv_tile_size;
+    uint32_t num_q_heads;
+    uint32_t qmul;
+    uint32_t head_dim;
+};
+
+struct gptoss_sdpa_reduce_args {
+    uint32_t num_kv_splits;
+    uint32_t head_dim;
 };
 
 struct gptoss_u32_fill_random_args {
@@ -63,6 +89,7 @@ struct gptoss_accumulate_args {
     uint32_t num_vecs_per_expert;
     uint32_t num_vecs_per_threadgroup;
     uint32_t num_vecs;
+    uint32_t num_active_experts;
 };
 
 struct gptoss_convert_args {
@@ -92,12 +119,36 @@ struct gptoss_dense_matmul_args {
     uint32_t k;
 };
 
+struct gptoss_dense_matmul_qkv_args {
+    uint32_t m;
+    uint32_t n;
+    uint32_t k;
+    uint32_t num_q_heads;
+    uint32_t num_kv_heads;
+    uint32_t token_offset;
+    uint32_t max_tokens;
+};
+
 struct gptoss_unembedding_args {
     uint32_t num_column_vecs;
     uint32_t num_rows_per_threadgroup;
     uint32_t num_rows;
 };
 
+struct gptoss_rmsnorm_unembedding_args {
+    uint32_t num_column_vecs;
+    uint32_t num_rows_per_threadgroup;
+    uint32_t num_rows;
+    float num_channels;
+    float epsilon;
+    uint32_t output_scores;
+    uint64_t rng_seed;
+    uint32_t rng_offset;
+    float inv_temperature;
+    uint32_t apply_logit_bias;
+    uint32_t apply_token_mask;
+};
+
 struct gptoss_moe_matmul_swiglu_args {
     uint32_t num_column_vecs;
     uint32_t num_rows;
@@ -117,26 +168,43 @@ struct gptoss_moe_matmul_args {
     uint32_t output_expert_stride;  // in elements
 };
 
+struct gptoss_expert_group_args {
+    uint32_t num_tokens;
+    uint32_t num_experts;
+    uint32_t num_active_experts;
+    uint32_t max_tasks;
+};
+
+// Chunk of up to MOE_GROUP_Bt assignments of one expert, processed by one threadgroup of the grouped MoE matmuls.
+// Tasks past the last one of a batch have no assignments.
+struct gptoss_expert_group_task {
+    uint32_t expert_id;
+    uint32_t assignment_offset;
+    uint32_t num_assignments;
+};
+
 struct gptoss_rope_args {
     uint32_t token_stride;
     uint32_t token_offset;
-    float freq_scale;
-    float interpolation_scale;
-    float yarn_offset;
-    float yarn_scale;
-    float yarn_multiplier;
+    uint32_t head_dim;
+};
+
+struct gptoss_rope_kv_scatter_args {
+    uint32_t token_offset;
+    uint32_t max_tokens;
+    uint32_t head_dim;
+    uint32_t num_q_heads;
+    uint32_t num_kv_heads;
 };
 
 struct gptoss_qkv_args {
     uint32_t num_column_vecs;
     uint32_t num_rows;
     uint32_t token_offset;
-    float freq_scale;
-    float interpolation_scale;
-    float yarn_offset;
-    float yarn_scale;
-    float yarn_multiplier;
     uint32_t max_tokens;
+    uint32_t num_q_heads;
+    uint32_t num_kv_heads;
+    uint32_t head_dim;
 };
 
 struct gptoss_softmax_args {
@@ -153,3 +221,26 @@ struct gptoss_sample_args {
     uint32_t num_dims;
     uint32_t num_dims_per_block;
 };
+
+struct gptoss_sample_filter_args {
+    uint64_t rng_seed;
+    uint32_t rng_offset;
+    uint32_t num_scores;
+    uint32_t num_scores_per_threadgroup;
+    uint32_t num_candidates_per_threadgroup;
+    uint32_t top_k;
+    float min_score_offset;
+    float inv_temperature;
+};
+
+struct gptoss_sample_candidates_args {
+    uint64_t rng_seed;
+    uint32_t rng_offset;
+    uint32_t num_candidates;
+    uint32_t top_k;
+    float inv_temperature;
+};
+
+struct gptoss_check_stop_token_args {
+    uint32_t num_vocabulary_tokens;
+};
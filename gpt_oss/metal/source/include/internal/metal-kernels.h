@@ -9,6 +9,7 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -18,7 +19,7 @@ extern "C" {
 
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_fill_random(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* u32_fill_random_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -29,7 +30,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_fill_random(
     uint64_t rng_offset);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_fill_random(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_fill_random_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -42,7 +43,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_fill_random(
     float rng_max);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_fill_random(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* bf16_fill_random_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -55,7 +56,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_fill_random(
     float rng_max);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_mf4_f32_convert(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* mf4_f32_convert_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -65,7 +66,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_mf4_f32_convert(
     uint64_t num_elements);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* bf16_f32_embeddings_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* token_buffer,
@@ -80,7 +81,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings
     uint32_t num_channels);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_rmsnorm_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -95,7 +96,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
     float epsilon);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -113,7 +114,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
     uint32_t num_rows);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qkv(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_qkv_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -126,6 +127,8 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qk
     size_t output_offset,
     const struct gptoss_metal_buffer* kv_buffer,
     size_t kv_offset,
+    const struct gptoss_metal_buffer* rope_table_buffer,
+    size_t rope_table_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
     uint32_t num_tokens,
@@ -134,15 +137,10 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qk
     uint32_t num_kv_heads,
     uint32_t attn_head_dim,
     uint32_t token_offset,
-    uint32_t max_tokens,
-    float rope_base,
-    float interpolation_scale,
-    float yarn_offset,
-    float yarn_scale,
-    float yarn_multiplier);
+    uint32_t max_tokens);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -161,8 +159,8 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_ad
 
 enum gptoss_status
 gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_qkv(
-    const struct gptoss_metal_command_buffer* command_buffer,
-    const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_bf16w_dense_matmul_qkv_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
     const struct gptoss_metal_buffer* weight_buffer,
@@ -171,15 +169,23 @@ gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_qkv(
     size_t bias_offset,
     const struct gptoss_metal_buffer* output_buffer,
     size_t output_offset,
+    const struct gptoss_metal_buffer* kv_buffer,
+    size_t kv_offset,
+    const struct gptoss_metal_buffer* rope_table_buffer,
+    size_t rope_table_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
     uint32_t num_tokens,
     uint32_t num_cols,
-    uint32_t num_rows);
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    uint32_t max_tokens);
 
 enum gptoss_status
 gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_attn_output(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -197,7 +203,7 @@ gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_attn_output(
 
 enum gptoss_status
 gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_mlp_gate(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -214,7 +220,7 @@ gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_mlp_gate(
     uint32_t num_rows);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -232,8 +238,43 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembeddi
     uint32_t num_cols,
     uint32_t num_rows);
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_unembedding(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_bf16w_rmsnorm_unembedding_fn,
+    size_t threadgroup_size,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* norm_weight_buffer,
+    size_t norm_weight_offset,
+    const struct gptoss_metal_buffer* weight_buffer,
+    size_t weight_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* lse_buffer,
+    size_t lse_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* token_mask_buffer,
+    size_t token_mask_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows,
+    float epsilon,
+    bool output_scores,
+    float temperature,
+    uint64_t rng_seed,
+    uint32_t rng_offset,
+    bool apply_logit_bias,
+    bool apply_token_mask,
+    uint32_t* num_threadgroups_out);
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_mf4w_moe_matmul_swiglu_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -258,7 +299,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul
     uint32_t num_rows);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_mf4w_moe_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -281,27 +322,115 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul
     uint32_t num_cols,
     uint32_t num_rows);
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_expert_group(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* expert_group_fn,
+    const struct gptoss_metal_buffer* expert_buffer,
+    size_t expert_offset,
+    const struct gptoss_metal_buffer* expert_offset_buffer,
+    size_t expert_offset_offset,
+    const struct gptoss_metal_buffer* expert_assignment_buffer,
+    size_t expert_assignment_offset,
+    const struct gptoss_metal_buffer* expert_task_buffer,
+    size_t expert_task_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul_swiglu(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_grouped_matmul_swiglu_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_task_buffer,
+    size_t expert_task_offset,
+    const struct gptoss_metal_buffer* expert_assignment_buffer,
+    size_t expert_assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    float swiglu_limit,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_grouped_matmul_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_task_buffer,
+    size_t expert_task_offset,
+    const struct gptoss_metal_buffer* expert_assignment_buffer,
+    size_t expert_assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows);
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_rope_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* activations_buffer,
     size_t activations_offset,
+    const struct gptoss_metal_buffer* rope_table_buffer,
+    size_t rope_table_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
-    float rope_base,
-    float interpolation_scale,
-    float yarn_offset,
-    float yarn_scale,
-    float yarn_multiplier,
     uint32_t num_tokens,
     uint32_t num_q_heads,
     uint32_t num_kv_heads,
     uint32_t attn_head_dim,
     uint32_t token_offset);
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope_kv_scatter(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_rope_kv_scatter_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* activations_buffer,
+    size_t activations_offset,
+    const struct gptoss_metal_buffer* kv_buffer,
+    size_t kv_offset,
+    const struct gptoss_metal_buffer* rope_table_buffer,
+    size_t rope_table_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    uint32_t max_tokens);
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_accumulate_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -318,7 +447,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
     uint32_t num_experts);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_topk_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -331,7 +460,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk(
     uint32_t num_active_experts);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_sdpa_fn,
     const struct gptoss_metal_buffer* q_buffer,
     size_t q_offset,
@@ -341,6 +470,31 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
     size_t s_offset,
     const struct gptoss_metal_buffer* output_buffer,
     size_t output_offset,
+    const struct gptoss_metal_buffer* partial_buffer,
+    size_t partial_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t window,
+    uint32_t kv_stride,
+    uint32_t num_q_tokens,
+    uint32_t num_kv_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t head_dim,
+    uint32_t threadgroup_qmul,
+    uint32_t num_kv_splits);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa_prefill(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sdpa_prefill_fn,
+    const struct gptoss_metal_buffer* q_buffer,
+    size_t q_offset,
+    const struct gptoss_metal_buffer* kv_buffer,
+    size_t kv_offset,
+    const struct gptoss_metal_buffer* s_buffer,
+    size_t s_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
     uint32_t window,
@@ -349,10 +503,27 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
     uint32_t num_kv_tokens,
     uint32_t num_q_heads,
     uint32_t num_kv_heads,
-    uint32_t head_dim);
+    uint32_t head_dim,
+    uint32_t threadgroup_qmul);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa_reduce(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sdpa_reduce_fn,
+    const struct gptoss_metal_buffer* partial_buffer,
+    size_t partial_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_q_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t head_dim,
+    uint32_t threadgroup_qmul,
+    uint32_t num_kv_splits);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_softmax(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_softmax_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -373,7 +544,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_softmax(
     uint32_t* num_channels_per_threadgroup_out);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_sample_fn,
     size_t min_threadgroup_size,
     const struct gptoss_metal_buffer* prob_buffer,
@@ -390,6 +561,54 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample(
     uint32_t num_channels,
     uint32_t num_channels_per_block);
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample_filter(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sample_filter_fn,
+    size_t threadgroup_size,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* score_buffer,
+    size_t score_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* candidate_buffer,
+    size_t candidate_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint64_t rng_seed,
+    uint32_t rng_offset,
+    uint32_t num_channels,
+    float temperature,
+    uint32_t top_k,
+    float min_p,
+    uint32_t* num_candidates_out);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample_candidates(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sample_candidates_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* candidate_buffer,
+    size_t candidate_offset,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint64_t rng_seed,
+    uint32_t rng_offset,
+    uint32_t num_candidates,
+    float temperature,
+    uint32_t top_k);
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_check_stop_token(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* check_stop_token_fn,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* stop_token_mask_buffer,
+    size_t stop_token_mask_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_vocabulary_tokens);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
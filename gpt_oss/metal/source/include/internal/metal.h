@@ -1,6 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <gpt-oss/types.h>
 
@@ -84,23 +86,89 @@ enum gptoss_status gptoss_metal_command_queue_create(
 enum gptoss_status gptoss_metal_command_queue_release(
     struct gptoss_metal_command_queue* command_queue);
 
+enum gptoss_metal_command_type {
+    gptoss_metal_command_type_launch_kernel = 0,
+    gptoss_metal_command_type_fill_buffer = 1,
+    gptoss_metal_command_type_copy_buffer = 2,
+};
+
+// Command recorded into a command list. Its parameters and buffers are stored in the arrays of the command list.
+struct gptoss_metal_command {
+    enum gptoss_metal_command_type type;
+    // Kernel launches only.
+    const struct gptoss_metal_function* function;
+    size_t threadgroup_size[3];
+    size_t num_threadgroups[3];
+    size_t threadgroup_buffer_size;
+    // Kernel parameters are params[params_offset:params_offset+params_size].
+    size_t params_offset;
+    size_t params_size;
+    // Device buffers are buffers[buffers_offset:buffers_offset+num_buffers] at the same range of buffer_offsets.
+    // Fills use one buffer, copies use the input buffer followed by the output buffer.
+    size_t buffers_offset;
+    size_t num_buffers;
+    // Fills and copies only.
+    size_t size;
+    uint8_t fill_value;
+};
+
+// Commands recorded by a recording command buffer, which can be encoded into command buffers any number of times.
+// Parameters and buffer offsets may be modified in place between encodings.
+struct gptoss_metal_command_list {
+    struct gptoss_metal_command* commands;
+    size_t num_commands;
+    size_t commands_capacity;
+    char* params;
+    size_t params_size;
+    size_t params_capacity;
+    const struct gptoss_metal_buffer** buffers;
+    size_t* buffer_offsets;
+    size_t num_buffers;
+    size_t buffers_capacity;
+};
+
+// Removes all commands from the command list, keeping its storage.
+void gptoss_metal_command_list_clear(
+    struct gptoss_metal_command_list* command_list);
+
+enum gptoss_status gptoss_metal_command_list_release(
+    struct gptoss_metal_command_list* command_list);
+
 struct gptoss_metal_command_buffer {
     void* object; // id<MTLCommandBuffer>
+    // Compute command encoder shared by consecutive kernel launches, or NULL. It dispatches serially, so each launch
+    // sees the results of the previous ones. Blits, commit, and release end it.
+    void* compute_encoder; // id<MTLComputeCommandEncoder>
+    // Command list that the commands are appended to instead of being encoded, if the command buffer is recording.
+    struct gptoss_metal_command_list* command_list;
 };
 
 enum gptoss_status gptoss_metal_command_buffer_create(
     const struct gptoss_metal_command_queue* command_queue,
     struct gptoss_metal_command_buffer* command_buffer_out);
 
+// Creates a command buffer that records the commands encoded into it into command_list rather than submitting them to
+// the GPU. A recording command buffer can't be committed.
+enum gptoss_status gptoss_metal_command_buffer_create_recording(
+    struct gptoss_metal_command_list* command_list,
+    struct gptoss_metal_command_buffer* command_buffer_out);
+
+// Returns whether commands can be encoded into the command buffer, i.e. whether it was created and not released.
+static inline bool gptoss_metal_command_buffer_is_valid(
+    const struct gptoss_metal_command_buffer* command_buffer)
+{
+    return command_buffer->object != NULL || command_buffer->command_list != NULL;
+}
+
 enum gptoss_status gptoss_metal_command_buffer_encode_fill_buffer(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_buffer* buffer,
     size_t offset,
     size_t size,
     uint8_t fill_value);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_copy_buffer(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
     const struct gptoss_metal_buffer* output_buffer,
@@ -108,7 +176,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_copy_buffer(
     size_t size);
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_kernel(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* function,
     size_t threadgroup_size_x,
     size_t threadgroup_size_y,
@@ -123,8 +191,25 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_kernel(
     const size_t* device_buffer_offsets,
     size_t threadgroup_buffer_size);
 
+// Encodes command i of command_list.
+enum gptoss_status gptoss_metal_command_buffer_encode_command(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_command_list* command_list,
+    size_t i);
+
+// Registers a handler that is called on an internal Metal thread when the command buffer completes. Must be called
+// before the command buffer is committed.
+enum gptoss_status gptoss_metal_command_buffer_add_completion_handler(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    void (*handler)(void* user_data),
+    void* user_data);
+
 enum gptoss_status gptoss_metal_command_buffer_commit(
-    const struct gptoss_metal_command_buffer* command_buffer);
+    struct gptoss_metal_command_buffer* command_buffer);
+
+enum gptoss_status gptoss_metal_command_buffer_is_completed(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    bool* completed_out);
 
 enum gptoss_status gptoss_metal_command_buffer_wait_completion(
     const struct gptoss_metal_command_buffer* command_buffer,
@@ -215,12 +215,38 @@ private:
     gptoss_metal_command_queue command_queue_{};
 };
 
+class CommandList {
+public:
+    inline CommandList() = default;
+
+    inline ~CommandList() {
+        gptoss_metal_command_list_release(&command_list_);
+    }
+
+    CommandList(const CommandList&) = delete;
+    CommandList& operator=(const CommandList&) = delete;
+
+    inline size_t size() const noexcept { return command_list_.num_commands; }
+
+    inline gptoss_metal_command_list* handle() noexcept { return &command_list_; }
+    inline const gptoss_metal_command_list* handle() const noexcept { return &command_list_; }
+
+private:
+    gptoss_metal_command_list command_list_{};
+};
+
 class CommandBuffer {
 public:
     inline explicit CommandBuffer(const CommandQueue& command_queue) {
         Check(gptoss_metal_command_buffer_create(command_queue.handle(), &command_buffer_),
             "gptoss_metal_command_buffer_create");
     }
+
+    // Records the encoded commands into command_list.
+    inline explicit CommandBuffer(CommandList& command_list) {
+        Check(gptoss_metal_command_buffer_create_recording(command_list.handle(), &command_buffer_),
+            "gptoss_metal_command_buffer_create_recording");
+    }
     inline ~CommandBuffer() {
         gptoss_metal_command_buffer_release(&command_buffer_);
     }
@@ -322,6 +348,13 @@ public:
             "gptoss_metal_command_buffer_encode_launch_u32_fill_random");
     }
 
+    inline void encode_command_list(const CommandList& command_list) {
+        for (size_t i = 0; i < command_list.size(); i++) {
+            Check(gptoss_metal_command_buffer_encode_command(&command_buffer_, command_list.handle(), i),
+                "gptoss_metal_command_buffer_encode_command");
+        }
+    }
+
     inline void commit() {
         Check(gptoss_metal_command_buffer_commit(&command_buffer_), "commit");
     }
@@ -332,6 +365,7 @@ public:
         return secs;
     }
 
+    inline gptoss_metal_command_buffer* handle() noexcept { return &command_buffer_; }
     inline const gptoss_metal_command_buffer* handle() const noexcept { return &command_buffer_; }
 
 private:
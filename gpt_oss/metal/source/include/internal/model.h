@@ -27,6 +27,13 @@ struct gptoss_tokenizer {
     uint32_t num_special_tokens;
 
     uint32_t special_token_id[gptoss_special_token_max - 1];
+
+    // Byte trie over the text tokens for constrained decoding, built when the model is loaded.
+    struct gptoss_token_trie_node* trie_nodes;
+    uint32_t num_trie_nodes;
+    uint32_t max_token_length;
+    // Offset of each length-prefixed text token in tokens_ptr.
+    uint32_t* token_offsets;
 };
 
 struct gptoss_model {
@@ -58,6 +65,8 @@ struct gptoss_model {
     float yarn_scale;
     float yarn_multiplier;
     float rmsnorm_epsilon;
+    // YaRN-adjusted RoPE inverse frequencies, one per pair of head dimensions (head_dim / 2 entries).
+    double* rope_inv_freq;
 
     uint32_t vocabulary_size;
 
@@ -82,16 +91,27 @@ struct gptoss_model {
     struct gptoss_metal_function f32_bf16w_dense_matmul_qkv_fn;
     struct gptoss_metal_function f32_bf16w_dense_matmul_attn_output_fn;
     struct gptoss_metal_function f32_bf16w_dense_matmul_mlp_gate_fn;
-    struct gptoss_metal_function f32_bf16w_unembedding_fn;
+    struct gptoss_metal_function f32_bf16w_rmsnorm_unembedding_fn;
     struct gptoss_metal_function f32_rope_fn;
+    struct gptoss_metal_function f32_rope_kv_scatter_fn;
     struct gptoss_metal_function f32_mf4w_moe_matmul_swiglu_fn;
     struct gptoss_metal_function f32_mf4w_moe_matmul_fn;
-    struct gptoss_metal_function f32_accumulate_e4_fn;
-    struct gptoss_metal_function f32_topk_softmax_e32_k4_fn;
-    struct gptoss_metal_function f32_topk_softmax_e128_k4_fn;
-    struct gptoss_metal_function f32_sdpa_q8_d64_fn;
-    struct gptoss_metal_function f32_softmax_fn;
-    struct gptoss_metal_function f32_sample_fn;
+    struct gptoss_metal_function expert_group_fn;
+    struct gptoss_metal_function f32_mf4w_moe_grouped_matmul_swiglu_fn;
+    struct gptoss_metal_function f32_mf4w_moe_grouped_matmul_fn;
+    // Specialized for num_experts and num_active_experts.
+    struct gptoss_metal_function f32_accumulate_fn;
+    struct gptoss_metal_function f32_topk_softmax_fn;
+    // Take the number of active experts from the arguments.
+    struct gptoss_metal_function f32_accumulate_generic_fn;
+    struct gptoss_metal_function f32_topk_softmax_generic_fn;
+    // Specialized for head_dim and sdpa_threadgroup_qmul.
+    struct gptoss_metal_function f32_sdpa_fn;
+    struct gptoss_metal_function f32_sdpa_reduce_fn;
+    struct gptoss_metal_function f32_sdpa_prefill_fn;
+    struct gptoss_metal_function f32_sample_filter_fn;
+    struct gptoss_metal_function f32_sample_candidates_fn;
+    struct gptoss_metal_function check_stop_token_fn;
 
     size_t per_block_shared_weights_size;
     size_t per_expert_block_weight_size;
@@ -104,6 +124,8 @@ struct gptoss_model {
     size_t mlp_out_threadgroup_size;
     size_t mlp_acc_threadgroup_size;
     size_t unembedding_threadgroup_size;
+    // Number of Q heads handled by one threadgroup of the SDPA kernels.
+    uint32_t sdpa_threadgroup_qmul;
 
     size_t attn_rmsnorm_gain_offset;
     size_t attn_qkv_weight_offset;
@@ -130,6 +152,37 @@ struct gptoss_model {
 
 #define GPTOSS_DEFAULT_BATCH_SIZE 128
 
+// Granularity (in tokens) at which the per-context RoPE table is extended.
+#define GPTOSS_ROPE_TABLE_CHUNK_SIZE 1024
+
+// Minimum number of attended KV tokens per threadgroup when SDPA splits the KV range across threadgroups.
+#define GPTOSS_SDPA_MIN_KV_SPLIT_SIZE 256
+
+// Batches route to the grouped MoE matmuls, which read each expert's weights once for all of its tokens, when they
+// have at least this many (token, active expert) assignments per expert on average.
+#define GPTOSS_MOE_GROUP_MIN_TOKENS_PER_EXPERT 2
+
+// Maximum top-k supported by the sampling filters. Bounds the number of sampling candidates per threadgroup.
+#define GPTOSS_MAX_TOP_K 256
+
+// Maximum number of single-token command buffers in flight while streaming sampled tokens. Keeps the GPU busy while
+// the host waits for, and delivers, the oldest token.
+#define GPTOSS_SAMPLE_STREAM_DEPTH 4
+
+// Interval between checks of the deadline while waiting for a command buffer of a call with a timeout.
+#define GPTOSS_DEADLINE_POLL_INTERVAL_NS 100000
+
+// States of the blocking call on a context, which gptoss_context_abort may cancel from another thread.
+enum gptoss_call_state {
+    gptoss_call_state_idle = 0,
+    gptoss_call_state_running = 1,
+    // gptoss_context_abort is setting the abort flag of the running call.
+    gptoss_call_state_aborting = 2,
+};
+
+// Maximum length of the n-grams indexed for prompt lookup decoding.
+#define GPTOSS_PROMPT_LOOKUP_MAX_NGRAM 4
+
 struct gptoss_context {
 #ifndef __cplusplus
     atomic_uint_least64_t ref_count;
@@ -138,12 +191,62 @@ struct gptoss_context {
 #endif
 
     struct gptoss_model* model;
+    // Cancellation of the blocking call in progress by gptoss_context_abort. abort_requested is set by the abort, and
+    // call_state (enum gptoss_call_state) tells whether there is a call to abort.
+#ifndef __cplusplus
+    atomic_bool abort_requested;
+    atomic_uint call_state;
+#else
+    bool abort_requested;
+    unsigned int call_state;
+#endif
+    // Time limit of each blocking call in nanoseconds, or 0 for none, and the deadline of the call in progress.
+    uint64_t timeout_ns;
+    uint64_t deadline_ns;
     // Number of tokens processed in the context.
     size_t num_tokens;
     // Number of tokens in the KV cache.
     size_t num_kv_tokens;
     // Length of the context.
     size_t max_tokens;
+    // Number of token positions with initialized entries in the RoPE table.
+    size_t num_rope_table_tokens;
+    // Number of per-threadgroup (max, sum of exp) pairs per token in lse_buffer from the last unembedding.
+    uint32_t num_lse_partials;
+    // Sampling filters applied by gptoss_context_sample at non-zero temperature. 0 disables the filter.
+    uint32_t top_k;
+    float min_p;
+    // Whether logit_bias_buffer and token_mask_buffer are applied to the unembedding outputs.
+    bool has_logit_bias;
+    bool has_token_mask;
+    // Grammar that constrains tokens sampled by gptoss_context_sample, or NULL.
+    struct gptoss_grammar* grammar;
+    // Whether sampling stops after the tokens in stop_token_mask_buffer.
+    bool has_stop_tokens;
+    // Byte sequences that stop sampling once the sampled tokens spell them. Sequence i is
+    // stop_sequence_data[stop_sequence_offsets[i]:stop_sequence_offsets[i + 1]].
+    char* stop_sequence_data;
+    size_t* stop_sequence_offsets;
+    size_t num_stop_sequences;
+    size_t max_stop_sequence_size;
+    // Last bytes (up to max_stop_sequence_size - 1) of the tokens sampled by the current call.
+    char* stop_tail;
+    size_t stop_tail_size;
+    // Last request submitted by gptoss_context_process_async or gptoss_context_sample_async, or NULL. Command buffers
+    // complete in submission order, so earlier requests completed once this one did.
+    struct gptoss_request* pending_request;
+    // Hash table from n-grams of up to GPTOSS_PROMPT_LOOKUP_MAX_NGRAM tokens to the position after their latest
+    // occurrence, for prompt lookup decoding. The size is a power of 2. Entries are hints and may be stale. Allocated on
+    // the first call of gptoss_context_sample_prompt_lookup, and NULL before.
+    uint32_t* ngram_table;
+    size_t ngram_table_size;
+    // Number of tokens whose preceding n-grams are indexed in ngram_table.
+    size_t num_ngram_indexed_tokens;
+    // Commands of a decode step (one input and one output token through the full model), recorded on the first decode
+    // step and replayed on the later ones. Empty until recorded.
+    struct gptoss_metal_command_list decode_plan;
+    // num_lse_partials of the unembedding in decode_plan.
+    uint32_t decode_plan_num_lse_partials;
 
     size_t kvcache_size;
     size_t allocation_size;
@@ -154,17 +257,41 @@ struct gptoss_context {
     struct gptoss_metal_buffer rmsnorm_activation_buffer;  // Both attention & MLP RMSNorm output
     struct gptoss_metal_buffer qkv_activation_buffer;  // QKV projection output
     struct gptoss_metal_buffer sdpa_activation_buffer;  // SDPA output
+    struct gptoss_metal_buffer sdpa_partial_buffer;  // SDPA partial softmax states for split KV ranges
     struct gptoss_metal_buffer gate_activation_buffer;  // MoE gating output
     struct gptoss_metal_buffer expert_activation_buffer;  // MoE expert predictions
     struct gptoss_metal_buffer swiglu_activation_buffer;  // MLP+SwiGLU output
     struct gptoss_metal_buffer moe_activation_buffer;  // MoE MLP output (per-active expert)
+    struct gptoss_metal_buffer expert_offset_buffer;  // uint32 start of each expert's group of assignments
+    struct gptoss_metal_buffer expert_assignment_buffer;  // uint32 (token, active expert) assignments grouped by expert
+    struct gptoss_metal_buffer expert_task_buffer;  // gptoss_expert_group_task chunks of the assignment groups
 
     // Input/output buffers.
     struct gptoss_metal_buffer control_buffer;
     struct gptoss_metal_buffer token_buffer;  // uint32 token IDs
     struct gptoss_metal_buffer score_buffer;  // unembedding outputs
-    struct gptoss_metal_buffer prob_buffer;
-    struct gptoss_metal_buffer sum_buffer;
     struct gptoss_metal_buffer argmax_buffer;
+    struct gptoss_metal_buffer lse_buffer;  // float2 (max, sum of exp) of unembedding outputs per token and threadgroup
+    struct gptoss_metal_buffer sample_candidate_buffer;  // uint2 (token, score bits) sampling candidates
+    struct gptoss_metal_buffer logit_bias_buffer;  // float bias per vocabulary token
+    struct gptoss_metal_buffer token_mask_buffer;  // uint32 bitmask of allowed vocabulary tokens
+    struct gptoss_metal_buffer stop_token_mask_buffer;  // uint32 bitmask of vocabulary tokens that stop sampling
     struct gptoss_metal_buffer kvcache_buffer;
+    struct gptoss_metal_buffer rope_table_buffer;  // float2 (cos, sin) per token position and pair of head dimensions
+};
+
+struct gptoss_request {
+#ifndef __cplusplus
+    atomic_uint_least64_t ref_count;
+#else
+    uint_least64_t ref_count;
+#endif
+
+    struct gptoss_metal_command_buffer command_buffer;
+    gptoss_request_callback_t callback;
+    void* user_data;
+    // Number of tokens sampled by the request.
+    size_t num_tokens;
+    // uint32 sampled token IDs, copied from the context's token buffer at the end of the command buffer.
+    struct gptoss_metal_buffer token_buffer;
 };
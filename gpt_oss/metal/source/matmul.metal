@@ -74,7 +74,8 @@ kernel void gptoss_f32_bf16w_matmul_qkv(
     const device bfloat* bias [[ buffer(3) ]],
     device float* q [[ buffer(4) ]],
     device float* kv [[ buffer(5) ]],
-    const device gptoss_control* control [[ buffer(6) ]],
+    const device float2* rope_table [[ buffer(6) ]],
+    const device gptoss_control* control [[ buffer(7) ]],
     threadgroup void* scratch [[ threadgroup(0) ]],
     uint2 gid [[threadgroup_position_in_grid]],
     uint simdgroup_tid [[thread_index_in_simdgroup]],
@@ -82,9 +83,9 @@ kernel void gptoss_f32_bf16w_matmul_qkv(
     uint num_simdgroups [[simdgroups_per_threadgroup]])
 {
     const uint simdgroup_size = 32;
-    const uint head_dim = 64;
-    const uint num_q_heads = 64;
-    const uint num_kv_heads = 8;
+    const uint head_dim = args.head_dim;
+    const uint num_q_heads = args.num_q_heads;
+    const uint num_kv_heads = args.num_kv_heads;
     if (control->abort != 0) {
         return;
     }
@@ -125,21 +126,10 @@ kernel void gptoss_f32_bf16w_matmul_qkv(
             const uint token_idx = args.token_offset + gid.y;
             const uint dim_idx = idx % (head_dim / 2);
             if (head_idx < num_q_heads + num_kv_heads) {
-                const float dim_idx_val = static_cast<float>(dim_idx);
-                const float inv_extrapolation_freq = metal::precise::exp(dim_idx_val * args.freq_scale);
-                const float inv_interpolation_freq = inv_extrapolation_freq * args.interpolation_scale;
-                const float alpha = metal::saturate(metal::fma(dim_idx_val, args.yarn_scale, args.yarn_offset));
-                const float inv_freq = metal::mix(inv_extrapolation_freq, inv_interpolation_freq, alpha);
-
-                const float phi = static_cast<float>(token_idx) * inv_freq;
-                const float yarn_multiplier = args.yarn_multiplier;
-                float cosphi;
-                const float sinphi = metal::precise::sincos(phi, cosphi) * yarn_multiplier;
-                cosphi *= yarn_multiplier;
-
+                const float2 cos_sin = rope_table[token_idx * (head_dim / 2) + dim_idx];
                 vals = (float2) {
-                    vals.x * cosphi - vals.y * sinphi,
-                    vals.x * sinphi + vals.y * cosphi,
+                    vals.x * cos_sin.x - vals.y * cos_sin.y,
+                    vals.x * cos_sin.y + vals.y * cos_sin.x,
                 };
             }
             if (head_idx < num_q_heads) {
@@ -233,26 +223,188 @@ kernel void gptoss_f32_bf16w_unembedding(
     }
 }
 
-// Current constraints for the dense matmul kernel:
-//  1- All B* and Sg_* are a multiple of 8.
-//  2- Bm is divisible by Sg_n and Bn is divisible by Sg_n.
-//  3- M, N and K are all divisible by 8..
-template <uint Bm, uint Bn, uint Bk, uint Sg_Bm, uint Sg_Bn, uint add = 0>
-inline void _gptoss_f32_bf16w_dense_matmul_impl(
-    constant gptoss_dense_matmul_args& args, const device float* lhs,
-    const device bfloat* rhs, const device bfloat* __restrict__ bias,
-    device float* out, const device gptoss_control* control, threadgroup float* scratch, threadgroup float* bias_tile,
-    uint sg_id, uint sg_count_per_tg, uint3 gid, uint3 tg_id, uint3 local_tid,
-    uint3 threadgroup_size) {
+inline static uint rng_squares32(ulong offset, ulong seed) {
+    const ulong y = offset * seed;
+    const ulong z = y + seed;
+
+    /* Round 1 */
+    ulong x = y * y + y;
+    x = metal::rotate(x, 32ul);
+
+    /* Round 2 */
+    x = x * x + z;
+    x = metal::rotate(x, 32ul);
 
+    /* Round 3 */
+    x = x * x + y;
+    x = metal::rotate(x, 32ul);
+
+    /* Round 4 */
+    x = x * x + z;
+    return as_type<uint2>(x).y;
+}
+
+// Fuses the final RMSNorm into the unembedding. Each threadgroup re-derives the RMS scale of its token (a single read
+// of the activations, negligible next to the threadgroup's slice of the unembedding matrix) and keeps the normalized
+// activations in threadgroup memory. Besides the packed argmax, each threadgroup writes its (max, sum of exp(score - max))
+// pair to lse[token * num_threadgroups + threadgroup], so log-sum-exp over the vocabulary merges max_threadgroups values
+// instead of re-reading all scores. Scores are written only if args.output_scores is set.
+// If args.inv_temperature is non-zero, the packed argmax is instead taken over score * inv_temperature + Gumbel noise,
+// which makes it an exact sample from softmax(score * inv_temperature) in the same pass (Gumbel-max trick). The noise
+// for row r of token t is derived from rng_squares32(((rng_offset + t) << 32) + r, rng_seed).
+// If args.apply_logit_bias is set, bias[r] is added to the score of row r. If args.apply_token_mask is set, rows with
+// a zero bit (r % 32) in token_mask[r / 32] get a score of -inf. Both apply before the argmax, sampling, and log-sum-exp.
+kernel void gptoss_f32_bf16w_rmsnorm_unembedding(
+    constant gptoss_rmsnorm_unembedding_args& args [[ buffer(0) ]],
+    const device float4* input [[ buffer(1) ]],
+    const device bfloat4* norm_weight [[ buffer(2) ]],
+    const device bfloat4* weight [[ buffer(3) ]],
+    device float* output [[ buffer(4) ]],
+    device metal::atomic_ulong* argmax [[ buffer(5) ]],
+    device float2* lse [[ buffer(6) ]],
+    const device float* bias [[ buffer(7) ]],
+    const device uint* token_mask [[ buffer(8) ]],
+    const device gptoss_control* control [[ buffer(9) ]],
+    threadgroup float4* normalized_input [[ threadgroup(0) ]],
+    uint2 gid [[threadgroup_position_in_grid]],
+    uint2 num_threadgroups [[threadgroups_per_grid]],
+    uint tid [[thread_index_in_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    const uint simdgroup_size = 32;
+    threadgroup float threadgroup_sumsq[32];
+    threadgroup uint2 threadgroup_argmax[32];
+    threadgroup float2 threadgroup_lse[32];
     if (control->abort != 0) {
         return;
     }
 
-    // The kernel assumes that M, K, and N are divisible by 8.
-    const uint M = args.m;
-    const uint K = args.k;
-    const uint N = args.n;
+    const uint num_column_vecs = args.num_column_vecs;
+    const uint threadgroup_size = num_simdgroups * simdgroup_size;
+    input += gid.y * num_column_vecs;
+
+    float4 sumsq4 = 0.0f;
+    for (uint i = tid; i < num_column_vecs; i += threadgroup_size) {
+        const float4 val = input[i];
+        sumsq4 = metal::fma(val, val, sumsq4);
+    }
+    const float2 sumsq2 = sumsq4.xy + sumsq4.zw;
+    float sumsq = metal::simd_sum(sumsq2.x + sumsq2.y);
+    if (metal::simd_is_first()) {
+        threadgroup_sumsq[simdgroup_idx] = sumsq;
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    sumsq = metal::simd_sum(simdgroup_tid < num_simdgroups ? threadgroup_sumsq[simdgroup_tid] : 0.0f);
+
+    const float scale = metal::precise::rsqrt(sumsq / args.num_channels + args.epsilon);
+    for (uint i = tid; i < num_column_vecs; i += threadgroup_size) {
+        normalized_input[i] = (input[i] * scale) * static_cast<float4>(norm_weight[i]);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    const uint row_start = gid.x * args.num_rows_per_threadgroup + simdgroup_idx;
+    const uint row_end = metal::min(gid.x * args.num_rows_per_threadgroup + args.num_rows_per_threadgroup, args.num_rows);
+    const uint num_iter = (num_column_vecs - simdgroup_tid + (simdgroup_size - 1)) / simdgroup_size;
+
+    const threadgroup float4* simdgroup_input = normalized_input + simdgroup_tid;
+    weight += num_column_vecs * row_start + simdgroup_tid;
+    output += gid.y * args.num_rows + row_start;
+
+    uint2 row_sum{0xFFFFFFFFul, 0xFFFFFFFFul};
+    float max_score = -INFINITY;
+    float sum_exp = 0.0f;
+    for (uint row = row_start; row < row_end; row += num_simdgroups) {
+        uint n = num_iter;
+
+        float4 sum4 = 0.0f;
+        do {
+            const bfloat4 w = *weight;
+            const float4 i = *simdgroup_input;
+
+            sum4 = metal::fma(static_cast<float4>(w), i, sum4);
+
+            weight += simdgroup_size;
+            simdgroup_input += simdgroup_size;
+        } while (--n != 0);
+        simdgroup_input -= num_iter * simdgroup_size;
+        weight -= num_iter * simdgroup_size;
+
+        const float2 sum2 = sum4.xy + sum4.zw;
+        float sum = sum2.x + sum2.y;
+        sum = metal::simd_sum(sum);
+        if (args.apply_logit_bias) {
+            sum += bias[row];
+        }
+        if (args.apply_token_mask && (token_mask[row / 32] & (1u << (row % 32))) == 0) {
+            sum = -INFINITY;
+        }
+        float key = sum;
+        if (args.inv_temperature != 0.0f) {
+            const uint word = rng_squares32((static_cast<ulong>(args.rng_offset + gid.y) << 32) + row, args.rng_seed);
+            const float uniform = (static_cast<float>(word >> 8) + 0.5f) * 0x1.0p-24f;
+            key = metal::fma(sum, args.inv_temperature, -metal::precise::log(-metal::precise::log(uniform)));
+        }
+        uint sum_bits = as_type<uint>(key);
+        if (static_cast<int>(sum_bits) >= 0) {
+            sum_bits ^= 0x7FFFFFFFu;
+        }
+        row_sum = as_type<uint2>(metal::min(as_type<ulong>(row_sum), as_type<ulong>(uint2{row, sum_bits})));
+
+        if (sum != -INFINITY) {
+            const float new_max_score = metal::max(max_score, sum);
+            sum_exp = metal::fma(sum_exp, metal::precise::exp(max_score - new_max_score), metal::precise::exp(sum - new_max_score));
+            max_score = new_max_score;
+        }
+
+        if (args.output_scores && metal::simd_is_first()) {
+            *output = sum;
+        }
+
+        weight += num_column_vecs * num_simdgroups;
+        output += num_simdgroups;
+    }
+    if (metal::simd_is_first()) {
+        threadgroup_argmax[simdgroup_idx] = row_sum;
+        threadgroup_lse[simdgroup_idx] = float2(max_score, sum_exp);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    if (simdgroup_idx == 0) {
+        // Min-Reduce threadgroup_argmax
+        float2 simdgroup_lse = float2(-INFINITY, 0.0f);
+        if (simdgroup_tid < num_simdgroups) {
+            row_sum = threadgroup_argmax[simdgroup_tid];
+            simdgroup_lse = threadgroup_lse[simdgroup_tid];
+        }
+        const uint sum_bits = row_sum.y;
+        const uint sum_bits_min = metal::simd_min(sum_bits);
+        const uint row_min = metal::simd_min(sum_bits == sum_bits_min ? row_sum.x : 0xFFFFFFFFu);
+
+        // Merge (max, sum of exp) pairs; simdgroups without rows contribute (-inf, 0).
+        const float threadgroup_max_score = metal::simd_max(simdgroup_lse.x);
+        const float threadgroup_sum_exp = metal::simd_sum(simdgroup_lse.y != 0.0f ?
+            simdgroup_lse.y * metal::precise::exp(simdgroup_lse.x - threadgroup_max_score) : 0.0f);
+        if (metal::simd_is_first()) {
+            const uint2 threadgroup_output{row_min, sum_bits_min};
+            atomic_min_explicit(&argmax[gid.y], as_type<ulong>(threadgroup_output), metal::memory_order_relaxed);
+            lse[gid.y * num_threadgroups.x + gid.x] = float2(threadgroup_max_score, threadgroup_sum_exp);
+        }
+    }
+}
+
+// Current constraints for the dense matmul kernel:
+//  1- All B* and Sg_* are a multiple of 8.
+//  2- Bm is divisible by Sg_n and Bn is divisible by Sg_n.
+//  3- M, N and K are all divisible by 8..
+//
+// Computes the (Bm x Bn) output tile of the threadgroup and stores it, without bias, to threadgroup scratch
+// memory in row-major order. The caller is responsible for the barrier before reading the scratch tile.
+template <uint Bm, uint Bn, uint Bk, uint Sg_Bm, uint Sg_Bn>
+inline void _gptoss_f32_bf16w_dense_matmul_tile(
+    uint K, const device float* lhs, const device bfloat* rhs,
+    threadgroup float* scratch, uint sg_id, uint3 tg_id) {
+
     static_assert((Bm % 8u) == 0u, "Bm must be a multiple of 8");
     static_assert((Bn % 8u) == 0u, "Bn must be a multiple of 8");
     static_assert((Bk % 8u) == 0u, "Bk must be a multiple of 8");
@@ -312,7 +464,7 @@ inline void _gptoss_f32_bf16w_dense_matmul_impl(
             }
         }
     }
-    // Epilogue.
+    // Spill the accumulators to threadgroup memory.
 #pragma clang loop unroll(full)
     for (uint n_subtile_ = 0; n_subtile_ < Sg_Bn; n_subtile_ += 8) {
         const uint col_index_in_out_tile = n_subtile_ / 8;
@@ -327,6 +479,29 @@ inline void _gptoss_f32_bf16w_dense_matmul_impl(
                             ulong2(local_col_offset, local_row_offset));
         }
     }
+}
+
+template <uint Bm, uint Bn, uint Bk, uint Sg_Bm, uint Sg_Bn, uint add = 0>
+inline void _gptoss_f32_bf16w_dense_matmul_impl(
+    constant gptoss_dense_matmul_args& args, const device float* lhs,
+    const device bfloat* rhs, const device bfloat* __restrict__ bias,
+    device float* out, const device gptoss_control* control, threadgroup float* scratch, threadgroup float* bias_tile,
+    uint sg_id, uint sg_count_per_tg, uint3 gid, uint3 tg_id, uint3 local_tid,
+    uint3 threadgroup_size) {
+
+    if (control->abort != 0) {
+        return;
+    }
+
+    // The kernel assumes that M, K, and N are divisible by 8.
+    const uint M = args.m;
+    const uint K = args.k;
+    const uint N = args.n;
+    const uint row_tg_offset = tg_id.y * Bm;
+    const uint col_tg_offset = tg_id.x * Bn;
+
+    _gptoss_f32_bf16w_dense_matmul_tile<Bm, Bn, Bk, Sg_Bm, Sg_Bn>(K, lhs, rhs, scratch, sg_id, tg_id);
+
     // TODO(ibahmed): vectorize these loads an maybe unroll the loop.
     const uint thread_count_per_tg =
         threadgroup_size.x * threadgroup_size.y * threadgroup_size.z;
@@ -357,25 +532,67 @@ inline void _gptoss_f32_bf16w_dense_matmul_impl(
     }
 }
 
+// Each threadgroup column tile spans exactly one attention head (QKV_Bn == head_dim), so the epilogue adds the
+// bias, applies YaRN RoPE to Q and K heads, and writes Q to the activation buffer and K/V directly into their
+// KV cache slots, like the epilogue of gptoss_f32_bf16w_matmul_qkv does for the decode path.
 kernel void gptoss_f32_bf16w_dense_matmul_qkv(
-    constant gptoss_dense_matmul_args& args [[buffer(0)]],
+    constant gptoss_dense_matmul_qkv_args& args [[buffer(0)]],
     const device float* lhs [[buffer(1)]],
     const device bfloat* rhs [[buffer(2)]],
     const device bfloat* __restrict__ bias [[buffer(3)]],
-    device float* out [[buffer(4)]],
-    const device gptoss_control* control [[buffer(5)]],
+    device float* q [[buffer(4)]],
+    device float* kv [[buffer(5)]],
+    const device float2* rope_table [[buffer(6)]],
+    const device gptoss_control* control [[buffer(7)]],
     uint sg_id [[simdgroup_index_in_threadgroup]],
-    uint sg_count_per_tg [[dispatch_simdgroups_per_threadgroup]],
-    uint3 gid [[thread_position_in_grid]],
     uint3 tg_id [[threadgroup_position_in_grid]],
     uint3 local_tid [[thread_position_in_threadgroup]],
     uint3 threadgroup_size [[threads_per_threadgroup]]) {
+    constexpr uint head_dim = QKV_Bn;
     threadgroup float scratch[QKV_Bm * QKV_Bn];
     threadgroup float bias_tile[QKV_Bn];
-    _gptoss_f32_bf16w_dense_matmul_impl<QKV_Bm, QKV_Bn, QKV_Bk, QKV_Sg_Bm,
-                                        QKV_Sg_Bn>(
-        args, lhs, rhs, bias, out, control, scratch, bias_tile, sg_id, sg_count_per_tg,
-        gid, tg_id, local_tid, threadgroup_size);
+    if (control->abort != 0) {
+        return;
+    }
+
+    _gptoss_f32_bf16w_dense_matmul_tile<QKV_Bm, QKV_Bn, QKV_Bk, QKV_Sg_Bm, QKV_Sg_Bn>(
+        args.k, lhs, rhs, scratch, sg_id, tg_id);
+
+    const uint head_idx = tg_id.x;
+    const uint row_tg_offset = tg_id.y * QKV_Bm;
+    const uint thread_count_per_tg = threadgroup_size.x;
+    for (uint c_local = local_tid.x; c_local < head_dim; c_local += thread_count_per_tg) {
+        bias_tile[c_local] = static_cast<float>(bias[head_idx * head_dim + c_local]);
+    }
+
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    const uint num_q_heads = args.num_q_heads;
+    const uint num_qk_heads = num_q_heads + args.num_kv_heads;
+    for (uint idx = local_tid.x; idx < QKV_Bm * (head_dim / 2); idx += thread_count_per_tg) {
+        const uint r = idx / (head_dim / 2);
+        const uint dim_idx = idx % (head_dim / 2);
+        const uint token_idx = args.token_offset + row_tg_offset + r;
+
+        float2 vals = reinterpret_cast<const threadgroup float2*>(scratch)[idx] +
+            reinterpret_cast<const threadgroup float2*>(bias_tile)[dim_idx];
+        if (head_idx < num_qk_heads) {
+            const float2 cos_sin = rope_table[token_idx * (head_dim / 2) + dim_idx];
+            vals = (float2) {
+                vals.x * cos_sin.x - vals.y * cos_sin.y,
+                vals.x * cos_sin.y + vals.y * cos_sin.x,
+            };
+        }
+        if (head_idx < num_q_heads) {
+            reinterpret_cast<device float2*>(q + (row_tg_offset + r) * args.n + head_idx * head_dim)[dim_idx] = vals;
+        } else if (head_idx < num_qk_heads) {
+            const uint h = head_idx - num_q_heads;
+            reinterpret_cast<device float2*>(kv + (h * args.max_tokens + token_idx) * 2 * head_dim)[dim_idx] = vals;
+        } else {
+            const uint h = head_idx - num_qk_heads;
+            reinterpret_cast<device float2*>(kv + (h * args.max_tokens + token_idx) * 2 * head_dim + head_dim)[dim_idx] = vals;
+        }
+    }
 }
 
 kernel void gptoss_f32_bf16w_dense_matmul_attn_output(
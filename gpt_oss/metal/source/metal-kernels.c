@@ -1,7 +1,8 @@
 #include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <math.h>
 
 #include <internal/kernel-args.h>
 #include <internal/log.h>
@@ -11,7 +12,7 @@
 
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_fill_random(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* u32_fill_random_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -21,7 +22,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_fill_random(
     uint64_t rng_seed,
     uint64_t rng_offset)
 {
-    if (command_buffer->object == NULL || u32_fill_random_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || u32_fill_random_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -51,7 +52,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_u32_fill_random(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_fill_random(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_fill_random_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -63,7 +64,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_fill_random(
     float rng_min,
     float rng_max)
 {
-    if (command_buffer->object == NULL || f32_fill_random_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_fill_random_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -99,7 +100,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_fill_random(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_fill_random(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* bf16_fill_random_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -111,7 +112,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_fill_random(
     float rng_min,
     float rng_max)
 {
-    if (command_buffer->object == NULL || bf16_fill_random_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || bf16_fill_random_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -147,7 +148,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_fill_random(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_mf4_f32_convert(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* mf4_f32_convert_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -156,7 +157,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_mf4_f32_convert(
     const struct gptoss_metal_buffer* output_buffer,
     uint64_t num_elements)
 {
-    if (command_buffer->object == NULL || mf4_f32_convert_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || mf4_f32_convert_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -188,7 +189,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_mf4_f32_convert(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* bf16_f32_embeddings_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* token_buffer,
@@ -202,7 +203,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings
     uint32_t num_tokens,
     uint32_t num_channels)
 {
-    if (command_buffer->object == NULL || bf16_f32_embeddings_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || bf16_f32_embeddings_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -233,7 +234,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_bf16_f32_embeddings
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_rmsnorm_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -247,7 +248,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
     uint32_t num_channels,
     float epsilon)
 {
-    if (command_buffer->object == NULL || f32_bf16w_rmsnorm_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_bf16w_rmsnorm_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -282,7 +283,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -299,7 +300,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
     uint32_t num_cols,
     uint32_t num_rows)
 {
-    if (command_buffer->object == NULL || f32_bf16w_matmul_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_bf16w_matmul_fn->pipeline_state_object == NULL) {
         GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
@@ -342,7 +343,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qkv(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_qkv_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -355,6 +356,8 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qk
     size_t output_offset,
     const struct gptoss_metal_buffer* kv_buffer,
     size_t kv_offset,
+    const struct gptoss_metal_buffer* rope_table_buffer,
+    size_t rope_table_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
     uint32_t num_tokens,
@@ -363,14 +366,9 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qk
     uint32_t num_kv_heads,
     uint32_t attn_head_dim,
     uint32_t token_offset,
-    uint32_t max_tokens,
-    float rope_base,
-    float interpolation_scale,
-    float yarn_offset,
-    float yarn_scale,
-    float yarn_multiplier)
+    uint32_t max_tokens)
 {
-    if (command_buffer->object == NULL || f32_bf16w_matmul_qkv_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_bf16w_matmul_qkv_fn->pipeline_state_object == NULL) {
         GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_qkv kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
@@ -389,18 +387,8 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qk
         return gptoss_status_invalid_argument;
     }
 
-    if (num_q_heads != 64) {
-        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_qkv kernel launch: number of Q heads (%" PRIu32 ") must be 64",
-            num_q_heads);
-        return gptoss_status_invalid_argument;
-    }
-    if (num_kv_heads != 8) {
-        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_qkv kernel launch: number of KV heads (%" PRIu32 ") must be 8",
-            num_kv_heads);
-        return gptoss_status_invalid_argument;
-    }
-    if (attn_head_dim != 64) {
-        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_qkv kernel launch: attention head dimension (%" PRIu32 ") must be 64",
+    if (attn_head_dim % 2 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_qkv kernel launch: attention head dimension (%" PRIu32 ") must be even",
             attn_head_dim);
         return gptoss_status_invalid_argument;
     }
@@ -417,12 +405,10 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qk
         .num_column_vecs = num_cols / 4,
         .num_rows = num_rows,
         .token_offset = token_offset,
-        .freq_scale = -logf(rope_base) / (float) (int32_t) (attn_head_dim / 2),
-        .interpolation_scale = interpolation_scale,
-        .yarn_offset = yarn_offset,
-        .yarn_scale = yarn_scale,
-        .yarn_multiplier = yarn_multiplier,
         .max_tokens = max_tokens,
+        .num_q_heads = num_q_heads,
+        .num_kv_heads = num_kv_heads,
+        .head_dim = attn_head_dim,
     };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
@@ -430,14 +416,14 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_qk
         threadgroup_size, 1, 1,
         num_rows / num_simdgroups, num_tokens, 1,
         sizeof(args), &args,
-        6,
-        (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, bias_buffer, output_buffer, kv_buffer, control_buffer},
-        (const size_t[]) {input_offset, weight_offset, bias_offset, output_offset, kv_offset, control_offset},
+        7,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, bias_buffer, output_buffer, kv_buffer, rope_table_buffer, control_buffer},
+        (const size_t[]) {input_offset, weight_offset, bias_offset, output_offset, kv_offset, rope_table_offset, control_offset},
         /*threadgroup_buffer_size=*/num_simdgroups * sizeof(float));
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_add(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -454,7 +440,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_ad
     uint32_t num_cols,
     uint32_t num_rows)
 {
-    if (command_buffer->object == NULL || f32_bf16w_matmul_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_bf16w_matmul_fn->pipeline_state_object == NULL) {
         GPTOSS_LOG_ERROR("failed to encode f32_bf16w_matmul_add kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
@@ -497,18 +483,8 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_matmul_ad
 }
 
 enum gptoss_status _gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_impl(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
-    const struct gptoss_metal_buffer* input_buffer,
-    size_t input_offset,
-    const struct gptoss_metal_buffer* weight_buffer,
-    size_t weight_offset,
-    const struct gptoss_metal_buffer* bias_buffer,
-    size_t bias_offset,
-    const struct gptoss_metal_buffer* output_buffer,
-    size_t output_offset, 
-    const struct gptoss_metal_buffer* control_buffer,
-    size_t control_offset,
     uint32_t num_tokens,
     uint32_t num_cols,
     uint32_t num_rows,
@@ -516,10 +492,15 @@ enum gptoss_status _gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_ma
     uint32_t Bn,
     uint32_t Bk,
     uint32_t Sg_Bm,
-    uint32_t Sg_Bn)
+    uint32_t Sg_Bn,
+    size_t params_size,
+    const void* params,
+    size_t num_device_buffers,
+    const struct gptoss_metal_buffer** device_buffers,
+    const size_t* device_buffer_offsets)
 {
 
-    if (command_buffer->object == NULL || f32_bf16w_dense_matmul_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_bf16w_dense_matmul_fn->pipeline_state_object == NULL) {
         GPTOSS_LOG_ERROR("failed to encode f32_bf16w_dense_matmul kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
@@ -540,15 +521,10 @@ enum gptoss_status _gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_ma
         return gptoss_status_invalid_argument;
     }
 
-    const struct gptoss_dense_matmul_args args = {
-        .m = num_tokens,
-        .n = num_rows,
-        .k = num_cols,
-    };
     const size_t threads_per_simdgroup = f32_bf16w_dense_matmul_fn->simdgroup_threads;
-    const uint32_t m = args.m;
-    const uint32_t n = args.n;
-    const uint32_t k = args.k;
+    const uint32_t m = num_tokens;
+    const uint32_t n = num_rows;
+    const uint32_t k = num_cols;
     if (Bm % Sg_Bm != 0) {
         GPTOSS_LOG_ERROR("failed to encode f32_bf16w_dense_matmul kernel launch: Bm (%" PRIu32 ") is not divisible by Sg_Bm (%" PRIu32 ")",
                          Bm, Sg_Bm);
@@ -591,17 +567,14 @@ enum gptoss_status _gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_ma
         command_buffer, f32_bf16w_dense_matmul_fn,
         threadgroup_size_x, threadgroup_size_y, threadgroup_size_z,
         grid_x, grid_y, grid_z,
-        sizeof(args), &args,
-        5,
-        (const struct gptoss_metal_buffer *[]){input_buffer, weight_buffer, bias_buffer, output_buffer, control_buffer},
-        (const size_t[]){input_offset, weight_offset, bias_offset, output_offset, control_offset},
+        params_size, params,
+        num_device_buffers, device_buffers, device_buffer_offsets,
         /*threadgroup_buffer_size=*/0);
-    return gptoss_status_success;
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_qkv(
-    const struct gptoss_metal_command_buffer* command_buffer,
-    const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_bf16w_dense_matmul_qkv_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
     const struct gptoss_metal_buffer* weight_buffer,
@@ -610,21 +583,48 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_mat
     size_t bias_offset,
     const struct gptoss_metal_buffer* output_buffer,
     size_t output_offset,
+    const struct gptoss_metal_buffer* kv_buffer,
+    size_t kv_offset,
+    const struct gptoss_metal_buffer* rope_table_buffer,
+    size_t rope_table_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
     uint32_t num_tokens,
     uint32_t num_cols,
-    uint32_t num_rows)
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    uint32_t max_tokens)
 {
+    if (attn_head_dim != QKV_Bn) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_dense_matmul_qkv kernel launch: attention head dimension (%" PRIu32 ") must be %" PRIu32,
+            attn_head_dim, (uint32_t) QKV_Bn);
+        return gptoss_status_invalid_argument;
+    }
+
+    const uint32_t num_rows = (num_q_heads + 2 * num_kv_heads) * attn_head_dim;
+    const struct gptoss_dense_matmul_qkv_args args = {
+        .m = num_tokens,
+        .n = num_rows,
+        .k = num_cols,
+        .num_q_heads = num_q_heads,
+        .num_kv_heads = num_kv_heads,
+        .token_offset = token_offset,
+        .max_tokens = max_tokens,
+    };
+
     return _gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_impl(
-        command_buffer, f32_bf16w_dense_matmul_fn, input_buffer, input_offset, 
-        weight_buffer, weight_offset, bias_buffer, bias_offset, output_buffer,
-        output_offset, control_buffer, control_offset, num_tokens, num_cols, num_rows, QKV_Bm, QKV_Bn, QKV_Bk,
-        QKV_Sg_Bm, QKV_Sg_Bn);
+        command_buffer, f32_bf16w_dense_matmul_qkv_fn, num_tokens, num_cols, num_rows,
+        QKV_Bm, QKV_Bn, QKV_Bk, QKV_Sg_Bm, QKV_Sg_Bn,
+        sizeof(args), &args,
+        7,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, bias_buffer, output_buffer, kv_buffer, rope_table_buffer, control_buffer},
+        (const size_t[]) {input_offset, weight_offset, bias_offset, output_offset, kv_offset, rope_table_offset, control_offset});
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_attn_output(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -640,15 +640,23 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_mat
     uint32_t num_cols,
     uint32_t num_rows)
 {
+    const struct gptoss_dense_matmul_args args = {
+        .m = num_tokens,
+        .n = num_rows,
+        .k = num_cols,
+    };
+
     return _gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_impl(
-        command_buffer, f32_bf16w_dense_matmul_fn, input_buffer, input_offset,
-        weight_buffer, weight_offset, bias_buffer, bias_offset, output_buffer,
-        output_offset, control_buffer, control_offset, num_tokens, num_cols, num_rows, ATTN_OUTPUT_Bm,
-        ATTN_OUTPUT_Bn, ATTN_OUTPUT_Bk, ATTN_OUTPUT_Sg_Bm, ATTN_OUTPUT_Sg_Bn);
+        command_buffer, f32_bf16w_dense_matmul_fn, num_tokens, num_cols, num_rows,
+        ATTN_OUTPUT_Bm, ATTN_OUTPUT_Bn, ATTN_OUTPUT_Bk, ATTN_OUTPUT_Sg_Bm, ATTN_OUTPUT_Sg_Bn,
+        sizeof(args), &args,
+        5,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, bias_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, weight_offset, bias_offset, output_offset, control_offset});
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_mlp_gate(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_dense_matmul_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -664,16 +672,23 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_mat
     uint32_t num_cols,
     uint32_t num_rows)
 {
+    const struct gptoss_dense_matmul_args args = {
+        .m = num_tokens,
+        .n = num_rows,
+        .k = num_cols,
+    };
+
     return _gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_impl(
-        command_buffer, f32_bf16w_dense_matmul_fn, input_buffer, input_offset,
-        weight_buffer, weight_offset, bias_buffer, bias_offset, output_buffer,
-        output_offset, control_buffer, control_offset, num_tokens, num_cols,
-        num_rows, MLP_GATE_Bm, MLP_GATE_Bn, MLP_GATE_Bk, MLP_GATE_Sg_Bm,
-        MLP_GATE_Sg_Bn);
+        command_buffer, f32_bf16w_dense_matmul_fn, num_tokens, num_cols, num_rows,
+        MLP_GATE_Bm, MLP_GATE_Bn, MLP_GATE_Bk, MLP_GATE_Sg_Bm, MLP_GATE_Sg_Bn,
+        sizeof(args), &args,
+        5,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, weight_buffer, bias_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, weight_offset, bias_offset, output_offset, control_offset});
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembedding(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_bf16w_unembedding_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -691,7 +706,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembeddi
     uint32_t num_cols,
     uint32_t num_rows)
 {
-    if (command_buffer->object == NULL || f32_bf16w_unembedding_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_bf16w_unembedding_fn->pipeline_state_object == NULL) {
         GPTOSS_LOG_ERROR("failed to encode f32_bf16w_unembedding kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
@@ -730,8 +745,97 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_unembeddi
         /*threadgroup_buffer_size=*/0);
 }
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_unembedding(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_bf16w_rmsnorm_unembedding_fn,
+    size_t threadgroup_size,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* norm_weight_buffer,
+    size_t norm_weight_offset,
+    const struct gptoss_metal_buffer* weight_buffer,
+    size_t weight_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* lse_buffer,
+    size_t lse_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* token_mask_buffer,
+    size_t token_mask_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_cols,
+    uint32_t num_rows,
+    float epsilon,
+    bool output_scores,
+    float temperature,
+    uint64_t rng_seed,
+    uint32_t rng_offset,
+    bool apply_logit_bias,
+    bool apply_token_mask,
+    uint32_t* num_threadgroups_out)
+{
+    *num_threadgroups_out = 0;
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_bf16w_rmsnorm_unembedding_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_unembedding kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = f32_bf16w_rmsnorm_unembedding_fn->simdgroup_threads;
+    } else if (threadgroup_size > f32_bf16w_rmsnorm_unembedding_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_unembedding kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_bf16w_rmsnorm_unembedding_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (num_cols % 4 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_unembedding kernel launch: number of columns (%" PRIu32 ") is not divisible by 4",
+            num_cols);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (!(temperature >= 0.0f)) {
+        GPTOSS_LOG_ERROR("failed to encode f32_bf16w_rmsnorm_unembedding kernel launch: invalid temperature %f", temperature);
+        return gptoss_status_invalid_argument;
+    }
+
+    const size_t num_simdgroups = threadgroup_size / f32_bf16w_rmsnorm_unembedding_fn->simdgroup_threads;
+    const size_t num_rows_per_threadgroup = math_ceil_div(num_rows, max_threadgroups * num_simdgroups) * num_simdgroups;
+    const size_t num_threadgroups = math_min(max_threadgroups, math_ceil_div(num_rows, num_rows_per_threadgroup));
+    const struct gptoss_rmsnorm_unembedding_args args = {
+        .num_column_vecs = num_cols / 4,
+        .num_rows_per_threadgroup = num_rows_per_threadgroup,
+        .num_rows = num_rows,
+        .num_channels = (float) num_cols,
+        .epsilon = epsilon,
+        .output_scores = output_scores,
+        .rng_seed = rng_seed,
+        .rng_offset = rng_offset,
+        .inv_temperature = temperature != 0.0f ? 1.0f / temperature : 0.0f,
+        .apply_logit_bias = apply_logit_bias,
+        .apply_token_mask = apply_token_mask,
+    };
+
+    *num_threadgroups_out = num_threadgroups;
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_bf16w_rmsnorm_unembedding_fn,
+        threadgroup_size, 1, 1,
+        num_threadgroups, num_tokens, 1,
+        sizeof(args), &args,
+        9,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, norm_weight_buffer, weight_buffer, output_buffer, argmax_buffer, lse_buffer, bias_buffer, token_mask_buffer, control_buffer},
+        (const size_t[]) {input_offset, norm_weight_offset, weight_offset, output_offset, argmax_offset, lse_offset, bias_offset, token_mask_offset, control_offset},
+        /*threadgroup_buffer_size=*/num_cols * sizeof(float));
+}
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_mf4w_moe_matmul_swiglu_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -755,7 +859,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul
     uint32_t num_cols,
     uint32_t num_rows)
 {
-    if (command_buffer->object == NULL || f32_mf4w_moe_matmul_swiglu_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_mf4w_moe_matmul_swiglu_fn->pipeline_state_object == NULL) {
         GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul_swiglu kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
@@ -807,7 +911,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_mf4w_moe_matmul_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* input_buffer,
@@ -830,7 +934,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul
     uint32_t num_cols,
     uint32_t num_rows)
 {
-    if (command_buffer->object == NULL || f32_mf4w_moe_matmul_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_mf4w_moe_matmul_fn->pipeline_state_object == NULL) {
         GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_matmul kernel launch: invalid command buffer or pipeline state object");
         return gptoss_status_invalid_state;
     }
@@ -880,26 +984,226 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul
         /*threadgroup_buffer_size=*/0);
 }
 
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_expert_group(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* expert_group_fn,
+    const struct gptoss_metal_buffer* expert_buffer,
+    size_t expert_offset,
+    const struct gptoss_metal_buffer* expert_offset_buffer,
+    size_t expert_offset_offset,
+    const struct gptoss_metal_buffer* expert_assignment_buffer,
+    size_t expert_assignment_offset,
+    const struct gptoss_metal_buffer* expert_task_buffer,
+    size_t expert_task_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts)
+{
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || expert_group_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode expert_group kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (num_experts > EXPERT_GROUP_MAX_EXPERTS) {
+        GPTOSS_LOG_ERROR("failed to encode expert_group kernel launch: number of experts (%" PRIu32 ") exceeds supported maximum (%u)",
+            num_experts, EXPERT_GROUP_MAX_EXPERTS);
+        return gptoss_status_unsupported_argument;
+    }
+
+    const struct gptoss_expert_group_args args = {
+        .num_tokens = num_tokens,
+        .num_experts = num_experts,
+        .num_active_experts = num_active_experts,
+        .max_tasks = EXPERT_GROUP_MAX_TASKS(num_tokens * num_active_experts, num_experts),
+    };
+
+    // A single threadgroup counts the tokens of every expert in threadgroup memory.
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, expert_group_fn,
+        math_min(expert_group_fn->max_threadgroup_threads, 1024), 1, 1,
+        1, 1, 1,
+        sizeof(args), &args,
+        5,
+        (const struct gptoss_metal_buffer *[]) {expert_buffer, expert_offset_buffer, expert_assignment_buffer, expert_task_buffer, control_buffer},
+        (const size_t[]) {expert_offset, expert_offset_offset, expert_assignment_offset, expert_task_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul_swiglu(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_grouped_matmul_swiglu_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_task_buffer,
+    size_t expert_task_offset,
+    const struct gptoss_metal_buffer* expert_assignment_buffer,
+    size_t expert_assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    float swiglu_limit,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows)
+{
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_mf4w_moe_grouped_matmul_swiglu_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul_swiglu kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = 2 * f32_mf4w_moe_grouped_matmul_swiglu_fn->simdgroup_threads;
+    } else if (threadgroup_size > f32_mf4w_moe_grouped_matmul_swiglu_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul_swiglu kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_mf4w_moe_grouped_matmul_swiglu_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    } else if (threadgroup_size % (2 * f32_mf4w_moe_grouped_matmul_swiglu_fn->simdgroup_threads)) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul_swiglu kernel launch: threadgroup size (%zu) is not divisible by simdgroup size (%zu) multiplied by 2X",
+            threadgroup_size, f32_mf4w_moe_grouped_matmul_swiglu_fn->simdgroup_threads);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (num_cols % 32 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul_swiglu kernel launch: number of columns (%" PRIu32 ") is not divisible by 32",
+            num_cols);
+        return gptoss_status_invalid_argument;
+    }
+    const size_t num_simdgroups = threadgroup_size / f32_mf4w_moe_grouped_matmul_swiglu_fn->simdgroup_threads;
+    if ((2 * num_rows) % num_simdgroups != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul_swiglu kernel launch: "
+            "the number of rows (%" PRIu32 ") multiplied by 2X is not divisible by the number of simdgroups (%zu)",
+            num_rows, num_simdgroups);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_moe_matmul_swiglu_args args = {
+        .num_column_vecs = num_cols / 32,
+        .num_rows = num_rows,
+        .num_active_experts = num_active_experts,
+        .weight_expert_stride = expert_stride,
+        .output_expert_stride = num_rows * num_tokens,
+        .swiglu_min = -swiglu_limit,
+        .swiglu_max = swiglu_limit,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_mf4w_moe_grouped_matmul_swiglu_fn,
+        threadgroup_size, 1, 1,
+        (2 * num_rows) / num_simdgroups, EXPERT_GROUP_MAX_TASKS(num_tokens * num_active_experts, num_experts), 1,
+        sizeof(args), &args,
+        8,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, expert_task_buffer, expert_assignment_buffer, weight_block_buffer, weight_scale_buffer, bias_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, expert_task_offset, expert_assignment_offset, weight_block_offset, weight_scale_offset, bias_offset, output_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_mf4w_moe_grouped_matmul_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* input_buffer,
+    size_t input_offset,
+    const struct gptoss_metal_buffer* expert_task_buffer,
+    size_t expert_task_offset,
+    const struct gptoss_metal_buffer* expert_assignment_buffer,
+    size_t expert_assignment_offset,
+    const struct gptoss_metal_buffer* weight_block_buffer,
+    size_t weight_block_offset,
+    const struct gptoss_metal_buffer* weight_scale_buffer,
+    size_t weight_scale_offset,
+    const struct gptoss_metal_buffer* bias_buffer,
+    size_t bias_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t expert_stride,
+    uint32_t num_tokens,
+    uint32_t num_experts,
+    uint32_t num_active_experts,
+    uint32_t num_cols,
+    uint32_t num_rows)
+{
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_mf4w_moe_grouped_matmul_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = f32_mf4w_moe_grouped_matmul_fn->simdgroup_threads;
+    } else if (threadgroup_size > f32_mf4w_moe_grouped_matmul_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_mf4w_moe_grouped_matmul_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    } else if (threadgroup_size % f32_mf4w_moe_grouped_matmul_fn->simdgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul kernel launch: threadgroup size (%zu) is not divisible by simdgroup size (%zu)",
+            threadgroup_size, f32_mf4w_moe_grouped_matmul_fn->simdgroup_threads);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (num_cols % 32 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul kernel launch: number of columns (%" PRIu32 ") is not divisible by 32",
+            num_cols);
+        return gptoss_status_invalid_argument;
+    }
+    const size_t num_simdgroups = threadgroup_size / f32_mf4w_moe_grouped_matmul_fn->simdgroup_threads;
+    if (num_rows % num_simdgroups != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_mf4w_moe_grouped_matmul kernel launch: "
+            "the number of rows (%" PRIu32 ") is not divisible by the number of simdgroups (%zu)",
+            num_rows, num_simdgroups);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_moe_matmul_args args = {
+        .num_column_vecs = num_cols / 32,
+        .num_rows = num_rows,
+        .num_active_experts = num_active_experts,
+        .input_expert_stride = num_tokens * (num_cols / 32),
+        .weight_expert_stride = expert_stride,
+        .output_expert_stride = num_rows * num_tokens,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_mf4w_moe_grouped_matmul_fn,
+        threadgroup_size, 1, 1,
+        num_rows / num_simdgroups, EXPERT_GROUP_MAX_TASKS(num_tokens * num_active_experts, num_experts), 1,
+        sizeof(args), &args,
+        8,
+        (const struct gptoss_metal_buffer *[]) {input_buffer, expert_task_buffer, expert_assignment_buffer, weight_block_buffer, weight_scale_buffer, bias_buffer, output_buffer, control_buffer},
+        (const size_t[]) {input_offset, expert_task_offset, expert_assignment_offset, weight_block_offset, weight_scale_offset, bias_offset, output_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_rope_fn,
     size_t threadgroup_size,
     const struct gptoss_metal_buffer* activations_buffer,
     size_t activations_offset,
+    const struct gptoss_metal_buffer* rope_table_buffer,
+    size_t rope_table_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
-    float rope_base,
-    float interpolation_scale,
-    float yarn_offset,
-    float yarn_scale,
-    float yarn_multiplier,
     uint32_t num_tokens,
     uint32_t num_q_heads,
     uint32_t num_kv_heads,
     uint32_t attn_head_dim,
     uint32_t token_offset)
 {
-    if (command_buffer->object == NULL || f32_rope_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_rope_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -909,35 +1213,107 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope(
         return gptoss_status_invalid_argument;
     }
 
-    const size_t num_simdgroups = threadgroup_size / f32_rope_fn->simdgroup_threads;
+    if (attn_head_dim % 2 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_rope kernel launch: attention head dimension (%" PRIu32 ") must be even",
+            attn_head_dim);
+        return gptoss_status_invalid_argument;
+    }
+
     const uint32_t num_qk_heads = num_q_heads + num_kv_heads;
-    if (num_qk_heads % num_simdgroups != 0) {
+    const size_t num_qk_pairs = (size_t) num_qk_heads * (attn_head_dim / 2);
+    if (num_qk_pairs % threadgroup_size != 0) {
         return gptoss_status_invalid_argument;
     }
 
     const struct gptoss_rope_args args = {
         .token_stride = (num_q_heads + 2 * num_kv_heads) * (attn_head_dim / 2),
         .token_offset = token_offset,
-        .freq_scale = -logf(rope_base) / (float) (int32_t) (attn_head_dim / 2),
-        .interpolation_scale = interpolation_scale,
-        .yarn_offset = yarn_offset,
-        .yarn_scale = yarn_scale,
-        .yarn_multiplier = yarn_multiplier,
+        .head_dim = attn_head_dim,
     };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
         command_buffer, f32_rope_fn,
         threadgroup_size, 1, 1,
-        num_qk_heads / num_simdgroups, num_tokens, 1,
+        num_qk_pairs / threadgroup_size, num_tokens, 1,
+        sizeof(args), &args,
+        3,
+        (const struct gptoss_metal_buffer *[]) {activations_buffer, rope_table_buffer, control_buffer},
+        (const size_t[]) {activations_offset, rope_table_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_rope_kv_scatter(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_rope_kv_scatter_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* activations_buffer,
+    size_t activations_offset,
+    const struct gptoss_metal_buffer* kv_buffer,
+    size_t kv_offset,
+    const struct gptoss_metal_buffer* rope_table_buffer,
+    size_t rope_table_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t attn_head_dim,
+    uint32_t token_offset,
+    uint32_t max_tokens)
+{
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_rope_kv_scatter_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_rope_kv_scatter kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = f32_rope_kv_scatter_fn->simdgroup_threads;
+    } else if (threadgroup_size > f32_rope_kv_scatter_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_rope_kv_scatter kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_rope_kv_scatter_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (attn_head_dim % 2 != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_rope_kv_scatter kernel launch: attention head dimension (%" PRIu32 ") must be even",
+            attn_head_dim);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (token_offset + num_tokens > max_tokens) {
+        GPTOSS_LOG_ERROR("failed to encode f32_rope_kv_scatter kernel launch: tokens [%" PRIu32 ", %" PRIu32 ") exceed the KV cache capacity (%" PRIu32 ")",
+            token_offset, token_offset + num_tokens, max_tokens);
+        return gptoss_status_invalid_argument;
+    }
+
+    const size_t num_qkv_pairs = (size_t) (num_q_heads + 2 * num_kv_heads) * (attn_head_dim / 2);
+    if (num_qkv_pairs % threadgroup_size != 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_rope_kv_scatter kernel launch: number of head element pairs (%zu) is not divisible by threadgroup size (%zu)",
+            num_qkv_pairs, threadgroup_size);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_rope_kv_scatter_args args = {
+        .token_offset = token_offset,
+        .max_tokens = max_tokens,
+        .head_dim = attn_head_dim,
+        .num_q_heads = num_q_heads,
+        .num_kv_heads = num_kv_heads,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_rope_kv_scatter_fn,
+        threadgroup_size, 1, 1,
+        num_qkv_pairs / threadgroup_size, num_tokens, 1,
         sizeof(args), &args,
-        2,
-        (const struct gptoss_metal_buffer *[]) {activations_buffer, control_buffer},
-        (const size_t[]) {activations_offset, control_offset},
+        4,
+        (const struct gptoss_metal_buffer *[]) {activations_buffer, kv_buffer, rope_table_buffer, control_buffer},
+        (const size_t[]) {activations_offset, kv_offset, rope_table_offset, control_offset},
         /*threadgroup_buffer_size=*/0);
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_accumulate_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -953,7 +1329,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
     uint32_t num_tokens,
     uint32_t num_experts)
 {
-    if (command_buffer->object == NULL || f32_accumulate_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_accumulate_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -975,6 +1351,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
         .num_vecs_per_expert = num_vecs_per_expert,
         .num_vecs_per_threadgroup = num_vecs_per_threadgroup,
         .num_vecs = num_vecs,
+        .num_active_experts = num_experts,
     };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
@@ -989,7 +1366,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_accumulate(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_topk_fn,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
@@ -1001,19 +1378,20 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk(
     uint32_t num_experts,
     uint32_t num_active_experts)
 {
-    if (command_buffer->object == NULL || f32_topk_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_topk_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
-    if (num_experts != 32  && num_experts != 128) {
+    if (num_active_experts == 0 || num_active_experts > num_experts) {
+        GPTOSS_LOG_ERROR("failed to encode f32_topk kernel launch: number of active experts (%" PRIu32 ") must be in [1, %" PRIu32 "]",
+            num_active_experts, num_experts);
         return gptoss_status_invalid_argument;
     }
 
-    if (num_active_experts != 4) {
-        return gptoss_status_invalid_argument;
-    }
-
-    const struct gptoss_topk_args args = { 0 };
+    const struct gptoss_topk_args args = {
+        .num_experts = num_experts,
+        .num_active_experts = num_active_experts,
+    };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
         command_buffer, f32_topk_fn,
@@ -1026,8 +1404,37 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_topk(
         /*threadgroup_buffer_size=*/0);
 }
 
+static enum gptoss_status _gptoss_metal_validate_sdpa_heads(
+    const char* kernel_name,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t head_dim,
+    uint32_t threadgroup_qmul)
+{
+    if (num_kv_heads == 0 || num_q_heads % num_kv_heads != 0) {
+        GPTOSS_LOG_ERROR("failed to encode %s kernel launch: number of Q heads (%" PRIu32 ") must be a multiple of the number of KV heads (%" PRIu32 ")",
+            kernel_name, num_q_heads, num_kv_heads);
+        return gptoss_status_invalid_argument;
+    }
+
+    const uint32_t qmul = num_q_heads / num_kv_heads;
+    if (threadgroup_qmul == 0 || qmul % threadgroup_qmul != 0) {
+        GPTOSS_LOG_ERROR("failed to encode %s kernel launch: number of Q heads per threadgroup (%" PRIu32 ") must divide the number of Q heads per KV head (%" PRIu32 ")",
+            kernel_name, threadgroup_qmul, qmul);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (head_dim == 0 || head_dim > SDPA_MAX_HEAD_DIM) {
+        GPTOSS_LOG_ERROR("failed to encode %s kernel launch: attention head dimension (%" PRIu32 ") must be in [1, %u]",
+            kernel_name, head_dim, SDPA_MAX_HEAD_DIM);
+        return gptoss_status_invalid_argument;
+    }
+
+    return gptoss_status_success;
+}
+
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_sdpa_fn,
     const struct gptoss_metal_buffer* q_buffer,
     size_t q_offset,
@@ -1037,6 +1444,8 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
     size_t s_offset,
     const struct gptoss_metal_buffer* output_buffer,
     size_t output_offset,
+    const struct gptoss_metal_buffer* partial_buffer,
+    size_t partial_offset,
     const struct gptoss_metal_buffer* control_buffer,
     size_t control_offset,
     uint32_t window,
@@ -1045,48 +1454,168 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa(
     uint32_t num_kv_tokens,
     uint32_t num_q_heads,
     uint32_t num_kv_heads,
-    uint32_t head_dim)
+    uint32_t head_dim,
+    uint32_t threadgroup_qmul,
+    uint32_t num_kv_splits)
 {
-    if (command_buffer->object == NULL || f32_sdpa_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_sdpa_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
-    if (num_q_heads != num_kv_heads * 8) {
-        GPTOSS_LOG_ERROR("number of Q heads (%" PRIu32 ") must be 8 times the number of KV heads (%" PRIu32 ")",
-            num_q_heads, num_kv_heads);
-        return gptoss_status_invalid_argument;
+    enum gptoss_status status = _gptoss_metal_validate_sdpa_heads("f32_sdpa", num_q_heads, num_kv_heads, head_dim, threadgroup_qmul);
+    if (status != gptoss_status_success) {
+        return status;
     }
 
-    if (head_dim != 64) {
-        GPTOSS_LOG_ERROR("attention head dimension (%" PRIu32 ") must be 64", head_dim);
+    if (num_kv_splits == 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sdpa kernel launch: number of KV splits must be positive");
         return gptoss_status_invalid_argument;
     }
 
     const size_t max_context_tokens = math_min(num_q_tokens + num_kv_tokens + 1, window);
+    const size_t kv_split_size = math_ceil_div(max_context_tokens, num_kv_splits);
     const size_t threadgroup_size = math_min(f32_sdpa_fn->max_threadgroup_threads,
-        max_context_tokens * f32_sdpa_fn->simdgroup_threads);
+        kv_split_size * f32_sdpa_fn->simdgroup_threads);
     const size_t half_threadgroup_size = math_round_down_po2(threadgroup_size / 2, f32_sdpa_fn->simdgroup_threads);
+    const size_t head_elements_per_thread = math_ceil_div(head_dim, f32_sdpa_fn->simdgroup_threads);
 
     const struct gptoss_sdpa_args args = {
         .qkv_dim = head_dim * (num_q_heads + 2 * num_kv_heads),
+        .num_q_tokens = num_q_tokens,
         .num_kv_tokens = num_kv_tokens,
         .kv_stride = kv_stride,
         .window = window,
+        .num_kv_splits = num_kv_splits,
+        .kv_split_size = (uint32_t) kv_split_size,
+        .num_q_heads = num_q_heads,
+        .qmul = num_q_heads / num_kv_heads,
+        .head_dim = head_dim,
     };
 
     return gptoss_metal_command_buffer_encode_launch_kernel(
         command_buffer, f32_sdpa_fn,
         threadgroup_size, 1, 1,
-        num_q_tokens, num_kv_heads, 1,
+        num_q_tokens, num_q_heads / threadgroup_qmul, num_kv_splits,
+        sizeof(args), &args,
+        6,
+        (const struct gptoss_metal_buffer *[]) {q_buffer, kv_buffer, s_buffer, output_buffer, partial_buffer, control_buffer},
+        (const size_t[]) {q_offset, kv_offset, s_offset, output_offset, partial_offset, control_offset},
+        /*threadgroup_buffer_size=*/half_threadgroup_size * threadgroup_qmul * head_elements_per_thread * sizeof(float));
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa_prefill(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sdpa_prefill_fn,
+    const struct gptoss_metal_buffer* q_buffer,
+    size_t q_offset,
+    const struct gptoss_metal_buffer* kv_buffer,
+    size_t kv_offset,
+    const struct gptoss_metal_buffer* s_buffer,
+    size_t s_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t window,
+    uint32_t kv_stride,
+    uint32_t num_q_tokens,
+    uint32_t num_kv_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t head_dim,
+    uint32_t threadgroup_qmul)
+{
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_sdpa_prefill_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    enum gptoss_status status = _gptoss_metal_validate_sdpa_heads("f32_sdpa_prefill", num_q_heads, num_kv_heads, head_dim, threadgroup_qmul);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    const size_t threadgroup_size = SDPA_PREFILL_Bq * f32_sdpa_prefill_fn->simdgroup_threads;
+    if (threadgroup_size > f32_sdpa_prefill_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sdpa_prefill kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_sdpa_prefill_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    }
+
+    // Keep the KV tile at the size of SDPA_PREFILL_Bk tokens with 64-dimensional heads.
+    const uint32_t kv_tile_size = math_max(SDPA_PREFILL_Bk * 64 / math_max(head_dim, 64), 1);
+    const struct gptoss_sdpa_args args = {
+        .qkv_dim = head_dim * (num_q_heads + 2 * num_kv_heads),
+        .num_q_tokens = num_q_tokens,
+        .num_kv_tokens = num_kv_tokens,
+        .kv_stride = kv_stride,
+        .window = window,
+        .num_kv_splits = 1,
+        .kv_split_size = 0,
+        .kv_tile_size = kv_tile_size,
+        .num_q_heads = num_q_heads,
+        .qmul = num_q_heads / num_kv_heads,
+        .head_dim = head_dim,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_sdpa_prefill_fn,
+        threadgroup_size, 1, 1,
+        math_ceil_div(num_q_tokens, SDPA_PREFILL_Bq), num_q_heads / threadgroup_qmul, 1,
         sizeof(args), &args,
         5,
         (const struct gptoss_metal_buffer *[]) {q_buffer, kv_buffer, s_buffer, output_buffer, control_buffer},
         (const size_t[]) {q_offset, kv_offset, s_offset, output_offset, control_offset},
-        /*threadgroup_buffer_size=*/half_threadgroup_size * 8 * 4 * sizeof(float));
+        /*threadgroup_buffer_size=*/kv_tile_size * 2 * head_dim * sizeof(float));
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sdpa_reduce(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sdpa_reduce_fn,
+    const struct gptoss_metal_buffer* partial_buffer,
+    size_t partial_offset,
+    const struct gptoss_metal_buffer* output_buffer,
+    size_t output_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_q_tokens,
+    uint32_t num_q_heads,
+    uint32_t num_kv_heads,
+    uint32_t head_dim,
+    uint32_t threadgroup_qmul,
+    uint32_t num_kv_splits)
+{
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_sdpa_reduce_fn->pipeline_state_object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    enum gptoss_status status = _gptoss_metal_validate_sdpa_heads("f32_sdpa_reduce", num_q_heads, num_kv_heads, head_dim, threadgroup_qmul);
+    if (status != gptoss_status_success) {
+        return status;
+    }
+
+    if (num_kv_splits == 0) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sdpa_reduce kernel launch: number of KV splits must be positive");
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_sdpa_reduce_args args = {
+        .num_kv_splits = num_kv_splits,
+        .head_dim = head_dim,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_sdpa_reduce_fn,
+        f32_sdpa_reduce_fn->simdgroup_threads, 1, 1,
+        num_q_tokens, num_q_heads / threadgroup_qmul, 1,
+        sizeof(args), &args,
+        3,
+        (const struct gptoss_metal_buffer *[]) {partial_buffer, output_buffer, control_buffer},
+        (const size_t[]) {partial_offset, output_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_softmax(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_softmax_fn,
     size_t threadgroup_size,
     size_t max_threadgroups,
@@ -1108,7 +1637,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_softmax(
 {
     *num_threadgroups_out = 0;
     *num_channels_per_threadgroup_out = 0;
-    if (command_buffer->object == NULL || f32_softmax_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_softmax_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -1136,7 +1665,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_softmax(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* f32_sample_fn,
     size_t min_threadgroup_size,
     const struct gptoss_metal_buffer* prob_buffer,
@@ -1153,7 +1682,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample(
     uint32_t num_channels,
     uint32_t num_channels_per_block)
 {
-    if (command_buffer->object == NULL || f32_sample_fn->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_sample_fn->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
@@ -1189,3 +1718,159 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample(
         (const size_t[]) {prob_offset, sum_offset, token_offset, control_offset},
         /*threadgroup_buffer_size=*/0);
 }
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample_filter(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sample_filter_fn,
+    size_t threadgroup_size,
+    size_t max_threadgroups,
+    const struct gptoss_metal_buffer* score_buffer,
+    size_t score_offset,
+    const struct gptoss_metal_buffer* argmax_buffer,
+    size_t argmax_offset,
+    const struct gptoss_metal_buffer* candidate_buffer,
+    size_t candidate_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint64_t rng_seed,
+    uint32_t rng_offset,
+    uint32_t num_channels,
+    float temperature,
+    uint32_t top_k,
+    float min_p,
+    uint32_t* num_candidates_out)
+{
+    *num_candidates_out = 0;
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_sample_filter_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sample_filter kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = f32_sample_filter_fn->max_threadgroup_threads;
+    } else if (threadgroup_size > f32_sample_filter_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sample_filter kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_sample_filter_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (!(temperature > 0.0f)) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sample_filter kernel launch: invalid temperature %f", temperature);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (!(min_p >= 0.0f && min_p <= 1.0f)) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sample_filter kernel launch: invalid min-p %f", min_p);
+        return gptoss_status_invalid_argument;
+    }
+
+    const size_t num_scores_per_threadgroup = math_ceil_div(num_channels, max_threadgroups);
+    const size_t num_threadgroups = math_ceil_div(num_channels, num_scores_per_threadgroup);
+    const uint32_t num_candidates_per_threadgroup = top_k != 0 ? top_k : 1;
+    const struct gptoss_sample_filter_args args = {
+        .rng_seed = rng_seed,
+        .rng_offset = rng_offset,
+        .num_scores = num_channels,
+        .num_scores_per_threadgroup = num_scores_per_threadgroup,
+        .num_candidates_per_threadgroup = num_candidates_per_threadgroup,
+        .top_k = top_k,
+        // p >= min_p * p_max is equivalent to score >= max_score + temperature * log(min_p).
+        .min_score_offset = min_p != 0.0f ? temperature * logf(min_p) : -INFINITY,
+        .inv_temperature = 1.0f / temperature,
+    };
+
+    *num_candidates_out = num_threadgroups * num_candidates_per_threadgroup;
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_sample_filter_fn,
+        threadgroup_size, 1, 1,
+        num_threadgroups, 1, 1,
+        sizeof(args), &args,
+        4,
+        (const struct gptoss_metal_buffer *[]) {score_buffer, argmax_buffer, candidate_buffer, control_buffer},
+        (const size_t[]) {score_offset, argmax_offset, candidate_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_f32_sample_candidates(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* f32_sample_candidates_fn,
+    size_t threadgroup_size,
+    const struct gptoss_metal_buffer* candidate_buffer,
+    size_t candidate_offset,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint64_t rng_seed,
+    uint32_t rng_offset,
+    uint32_t num_candidates,
+    float temperature,
+    uint32_t top_k)
+{
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || f32_sample_candidates_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sample_candidates kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    if (threadgroup_size == 0) {
+        threadgroup_size = f32_sample_candidates_fn->max_threadgroup_threads;
+    } else if (threadgroup_size > f32_sample_candidates_fn->max_threadgroup_threads) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sample_candidates kernel launch: threadgroup size (%zu) exceeds supported maximum (%zu)",
+            threadgroup_size, f32_sample_candidates_fn->max_threadgroup_threads);
+        return gptoss_status_invalid_argument;
+    }
+
+    if (!(temperature > 0.0f)) {
+        GPTOSS_LOG_ERROR("failed to encode f32_sample_candidates kernel launch: invalid temperature %f", temperature);
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_sample_candidates_args args = {
+        .rng_seed = rng_seed,
+        .rng_offset = rng_offset,
+        .num_candidates = num_candidates,
+        .top_k = top_k,
+        .inv_temperature = 1.0f / temperature,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, f32_sample_candidates_fn,
+        threadgroup_size, 1, 1,
+        1, 1, 1,
+        sizeof(args), &args,
+        3,
+        (const struct gptoss_metal_buffer *[]) {candidate_buffer, token_buffer, control_buffer},
+        (const size_t[]) {candidate_offset, token_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
+
+enum gptoss_status gptoss_metal_command_buffer_encode_launch_check_stop_token(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_function* check_stop_token_fn,
+    const struct gptoss_metal_buffer* token_buffer,
+    size_t token_offset,
+    const struct gptoss_metal_buffer* stop_token_mask_buffer,
+    size_t stop_token_mask_offset,
+    const struct gptoss_metal_buffer* control_buffer,
+    size_t control_offset,
+    uint32_t num_vocabulary_tokens)
+{
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || check_stop_token_fn->pipeline_state_object == NULL) {
+        GPTOSS_LOG_ERROR("failed to encode check_stop_token kernel launch: invalid command buffer or pipeline state object");
+        return gptoss_status_invalid_state;
+    }
+
+    const struct gptoss_check_stop_token_args args = {
+        .num_vocabulary_tokens = num_vocabulary_tokens,
+    };
+
+    return gptoss_metal_command_buffer_encode_launch_kernel(
+        command_buffer, check_stop_token_fn,
+        1, 1, 1,
+        1, 1, 1,
+        sizeof(args), &args,
+        3,
+        (const struct gptoss_metal_buffer *[]) {token_buffer, stop_token_mask_buffer, control_buffer},
+        (const size_t[]) {token_offset, stop_token_mask_offset, control_offset},
+        /*threadgroup_buffer_size=*/0);
+}
@@ -321,6 +321,131 @@ enum gptoss_status gptoss_metal_command_queue_release(
     return gptoss_status_success;
 }
 
+static bool gptoss_metal_command_list_grow(
+    void** array,
+    size_t* capacity,
+    size_t required_capacity,
+    size_t element_size)
+{
+    if (required_capacity <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity != 0 ? *capacity * 2 : 64;
+    while (new_capacity < required_capacity) {
+        new_capacity *= 2;
+    }
+    void* new_array = realloc(*array, new_capacity * element_size);
+    if (new_array == NULL) {
+        return false;
+    }
+    *array = new_array;
+    *capacity = new_capacity;
+    return true;
+}
+
+// Appends a command with params_size bytes of parameters and num_buffers buffers to the command list, and returns it
+// with its parameters and buffers allocated, or NULL if out of memory.
+static struct gptoss_metal_command* gptoss_metal_command_list_append(
+    struct gptoss_metal_command_list* command_list,
+    enum gptoss_metal_command_type type,
+    size_t params_size,
+    size_t num_buffers)
+{
+    // Align parameters so that they can be accessed in place as kernel argument structures.
+    const size_t params_offset = (command_list->params_size + 15) & ~(size_t) 15;
+    const size_t buffers_capacity = command_list->buffers_capacity;
+    if (!gptoss_metal_command_list_grow((void**) &command_list->commands, &command_list->commands_capacity,
+            command_list->num_commands + 1, sizeof(struct gptoss_metal_command)) ||
+        !gptoss_metal_command_list_grow((void**) &command_list->params, &command_list->params_capacity,
+            params_offset + params_size, sizeof(char)) ||
+        !gptoss_metal_command_list_grow((void**) &command_list->buffers, &command_list->buffers_capacity,
+            command_list->num_buffers + num_buffers, sizeof(const struct gptoss_metal_buffer*)))
+    {
+        GPTOSS_LOG_ERROR("failed to grow command list to %zu commands", command_list->num_commands + 1);
+        return NULL;
+    }
+    if (command_list->buffers_capacity != buffers_capacity) {
+        // buffer_offsets always has the same capacity as buffers.
+        size_t* buffer_offsets = realloc(command_list->buffer_offsets, command_list->buffers_capacity * sizeof(size_t));
+        if (buffer_offsets == NULL) {
+            GPTOSS_LOG_ERROR("failed to grow command list to %zu buffers", command_list->num_buffers + num_buffers);
+            command_list->buffers_capacity = buffers_capacity;
+            return NULL;
+        }
+        command_list->buffer_offsets = buffer_offsets;
+    }
+
+    struct gptoss_metal_command* command = &command_list->commands[command_list->num_commands++];
+    memset(command, 0, sizeof(struct gptoss_metal_command));
+    command->type = type;
+    command->params_offset = params_offset;
+    command->params_size = params_size;
+    command->buffers_offset = command_list->num_buffers;
+    command->num_buffers = num_buffers;
+    command_list->params_size = params_offset + params_size;
+    command_list->num_buffers += num_buffers;
+    return command;
+}
+
+void gptoss_metal_command_list_clear(
+    struct gptoss_metal_command_list* command_list)
+{
+    command_list->num_commands = 0;
+    command_list->params_size = 0;
+    command_list->num_buffers = 0;
+}
+
+enum gptoss_status gptoss_metal_command_list_release(
+    struct gptoss_metal_command_list* command_list)
+{
+    free(command_list->commands);
+    free(command_list->params);
+    free(command_list->buffers);
+    free(command_list->buffer_offsets);
+    memset(command_list, 0, sizeof(struct gptoss_metal_command_list));
+    return gptoss_status_success;
+}
+
+// Returns the open compute command encoder of the command buffer, creating it if needed. Keeping one encoder across
+// launches avoids the cost of creating and ending an encoder for each of the hundreds of short kernels of a step.
+static id<MTLComputeCommandEncoder> gptoss_metal_command_buffer_get_compute_encoder(
+    struct gptoss_metal_command_buffer* command_buffer)
+{
+    if (command_buffer->compute_encoder == NULL) {
+        id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+        id<MTLComputeCommandEncoder> command_encoder_obj =
+            [command_buffer_obj computeCommandEncoderWithDispatchType:MTLDispatchTypeSerial];
+        if (command_encoder_obj == nil) {
+            return nil;
+        }
+        [command_encoder_obj retain];
+        command_buffer->compute_encoder = (void*) command_encoder_obj;
+    }
+    return (id<MTLComputeCommandEncoder>) command_buffer->compute_encoder;
+}
+
+// Ends the open compute command encoder of the command buffer, if any.
+static void gptoss_metal_command_buffer_end_compute_encoder(
+    struct gptoss_metal_command_buffer* command_buffer)
+{
+    if (command_buffer->compute_encoder != NULL) {
+        id<MTLComputeCommandEncoder> command_encoder_obj = (id<MTLComputeCommandEncoder>) command_buffer->compute_encoder;
+        [command_encoder_obj endEncoding];
+        [command_encoder_obj release];
+        command_buffer->compute_encoder = NULL;
+    }
+}
+
+enum gptoss_status gptoss_metal_command_buffer_create_recording(
+    struct gptoss_metal_command_list* command_list,
+    struct gptoss_metal_command_buffer* command_buffer_out)
+{
+    command_buffer_out->object = NULL;
+    command_buffer_out->compute_encoder = NULL;
+    command_buffer_out->command_list = command_list;
+    return gptoss_status_success;
+}
+
 enum gptoss_status gptoss_metal_command_buffer_create(
     const struct gptoss_metal_command_queue* command_queue,
     struct gptoss_metal_command_buffer* command_buffer_out)
@@ -333,26 +458,43 @@ enum gptoss_status gptoss_metal_command_buffer_create(
     }
     [command_buffer_obj retain];
     command_buffer_out->object = (void*) command_buffer_obj;
+    command_buffer_out->compute_encoder = NULL;
+    command_buffer_out->command_list = NULL;
     return gptoss_status_success;
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_fill_buffer(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_buffer* buffer,
     size_t offset,
     size_t size,
     uint8_t fill_value)
 {
-    if (command_buffer->object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer)) {
         return gptoss_status_invalid_state;
     }
     if (buffer->object == NULL) {
         return gptoss_status_invalid_argument;
     }
 
+    struct gptoss_metal_command_list* command_list = command_buffer->command_list;
+    if (command_list != NULL) {
+        struct gptoss_metal_command* command = gptoss_metal_command_list_append(
+            command_list, gptoss_metal_command_type_fill_buffer, /*params_size=*/0, /*num_buffers=*/1);
+        if (command == NULL) {
+            return gptoss_status_insufficient_memory;
+        }
+        command_list->buffers[command->buffers_offset] = buffer;
+        command_list->buffer_offsets[command->buffers_offset] = offset;
+        command->size = size;
+        command->fill_value = fill_value;
+        return gptoss_status_success;
+    }
+
     id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
     id<MTLBuffer> buffer_obj = (id<MTLBuffer>) buffer->object;
 
+    gptoss_metal_command_buffer_end_compute_encoder(command_buffer);
     id<MTLBlitCommandEncoder> command_encoder_obj = [command_buffer_obj blitCommandEncoder];
 
     const NSRange range = NSMakeRange((NSUInteger) offset, (NSUInteger) size);
@@ -363,14 +505,14 @@ enum gptoss_status gptoss_metal_command_buffer_encode_fill_buffer(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_copy_buffer(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_buffer* input_buffer,
     size_t input_offset,
     const struct gptoss_metal_buffer* output_buffer,
     size_t output_offset,
     size_t size)
 {
-    if (command_buffer->object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer)) {
         return gptoss_status_invalid_state;
     }
     if (input_buffer->object == NULL) {
@@ -380,10 +522,26 @@ enum gptoss_status gptoss_metal_command_buffer_encode_copy_buffer(
         return gptoss_status_invalid_argument;
     }
 
+    struct gptoss_metal_command_list* command_list = command_buffer->command_list;
+    if (command_list != NULL) {
+        struct gptoss_metal_command* command = gptoss_metal_command_list_append(
+            command_list, gptoss_metal_command_type_copy_buffer, /*params_size=*/0, /*num_buffers=*/2);
+        if (command == NULL) {
+            return gptoss_status_insufficient_memory;
+        }
+        command_list->buffers[command->buffers_offset + 0] = input_buffer;
+        command_list->buffer_offsets[command->buffers_offset + 0] = input_offset;
+        command_list->buffers[command->buffers_offset + 1] = output_buffer;
+        command_list->buffer_offsets[command->buffers_offset + 1] = output_offset;
+        command->size = size;
+        return gptoss_status_success;
+    }
+
     id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
     id<MTLBuffer> input_buffer_obj = (id<MTLBuffer>) input_buffer->object;
     id<MTLBuffer> output_buffer_obj = (id<MTLBuffer>) output_buffer->object;
 
+    gptoss_metal_command_buffer_end_compute_encoder(command_buffer);
     id<MTLBlitCommandEncoder> command_encoder_obj = [command_buffer_obj blitCommandEncoder];
 
     [command_encoder_obj copyFromBuffer:input_buffer_obj sourceOffset:(NSUInteger) input_offset
@@ -395,7 +553,7 @@ enum gptoss_status gptoss_metal_command_buffer_encode_copy_buffer(
 }
 
 enum gptoss_status gptoss_metal_command_buffer_encode_launch_kernel(
-    const struct gptoss_metal_command_buffer* command_buffer,
+    struct gptoss_metal_command_buffer* command_buffer,
     const struct gptoss_metal_function* function,
     size_t threadgroup_size_x,
     size_t threadgroup_size_y,
@@ -410,14 +568,41 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_kernel(
     const size_t* device_buffer_offsets,
     size_t threadgroup_buffer_size)
 {
-    if (command_buffer->object == NULL || function->pipeline_state_object == NULL) {
+    if (!gptoss_metal_command_buffer_is_valid(command_buffer) || function->pipeline_state_object == NULL) {
         return gptoss_status_invalid_state;
     }
 
-    id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+    struct gptoss_metal_command_list* command_list = command_buffer->command_list;
+    if (command_list != NULL) {
+        struct gptoss_metal_command* command = gptoss_metal_command_list_append(
+            command_list, gptoss_metal_command_type_launch_kernel, params_size, num_device_buffers);
+        if (command == NULL) {
+            return gptoss_status_insufficient_memory;
+        }
+        command->function = function;
+        command->threadgroup_size[0] = threadgroup_size_x;
+        command->threadgroup_size[1] = threadgroup_size_y;
+        command->threadgroup_size[2] = threadgroup_size_z;
+        command->num_threadgroups[0] = num_threadgroups_x;
+        command->num_threadgroups[1] = num_threadgroups_y;
+        command->num_threadgroups[2] = num_threadgroups_z;
+        command->threadgroup_buffer_size = threadgroup_buffer_size;
+        memcpy(command_list->params + command->params_offset, params, params_size);
+        for (size_t i = 0; i < num_device_buffers; i++) {
+            command_list->buffers[command->buffers_offset + i] = device_buffers[i];
+            command_list->buffer_offsets[command->buffers_offset + i] =
+                device_buffer_offsets == NULL ? 0 : device_buffer_offsets[i];
+        }
+        return gptoss_status_success;
+    }
+
     id<MTLComputePipelineState> pipeline_state_obj = (id<MTLComputePipelineState>) function->pipeline_state_object;
 
-    id<MTLComputeCommandEncoder> command_encoder_obj = [command_buffer_obj computeCommandEncoder];
+    id<MTLComputeCommandEncoder> command_encoder_obj = gptoss_metal_command_buffer_get_compute_encoder(command_buffer);
+    if (command_encoder_obj == nil) {
+        GPTOSS_LOG_ERROR("failed to create Metal compute command encoder");
+        return gptoss_status_unsupported_system;
+    }
 
     // Set kernel arguments
     [command_encoder_obj setComputePipelineState:pipeline_state_obj];
@@ -435,23 +620,84 @@ enum gptoss_status gptoss_metal_command_buffer_encode_launch_kernel(
     const MTLSize threadgroup_size = MTLSizeMake(threadgroup_size_x, threadgroup_size_y, threadgroup_size_z);
     const MTLSize num_threadgroups = MTLSizeMake(num_threadgroups_x, num_threadgroups_y, num_threadgroups_z);
     [command_encoder_obj dispatchThreadgroups:num_threadgroups threadsPerThreadgroup:threadgroup_size];
-    [command_encoder_obj endEncoding];
 
     return gptoss_status_success;
 }
 
+enum gptoss_status gptoss_metal_command_buffer_encode_command(
+    struct gptoss_metal_command_buffer* command_buffer,
+    const struct gptoss_metal_command_list* command_list,
+    size_t i)
+{
+    if (i >= command_list->num_commands) {
+        return gptoss_status_invalid_argument;
+    }
+
+    const struct gptoss_metal_command* command = &command_list->commands[i];
+    const struct gptoss_metal_buffer** buffers = command_list->buffers + command->buffers_offset;
+    const size_t* buffer_offsets = command_list->buffer_offsets + command->buffers_offset;
+    switch (command->type) {
+        case gptoss_metal_command_type_launch_kernel:
+            return gptoss_metal_command_buffer_encode_launch_kernel(
+                command_buffer, command->function,
+                command->threadgroup_size[0], command->threadgroup_size[1], command->threadgroup_size[2],
+                command->num_threadgroups[0], command->num_threadgroups[1], command->num_threadgroups[2],
+                command->params_size, command_list->params + command->params_offset,
+                command->num_buffers, buffers, buffer_offsets,
+                command->threadgroup_buffer_size);
+        case gptoss_metal_command_type_fill_buffer:
+            return gptoss_metal_command_buffer_encode_fill_buffer(
+                command_buffer, buffers[0], buffer_offsets[0], command->size, command->fill_value);
+        case gptoss_metal_command_type_copy_buffer:
+            return gptoss_metal_command_buffer_encode_copy_buffer(
+                command_buffer, buffers[0], buffer_offsets[0], buffers[1], buffer_offsets[1], command->size);
+    }
+    return gptoss_status_invalid_argument;
+}
+
+enum gptoss_status gptoss_metal_command_buffer_add_completion_handler(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    void (*handler)(void* user_data),
+    void* user_data)
+{
+    if (command_buffer->object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+    [command_buffer_obj addCompletedHandler:^(id<MTLCommandBuffer> _Nonnull completed_command_buffer) {
+        handler(user_data);
+    }];
+    return gptoss_status_success;
+}
+
 enum gptoss_status gptoss_metal_command_buffer_commit(
-    const struct gptoss_metal_command_buffer* command_buffer)
+    struct gptoss_metal_command_buffer* command_buffer)
 {
     if (command_buffer->object == NULL) {
         return gptoss_status_invalid_state;
     }
 
+    gptoss_metal_command_buffer_end_compute_encoder(command_buffer);
     id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
     [command_buffer_obj commit];
     return gptoss_status_success;
 }
 
+enum gptoss_status gptoss_metal_command_buffer_is_completed(
+    const struct gptoss_metal_command_buffer* command_buffer,
+    bool* completed_out)
+{
+    if (command_buffer->object == NULL) {
+        return gptoss_status_invalid_state;
+    }
+
+    id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
+    // Completed and Error are the terminal states of a committed command buffer.
+    *completed_out = [command_buffer_obj status] >= MTLCommandBufferStatusCompleted;
+    return gptoss_status_success;
+}
+
 enum gptoss_status gptoss_metal_command_buffer_wait_completion(
     const struct gptoss_metal_command_buffer* command_buffer,
     double* elapsed_seconds)
@@ -473,6 +719,7 @@ enum gptoss_status gptoss_metal_command_buffer_wait_completion(
 enum gptoss_status gptoss_metal_command_buffer_release(
     struct gptoss_metal_command_buffer* command_buffer)
 {
+    gptoss_metal_command_buffer_end_compute_encoder(command_buffer);
     if (command_buffer->object != NULL) {
         id<MTLCommandBuffer> command_buffer_obj = (id<MTLCommandBuffer>) command_buffer->object;
         [command_buffer_obj release];
@@ -1,7 +1,9 @@
 #include <assert.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -16,6 +18,7 @@
 #include <gpt-oss.h>
 
 #include "internal/datatype.h"
+#include "internal/grammar.h"
 #include "internal/kernel-args.h"  // gptoss_expert_prediction
 #include "internal/log.h"
 #include "internal/uuid.h"
@@ -24,6 +27,20 @@
 #include "internal/model.h"
 
 
+// (experts, active experts) shapes with a specialized gptoss_f32_topk_softmax_e<experts>_k<active experts> kernel.
+static const struct {
+    uint32_t num_experts;
+    uint32_t num_active_experts;
+} topk_softmax_specializations[] = {
+    {16, 4},
+    {32, 4},
+    {64, 4},
+    {64, 8},
+    {128, 4},
+    {128, 8},
+    {256, 8},
+};
+
 static size_t round_up_to_page_size(size_t bytes) {
     const size_t page_size_mask = (size_t) vm_page_size - 1;
     if ((bytes & page_size_mask) != 0) {
@@ -195,6 +212,40 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
 
     model->max_batch_tokens = max_batch_tokens == 0 ? GPTOSS_DEFAULT_BATCH_SIZE : max_batch_tokens;
 
+    if (model->num_active_experts == 0 || model->num_active_experts > model->num_experts) {
+        GPTOSS_LOG_ERROR("unsupported MoE configuration: %" PRIu32 " active experts out of %" PRIu32,
+            model->num_active_experts, model->num_experts);
+        status = gptoss_status_unsupported_argument;
+        goto cleanup;
+    }
+    if (model->num_kv_heads == 0 || model->num_heads % model->num_kv_heads != 0) {
+        GPTOSS_LOG_ERROR("unsupported attention configuration: %" PRIu32 " Q heads, %" PRIu32 " KV heads",
+            model->num_heads, model->num_kv_heads);
+        status = gptoss_status_unsupported_argument;
+        goto cleanup;
+    }
+    if (model->head_dim == 0 || model->head_dim % 2 != 0 || model->head_dim > SDPA_MAX_HEAD_DIM) {
+        GPTOSS_LOG_ERROR("unsupported attention head dimension %" PRIu32, model->head_dim);
+        status = gptoss_status_unsupported_argument;
+        goto cleanup;
+    }
+
+    // YaRN inverse frequencies, mixed between extrapolation and interpolation once per model.
+    const size_t rope_inv_freq_size = (model->head_dim / 2) * sizeof(double);
+    model->rope_inv_freq = malloc(rope_inv_freq_size);
+    if (model->rope_inv_freq == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for RoPE frequency table", rope_inv_freq_size);
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+    const double freq_scale = -log((double) model->rope_theta) / (double) (model->head_dim / 2);
+    for (uint32_t i = 0; i < model->head_dim / 2; i++) {
+        const double inv_extrapolation_freq = exp((double) i * freq_scale);
+        const double inv_interpolation_freq = inv_extrapolation_freq * (double) model->interpolation_scale;
+        const double alpha = fmin(fmax(fma((double) i, (double) model->yarn_scale, (double) model->yarn_offset), 0.0), 1.0);
+        model->rope_inv_freq[i] = inv_extrapolation_freq + (inv_interpolation_freq - inv_extrapolation_freq) * alpha;
+    }
+
     struct gptoss_uuid tokenizer_uuid;
     status = read_fd(fd, &tokenizer_uuid, sizeof(tokenizer_uuid), path);
     if (status != gptoss_status_success) {
@@ -265,6 +316,11 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
 
     prefetch_fd(fd, tokenizer_mapping_start, tokenizer_mapping_size, path);
 
+    status = gptoss_tokenizer_build_trie(tokenizer);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
     struct stat model_stat = {0};
     int stat_result = fstat(fd, &model_stat);
     if (stat_result != 0) {
@@ -341,14 +397,25 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_bf16w_unembedding", &model->f32_bf16w_unembedding_fn);
+    status = gptoss_metal_function_create(&model->library, "gptoss_f32_bf16w_rmsnorm_unembedding", &model->f32_bf16w_rmsnorm_unembedding_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
+    // The fused final RMSNorm keeps the normalized activations of a token in threadgroup memory.
+    if (model->f32_bf16w_rmsnorm_unembedding_fn.static_threadgroup_memory + model->embedding_dim * sizeof(float) > model->device.max_threadgroup_memory) {
+        GPTOSS_LOG_ERROR("unsupported embedding dimension %" PRIu32 ": normalized activations exceed %zu bytes of threadgroup memory",
+            model->embedding_dim, model->device.max_threadgroup_memory);
+        status = gptoss_status_unsupported_argument;
+        goto cleanup;
+    }
     status = gptoss_metal_function_create(&model->library, "gptoss_f32_rope", &model->f32_rope_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
+    status = gptoss_metal_function_create(&model->library, "gptoss_f32_rope_kv_scatter", &model->f32_rope_kv_scatter_fn);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
     status = gptoss_metal_function_create(&model->library, "gptoss_f32_mf4w_moe_matmul_swiglu", &model->f32_mf4w_moe_matmul_swiglu_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
@@ -357,27 +424,92 @@ enum gptoss_status GPTOSS_ABI gptoss_model_create_from_file(
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_accumulate_e4", &model->f32_accumulate_e4_fn);
+    status = gptoss_metal_function_create(&model->library, "gptoss_expert_group", &model->expert_group_fn);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_metal_function_create(&model->library, "gptoss_f32_mf4w_moe_grouped_matmul_swiglu", &model->f32_mf4w_moe_grouped_matmul_swiglu_fn);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    status = gptoss_metal_function_create(&model->library, "gptoss_f32_mf4w_moe_grouped_matmul", &model->f32_mf4w_moe_grouped_matmul_fn);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+
+    // Router kernels are specialized for common (experts, active experts) shapes; other shapes use the generic ones.
+    char router_fn_name[64] = "gptoss_f32_accumulate";
+    switch (model->num_active_experts) {
+        case 2:
+        case 4:
+        case 8:
+            snprintf(router_fn_name, sizeof(router_fn_name), "gptoss_f32_accumulate_e%" PRIu32, model->num_active_experts);
+            break;
+    }
+    status = gptoss_metal_function_create(&model->library, router_fn_name, &model->f32_accumulate_fn);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    strcpy(router_fn_name, "gptoss_f32_topk_softmax");
+    for (size_t i = 0; i < sizeof(topk_softmax_specializations) / sizeof(topk_softmax_specializations[0]); i++) {
+        if (topk_softmax_specializations[i].num_experts == model->num_experts &&
+            topk_softmax_specializations[i].num_active_experts == model->num_active_experts)
+        {
+            snprintf(router_fn_name, sizeof(router_fn_name), "gptoss_f32_topk_softmax_e%" PRIu32 "_k%" PRIu32,
+                model->num_experts, model->num_active_experts);
+            break;
+        }
+    }
+    status = gptoss_metal_function_create(&model->library, router_fn_name, &model->f32_topk_softmax_fn);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    // Self-speculative drafts may use fewer active experts than the model.
+    status = gptoss_metal_function_create(&model->library, "gptoss_f32_accumulate", &model->f32_accumulate_generic_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_topk_softmax_e32_k4", &model->f32_topk_softmax_e32_k4_fn);
+    status = gptoss_metal_function_create(&model->library, "gptoss_f32_topk_softmax", &model->f32_topk_softmax_generic_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_topk_softmax_e128_k4", &model->f32_topk_softmax_e128_k4_fn);
+    status = gptoss_metal_function_create(&model->library, "gptoss_f32_sample_filter", &model->f32_sample_filter_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_softmax", &model->f32_softmax_fn);
+    status = gptoss_metal_function_create(&model->library, "gptoss_f32_sample_candidates", &model->f32_sample_candidates_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_sample", &model->f32_sample_fn);
+    status = gptoss_metal_function_create(&model->library, "gptoss_check_stop_token", &model->check_stop_token_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
-    status = gptoss_metal_function_create(&model->library, "gptoss_f32_sdpa_q8_d64", &model->f32_sdpa_q8_d64_fn);
+
+    // SDPA kernels are specialized for common head dimensions and process the largest power-of-2 number of Q heads
+    // (up to 8) that divides the number of Q heads per KV head. Other head dimensions use the generic kernels.
+    const uint32_t attn_qmul = model->num_heads / model->num_kv_heads;
+    char sdpa_suffix[16] = "generic";
+    model->sdpa_threadgroup_qmul = 1;
+    if (model->head_dim == 64 || model->head_dim == 128) {
+        while (model->sdpa_threadgroup_qmul < 8 && attn_qmul % (model->sdpa_threadgroup_qmul * 2) == 0) {
+            model->sdpa_threadgroup_qmul *= 2;
+        }
+        snprintf(sdpa_suffix, sizeof(sdpa_suffix), "q%" PRIu32 "_d%" PRIu32, model->sdpa_threadgroup_qmul, model->head_dim);
+    }
+    char sdpa_fn_name[64];
+    snprintf(sdpa_fn_name, sizeof(sdpa_fn_name), "gptoss_f32_sdpa_%s", sdpa_suffix);
+    status = gptoss_metal_function_create(&model->library, sdpa_fn_name, &model->f32_sdpa_fn);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    snprintf(sdpa_fn_name, sizeof(sdpa_fn_name), "gptoss_f32_sdpa_reduce_%s", sdpa_suffix);
+    status = gptoss_metal_function_create(&model->library, sdpa_fn_name, &model->f32_sdpa_reduce_fn);
+    if (status != gptoss_status_success) {
+        goto cleanup;
+    }
+    snprintf(sdpa_fn_name, sizeof(sdpa_fn_name), "gptoss_f32_sdpa_prefill_%s", sdpa_suffix);
+    status = gptoss_metal_function_create(&model->library, sdpa_fn_name, &model->f32_sdpa_prefill_fn);
     if (status != gptoss_status_success) {
         goto cleanup;
     }
@@ -522,21 +654,30 @@ enum gptoss_status GPTOSS_ABI gptoss_model_release(
             gptoss_metal_function_release(&model->f32_bf16w_dense_matmul_qkv_fn);
             gptoss_metal_function_release(&model->f32_bf16w_dense_matmul_attn_output_fn);
             gptoss_metal_function_release(&model->f32_bf16w_dense_matmul_mlp_gate_fn);
-            gptoss_metal_function_release(&model->f32_bf16w_unembedding_fn);
+            gptoss_metal_function_release(&model->f32_bf16w_rmsnorm_unembedding_fn);
             gptoss_metal_function_release(&model->f32_rope_fn);
+            gptoss_metal_function_release(&model->f32_rope_kv_scatter_fn);
             gptoss_metal_function_release(&model->f32_mf4w_moe_matmul_swiglu_fn);
             gptoss_metal_function_release(&model->f32_mf4w_moe_matmul_fn);
-            gptoss_metal_function_release(&model->f32_accumulate_e4_fn);
-            gptoss_metal_function_release(&model->f32_topk_softmax_e32_k4_fn);
-            gptoss_metal_function_release(&model->f32_topk_softmax_e128_k4_fn);
-            gptoss_metal_function_release(&model->f32_softmax_fn);
-            gptoss_metal_function_release(&model->f32_sample_fn);
-            gptoss_metal_function_release(&model->f32_sdpa_q8_d64_fn);
+            gptoss_metal_function_release(&model->expert_group_fn);
+            gptoss_metal_function_release(&model->f32_mf4w_moe_grouped_matmul_swiglu_fn);
+            gptoss_metal_function_release(&model->f32_mf4w_moe_grouped_matmul_fn);
+            gptoss_metal_function_release(&model->f32_accumulate_fn);
+            gptoss_metal_function_release(&model->f32_topk_softmax_fn);
+            gptoss_metal_function_release(&model->f32_accumulate_generic_fn);
+            gptoss_metal_function_release(&model->f32_topk_softmax_generic_fn);
+            gptoss_metal_function_release(&model->f32_sample_filter_fn);
+            gptoss_metal_function_release(&model->f32_sample_candidates_fn);
+            gptoss_metal_function_release(&model->check_stop_token_fn);
+            gptoss_metal_function_release(&model->f32_sdpa_fn);
+            gptoss_metal_function_release(&model->f32_sdpa_reduce_fn);
+            gptoss_metal_function_release(&model->f32_sdpa_prefill_fn);
             gptoss_metal_library_release(&model->library);
 
             gptoss_metal_command_queue_release(&model->command_queue);
             gptoss_metal_device_release(&model->device);
-            // Weight buffers
+
+            free(model->rope_inv_freq);
 
             if (model->mapping_ptr != NULL && model->mapping_size != 0) {
                 if (model->lock_memory) {
@@ -8,36 +8,69 @@
 
 
 // Each thread handles 2 head elements.
-// Each simdgroup handles one head (64 head elements).
+// Rotations come from the per-context table of (cos, sin) pairs, already scaled by the YaRN multiplier.
 
 kernel void gptoss_f32_rope(
     constant gptoss_rope_args& args [[ buffer(0) ]],
     device float2* activations [[ buffer(1) ]],
-    const device gptoss_control* control [[ buffer(2) ]],
+    const device float2* rope_table [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
     uint2 gid [[thread_position_in_grid]])
 {
-    const uint num_head_dims = 64;
     if (control->abort != 0) {
         return;
     }
 
-    const float dim_idx = static_cast<float>(gid.x % (num_head_dims / 2));
+    const uint num_head_pairs = args.head_dim / 2;
+    const uint dim_idx = gid.x % num_head_pairs;
     const uint token_idx = args.token_offset + gid.y;
     activations += gid.y * args.token_stride + gid.x;
 
     const float2 input_vals = *activations;
-    const float inv_extrapolation_freq = metal::precise::exp(dim_idx * args.freq_scale);
-    const float inv_interpolation_freq = inv_extrapolation_freq * args.interpolation_scale;
-    const float alpha = metal::saturate(metal::fma(dim_idx, args.yarn_scale, args.yarn_offset));
-    const float inv_freq = metal::mix(inv_extrapolation_freq, inv_interpolation_freq, alpha);
-
-    const float phi = static_cast<float>(token_idx) * inv_freq;
-    const float yarn_multiplier = args.yarn_multiplier;
-    float cosphi;
-    const float sinphi = metal::precise::sincos(phi, cosphi) * yarn_multiplier;
-    cosphi *= yarn_multiplier;
-
-    const float output_re = input_vals.x * cosphi - input_vals.y * sinphi;
-    const float output_im = input_vals.x * sinphi + input_vals.y * cosphi;
+    const float2 cos_sin = rope_table[token_idx * num_head_pairs + dim_idx];
+
+    const float output_re = input_vals.x * cos_sin.x - input_vals.y * cos_sin.y;
+    const float output_im = input_vals.x * cos_sin.y + input_vals.y * cos_sin.x;
     *activations = (float2) { output_re, output_im };
 }
+
+// Rotates Q and K of a batch of QKV activations rows for tokens [token_offset, token_offset + num_tokens) of one
+// sequence. Q stays in place, while rotated K and V are scattered to the sequence's KV cache.
+// Each thread handles 2 elements of one Q, K, or V head.
+
+kernel void gptoss_f32_rope_kv_scatter(
+    constant gptoss_rope_kv_scatter_args& args [[ buffer(0) ]],
+    device float2* activations [[ buffer(1) ]],
+    device float* kv [[ buffer(2) ]],
+    const device float2* rope_table [[ buffer(3) ]],
+    const device gptoss_control* control [[ buffer(4) ]],
+    uint2 gid [[thread_position_in_grid]])
+{
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint num_head_pairs = args.head_dim / 2;
+    const uint head_idx = gid.x / num_head_pairs;
+    const uint dim_idx = gid.x % num_head_pairs;
+    const uint token_idx = args.token_offset + gid.y;
+    activations += gid.y * (args.num_q_heads + 2 * args.num_kv_heads) * num_head_pairs + gid.x;
+
+    float2 vals = *activations;
+    if (head_idx < args.num_q_heads + args.num_kv_heads) {
+        const float2 cos_sin = rope_table[token_idx * num_head_pairs + dim_idx];
+        vals = (float2) {
+            vals.x * cos_sin.x - vals.y * cos_sin.y,
+            vals.x * cos_sin.y + vals.y * cos_sin.x,
+        };
+    }
+    if (head_idx < args.num_q_heads) {
+        *activations = vals;
+    } else if (head_idx < args.num_q_heads + args.num_kv_heads) {
+        const uint h = head_idx - args.num_q_heads;
+        reinterpret_cast<device float2*>(kv + (h * args.max_tokens + token_idx) * 2 * args.head_dim)[dim_idx] = vals;
+    } else {
+        const uint h = head_idx - args.num_q_heads - args.num_kv_heads;
+        reinterpret_cast<device float2*>(kv + (h * args.max_tokens + token_idx) * 2 * args.head_dim + args.head_dim)[dim_idx] = vals;
+    }
+}
@@ -207,3 +207,312 @@ kernel void gptoss_f32_sample(
         *prediction = sample_idx;
     }
 }
+
+// Maps a score to a key with the same ordering. Key 0 is reserved for scores excluded from sampling.
+inline static uint _gptoss_score_key(float score) {
+    const uint bits = as_type<uint>(score);
+    return bits ^ (static_cast<int>(bits) < 0 ? 0xFFFFFFFFu : 0x80000000u);
+}
+
+// Perturbs a score scaled by inv_temperature with Gumbel noise, such that the argmax of the perturbed scores is an
+// exact sample from their softmax. Uses the same noise as the Gumbel-max sampling in gptoss_f32_bf16w_rmsnorm_unembedding.
+inline static float _gptoss_gumbel_key(float score, uint index, float inv_temperature, ulong rng_seed, uint rng_offset) {
+    const uint word = rng_squares32((static_cast<ulong>(rng_offset) << 32) + index, rng_seed);
+    const float uniform = (static_cast<float>(word >> 8) + 0.5f) * 0x1.0p-24f;
+    return metal::fma(score, inv_temperature, -metal::precise::log(-metal::precise::log(uniform)));
+}
+
+struct _gptoss_threshold_score_keys {
+    const device float* score;
+    float threshold;
+
+    uint operator()(uint i) const {
+        const float score_val = score[i];
+        return score_val >= threshold && score_val != -INFINITY ? _gptoss_score_key(score_val) : 0;
+    }
+};
+
+struct _gptoss_candidate_keys {
+    const device uint2* candidates;
+
+    uint operator()(uint i) const {
+        const uint2 candidate = candidates[i];
+        return candidate.x != 0xFFFFFFFFu ? _gptoss_score_key(as_type<float>(candidate.y)) : 0;
+    }
+};
+
+// Finds the k-th largest of n keys with an 8-bit radix selection, i.e. in 4 passes over the keys regardless of k.
+// Returns the key and stores the number of strictly larger keys in num_greater. If fewer than k keys are non-zero,
+// returns 0. Must be called uniformly by all threads in the threadgroup.
+template <typename KeyFn>
+inline uint _gptoss_radix_select(
+    KeyFn key_fn,
+    uint n,
+    uint k,
+    threadgroup metal::atomic_uint* histogram,
+    threadgroup uint* scratch,
+    uint tid,
+    uint threadgroup_size,
+    thread uint& num_greater)
+{
+    uint prefix = 0;
+    uint prefix_mask = 0;
+    uint rank = k;
+    num_greater = 0;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        for (uint i = tid; i < 256; i += threadgroup_size) {
+            metal::atomic_store_explicit(&histogram[i], 0, metal::memory_order_relaxed);
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        for (uint i = tid; i < n; i += threadgroup_size) {
+            const uint key = key_fn(i);
+            if ((key & prefix_mask) == prefix) {
+                metal::atomic_fetch_add_explicit(&histogram[(key >> shift) & 0xFFu], 1, metal::memory_order_relaxed);
+            }
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        if (tid == 0) {
+            // Find the digit of the rank-th largest key among the keys that match the prefix.
+            uint digit = 255;
+            uint num_above = 0;
+            for (;; digit--) {
+                const uint count = metal::atomic_load_explicit(&histogram[digit], metal::memory_order_relaxed);
+                if (num_above + count >= rank || digit == 0) {
+                    break;
+                }
+                num_above += count;
+            }
+            scratch[0] = digit;
+            scratch[1] = num_above;
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        const uint digit = scratch[0];
+        const uint num_above = scratch[1];
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+        prefix |= digit << shift;
+        prefix_mask |= 0xFFu << shift;
+        rank -= num_above;
+        num_greater += num_above;
+    }
+    return prefix;
+}
+
+// Reduces (key, index) pairs to the index of the largest key, lowest index first among equal keys.
+// Must be called uniformly by all threads in the threadgroup.
+inline uint _gptoss_threadgroup_argmax(
+    float key,
+    uint index,
+    threadgroup uint2* buffer,
+    uint simdgroup_tid,
+    uint simdgroup_idx,
+    uint num_simdgroups)
+{
+    uint key_bits = as_type<uint>(key);
+    if (static_cast<int>(key_bits) >= 0) {
+        key_bits ^= 0x7FFFFFFFu;
+    }
+    key_bits = index != 0xFFFFFFFFu ? key_bits : 0xFFFFFFFFu;
+    uint key_bits_min = metal::simd_min(key_bits);
+    index = metal::simd_min(key_bits == key_bits_min ? index : 0xFFFFFFFFu);
+    if (metal::simd_is_first()) {
+        buffer[simdgroup_idx] = uint2(index, key_bits_min);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    uint2 simdgroup_argmax = uint2(0xFFFFFFFFu, 0xFFFFFFFFu);
+    if (simdgroup_tid < num_simdgroups) {
+        simdgroup_argmax = buffer[simdgroup_tid];
+    }
+    key_bits_min = metal::simd_min(simdgroup_argmax.y);
+    return metal::simd_min(simdgroup_argmax.y == key_bits_min ? simdgroup_argmax.x : 0xFFFFFFFFu);
+}
+
+// Stores the candidates with keys above kth_key, and as many candidates with key equal to kth_key as fit into k, to
+// candidates[0:k], and fills the remaining slots with empty candidates. Must be called uniformly by all threads in the
+// threadgroup.
+template <typename KeyFn>
+inline void _gptoss_store_top_candidates(
+    KeyFn key_fn,
+    const device float* score,
+    uint score_index_offset,
+    uint n,
+    uint k,
+    uint kth_key,
+    uint num_greater,
+    device uint2* candidates,
+    threadgroup metal::atomic_uint* counters,
+    uint tid,
+    uint threadgroup_size)
+{
+    if (tid < 2) {
+        metal::atomic_store_explicit(&counters[tid], 0, metal::memory_order_relaxed);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    const uint num_ties = k - num_greater;
+    for (uint i = tid; i < n; i += threadgroup_size) {
+        const uint key = key_fn(i);
+        if (key == 0 || key < kth_key) {
+            continue;
+        }
+        uint slot;
+        if (key > kth_key) {
+            slot = metal::atomic_fetch_add_explicit(&counters[0], 1, metal::memory_order_relaxed);
+        } else {
+            slot = metal::atomic_fetch_add_explicit(&counters[1], 1, metal::memory_order_relaxed);
+            if (slot >= num_ties) {
+                continue;
+            }
+            slot += num_greater;
+        }
+        candidates[slot] = uint2(score_index_offset + i, as_type<uint>(score[i]));
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    const uint num_stored = metal::atomic_load_explicit(&counters[0], metal::memory_order_relaxed) +
+        metal::min(metal::atomic_load_explicit(&counters[1], metal::memory_order_relaxed), num_ties);
+    for (uint i = num_stored + tid; i < k; i += threadgroup_size) {
+        candidates[i] = uint2(0xFFFFFFFFu, 0);
+    }
+}
+
+// Reduces the scores of 1 token to a small set of sampling candidates, stored as (token, score bits) pairs.
+// Scores below max_score + args.min_score_offset (i.e. probability below min_p times the top probability) and masked
+// (-inf) scores are excluded. With args.top_k != 0, each threadgroup stores the top_k largest remaining scores of its
+// range of the vocabulary, a superset of the global top-k. Otherwise, each threadgroup stores the Gumbel-max sample
+// among its remaining scores, as the global Gumbel-max sample is the largest of these.
+[[max_total_threads_per_threadgroup(1024)]]
+kernel void gptoss_f32_sample_filter(
+    constant gptoss_sample_filter_args& args [[ buffer(0) ]],
+    const device float* score [[ buffer(1) ]],
+    const device uint2* argmax [[ buffer(2) ]],
+    device uint2* candidates [[ buffer(3) ]],
+    const device gptoss_control* control [[ buffer(4) ]],
+    uint gid [[threadgroup_position_in_grid]],
+    uint tid [[thread_position_in_threadgroup]],
+    uint threadgroup_size [[threads_per_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    threadgroup metal::atomic_uint threadgroup_histogram[256];
+    threadgroup uint threadgroup_scratch[2];
+    threadgroup uint2 threadgroup_argmax[32];
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint score_start = metal::min(gid * args.num_scores_per_threadgroup, args.num_scores);
+    const uint num_scores = metal::min(args.num_scores - score_start, args.num_scores_per_threadgroup);
+    score += score_start;
+    candidates += gid * args.num_candidates_per_threadgroup;
+
+    uint max_bits = argmax->y;
+    if (static_cast<int>(max_bits) >= 0) {
+        max_bits ^= 0x7FFFFFFFu;
+    }
+    const float threshold = as_type<float>(max_bits) + args.min_score_offset;
+    const _gptoss_threshold_score_keys key_fn{score, threshold};
+
+    if (args.top_k != 0) {
+        uint num_greater;
+        const uint kth_key = _gptoss_radix_select(key_fn, num_scores, args.top_k,
+            threadgroup_histogram, threadgroup_scratch, tid, threadgroup_size, num_greater);
+        _gptoss_store_top_candidates(key_fn, score, score_start, num_scores, args.top_k, kth_key, num_greater,
+            candidates, threadgroup_histogram, tid, threadgroup_size);
+    } else {
+        float best_key = -INFINITY;
+        uint best_idx = 0xFFFFFFFFu;
+        for (uint i = tid; i < num_scores; i += threadgroup_size) {
+            const float score_val = score[i];
+            if (score_val >= threshold && score_val != -INFINITY) {
+                const float key = _gptoss_gumbel_key(score_val, score_start + i, args.inv_temperature, args.rng_seed, args.rng_offset);
+                if (best_idx == 0xFFFFFFFFu || key > best_key) {
+                    best_key = key;
+                    best_idx = i;
+                }
+            }
+        }
+        best_idx = _gptoss_threadgroup_argmax(best_key, best_idx, threadgroup_argmax, simdgroup_tid, simdgroup_idx, num_simdgroups);
+        if (tid == 0) {
+            *candidates = best_idx != 0xFFFFFFFFu ?
+                uint2(score_start + best_idx, as_type<uint>(score[best_idx])) : uint2(0xFFFFFFFFu, 0);
+        }
+    }
+}
+
+// Samples 1 token among the candidates from gptoss_f32_sample_filter: restricts them to the top_k largest scores (if
+// args.top_k != 0) and takes their Gumbel-max sample at temperature 1 / args.inv_temperature.
+[[max_total_threads_per_threadgroup(1024)]]
+kernel void gptoss_f32_sample_candidates(
+    constant gptoss_sample_candidates_args& args [[ buffer(0) ]],
+    const device uint2* candidates [[ buffer(1) ]],
+    device uint* prediction [[ buffer(2) ]],
+    const device gptoss_control* control [[ buffer(3) ]],
+    uint tid [[thread_position_in_threadgroup]],
+    uint threadgroup_size [[threads_per_threadgroup]],
+    uint simdgroup_tid [[thread_index_in_simdgroup]],
+    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
+    uint num_simdgroups [[simdgroups_per_threadgroup]])
+{
+    threadgroup metal::atomic_uint threadgroup_histogram[256];
+    threadgroup uint threadgroup_scratch[2];
+    threadgroup uint2 threadgroup_argmax[32];
+    if (control->abort != 0) {
+        return;
+    }
+
+    const _gptoss_candidate_keys key_fn{candidates};
+    uint kth_key = 1;
+    uint num_ties = 0xFFFFFFFFu;
+    if (args.top_k != 0) {
+        uint num_greater;
+        kth_key = _gptoss_radix_select(key_fn, args.num_candidates, args.top_k,
+            threadgroup_histogram, threadgroup_scratch, tid, threadgroup_size, num_greater);
+        num_ties = args.top_k - num_greater;
+        if (tid == 0) {
+            metal::atomic_store_explicit(&threadgroup_histogram[0], 0, metal::memory_order_relaxed);
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+    }
+
+    float best_key = -INFINITY;
+    uint best_idx = 0xFFFFFFFFu;
+    for (uint i = tid; i < args.num_candidates; i += threadgroup_size) {
+        const uint key = key_fn(i);
+        if (key == 0 || key < kth_key) {
+            continue;
+        }
+        if (key == kth_key && args.top_k != 0) {
+            if (metal::atomic_fetch_add_explicit(&threadgroup_histogram[0], 1, metal::memory_order_relaxed) >= num_ties) {
+                continue;
+            }
+        }
+        const uint2 candidate = candidates[i];
+        const float gumbel_key = _gptoss_gumbel_key(as_type<float>(candidate.y), candidate.x, args.inv_temperature, args.rng_seed, args.rng_offset);
+        if (best_idx == 0xFFFFFFFFu || gumbel_key > best_key || (gumbel_key == best_key && candidate.x < best_idx)) {
+            best_key = gumbel_key;
+            best_idx = candidate.x;
+        }
+    }
+    best_idx = _gptoss_threadgroup_argmax(best_key, best_idx, threadgroup_argmax, simdgroup_tid, simdgroup_idx, num_simdgroups);
+    if (tid == 0) {
+        *prediction = best_idx;
+    }
+}
+
+// Sets the abort flag if the sampled token is in the stop token mask, so that all subsequent kernels in the command
+// buffer, i.e. the remaining sampling steps, exit early.
+kernel void gptoss_check_stop_token(
+    constant gptoss_check_stop_token_args& args [[ buffer(0) ]],
+    const device uint* token [[ buffer(1) ]],
+    const device uint* stop_token_mask [[ buffer(2) ]],
+    device gptoss_control* control [[ buffer(3) ]])
+{
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint token_id = *token;
+    if (token_id < args.num_vocabulary_tokens && (stop_token_mask[token_id / 32] & (1u << (token_id % 32))) != 0) {
+        control->abort = 1;
+    }
+}
@@ -9,243 +9,139 @@
 #pragma METAL fp math_mode(safe)
 #pragma METAL fp contract(off)
 
-// Each threadgroup handles 8 Q heads / 1 KV head for 1 token
-
-kernel void gptoss_f32_sdpa_q8_d64(
-    constant gptoss_sdpa_args& args [[ buffer(0) ]],
-    const device float* q [[ buffer(1) ]],
-    const device float* kv [[ buffer(2) ]],
-    const device bfloat* s [[ buffer(3) ]],
-    device float* output [[ buffer(4) ]],
-    const device gptoss_control* control [[ buffer(6) ]],
-    threadgroup void* threadgroup_buffer [[ threadgroup(0) ]],
-    uint2 gid [[threadgroup_position_in_grid]],
-    uint2 tid [[thread_position_in_threadgroup]],
-    uint simdgroup_tid [[thread_index_in_simdgroup]],
-    uint simdgroup_idx [[simdgroup_index_in_threadgroup]],
-    uint num_simdgroups [[simdgroups_per_threadgroup]])
+// SDPA kernels are specialized for the head dimension (head_dim) and the number of Q heads handled by one
+// threadgroup (qmul). qmul must divide the number of Q heads that share a KV head (args.qmul), so all Q heads of a
+// threadgroup attend to the same KV head. Lane i of a simdgroup handles head elements i, i + 32, i + 64, ...
+// head_dim == 0 selects the generic variant, which takes the head dimension (up to SDPA_MAX_HEAD_DIM) from the
+// arguments.
+
+// Each threadgroup handles qmul Q heads for 1 token, and one of num_kv_splits consecutive chunks of the attended KV
+// range. With a single split the threadgroup writes the normalized output. Otherwise it writes its unnormalized
+// output with the running max and sum of exponents (partial softmax state) to the partial buffer, and
+// gptoss_f32_sdpa_reduce merges the partial states of all splits.
+
+template <uint head_dim, uint qmul>
+inline void _gptoss_f32_sdpa_impl(
+    constant gptoss_sdpa_args& args,
+    const device float* q,
+    const device float* kv,
+    const device bfloat* s,
+    device float* output,
+    device float* partial,
+    const device gptoss_control* control,
+    threadgroup float* threadgroup_buffer,
+    uint3 gid,
+    uint3 num_threadgroups,
+    uint tid,
+    uint simdgroup_tid,
+    uint simdgroup_idx,
+    uint num_simdgroups)
 {
-    const uint simdgroup_size = 32;
+    constexpr uint simdgroup_size = 32;
+    constexpr uint num_elements = (head_dim != 0 ? head_dim : SDPA_MAX_HEAD_DIM) / simdgroup_size;
     if (control->abort != 0) {
         return;
     }
 
-    const uint num_q_heads = 64;
-    const uint head_dim = 64;
-    const uint qmul = 8;
-
-    const uint token_stride = 2 * head_dim;
+    const uint hd = head_dim != 0 ? head_dim : args.head_dim;
+    const uint num_valid_elements = head_dim != 0 ? num_elements : (hd + simdgroup_size - 1) / simdgroup_size;
+    const uint token_stride = 2 * hd;
 
     const uint qt = gid.x;  // Q token index
-    const uint h = gid.y;   // KV head index
+    const uint qh = gid.y * qmul;  // First Q head index
+    const uint h = qh / args.qmul;  // KV head index
+    const uint split = gid.z;  // KV split index
 
-    q += qt * args.qkv_dim + h * (qmul * head_dim);
+    q += qt * args.qkv_dim + qh * hd;
     kv += h * args.kv_stride;
-    output += qt * (num_q_heads * head_dim) + h * (qmul * head_dim);
-
-    float m0 = static_cast<float>(s[h * qmul + 0]);
-    float m1 = static_cast<float>(s[h * qmul + 1]);
-    float m2 = static_cast<float>(s[h * qmul + 2]);
-    float m3 = static_cast<float>(s[h * qmul + 3]);
-    float m4 = static_cast<float>(s[h * qmul + 4]);
-    float m5 = static_cast<float>(s[h * qmul + 5]);
-    float m6 = static_cast<float>(s[h * qmul + 6]);
-    float m7 = static_cast<float>(s[h * qmul + 7]);
-
-    float l0 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l1 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l2 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l3 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l4 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l5 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l6 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-    float l7 = simdgroup_idx == 0 ? 1.0f : 0.0f;
-
-    float2 out0 = 0.0f;
-    float2 out1 = 0.0f;
-    float2 out2 = 0.0f;
-    float2 out3 = 0.0f;
-    float2 out4 = 0.0f;
-    float2 out5 = 0.0f;
-    float2 out6 = 0.0f;
-    float2 out7 = 0.0f;
-
-    float2 q0 = reinterpret_cast<const device float2*>(q + 0 * head_dim)[simdgroup_tid];
-    float2 q1 = reinterpret_cast<const device float2*>(q + 1 * head_dim)[simdgroup_tid];
-    float2 q2 = reinterpret_cast<const device float2*>(q + 2 * head_dim)[simdgroup_tid];
-    float2 q3 = reinterpret_cast<const device float2*>(q + 3 * head_dim)[simdgroup_tid];
-    float2 q4 = reinterpret_cast<const device float2*>(q + 4 * head_dim)[simdgroup_tid];
-    float2 q5 = reinterpret_cast<const device float2*>(q + 5 * head_dim)[simdgroup_tid];
-    float2 q6 = reinterpret_cast<const device float2*>(q + 6 * head_dim)[simdgroup_tid];
-    float2 q7 = reinterpret_cast<const device float2*>(q + 7 * head_dim)[simdgroup_tid];
-
-    const uint kt_end = qt + args.num_kv_tokens + 1;
-    const uint kt_start = metal::subsat(kt_end, args.window) + simdgroup_idx;
+    s += qh;
+
+    // The sink contributes exp(sink - m) to the denominator exactly once, in the first split.
+    const float l_init = simdgroup_idx == 0 && split == 0 ? 1.0f : 0.0f;
+    float qval[qmul][num_elements];
+    float out[qmul][num_elements];
+    float m[qmul];
+    float l[qmul];
+#pragma clang loop unroll(full)
+    for (uint i = 0; i < qmul; i++) {
+        m[i] = static_cast<float>(s[i]);
+        l[i] = l_init;
+#pragma clang loop unroll(full)
+        for (uint j = 0; j < num_elements; j++) {
+            const uint d = j * simdgroup_size + simdgroup_tid;
+            qval[i][j] = head_dim != 0 || d < hd ? q[i * hd + d] : 0.0f;
+            out[i][j] = 0.0f;
+        }
+    }
+
+    const uint kt_range_end = qt + args.num_kv_tokens + 1;
+    const uint kt_range_start = metal::subsat(kt_range_end, args.window);
+    const uint kt_end = metal::min(kt_range_start + (split + 1) * args.kv_split_size, kt_range_end);
+    const uint kt_start = kt_range_start + split * args.kv_split_size + simdgroup_idx;
     kv += token_stride * kt_start;
     for (uint kt = kt_start; kt < kt_end; kt += num_simdgroups) {
-        const float2 kval = reinterpret_cast<const device float2*>(kv)[simdgroup_tid];
-
-        float qk0 = metal::dot(q0, kval);
-        float qk1 = metal::dot(q1, kval);
-        float qk2 = metal::dot(q2, kval);
-        float qk3 = metal::dot(q3, kval);
-        float qk4 = metal::dot(q4, kval);
-        float qk5 = metal::dot(q5, kval);
-        float qk6 = metal::dot(q6, kval);
-        float qk7 = metal::dot(q7, kval);
-
-        qk0 = metal::simd_sum(qk0);
-        qk1 = metal::simd_sum(qk1);
-        qk2 = metal::simd_sum(qk2);
-        qk3 = metal::simd_sum(qk3);
-        qk4 = metal::simd_sum(qk4);
-        qk5 = metal::simd_sum(qk5);
-        qk6 = metal::simd_sum(qk6);
-        qk7 = metal::simd_sum(qk7);
-
-        const float new_m0 = metal::max(m0, qk0);
-        const float new_m1 = metal::max(m1, qk1);
-        const float new_m2 = metal::max(m2, qk2);
-        const float new_m3 = metal::max(m3, qk3);
-        const float new_m4 = metal::max(m4, qk4);
-        const float new_m5 = metal::max(m5, qk5);
-        const float new_m6 = metal::max(m6, qk6);
-        const float new_m7 = metal::max(m7, qk7);
-
-        const float alpha0 = metal::fast::exp(m0 - new_m0);
-        const float alpha1 = metal::fast::exp(m1 - new_m1);
-        const float alpha2 = metal::fast::exp(m2 - new_m2);
-        const float alpha3 = metal::fast::exp(m3 - new_m3);
-        const float alpha4 = metal::fast::exp(m4 - new_m4);
-        const float alpha5 = metal::fast::exp(m5 - new_m5);
-        const float alpha6 = metal::fast::exp(m6 - new_m6);
-        const float alpha7 = metal::fast::exp(m7 - new_m7);
-
-        qk0 = metal::fast::exp(qk0 - new_m0);
-        qk1 = metal::fast::exp(qk1 - new_m1);
-        qk2 = metal::fast::exp(qk2 - new_m2);
-        qk3 = metal::fast::exp(qk3 - new_m3);
-        qk4 = metal::fast::exp(qk4 - new_m4);
-        qk5 = metal::fast::exp(qk5 - new_m5);
-        qk6 = metal::fast::exp(qk6 - new_m6);
-        qk7 = metal::fast::exp(qk7 - new_m7);
-
-        l0 = metal::fma(l0, alpha0, qk0);
-        l1 = metal::fma(l1, alpha1, qk1);
-        l2 = metal::fma(l2, alpha2, qk2);
-        l3 = metal::fma(l3, alpha3, qk3);
-        l4 = metal::fma(l4, alpha4, qk4);
-        l5 = metal::fma(l5, alpha5, qk5);
-        l6 = metal::fma(l6, alpha6, qk6);
-        l7 = metal::fma(l7, alpha7, qk7);
-
-        m0 = new_m0;
-        m1 = new_m1;
-        m2 = new_m2;
-        m3 = new_m3;
-        m4 = new_m4;
-        m5 = new_m5;
-        m6 = new_m6;
-        m7 = new_m7;
-
-        const float2 vval = reinterpret_cast<const device float2*>(kv + head_dim)[simdgroup_tid];
+        float kval[num_elements];
+        float vval[num_elements];
+#pragma clang loop unroll(full)
+        for (uint j = 0; j < num_elements; j++) {
+            const uint d = j * simdgroup_size + simdgroup_tid;
+            kval[j] = head_dim != 0 || d < hd ? kv[d] : 0.0f;
+            vval[j] = head_dim != 0 || d < hd ? kv[hd + d] : 0.0f;
+        }
         kv += token_stride * num_simdgroups;
-        out0 = metal::fma(vval, qk0, out0 * alpha0);
-        out1 = metal::fma(vval, qk1, out1 * alpha1);
-        out2 = metal::fma(vval, qk2, out2 * alpha2);
-        out3 = metal::fma(vval, qk3, out3 * alpha3);
-        out4 = metal::fma(vval, qk4, out4 * alpha4);
-        out5 = metal::fma(vval, qk5, out5 * alpha5);
-        out6 = metal::fma(vval, qk6, out6 * alpha6);
-        out7 = metal::fma(vval, qk7, out7 * alpha7);
+
+#pragma clang loop unroll(full)
+        for (uint i = 0; i < qmul; i++) {
+            float qk = 0.0f;
+#pragma clang loop unroll(full)
+            for (uint j = 0; j < num_elements; j++) {
+                qk = metal::fma(qval[i][j], kval[j], qk);
+            }
+            qk = metal::simd_sum(qk);
+
+            const float new_m = metal::max(m[i], qk);
+            const float alpha = metal::fast::exp(m[i] - new_m);
+            const float p = metal::fast::exp(qk - new_m);
+            l[i] = metal::fma(l[i], alpha, p);
+#pragma clang loop unroll(full)
+            for (uint j = 0; j < num_elements; j++) {
+                out[i][j] = metal::fma(vval[j], p, out[i][j] * alpha);
+            }
+            m[i] = new_m;
+        }
     }
     if (num_simdgroups > 1) {
         if (metal::simd_is_first()) {
-            static_cast<threadgroup float*>(threadgroup_buffer)[0 * num_simdgroups + simdgroup_idx] = m0;
-            static_cast<threadgroup float*>(threadgroup_buffer)[1 * num_simdgroups + simdgroup_idx] = m1;
-            static_cast<threadgroup float*>(threadgroup_buffer)[2 * num_simdgroups + simdgroup_idx] = m2;
-            static_cast<threadgroup float*>(threadgroup_buffer)[3 * num_simdgroups + simdgroup_idx] = m3;
-            static_cast<threadgroup float*>(threadgroup_buffer)[4 * num_simdgroups + simdgroup_idx] = m4;
-            static_cast<threadgroup float*>(threadgroup_buffer)[5 * num_simdgroups + simdgroup_idx] = m5;
-            static_cast<threadgroup float*>(threadgroup_buffer)[6 * num_simdgroups + simdgroup_idx] = m6;
-            static_cast<threadgroup float*>(threadgroup_buffer)[7 * num_simdgroups + simdgroup_idx] = m7;
-
-            static_cast<threadgroup float*>(threadgroup_buffer)[ 8 * num_simdgroups + simdgroup_idx] = l0;
-            static_cast<threadgroup float*>(threadgroup_buffer)[ 9 * num_simdgroups + simdgroup_idx] = l1;
-            static_cast<threadgroup float*>(threadgroup_buffer)[10 * num_simdgroups + simdgroup_idx] = l2;
-            static_cast<threadgroup float*>(threadgroup_buffer)[11 * num_simdgroups + simdgroup_idx] = l3;
-            static_cast<threadgroup float*>(threadgroup_buffer)[12 * num_simdgroups + simdgroup_idx] = l4;
-            static_cast<threadgroup float*>(threadgroup_buffer)[13 * num_simdgroups + simdgroup_idx] = l5;
-            static_cast<threadgroup float*>(threadgroup_buffer)[14 * num_simdgroups + simdgroup_idx] = l6;
-            static_cast<threadgroup float*>(threadgroup_buffer)[15 * num_simdgroups + simdgroup_idx] = l7;
+#pragma clang loop unroll(full)
+            for (uint i = 0; i < qmul; i++) {
+                threadgroup_buffer[i * num_simdgroups + simdgroup_idx] = m[i];
+                threadgroup_buffer[(qmul + i) * num_simdgroups + simdgroup_idx] = l[i];
+            }
         }
         metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
-        // Note: simdgroup refers not to the thread's current simdgroup, but to one with simdgroup_idx == thread's simdgroup_tid.
-        float simdgroup_m0 = m0;
-        float simdgroup_m1 = m1;
-        float simdgroup_m2 = m2;
-        float simdgroup_m3 = m3;
-        float simdgroup_m4 = m4;
-        float simdgroup_m5 = m5;
-        float simdgroup_m6 = m6;
-        float simdgroup_m7 = m7;
-        if (simdgroup_tid < num_simdgroups) {
-            simdgroup_m0 = static_cast<const threadgroup float*>(threadgroup_buffer)[0 * num_simdgroups + simdgroup_tid];
-            simdgroup_m1 = static_cast<const threadgroup float*>(threadgroup_buffer)[1 * num_simdgroups + simdgroup_tid];
-            simdgroup_m2 = static_cast<const threadgroup float*>(threadgroup_buffer)[2 * num_simdgroups + simdgroup_tid];
-            simdgroup_m3 = static_cast<const threadgroup float*>(threadgroup_buffer)[3 * num_simdgroups + simdgroup_tid];
-            simdgroup_m4 = static_cast<const threadgroup float*>(threadgroup_buffer)[4 * num_simdgroups + simdgroup_tid];
-            simdgroup_m5 = static_cast<const threadgroup float*>(threadgroup_buffer)[5 * num_simdgroups + simdgroup_tid];
-            simdgroup_m6 = static_cast<const threadgroup float*>(threadgroup_buffer)[6 * num_simdgroups + simdgroup_tid];
-            simdgroup_m7 = static_cast<const threadgroup float*>(threadgroup_buffer)[7 * num_simdgroups + simdgroup_tid];
-        }
-
-        const float threadgroup_m0 = metal::simd_max(simdgroup_m0);
-        const float threadgroup_m1 = metal::simd_max(simdgroup_m1);
-        const float threadgroup_m2 = metal::simd_max(simdgroup_m2);
-        const float threadgroup_m3 = metal::simd_max(simdgroup_m3);
-        const float threadgroup_m4 = metal::simd_max(simdgroup_m4);
-        const float threadgroup_m5 = metal::simd_max(simdgroup_m5);
-        const float threadgroup_m6 = metal::simd_max(simdgroup_m6);
-        const float threadgroup_m7 = metal::simd_max(simdgroup_m7);
-
-        out0 *= metal::fast::exp(m0 - threadgroup_m0);
-        out1 *= metal::fast::exp(m1 - threadgroup_m1);
-        out2 *= metal::fast::exp(m2 - threadgroup_m2);
-        out3 *= metal::fast::exp(m3 - threadgroup_m3);
-        out4 *= metal::fast::exp(m4 - threadgroup_m4);
-        out5 *= metal::fast::exp(m5 - threadgroup_m5);
-        out6 *= metal::fast::exp(m6 - threadgroup_m6);
-        out7 *= metal::fast::exp(m7 - threadgroup_m7);
-
-        if (simdgroup_idx == 0) {
-            l0 = 0.0f;
-            l1 = 0.0f;
-            l2 = 0.0f;
-            l3 = 0.0f;
-            l4 = 0.0f;
-            l5 = 0.0f;
-            l6 = 0.0f;
-            l7 = 0.0f;
+#pragma clang loop unroll(full)
+        for (uint i = 0; i < qmul; i++) {
+            // Note: simdgroup refers not to the thread's current simdgroup, but to one with simdgroup_idx == thread's simdgroup_tid.
+            float simdgroup_m = m[i];
             if (simdgroup_tid < num_simdgroups) {
-                l0 = static_cast<const threadgroup float*>(threadgroup_buffer)[ 8 * num_simdgroups + simdgroup_tid];
-                l1 = static_cast<const threadgroup float*>(threadgroup_buffer)[ 9 * num_simdgroups + simdgroup_tid];
-                l2 = static_cast<const threadgroup float*>(threadgroup_buffer)[10 * num_simdgroups + simdgroup_tid];
-                l3 = static_cast<const threadgroup float*>(threadgroup_buffer)[11 * num_simdgroups + simdgroup_tid];
-                l4 = static_cast<const threadgroup float*>(threadgroup_buffer)[12 * num_simdgroups + simdgroup_tid];
-                l5 = static_cast<const threadgroup float*>(threadgroup_buffer)[13 * num_simdgroups + simdgroup_tid];
-                l6 = static_cast<const threadgroup float*>(threadgroup_buffer)[14 * num_simdgroups + simdgroup_tid];
-                l7 = static_cast<const threadgroup float*>(threadgroup_buffer)[15 * num_simdgroups + simdgroup_tid];
+                simdgroup_m = threadgroup_buffer[i * num_simdgroups + simdgroup_tid];
             }
+            const float threadgroup_m = metal::simd_max(simdgroup_m);
 
-            l0 = metal::simd_sum(l0 * metal::fast::exp(simdgroup_m0 - threadgroup_m0));
-            l1 = metal::simd_sum(l1 * metal::fast::exp(simdgroup_m1 - threadgroup_m1));
-            l2 = metal::simd_sum(l2 * metal::fast::exp(simdgroup_m2 - threadgroup_m2));
-            l3 = metal::simd_sum(l3 * metal::fast::exp(simdgroup_m3 - threadgroup_m3));
-            l4 = metal::simd_sum(l4 * metal::fast::exp(simdgroup_m4 - threadgroup_m4));
-            l5 = metal::simd_sum(l5 * metal::fast::exp(simdgroup_m5 - threadgroup_m5));
-            l6 = metal::simd_sum(l6 * metal::fast::exp(simdgroup_m6 - threadgroup_m6));
-            l7 = metal::simd_sum(l7 * metal::fast::exp(simdgroup_m7 - threadgroup_m7));
+            const float scale = metal::fast::exp(m[i] - threadgroup_m);
+#pragma clang loop unroll(full)
+            for (uint j = 0; j < num_elements; j++) {
+                out[i][j] *= scale;
+            }
+            m[i] = threadgroup_m;
+
+            if (simdgroup_idx == 0) {
+                float simdgroup_l = 0.0f;
+                if (simdgroup_tid < num_simdgroups) {
+                    simdgroup_l = threadgroup_buffer[(qmul + i) * num_simdgroups + simdgroup_tid];
+                }
+                l[i] = metal::simd_sum(simdgroup_l * metal::fast::exp(simdgroup_m - threadgroup_m));
+            }
         }
 
         uint num_threads = num_simdgroups * simdgroup_size;
@@ -254,40 +150,326 @@ kernel void gptoss_f32_sdpa_q8_d64(
             const uint num_half_threads = num_threads - num_smem_threads;
 
             metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
-            const uint smem_tid = tid.x - num_half_threads;
+            const uint smem_tid = tid - num_half_threads;
             if (smem_tid < num_smem_threads) {
-                static_cast<threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 0 + smem_tid] = out0;
-                static_cast<threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 1 + smem_tid] = out1;
-                static_cast<threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 2 + smem_tid] = out2;
-                static_cast<threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 3 + smem_tid] = out3;
-                static_cast<threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 4 + smem_tid] = out4;
-                static_cast<threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 5 + smem_tid] = out5;
-                static_cast<threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 6 + smem_tid] = out6;
-                static_cast<threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 7 + smem_tid] = out7;
+#pragma clang loop unroll(full)
+                for (uint i = 0; i < qmul; i++) {
+#pragma clang loop unroll(full)
+                    for (uint j = 0; j < num_elements; j++) {
+                        if (j < num_valid_elements) {
+                            threadgroup_buffer[(i * num_valid_elements + j) * num_smem_threads + smem_tid] = out[i][j];
+                        }
+                    }
+                }
             }
             metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
-            if (tid.x < num_smem_threads) {
-                out0 += static_cast<const threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 0 + tid.x];
-                out1 += static_cast<const threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 1 + tid.x];
-                out2 += static_cast<const threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 2 + tid.x];
-                out3 += static_cast<const threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 3 + tid.x];
-                out4 += static_cast<const threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 4 + tid.x];
-                out5 += static_cast<const threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 5 + tid.x];
-                out6 += static_cast<const threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 6 + tid.x];
-                out7 += static_cast<const threadgroup float2*>(threadgroup_buffer)[num_smem_threads * 7 + tid.x];
+            if (tid < num_smem_threads) {
+#pragma clang loop unroll(full)
+                for (uint i = 0; i < qmul; i++) {
+#pragma clang loop unroll(full)
+                    for (uint j = 0; j < num_elements; j++) {
+                        if (j < num_valid_elements) {
+                            out[i][j] += threadgroup_buffer[(i * num_valid_elements + j) * num_smem_threads + tid];
+                        }
+                    }
+                }
             }
 
             num_threads = num_half_threads;
         } while (num_threads > simdgroup_size);
     }
-    if (simdgroup_idx == 0) {
-        reinterpret_cast<device float2*>(output + 0 * head_dim)[simdgroup_tid] = out0 / l0;
-        reinterpret_cast<device float2*>(output + 1 * head_dim)[simdgroup_tid] = out1 / l1;
-        reinterpret_cast<device float2*>(output + 2 * head_dim)[simdgroup_tid] = out2 / l2;
-        reinterpret_cast<device float2*>(output + 3 * head_dim)[simdgroup_tid] = out3 / l3;
-        reinterpret_cast<device float2*>(output + 4 * head_dim)[simdgroup_tid] = out4 / l4;
-        reinterpret_cast<device float2*>(output + 5 * head_dim)[simdgroup_tid] = out5 / l5;
-        reinterpret_cast<device float2*>(output + 6 * head_dim)[simdgroup_tid] = out6 / l6;
-        reinterpret_cast<device float2*>(output + 7 * head_dim)[simdgroup_tid] = out7 / l7;
+    if (simdgroup_idx != 0) {
+        return;
+    }
+    if (args.num_kv_splits != 1) {
+        // Partial state layout: qmul x head_dim unnormalized outputs, then qmul maximums, then qmul sums.
+        const uint partial_size = qmul * (hd + 2);
+        partial += ((qt * num_threadgroups.y + gid.y) * args.num_kv_splits + split) * partial_size;
+#pragma clang loop unroll(full)
+        for (uint i = 0; i < qmul; i++) {
+#pragma clang loop unroll(full)
+            for (uint j = 0; j < num_elements; j++) {
+                const uint d = j * simdgroup_size + simdgroup_tid;
+                if (head_dim != 0 || d < hd) {
+                    partial[i * hd + d] = out[i][j];
+                }
+            }
+        }
+        if (metal::simd_is_first()) {
+            partial += qmul * hd;
+#pragma clang loop unroll(full)
+            for (uint i = 0; i < qmul; i++) {
+                partial[i] = m[i];
+                partial[qmul + i] = l[i];
+            }
+        }
+    } else {
+        output += qt * (args.num_q_heads * hd) + qh * hd;
+#pragma clang loop unroll(full)
+        for (uint i = 0; i < qmul; i++) {
+#pragma clang loop unroll(full)
+            for (uint j = 0; j < num_elements; j++) {
+                const uint d = j * simdgroup_size + simdgroup_tid;
+                if (head_dim != 0 || d < hd) {
+                    output[i * hd + d] = out[i][j] / l[i];
+                }
+            }
+        }
     }
 }
+
+// Each threadgroup (a single simdgroup) merges the partial softmax states of all KV splits for qmul Q heads of 1 token.
+
+template <uint head_dim, uint qmul>
+inline void _gptoss_f32_sdpa_reduce_impl(
+    constant gptoss_sdpa_reduce_args& args,
+    const device float* partial,
+    device float* output,
+    const device gptoss_control* control,
+    uint2 gid,
+    uint2 num_threadgroups,
+    uint simdgroup_tid)
+{
+    constexpr uint simdgroup_size = 32;
+    constexpr uint num_elements = (head_dim != 0 ? head_dim : SDPA_MAX_HEAD_DIM) / simdgroup_size;
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint hd = head_dim != 0 ? head_dim : args.head_dim;
+    const uint partial_size = qmul * (hd + 2);
+
+    const uint qt = gid.x;  // Q token index
+    const uint num_kv_splits = args.num_kv_splits;
+
+    partial += (qt * num_threadgroups.y + gid.y) * num_kv_splits * partial_size;
+    output += (qt * num_threadgroups.y + gid.y) * (qmul * hd);
+
+    for (uint i = 0; i < qmul; i++) {
+        float m = partial[qmul * hd + i];
+        for (uint split = 1; split < num_kv_splits; split++) {
+            m = metal::max(m, partial[split * partial_size + qmul * hd + i]);
+        }
+
+        float l = 0.0f;
+        float out[num_elements];
+#pragma clang loop unroll(full)
+        for (uint j = 0; j < num_elements; j++) {
+            out[j] = 0.0f;
+        }
+        for (uint split = 0; split < num_kv_splits; split++) {
+            const device float* split_partial = partial + split * partial_size;
+            const float scale = metal::fast::exp(split_partial[qmul * hd + i] - m);
+            l = metal::fma(split_partial[qmul * hd + qmul + i], scale, l);
+#pragma clang loop unroll(full)
+            for (uint j = 0; j < num_elements; j++) {
+                const uint d = j * simdgroup_size + simdgroup_tid;
+                if (head_dim != 0 || d < hd) {
+                    out[j] = metal::fma(split_partial[i * hd + d], scale, out[j]);
+                }
+            }
+        }
+#pragma clang loop unroll(full)
+        for (uint j = 0; j < num_elements; j++) {
+            const uint d = j * simdgroup_size + simdgroup_tid;
+            if (head_dim != 0 || d < hd) {
+                output[i * hd + d] = out[j] / l;
+            }
+        }
+    }
+}
+
+// Each threadgroup handles qmul Q heads for a tile of SDPA_PREFILL_Bq consecutive Q tokens, one Q token per
+// simdgroup. The threadgroup streams the union of the tokens' attended KV ranges through threadgroup memory in tiles
+// of args.kv_tile_size tokens, so each KV tile is read from device memory once and reused by all Q tokens of the tile.
+// Causal masking and the sliding window are applied per Q token when iterating over the cached KV tile.
+
+template <uint head_dim, uint qmul>
+inline void _gptoss_f32_sdpa_prefill_impl(
+    constant gptoss_sdpa_args& args,
+    const device float* q,
+    const device float* kv,
+    const device bfloat* s,
+    device float* output,
+    const device gptoss_control* control,
+    threadgroup float* kv_tile,
+    uint2 gid,
+    uint tid,
+    uint threadgroup_size,
+    uint simdgroup_tid,
+    uint simdgroup_idx)
+{
+    constexpr uint simdgroup_size = 32;
+    constexpr uint num_elements = (head_dim != 0 ? head_dim : SDPA_MAX_HEAD_DIM) / simdgroup_size;
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint hd = head_dim != 0 ? head_dim : args.head_dim;
+    const uint token_stride = 2 * hd;
+
+    const uint qh = gid.y * qmul;  // First Q head index
+    const uint h = qh / args.qmul;  // KV head index
+    const uint tile_qt_start = gid.x * SDPA_PREFILL_Bq;
+    const uint tile_qt_end = metal::min(tile_qt_start + SDPA_PREFILL_Bq, args.num_q_tokens);
+    const uint qt = tile_qt_start + simdgroup_idx;  // Q token index
+    const bool valid_qt = qt < tile_qt_end;
+
+    // Attended KV range of this simdgroup's Q token (empty for Q tokens past the end of the input).
+    const uint kt_end = valid_qt ? qt + args.num_kv_tokens + 1 : 0;
+    const uint kt_start = metal::subsat(kt_end, args.window);
+    // Union of attended KV ranges of all Q tokens in the tile.
+    const uint tile_kt_end = tile_qt_end + args.num_kv_tokens;
+    const uint tile_kt_start = metal::subsat(tile_qt_start + args.num_kv_tokens + 1, args.window);
+
+    q += qt * args.qkv_dim + qh * hd;
+    kv += h * args.kv_stride;
+    s += qh;
+
+    float qval[qmul][num_elements];
+    float out[qmul][num_elements];
+    float m[qmul];
+    float l[qmul];
+#pragma clang loop unroll(full)
+    for (uint i = 0; i < qmul; i++) {
+        m[i] = static_cast<float>(s[i]);
+        l[i] = 1.0f;
+#pragma clang loop unroll(full)
+        for (uint j = 0; j < num_elements; j++) {
+            const uint d = j * simdgroup_size + simdgroup_tid;
+            qval[i][j] = valid_qt && (head_dim != 0 || d < hd) ? q[i * hd + d] : 0.0f;
+            out[i][j] = 0.0f;
+        }
+    }
+
+    for (uint kt_tile = tile_kt_start; kt_tile < tile_kt_end; kt_tile += args.kv_tile_size) {
+        const uint num_tile_tokens = metal::min(tile_kt_end - kt_tile, args.kv_tile_size);
+
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+        if (head_dim % 2 == 0 && head_dim != 0) {
+            // Rows of 2 * head_dim floats keep 16-byte alignment.
+            const device float4* kv_tile_src = reinterpret_cast<const device float4*>(kv + kt_tile * token_stride);
+            for (uint i = tid; i < num_tile_tokens * (token_stride / 4); i += threadgroup_size) {
+                reinterpret_cast<threadgroup float4*>(kv_tile)[i] = kv_tile_src[i];
+            }
+        } else {
+            const device float* kv_tile_src = kv + kt_tile * token_stride;
+            for (uint i = tid; i < num_tile_tokens * token_stride; i += threadgroup_size) {
+                kv_tile[i] = kv_tile_src[i];
+            }
+        }
+        metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+        const uint kt_first = metal::max(kt_start, kt_tile);
+        const uint kt_last = metal::min(kt_end, kt_tile + num_tile_tokens);
+        for (uint kt = kt_first; kt < kt_last; kt++) {
+            const threadgroup float* kv_token = kv_tile + (kt - kt_tile) * token_stride;
+            float kval[num_elements];
+            float vval[num_elements];
+#pragma clang loop unroll(full)
+            for (uint j = 0; j < num_elements; j++) {
+                const uint d = j * simdgroup_size + simdgroup_tid;
+                kval[j] = head_dim != 0 || d < hd ? kv_token[d] : 0.0f;
+                vval[j] = head_dim != 0 || d < hd ? kv_token[hd + d] : 0.0f;
+            }
+#pragma clang loop unroll(full)
+            for (uint i = 0; i < qmul; i++) {
+                float qk = 0.0f;
+#pragma clang loop unroll(full)
+                for (uint j = 0; j < num_elements; j++) {
+                    qk = metal::fma(qval[i][j], kval[j], qk);
+                }
+                qk = metal::simd_sum(qk);
+
+                const float new_m = metal::max(m[i], qk);
+                const float alpha = metal::fast::exp(m[i] - new_m);
+                const float p = metal::fast::exp(qk - new_m);
+                l[i] = metal::fma(l[i], alpha, p);
+#pragma clang loop unroll(full)
+                for (uint j = 0; j < num_elements; j++) {
+                    out[i][j] = metal::fma(vval[j], p, out[i][j] * alpha);
+                }
+                m[i] = new_m;
+            }
+        }
+    }
+
+    if (valid_qt) {
+        output += qt * (args.num_q_heads * hd) + qh * hd;
+#pragma clang loop unroll(full)
+        for (uint i = 0; i < qmul; i++) {
+#pragma clang loop unroll(full)
+            for (uint j = 0; j < num_elements; j++) {
+                const uint d = j * simdgroup_size + simdgroup_tid;
+                if (head_dim != 0 || d < hd) {
+                    output[i * hd + d] = out[i][j] / l[i];
+                }
+            }
+        }
+    }
+}
+
+#define GPTOSS_F32_SDPA_KERNELS(suffix, head_dim, qmul)                                                   \
+    kernel void gptoss_f32_sdpa_##suffix(                                                                 \
+        constant gptoss_sdpa_args& args [[ buffer(0) ]],                                                  \
+        const device float* q [[ buffer(1) ]],                                                            \
+        const device float* kv [[ buffer(2) ]],                                                           \
+        const device bfloat* s [[ buffer(3) ]],                                                           \
+        device float* output [[ buffer(4) ]],                                                             \
+        device float* partial [[ buffer(5) ]],                                                            \
+        const device gptoss_control* control [[ buffer(6) ]],                                             \
+        threadgroup float* threadgroup_buffer [[ threadgroup(0) ]],                                       \
+        uint3 gid [[threadgroup_position_in_grid]],                                                       \
+        uint3 num_threadgroups [[threadgroups_per_grid]],                                                 \
+        uint tid [[thread_index_in_threadgroup]],                                                         \
+        uint simdgroup_tid [[thread_index_in_simdgroup]],                                                 \
+        uint simdgroup_idx [[simdgroup_index_in_threadgroup]],                                            \
+        uint num_simdgroups [[simdgroups_per_threadgroup]])                                               \
+    {                                                                                                     \
+        _gptoss_f32_sdpa_impl<head_dim, qmul>(                                                            \
+            args, q, kv, s, output, partial, control, threadgroup_buffer,                                 \
+            gid, num_threadgroups, tid, simdgroup_tid, simdgroup_idx, num_simdgroups);                    \
+    }                                                                                                     \
+                                                                                                          \
+    kernel void gptoss_f32_sdpa_reduce_##suffix(                                                          \
+        constant gptoss_sdpa_reduce_args& args [[ buffer(0) ]],                                           \
+        const device float* partial [[ buffer(1) ]],                                                      \
+        device float* output [[ buffer(2) ]],                                                             \
+        const device gptoss_control* control [[ buffer(3) ]],                                             \
+        uint2 gid [[threadgroup_position_in_grid]],                                                       \
+        uint2 num_threadgroups [[threadgroups_per_grid]],                                                 \
+        uint simdgroup_tid [[thread_index_in_simdgroup]])                                                 \
+    {                                                                                                     \
+        _gptoss_f32_sdpa_reduce_impl<head_dim, qmul>(                                                     \
+            args, partial, output, control, gid, num_threadgroups, simdgroup_tid);                        \
+    }                                                                                                     \
+                                                                                                          \
+    kernel void gptoss_f32_sdpa_prefill_##suffix(                                                         \
+        constant gptoss_sdpa_args& args [[ buffer(0) ]],                                                  \
+        const device float* q [[ buffer(1) ]],                                                            \
+        const device float* kv [[ buffer(2) ]],                                                           \
+        const device bfloat* s [[ buffer(3) ]],                                                           \
+        device float* output [[ buffer(4) ]],                                                             \
+        const device gptoss_control* control [[ buffer(5) ]],                                             \
+        threadgroup float* kv_tile [[ threadgroup(0) ]],                                                  \
+        uint2 gid [[threadgroup_position_in_grid]],                                                       \
+        uint tid [[thread_index_in_threadgroup]],                                                         \
+        uint threadgroup_size [[threads_per_threadgroup]],                                                \
+        uint simdgroup_tid [[thread_index_in_simdgroup]],                                                 \
+        uint simdgroup_idx [[simdgroup_index_in_threadgroup]])                                            \
+    {                                                                                                     \
+        _gptoss_f32_sdpa_prefill_impl<head_dim, qmul>(                                                    \
+            args, q, kv, s, output, control, kv_tile,                                                     \
+            gid, tid, threadgroup_size, simdgroup_tid, simdgroup_idx);                                    \
+    }
+
+GPTOSS_F32_SDPA_KERNELS(q8_d64, 64, 8)
+GPTOSS_F32_SDPA_KERNELS(q4_d64, 64, 4)
+GPTOSS_F32_SDPA_KERNELS(q2_d64, 64, 2)
+GPTOSS_F32_SDPA_KERNELS(q1_d64, 64, 1)
+GPTOSS_F32_SDPA_KERNELS(q8_d128, 128, 8)
+GPTOSS_F32_SDPA_KERNELS(q4_d128, 128, 4)
+GPTOSS_F32_SDPA_KERNELS(q2_d128, 128, 2)
+GPTOSS_F32_SDPA_KERNELS(q1_d128, 128, 1)
+// Generic fallback: 1 Q head per threadgroup, any head dimension up to SDPA_MAX_HEAD_DIM.
+GPTOSS_F32_SDPA_KERNELS(generic, 0, 1)
@@ -10,6 +10,7 @@
 
 #include <gpt-oss.h>
 
+#include "internal/grammar.h"
 #include "internal/log.h"
 #include "internal/model.h"
 
@@ -80,6 +81,127 @@ enum gptoss_status GPTOSS_ABI gptoss_tokenizer_decode(
     return gptoss_status_success;
 }
 
+struct token_ref {
+    const uint8_t* ptr;
+    uint32_t length;
+    uint32_t id;
+};
+
+static int compare_token_refs(const void* a_ptr, const void* b_ptr) {
+    const struct token_ref* a = (const struct token_ref*) a_ptr;
+    const struct token_ref* b = (const struct token_ref*) b_ptr;
+    const uint32_t min_length = a->length < b->length ? a->length : b->length;
+    const int result = memcmp(a->ptr, b->ptr, min_length);
+    if (result != 0) {
+        return result;
+    }
+    if (a->length != b->length) {
+        return a->length < b->length ? -1 : 1;
+    }
+    return a->id < b->id ? -1 : 1;
+}
+
+enum gptoss_status gptoss_tokenizer_build_trie(
+    struct gptoss_tokenizer* tokenizer)
+{
+    enum gptoss_status status = gptoss_status_success;
+    const uint32_t num_tokens = tokenizer->num_text_tokens;
+    struct token_ref* token_refs = NULL;
+    uint32_t* open_nodes = NULL;
+
+    tokenizer->token_offsets = malloc(num_tokens * sizeof(uint32_t));
+    token_refs = malloc(num_tokens * sizeof(struct token_ref));
+    if (tokenizer->token_offsets == NULL || token_refs == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for token trie construction",
+            num_tokens * (sizeof(uint32_t) + sizeof(struct token_ref)));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+
+    // Index the length-prefixed tokens; the total length bounds the number of trie nodes.
+    size_t offset = 0;
+    size_t total_length = 0;
+    uint32_t max_token_length = 1;
+    for (uint32_t t = 0; t < num_tokens; t++) {
+        // Reading unaligned uint16_t
+        uint16_t token_length;
+        memcpy(&token_length, tokenizer->tokens_ptr + offset, sizeof(token_length));
+
+        tokenizer->token_offsets[t] = (uint32_t) offset;
+        token_refs[t] = (struct token_ref) {
+            .ptr = (const uint8_t*) tokenizer->tokens_ptr + offset + sizeof(uint16_t),
+            .length = token_length,
+            .id = t,
+        };
+        offset += (size_t) token_length + sizeof(uint16_t);
+        total_length += token_length;
+        if (token_length > max_token_length) {
+            max_token_length = token_length;
+        }
+    }
+    if (total_length >= UINT32_MAX) {
+        GPTOSS_LOG_ERROR("total token length %zu is too large for the token trie", total_length);
+        status = gptoss_status_unsupported_argument;
+        goto cleanup;
+    }
+
+    tokenizer->trie_nodes = malloc(total_length * sizeof(struct gptoss_token_trie_node));
+    open_nodes = malloc((max_token_length + 1) * sizeof(uint32_t));
+    if (tokenizer->trie_nodes == NULL || open_nodes == NULL) {
+        GPTOSS_LOG_ERROR("failed to allocate %zu bytes for token trie",
+            total_length * sizeof(struct gptoss_token_trie_node));
+        status = gptoss_status_insufficient_memory;
+        goto cleanup;
+    }
+
+    // In sorted order, each token shares a prefix with the previous token and adds new nodes after it. Nodes deeper
+    // than the shared prefix are complete at that point.
+    qsort(token_refs, num_tokens, sizeof(struct token_ref), compare_token_refs);
+    struct gptoss_token_trie_node* nodes = tokenizer->trie_nodes;
+    uint32_t num_nodes = 0;
+    const struct token_ref* prev_ref = NULL;
+    uint32_t prev_length = 0;
+    for (uint32_t i = 0; i < num_tokens; i++) {
+        const struct token_ref* ref = &token_refs[i];
+        uint32_t common_length = 0;
+        if (prev_ref != NULL) {
+            while (common_length < ref->length && common_length < prev_length &&
+                ref->ptr[common_length] == prev_ref->ptr[common_length])
+            {
+                common_length++;
+            }
+        }
+        if (ref->length == common_length) {
+            // Empty token or duplicate of the previous token
+            continue;
+        }
+        for (uint32_t d = common_length + 1; d <= prev_length; d++) {
+            nodes[open_nodes[d]].subtree_end = num_nodes;
+        }
+        for (uint32_t d = common_length + 1; d <= ref->length; d++) {
+            nodes[num_nodes] = (struct gptoss_token_trie_node) {
+                .token_id = UINT32_MAX,
+                .depth = (uint16_t) d,
+                .byte = ref->ptr[d - 1],
+            };
+            open_nodes[d] = num_nodes++;
+        }
+        nodes[open_nodes[ref->length]].token_id = ref->id;
+        prev_ref = ref;
+        prev_length = ref->length;
+    }
+    for (uint32_t d = 1; d <= prev_length; d++) {
+        nodes[open_nodes[d]].subtree_end = num_nodes;
+    }
+    tokenizer->num_trie_nodes = num_nodes;
+    tokenizer->max_token_length = max_token_length;
+
+cleanup:
+    free(token_refs);
+    free(open_nodes);
+    return status;
+}
+
 enum gptoss_status GPTOSS_ABI gptoss_tokenizer_retain(
     gptoss_tokenizer_t tokenizer)
 {
@@ -98,6 +220,9 @@ enum gptoss_status GPTOSS_ABI gptoss_tokenizer_release(
                 }
             }
 
+            free(tokenizer->trie_nodes);
+            free(tokenizer->token_offsets);
+
             memset(tokenizer, 0, sizeof(struct gptoss_tokenizer));
             free(tokenizer);
         }
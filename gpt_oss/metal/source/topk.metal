@@ -203,3 +203,182 @@ kernel void gptoss_f32_topk_softmax_e32_k4(
         };
     }
 }
+
+// Each threadgroup (a single simdgroup) selects the top num_active_experts of num_experts router logits for 1 token
+// and normalizes their softmax. The i-th selected expert is the largest logit ordered strictly after the (i-1)-th one
+// in (logit descending, expert index ascending) order, so ties resolve to the lower expert index like the kernels
+// above, and no selected expert needs to be masked out. Specializations keep each lane's logits in registers;
+// num_experts == 0 and/or num_active_experts == 0 take the values from the arguments instead.
+
+template <uint num_experts, uint num_active_experts>
+inline void _gptoss_f32_topk_softmax_impl(
+    constant gptoss_topk_args& args,
+    const device float* input,
+    device gptoss_expert_prediction* output,
+    const device gptoss_control* control,
+    uint gid,
+    uint tid)
+{
+    constexpr uint simdgroup_size = 32;
+    constexpr uint num_lane_vals = num_experts != 0 ? (num_experts + simdgroup_size - 1) / simdgroup_size : 1;
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint ne = num_experts != 0 ? num_experts : args.num_experts;
+    const uint k = num_active_experts != 0 ? num_active_experts : args.num_active_experts;
+
+    input += gid * ne;
+    output += gid * k;
+
+    float vals[num_lane_vals];
+    if (num_experts != 0) {
+#pragma clang loop unroll(full)
+        for (uint j = 0; j < num_lane_vals; j++) {
+            const uint e = j * simdgroup_size + tid;
+            vals[j] = e < ne ? input[e] : -INFINITY;
+        }
+    }
+
+    float prev_val = INFINITY;
+    uint prev_idx = 0;
+    float top_val = 0.0f;
+    float sum = 0.0f;
+    for (uint i = 0; i < k; i++) {
+        float best_val = -INFINITY;
+        uint best_idx = 0xFFFFFFFFu;
+        const uint num_iter = num_experts != 0 ? num_lane_vals : (ne + simdgroup_size - 1) / simdgroup_size;
+        for (uint j = 0; j < num_iter; j++) {
+            const uint e = j * simdgroup_size + tid;
+            if (e < ne) {
+                const float val = num_experts != 0 ? vals[j] : input[e];
+                const bool after_prev = val < prev_val || (val == prev_val && e > prev_idx);
+                if (after_prev && (val > best_val || best_idx == 0xFFFFFFFFu)) {
+                    best_val = val;
+                    best_idx = e;
+                }
+            }
+        }
+
+        const float topval = metal::simd_max(best_idx != 0xFFFFFFFFu ? best_val : -INFINITY);
+        const uint topidx = metal::simd_min(best_idx != 0xFFFFFFFFu && best_val == topval ? best_idx : 0xFFFFFFFFu);
+        if (i == 0) {
+            top_val = topval;
+        }
+        const float topexp = metal::precise::exp(topval - top_val);
+        sum += topexp;
+        if (metal::simd_is_first()) {
+            output[i] = (gptoss_expert_prediction) {
+                .expert_id = topidx,
+                .score = topexp,
+            };
+        }
+        prev_val = topval;
+        prev_idx = topidx;
+    }
+
+    if (metal::simd_is_first()) {
+        const float scale = 1.0 / sum;
+        for (uint i = 0; i < k; i++) {
+            output[i].score *= scale;
+        }
+    }
+}
+
+#define GPTOSS_F32_TOPK_SOFTMAX_KERNEL(name, num_experts, num_active_experts)       \
+    [[max_total_threads_per_threadgroup(32)]]                                       \
+    kernel void name(                                                               \
+        constant gptoss_topk_args& args [[ buffer(0) ]],                            \
+        const device float* input [[ buffer(1) ]],                                  \
+        device gptoss_expert_prediction* output [[ buffer(2) ]],                    \
+        const device gptoss_control* control [[ buffer(3) ]],                       \
+        uint gid [[threadgroup_position_in_grid]],                                  \
+        uint tid [[thread_position_in_threadgroup]])                                \
+    {                                                                               \
+        _gptoss_f32_topk_softmax_impl<num_experts, num_active_experts>(             \
+            args, input, output, control, gid, tid);                                \
+    }
+
+GPTOSS_F32_TOPK_SOFTMAX_KERNEL(gptoss_f32_topk_softmax_e16_k4, 16, 4)
+GPTOSS_F32_TOPK_SOFTMAX_KERNEL(gptoss_f32_topk_softmax_e64_k4, 64, 4)
+GPTOSS_F32_TOPK_SOFTMAX_KERNEL(gptoss_f32_topk_softmax_e64_k8, 64, 8)
+GPTOSS_F32_TOPK_SOFTMAX_KERNEL(gptoss_f32_topk_softmax_e128_k8, 128, 8)
+GPTOSS_F32_TOPK_SOFTMAX_KERNEL(gptoss_f32_topk_softmax_e256_k8, 256, 8)
+GPTOSS_F32_TOPK_SOFTMAX_KERNEL(gptoss_f32_topk_softmax, 0, 0)
+
+// Groups the (token, active expert) assignments of a batch by expert, for grouped MoE matmuls. Assignment
+// t * num_active_experts + k (the k-th expert of token t) is stored in expert_assignments within
+// [expert_offsets[e], expert_offsets[e + 1]) of its expert e. The order within a group is unspecified.
+// The groups are split into a flat list of expert_tasks of up to MOE_GROUP_Bt assignments, padded with empty tasks to
+// args.max_tasks, so that the threadgroups of the grouped matmuls map to chunks of work regardless of how unevenly
+// the tokens are spread across experts.
+[[max_total_threads_per_threadgroup(1024)]]
+kernel void gptoss_expert_group(
+    constant gptoss_expert_group_args& args [[ buffer(0) ]],
+    const device gptoss_expert_prediction* expert [[ buffer(1) ]],
+    device uint* expert_offsets [[ buffer(2) ]],
+    device uint* expert_assignments [[ buffer(3) ]],
+    device gptoss_expert_group_task* expert_tasks [[ buffer(4) ]],
+    const device gptoss_control* control [[ buffer(5) ]],
+    uint tid [[thread_position_in_threadgroup]],
+    uint threadgroup_size [[threads_per_threadgroup]])
+{
+    threadgroup metal::atomic_uint expert_counters[EXPERT_GROUP_MAX_EXPERTS];
+    threadgroup uint task_offsets[EXPERT_GROUP_MAX_EXPERTS + 1];
+    if (control->abort != 0) {
+        return;
+    }
+
+    const uint num_assignments = args.num_tokens * args.num_active_experts;
+    for (uint e = tid; e < args.num_experts; e += threadgroup_size) {
+        metal::atomic_store_explicit(&expert_counters[e], 0, metal::memory_order_relaxed);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    for (uint i = tid; i < num_assignments; i += threadgroup_size) {
+        metal::atomic_fetch_add_explicit(&expert_counters[expert[i].expert_id], 1, metal::memory_order_relaxed);
+    }
+    metal::threadgroup_barrier(metal::mem_flags::mem_threadgroup);
+
+    if (tid == 0) {
+        uint offset = 0;
+        uint task_offset = 0;
+        for (uint e = 0; e < args.num_experts; e++) {
+            const uint count = metal::atomic_load_explicit(&expert_counters[e], metal::memory_order_relaxed);
+            expert_offsets[e] = offset;
+            task_offsets[e] = task_offset;
+            metal::atomic_store_explicit(&expert_counters[e], offset, metal::memory_order_relaxed);
+            offset += count;
+            task_offset += (count + MOE_GROUP_Bt - 1) / MOE_GROUP_Bt;
+        }
+        expert_offsets[args.num_experts] = offset;
+        task_offsets[args.num_experts] = task_offset;
+    }
+    // Expert offsets are read back from device memory below.
+    metal::threadgroup_barrier(metal::mem_flags::mem_device | metal::mem_flags::mem_threadgroup);
+
+    for (uint e = tid; e < args.num_experts; e += threadgroup_size) {
+        const uint group_start = expert_offsets[e];
+        const uint group_end = expert_offsets[e + 1];
+        uint task = task_offsets[e];
+        for (uint start = group_start; start < group_end; start += MOE_GROUP_Bt) {
+            expert_tasks[task++] = gptoss_expert_group_task{
+                /*expert_id=*/e,
+                /*assignment_offset=*/start,
+                /*num_assignments=*/metal::min(group_end - start, (uint) MOE_GROUP_Bt),
+            };
+        }
+    }
+    for (uint task = task_offsets[args.num_experts] + tid; task < args.max_tasks; task += threadgroup_size) {
+        expert_tasks[task] = gptoss_expert_group_task{
+            /*expert_id=*/0,
+            /*assignment_offset=*/0,
+            /*num_assignments=*/0,
+        };
+    }
+
+    for (uint i = tid; i < num_assignments; i += threadgroup_size) {
+        const uint position = metal::atomic_fetch_add_explicit(&expert_counters[expert[i].expert_id], 1, metal::memory_order_relaxed);
+        expert_assignments[position] = i;
+    }
+}
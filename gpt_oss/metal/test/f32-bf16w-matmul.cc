@@ -64,6 +64,22 @@ TEST(F32_BF16W_DENSE_MATMUL_QKV, seq_len_1024) {
         .num_tokens(1024)
         .num_rows(5120)
         .num_cols(2880)
+        .num_q_heads(64)
+        .num_kv_heads(8)
+        .head_dim(64)
+        .TestF32_BF16W(
+            MatMulKernelTester::MatMulKernelType::PREFILL_QKV_OPTIMIZED);
+}
+
+TEST(F32_BF16W_DENSE_MATMUL_QKV, token_offset) {
+    MatMulKernelTester()
+        .num_tokens(128)
+        .num_rows(5120)
+        .num_cols(2880)
+        .num_q_heads(64)
+        .num_kv_heads(8)
+        .head_dim(64)
+        .token_offset(1000)
         .TestF32_BF16W(
             MatMulKernelTester::MatMulKernelType::PREFILL_QKV_OPTIMIZED);
 }
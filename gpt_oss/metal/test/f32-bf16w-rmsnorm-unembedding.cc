@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "unembedding-kernel-tester.hpp"
+
+
+using gptoss::UnembeddingKernelTester;
+
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, single_threadgroup) {
+    UnembeddingKernelTester()
+        .num_rows(100)
+        .max_threadgroups(1)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, multiple_threadgroups) {
+    UnembeddingKernelTester()
+        .num_rows(1000)
+        .max_threadgroups(10)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, partial_threadgroup) {
+    UnembeddingKernelTester()
+        .num_rows(1003)
+        .threadgroup_size(416)
+        .max_threadgroups(7)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, partial_column_iteration) {
+    UnembeddingKernelTester()
+        .num_cols(2880)
+        .num_rows(500)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, multiple_tokens) {
+    UnembeddingKernelTester()
+        .num_tokens(3)
+        .num_rows(1000)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, no_scores) {
+    UnembeddingKernelTester()
+        .num_tokens(2)
+        .num_rows(1000)
+        .output_scores(false)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, gumbel_sample) {
+    UnembeddingKernelTester()
+        .num_rows(1000)
+        .output_scores(false)
+        .temperature(1.0f)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, gumbel_sample_multiple_tokens) {
+    UnembeddingKernelTester()
+        .num_tokens(3)
+        .num_rows(1003)
+        .threadgroup_size(416)
+        .max_threadgroups(7)
+        .temperature(0.7f)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, logit_bias) {
+    UnembeddingKernelTester()
+        .num_tokens(2)
+        .num_rows(1000)
+        .logit_bias(true)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, token_mask) {
+    UnembeddingKernelTester()
+        .num_tokens(2)
+        .num_rows(1003)
+        .token_mask(true)
+        .TestF32_BF16W_RMSNorm();
+}
+
+TEST(F32_BF16W_RMSNORM_UNEMBEDDING, gumbel_sample_logit_bias_token_mask) {
+    UnembeddingKernelTester()
+        .num_tokens(3)
+        .num_rows(1003)
+        .temperature(0.7f)
+        .logit_bias(true)
+        .token_mask(true)
+        .TestF32_BF16W_RMSNorm();
+}
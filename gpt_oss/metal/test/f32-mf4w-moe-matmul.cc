@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "moe-kernel-tester.hpp"
+
+
+using gptoss::MoEMatMulKernelTester;
+
+constexpr std::uint32_t kEmbeddingDim = 1024;
+constexpr std::uint32_t kMLPDim = 1024;
+
+
+TEST(F32_MF4W_MOE_GROUPED_MATMUL_SWIGLU, multiple_tasks_per_expert) {
+    MoEMatMulKernelTester()
+        .num_tokens(20)
+        .num_experts(16)
+        .num_active_experts(4)
+        .num_cols(kEmbeddingDim)
+        .num_rows(kMLPDim)
+        .TestGroupedSwiGLU();
+}
+
+TEST(F32_MF4W_MOE_GROUPED_MATMUL_SWIGLU, partial_tasks_only) {
+    MoEMatMulKernelTester()
+        .num_tokens(5)
+        .num_experts(16)
+        .num_active_experts(4)
+        .num_cols(kEmbeddingDim)
+        .num_rows(kMLPDim)
+        .TestGroupedSwiGLU();
+}
+
+TEST(F32_MF4W_MOE_GROUPED_MATMUL_SWIGLU, many_active_experts) {
+    MoEMatMulKernelTester()
+        .num_tokens(17)
+        .num_experts(32)
+        .num_active_experts(8)
+        .num_cols(kEmbeddingDim)
+        .num_rows(kMLPDim)
+        .TestGroupedSwiGLU();
+}
+
+TEST(F32_MF4W_MOE_GROUPED_MATMUL, multiple_tasks_per_expert) {
+    MoEMatMulKernelTester()
+        .num_tokens(20)
+        .num_experts(16)
+        .num_active_experts(4)
+        .num_cols(kMLPDim)
+        .num_rows(kEmbeddingDim)
+        .TestGrouped();
+}
+
+TEST(F32_MF4W_MOE_GROUPED_MATMUL, partial_tasks_only) {
+    MoEMatMulKernelTester()
+        .num_tokens(5)
+        .num_experts(16)
+        .num_active_experts(4)
+        .num_cols(kMLPDim)
+        .num_rows(kEmbeddingDim)
+        .TestGrouped();
+}
+
+TEST(F32_MF4W_MOE_GROUPED_MATMUL, many_active_experts) {
+    MoEMatMulKernelTester()
+        .num_tokens(17)
+        .num_experts(32)
+        .num_active_experts(8)
+        .num_cols(kMLPDim)
+        .num_rows(kEmbeddingDim)
+        .TestGrouped();
+}
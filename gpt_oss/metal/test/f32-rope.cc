@@ -9,7 +9,7 @@
 using gptoss::RoPEKernelTester;
 
 constexpr float kFrequencyBase = 50000.0f;
-constexpr std::uint32_t kHeadDim = 64;  // fixed in the kernel
+constexpr std::uint32_t kHeadDim = 64;
 constexpr std::uint32_t kTokenOffset = 7;
 
 
@@ -69,3 +69,60 @@ TEST(F32_ROPE, multiple_tokens) {
         .threadgroup_size(threadgroup_size)
         .TestF32();
 }
+
+TEST(F32_ROPE, head_dim128) {
+    constexpr std::uint32_t head_dim = 128;
+    constexpr std::size_t threadgroup_size = 64;
+
+    RoPEKernelTester()
+        .head_dim(head_dim)
+        .num_tokens(3)
+        .num_q_heads(4)
+        .num_kv_heads(2)
+        .token_offset(kTokenOffset)
+        .frequency_base(kFrequencyBase)
+        .threadgroup_size(threadgroup_size)
+        .TestF32();
+}
+
+TEST(F32_ROPE_KV_SCATTER, single_token) {
+    RoPEKernelTester()
+        .head_dim(kHeadDim)
+        .num_q_heads(4)
+        .num_kv_heads(2)
+        .token_offset(kTokenOffset)
+        .max_tokens(16)
+        .frequency_base(kFrequencyBase)
+        .threadgroup_size(kHeadDim / 2)
+        .TestF32KVScatter();
+}
+
+TEST(F32_ROPE_KV_SCATTER, multiple_tokens) {
+    constexpr std::size_t threadgroup_size = 64;
+
+    RoPEKernelTester()
+        .head_dim(kHeadDim)
+        .num_tokens(5)
+        .num_q_heads(8)
+        .num_kv_heads(2)
+        .token_offset(kTokenOffset)
+        .max_tokens(32)
+        .frequency_base(kFrequencyBase)
+        .threadgroup_size(threadgroup_size)
+        .TestF32KVScatter();
+}
+
+TEST(F32_ROPE_KV_SCATTER, head_dim128) {
+    constexpr std::uint32_t head_dim = 128;
+    constexpr std::size_t threadgroup_size = 64;
+
+    RoPEKernelTester()
+        .head_dim(head_dim)
+        .num_tokens(3)
+        .num_q_heads(4)
+        .num_kv_heads(2)
+        .token_offset(kTokenOffset)
+        .frequency_base(kFrequencyBase)
+        .threadgroup_size(threadgroup_size)
+        .TestF32KVScatter();
+}
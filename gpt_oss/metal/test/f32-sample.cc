@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "sample-kernel-tester.hpp"
+
+
+using gptoss::SampleKernelTester;
+
+constexpr std::uint32_t kVocabularySize = 201088;
+
+
+TEST(F32_SAMPLE, min_p) {
+    SampleKernelTester()
+        .min_p(0.1f)
+        .TestF32();
+}
+
+TEST(F32_SAMPLE, min_p_high_temperature) {
+    SampleKernelTester()
+        .temperature(4.0f)
+        .min_p(0.05f)
+        .TestF32();
+}
+
+TEST(F32_SAMPLE, top_k) {
+    SampleKernelTester()
+        .top_k(40)
+        .TestF32();
+}
+
+TEST(F32_SAMPLE, top_1) {
+    SampleKernelTester()
+        .top_k(1)
+        .TestF32();
+}
+
+TEST(F32_SAMPLE, top_k_max) {
+    SampleKernelTester()
+        .top_k(256)
+        .temperature(2.0f)
+        .TestF32();
+}
+
+TEST(F32_SAMPLE, top_k_min_p) {
+    SampleKernelTester()
+        .top_k(50)
+        .min_p(0.2f)
+        .temperature(0.7f)
+        .TestF32();
+}
+
+TEST(F32_SAMPLE, top_k_exceeds_threadgroup_range) {
+    SampleKernelTester()
+        .num_channels(1000)
+        .max_threadgroups(20)
+        .top_k(100)
+        .TestF32();
+}
+
+TEST(F32_SAMPLE, vocabulary) {
+    SampleKernelTester()
+        .num_channels(kVocabularySize)
+        .max_threadgroups(30)
+        .top_k(64)
+        .min_p(0.01f)
+        .TestF32();
+}
+
+TEST(F32_SAMPLE, stop_token) {
+    SampleKernelTester()
+        .TestCheckStopToken({17, 4095, 42, 9, 256}, {42, 9999});
+}
+
+TEST(F32_SAMPLE, stop_token_first) {
+    SampleKernelTester()
+        .TestCheckStopToken({42, 17, 4095}, {42});
+}
+
+TEST(F32_SAMPLE, no_stop_token) {
+    SampleKernelTester()
+        .TestCheckStopToken({17, 4095, 256}, {42});
+}
@@ -0,0 +1,189 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "sdpa-kernel-tester.hpp"
+
+
+using gptoss::SDPAKernelTester;
+
+constexpr std::uint32_t kWindow = 128;
+
+
+TEST(F32_SDPA, single_token) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(0)
+        .TestF32();
+}
+
+TEST(F32_SDPA, decode) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(1000)
+        .TestF32();
+}
+
+TEST(F32_SDPA, decode_split_kv) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(1000)
+        .num_kv_splits(4)
+        .TestF32();
+}
+
+TEST(F32_SDPA, decode_split_kv_uneven) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(999)
+        .num_kv_splits(7)
+        .TestF32();
+}
+
+TEST(F32_SDPA, decode_window) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(1000)
+        .window(kWindow)
+        .TestF32();
+}
+
+TEST(F32_SDPA, decode_window_split_kv) {
+    SDPAKernelTester()
+        .num_q_tokens(1)
+        .num_kv_tokens(1000)
+        .window(kWindow)
+        .num_kv_splits(3)
+        .TestF32();
+}
+
+TEST(F32_SDPA, multiple_tokens) {
+    SDPAKernelTester()
+        .num_q_tokens(5)
+        .num_kv_tokens(200)
+        .TestF32();
+}
+
+TEST(F32_SDPA, multiple_tokens_split_kv) {
+    SDPAKernelTester()
+        .num_q_tokens(5)
+        .num_kv_tokens(200)
+        .window(kWindow)
+        .num_kv_splits(2)
+        .TestF32();
+}
+
+TEST(F32_SDPA_PREFILL, single_tile) {
+    SDPAKernelTester()
+        .num_q_tokens(16)
+        .num_kv_tokens(0)
+        .TestF32(SDPAKernelTester::SDPAKernelType::PREFILL_OPTIMIZED);
+}
+
+TEST(F32_SDPA_PREFILL, partial_tile) {
+    SDPAKernelTester()
+        .num_q_tokens(37)
+        .num_kv_tokens(0)
+        .TestF32(SDPAKernelTester::SDPAKernelType::PREFILL_OPTIMIZED);
+}
+
+TEST(F32_SDPA_PREFILL, token_offset) {
+    SDPAKernelTester()
+        .num_q_tokens(64)
+        .num_kv_tokens(100)
+        .TestF32(SDPAKernelTester::SDPAKernelType::PREFILL_OPTIMIZED);
+}
+
+TEST(F32_SDPA_PREFILL, window) {
+    SDPAKernelTester()
+        .num_q_tokens(300)
+        .num_kv_tokens(0)
+        .window(kWindow)
+        .TestF32(SDPAKernelTester::SDPAKernelType::PREFILL_OPTIMIZED);
+}
+
+TEST(F32_SDPA_PREFILL, window_token_offset) {
+    SDPAKernelTester()
+        .num_q_tokens(100)
+        .num_kv_tokens(500)
+        .window(kWindow)
+        .TestF32(SDPAKernelTester::SDPAKernelType::PREFILL_OPTIMIZED);
+}
+
+TEST(F32_SDPA, head_dim128) {
+    SDPAKernelTester()
+        .head_dim(128)
+        .num_kv_heads(4)
+        .qmul(8)
+        .threadgroup_qmul(8)
+        .num_q_tokens(1)
+        .num_kv_tokens(300)
+        .num_kv_splits(2)
+        .TestF32();
+}
+
+TEST(F32_SDPA, qmul4) {
+    SDPAKernelTester()
+        .num_kv_heads(8)
+        .qmul(4)
+        .threadgroup_qmul(4)
+        .num_q_tokens(3)
+        .num_kv_tokens(300)
+        .TestF32();
+}
+
+TEST(F32_SDPA, qmul16) {
+    SDPAKernelTester()
+        .num_kv_heads(2)
+        .qmul(16)
+        .threadgroup_qmul(8)
+        .num_q_tokens(1)
+        .num_kv_tokens(300)
+        .num_kv_splits(3)
+        .TestF32();
+}
+
+TEST(F32_SDPA, mha) {
+    SDPAKernelTester()
+        .num_kv_heads(16)
+        .qmul(1)
+        .threadgroup_qmul(1)
+        .num_q_tokens(2)
+        .num_kv_tokens(100)
+        .TestF32();
+}
+
+TEST(F32_SDPA, generic) {
+    SDPAKernelTester()
+        .head_dim(80)
+        .num_kv_heads(4)
+        .qmul(3)
+        .threadgroup_qmul(1)
+        .num_q_tokens(2)
+        .num_kv_tokens(300)
+        .num_kv_splits(2)
+        .TestF32();
+}
+
+TEST(F32_SDPA_PREFILL, head_dim128) {
+    SDPAKernelTester()
+        .head_dim(128)
+        .num_kv_heads(4)
+        .qmul(4)
+        .threadgroup_qmul(4)
+        .num_q_tokens(40)
+        .num_kv_tokens(50)
+        .window(kWindow)
+        .TestF32(SDPAKernelTester::SDPAKernelType::PREFILL_OPTIMIZED);
+}
+
+TEST(F32_SDPA_PREFILL, generic) {
+    SDPAKernelTester()
+        .head_dim(80)
+        .num_kv_heads(2)
+        .qmul(3)
+        .threadgroup_qmul(1)
+        .num_q_tokens(40)
+        .num_kv_tokens(50)
+        .TestF32(SDPAKernelTester::SDPAKernelType::PREFILL_OPTIMIZED);
+}
@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "topk-kernel-tester.hpp"
+
+
+using gptoss::TopKKernelTester;
+
+
+TEST(F32_TOPK_SOFTMAX, e32_k4) {
+    TopKKernelTester()
+        .num_tokens(5)
+        .num_experts(32)
+        .num_active_experts(4)
+        .TestF32();
+}
+
+TEST(F32_TOPK_SOFTMAX, e128_k4) {
+    TopKKernelTester()
+        .num_tokens(5)
+        .num_experts(128)
+        .num_active_experts(4)
+        .TestF32();
+}
+
+TEST(F32_TOPK_SOFTMAX, e16_k4) {
+    TopKKernelTester()
+        .num_tokens(5)
+        .num_experts(16)
+        .num_active_experts(4)
+        .TestF32();
+}
+
+TEST(F32_TOPK_SOFTMAX, e64_k8) {
+    TopKKernelTester()
+        .num_tokens(5)
+        .num_experts(64)
+        .num_active_experts(8)
+        .TestF32();
+}
+
+TEST(F32_TOPK_SOFTMAX, e256_k8) {
+    TopKKernelTester()
+        .num_tokens(5)
+        .num_experts(256)
+        .num_active_experts(8)
+        .TestF32();
+}
+
+TEST(F32_TOPK_SOFTMAX, generic) {
+    TopKKernelTester()
+        .num_tokens(5)
+        .num_experts(48)
+        .num_active_experts(6)
+        .TestF32("gptoss_f32_topk_softmax");
+}
+
+TEST(F32_TOPK_SOFTMAX, generic_single_expert) {
+    TopKKernelTester()
+        .num_tokens(3)
+        .num_experts(7)
+        .num_active_experts(1)
+        .TestF32("gptoss_f32_topk_softmax");
+}
+
+TEST(EXPERT_GROUP, e32_k4) {
+    TopKKernelTester()
+        .num_tokens(64)
+        .num_experts(32)
+        .num_active_experts(4)
+        .TestExpertGroup();
+}
+
+TEST(EXPERT_GROUP, e128_k4) {
+    TopKKernelTester()
+        .num_tokens(300)
+        .num_experts(128)
+        .num_active_experts(4)
+        .TestExpertGroup();
+}
+
+TEST(EXPERT_GROUP, single_token) {
+    TopKKernelTester()
+        .num_tokens(1)
+        .num_experts(32)
+        .num_active_experts(4)
+        .TestExpertGroup();
+}
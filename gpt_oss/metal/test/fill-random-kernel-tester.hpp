@@ -52,6 +52,17 @@ public:
         return max_threadgroups_;
     }
 
+    // Whether the kernel launch is recorded into a command list and encoded from there.
+    [[nodiscard]]
+    FillRandomKernelTester& recorded(bool recorded) {
+        recorded_ = recorded;
+        return *this;
+    }
+
+    bool recorded() const {
+        return recorded_;
+    }
+
     void Validate() const {
         ASSERT_NE(num_elements(), 0);
         ASSERT_NE(threadgroup_size(), 0);
@@ -63,14 +74,22 @@ public:
 
         metal::Buffer output_buffer{device_, num_elements() * sizeof(std::uint32_t)};
 
+        metal::CommandList command_list;
         metal::CommandBuffer command_buffer{command_queue_};
-        command_buffer.encode_launch_u32_fill_random(
-            u32_fill_random_fn_,
-            threadgroup_size(),
-            max_threadgroups(),
-            output_buffer,
-            /*output_offset=*/0,
-            num_elements(), kSeed, kOffset);
+        {
+            metal::CommandBuffer recording_command_buffer{command_list};
+            (recorded() ? recording_command_buffer : command_buffer).encode_launch_u32_fill_random(
+                u32_fill_random_fn_,
+                threadgroup_size(),
+                max_threadgroups(),
+                output_buffer,
+                /*output_offset=*/0,
+                num_elements(), kSeed, kOffset);
+        }
+        if (recorded()) {
+            ASSERT_EQ(command_list.size(), 1);
+            command_buffer.encode_command_list(command_list);
+        }
 
         command_buffer.commit();
         command_buffer.wait_completion();
@@ -96,6 +115,7 @@ private:
     std::uint32_t num_elements_{1};
     std::size_t threadgroup_size_{32};
     std::size_t max_threadgroups_{1};
+    bool recorded_{false};
 };
 
 }  // namespace gptoss
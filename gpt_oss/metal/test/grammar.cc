@@ -0,0 +1,194 @@
+#include <gtest/gtest.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <gpt-oss.h>
+
+#include <internal/grammar.h>
+#include <internal/model.h>
+
+
+namespace {
+
+// Tokenizer with the given text tokens, followed by an <|end|> special token.
+class TestTokenizer {
+public:
+    explicit TestTokenizer(std::initializer_list<std::string_view> tokens) {
+        for (std::string_view token : tokens) {
+            const std::uint16_t token_length = static_cast<std::uint16_t>(token.size());
+            tokens_.append(reinterpret_cast<const char*>(&token_length), sizeof(token_length));
+            tokens_.append(token);
+        }
+
+        tokenizer_ = static_cast<gptoss_tokenizer*>(std::malloc(sizeof(gptoss_tokenizer)));
+        std::memset(tokenizer_, 0, sizeof(gptoss_tokenizer));
+        std::memset(tokenizer_->special_token_id, 0xFF, sizeof(tokenizer_->special_token_id));
+        tokenizer_->ref_count = 1;
+        tokenizer_->tokens_ptr = tokens_.data();
+        tokenizer_->num_text_tokens = static_cast<std::uint32_t>(tokens.size());
+        tokenizer_->num_special_tokens = 1;
+        tokenizer_->special_token_id[gptoss_special_token_end - 1] = end_token_id();
+        EXPECT_EQ(gptoss_tokenizer_build_trie(tokenizer_), gptoss_status_success);
+    }
+
+    ~TestTokenizer() {
+        gptoss_tokenizer_release(tokenizer_);
+    }
+
+    gptoss_tokenizer_t handle() const {
+        return tokenizer_;
+    }
+
+    std::uint32_t end_token_id() const {
+        return tokenizer_->num_text_tokens;
+    }
+
+private:
+    std::string tokens_;
+    gptoss_tokenizer* tokenizer_{nullptr};
+};
+
+class Grammar {
+public:
+    Grammar(const TestTokenizer& tokenizer, std::string_view text) : tokenizer_(tokenizer) {
+        status_ = gptoss_grammar_create(tokenizer.handle(), text.data(), text.size(), &grammar_);
+    }
+
+    ~Grammar() {
+        gptoss_grammar_release(grammar_);
+    }
+
+    gptoss_status status() const {
+        return status_;
+    }
+
+    gptoss_status accept(std::uint32_t token_id) {
+        return gptoss_grammar_accept_token(grammar_, token_id);
+    }
+
+    gptoss_status reset() {
+        return gptoss_grammar_reset(grammar_);
+    }
+
+    // Returns the IDs of the allowed tokens.
+    std::vector<std::uint32_t> allowed_tokens() const {
+        const std::uint32_t num_tokens = tokenizer_.end_token_id() + 1;
+        std::vector<std::uint32_t> token_mask((num_tokens + 31) / 32);
+        EXPECT_EQ(gptoss_grammar_get_token_mask(grammar_, token_mask.data()), gptoss_status_success);
+
+        std::vector<std::uint32_t> allowed_tokens;
+        for (std::uint32_t t = 0; t < num_tokens; t++) {
+            if (token_mask[t / 32] & (UINT32_C(1) << (t % 32))) {
+                allowed_tokens.push_back(t);
+            }
+        }
+        return allowed_tokens;
+    }
+
+private:
+    const TestTokenizer& tokenizer_;
+    gptoss_grammar_t grammar_{nullptr};
+    gptoss_status status_{gptoss_status_success};
+};
+
+using Tokens = std::vector<std::uint32_t>;
+
+}  // namespace
+
+
+TEST(GRAMMAR, alternatives) {
+    const TestTokenizer tokenizer{"y", "yes", "n", "no", "nope", "e", "s", "o", "x"};
+    Grammar grammar{tokenizer, R"(root ::= "yes" | "no")"};
+    ASSERT_EQ(grammar.status(), gptoss_status_success);
+
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 1, 2, 3}));
+    ASSERT_EQ(grammar.accept(0), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{5}));
+    ASSERT_EQ(grammar.accept(5), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{6}));
+    ASSERT_EQ(grammar.accept(6), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{tokenizer.end_token_id()}));
+    ASSERT_EQ(grammar.accept(tokenizer.end_token_id()), gptoss_status_success);
+
+    ASSERT_EQ(grammar.reset(), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 1, 2, 3}));
+    ASSERT_EQ(grammar.accept(3), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{tokenizer.end_token_id()}));
+}
+
+TEST(GRAMMAR, reject_token) {
+    const TestTokenizer tokenizer{"a", "b", "ab"};
+    Grammar grammar{tokenizer, R"(root ::= "ab")"};
+    ASSERT_EQ(grammar.status(), gptoss_status_success);
+
+    EXPECT_EQ(grammar.accept(1), gptoss_status_invalid_argument);
+    EXPECT_EQ(grammar.accept(tokenizer.end_token_id()), gptoss_status_invalid_argument);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 2}));
+}
+
+TEST(GRAMMAR, repetition) {
+    const TestTokenizer tokenizer{"1", "12", "a", "1a", ",", "1,2"};
+    Grammar grammar{tokenizer, R"(
+        # Comma-separated list of numbers
+        root ::= number ("," number)*
+        number ::= [0-9]+
+    )"};
+    ASSERT_EQ(grammar.status(), gptoss_status_success);
+
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 1, 5}));
+    ASSERT_EQ(grammar.accept(5), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 1, 4, 5, tokenizer.end_token_id()}));
+    ASSERT_EQ(grammar.accept(4), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 1, 5}));
+}
+
+TEST(GRAMMAR, optional_and_classes) {
+    const TestTokenizer tokenizer{"-", "-1", "1", "x", "\n", "\t"};
+    Grammar grammar{tokenizer, R"(root ::= "-"? [^-a-z\t] .)"};
+    ASSERT_EQ(grammar.status(), gptoss_status_success);
+
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 1, 2, 4}));
+    ASSERT_EQ(grammar.accept(1), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 2, 3, 4, 5}));
+}
+
+TEST(GRAMMAR, json_array) {
+    const TestTokenizer tokenizer{"[", "]", "[]", "[[", "]]", ",", " ", "1", "true", "\"", "\"a\"", "a"};
+    Grammar grammar{tokenizer, R"(
+        root ::= value
+        value ::= array | "true" | [0-9]+ | "\"" [a-z]* "\""
+        array ::= "[" ws (value ws ("," ws value ws)*)? "]"
+        ws ::= " "*
+    )"};
+    ASSERT_EQ(grammar.status(), gptoss_status_success);
+
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 2, 3, 7, 8, 9, 10}));
+    ASSERT_EQ(grammar.accept(3), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{0, 1, 2, 3, 4, 6, 7, 8, 9, 10}));
+    ASSERT_EQ(grammar.accept(10), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{1, 4, 5, 6}));
+    ASSERT_EQ(grammar.accept(4), gptoss_status_success);
+    EXPECT_EQ(grammar.allowed_tokens(), (Tokens{tokenizer.end_token_id()}));
+}
+
+TEST(GRAMMAR, invalid_grammar) {
+    const TestTokenizer tokenizer{"a"};
+    EXPECT_EQ(Grammar(tokenizer, R"(root ::= other)").status(), gptoss_status_invalid_argument);
+    EXPECT_EQ(Grammar(tokenizer, R"(start ::= "a")").status(), gptoss_status_invalid_argument);
+    EXPECT_EQ(Grammar(tokenizer, R"(root ::= "a)").status(), gptoss_status_invalid_argument);
+    EXPECT_EQ(Grammar(tokenizer, R"(root ::= ("a")").status(), gptoss_status_invalid_argument);
+    EXPECT_EQ(Grammar(tokenizer, R"(root ::= "a" root ::= "b")").status(), gptoss_status_invalid_argument);
+}
+
+TEST(GRAMMAR, left_recursion) {
+    const TestTokenizer tokenizer{"a"};
+    EXPECT_EQ(Grammar(tokenizer, R"(root ::= root "a" | "a")").status(), gptoss_status_unsupported_argument);
+    EXPECT_EQ(Grammar(tokenizer, R"(root ::= ("a"?)*)").status(), gptoss_status_unsupported_argument);
+}
@@ -5,6 +5,7 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 
 #include <internal/datatype.hpp>
 #include <internal/metal.hpp>
@@ -92,6 +93,60 @@ public:
         return threadgroup_size_;
     }
 
+    [[nodiscard]]
+    MatMulKernelTester& num_q_heads(std::uint32_t num_q_heads) {
+        num_q_heads_ = num_q_heads;
+        return *this;
+    }
+
+    std::uint32_t num_q_heads() const {
+        return num_q_heads_;
+    }
+
+    [[nodiscard]]
+    MatMulKernelTester& num_kv_heads(std::uint32_t num_kv_heads) {
+        num_kv_heads_ = num_kv_heads;
+        return *this;
+    }
+
+    std::uint32_t num_kv_heads() const {
+        return num_kv_heads_;
+    }
+
+    [[nodiscard]]
+    MatMulKernelTester& head_dim(std::uint32_t head_dim) {
+        head_dim_ = head_dim;
+        return *this;
+    }
+
+    std::uint32_t head_dim() const {
+        return head_dim_;
+    }
+
+    [[nodiscard]]
+    MatMulKernelTester& token_offset(std::uint32_t token_offset) {
+        token_offset_ = token_offset;
+        return *this;
+    }
+
+    std::uint32_t token_offset() const {
+        return token_offset_;
+    }
+
+    std::uint32_t max_tokens() const {
+        return token_offset() + num_tokens();
+    }
+
+    [[nodiscard]]
+    MatMulKernelTester& frequency_base(float frequency_base) {
+        frequency_base_ = frequency_base;
+        return *this;
+    }
+
+    float frequency_base() const {
+        return frequency_base_;
+    }
+
     void Validate(std::uint32_t vec_size) const {
         ASSERT_NE(num_rows(), 0);
         ASSERT_NE(num_cols(), 0);
@@ -116,9 +171,22 @@ public:
         metal::Buffer bias_buffer{device_, num_rows() * sizeof(gptoss_bfloat16)};
         metal::Buffer output_buffer{device_, num_tokens() * num_rows() * sizeof(float)};
         metal::Buffer output_buffer_copy{device_, num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer kv_buffer{device_, num_kv_heads() * max_tokens() * 2 * head_dim() * sizeof(float)};
+        metal::Buffer rope_table_buffer{device_, max_tokens() * head_dim() * sizeof(float)};
         metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
         std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
 
+        float* rope_table_ptr = static_cast<float*>(rope_table_buffer.ptr());
+        for (std::uint32_t t = 0; t < max_tokens(); t++) {
+            for (std::uint32_t d = 0; d < head_dim(); d += 2) {
+                const double inv_freq = 1.0 /
+                    std::pow(static_cast<double>(frequency_base()), static_cast<double>(d) / static_cast<double>(head_dim()));
+                const double phi = static_cast<double>(t) * inv_freq;
+                rope_table_ptr[t * head_dim() + d] = static_cast<float>(std::cos(phi));
+                rope_table_ptr[t * head_dim() + d + 1] = static_cast<float>(std::sin(phi));
+            }
+        }
+
         command_buffer_initialize.encode_launch_f32_fill_random(
             f32_fill_random_fn_,
             /*threadgroup_size=*/0,
@@ -189,8 +257,11 @@ public:
                     /*input_offset=*/0, weight_buffer.handle(),
                     /*weight_offset=*/0, bias_buffer.handle(),
                     /*bias_offset=*/0, output_buffer.handle(),
-                    /*output_offset=*/0, control_buffer.handle(),
-                    /*control_offset=*/0, num_tokens(), num_cols(), num_rows()),
+                    /*output_offset=*/0, kv_buffer.handle(),
+                    /*kv_offset=*/0, rope_table_buffer.handle(),
+                    /*rope_table_offset=*/0, control_buffer.handle(),
+                    /*control_offset=*/0, num_tokens(), num_cols(),
+                    num_q_heads(), num_kv_heads(), head_dim(), token_offset(), max_tokens()),
                 "gptoss_metal_command_buffer_encode_launch_f32_bf16w_dense_matmul_qkv");
             break;
         case MatMulKernelType::PREFILL_ATTN_OUTPUT_OPTIMIZED:
@@ -227,6 +298,10 @@ public:
         const gptoss_bfloat16* bias_ptr = static_cast<const gptoss_bfloat16*>(bias_buffer.ptr());
         const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
         const float* output_ptr_copy = static_cast<const float*>(output_buffer_copy.ptr());
+        if (kernel_type == MatMulKernelType::PREFILL_QKV_OPTIMIZED) {
+            ValidateQKV(input_ptr, weight_ptr, bias_ptr, output_ptr, static_cast<const float*>(kv_buffer.ptr()));
+            return;
+        }
         for (size_t t = 0; t < num_tokens(); t++) {
             for (size_t r = 0; r < num_rows(); r++) {
                 double ref_sum = upcast<double>(bias_ptr[r]);
@@ -248,6 +323,59 @@ public:
     }
 
 private:
+    // Checks the fused QKV epilogue: Q heads are stored RoPE'd in the output buffer, while K heads (RoPE'd) and
+    // V heads are stored only in the KV cache at position token_offset + t.
+    void ValidateQKV(const float* input_ptr, const gptoss_bfloat16* weight_ptr, const gptoss_bfloat16* bias_ptr,
+                     const float* output_ptr, const float* kv_ptr) const
+    {
+        ASSERT_EQ(num_rows(), (num_q_heads() + 2 * num_kv_heads()) * head_dim());
+
+        std::vector<double> ref_row(num_rows());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            for (std::uint32_t r = 0; r < num_rows(); r++) {
+                double ref_sum = upcast<double>(bias_ptr[r]);
+                for (std::uint32_t c = 0; c < num_cols(); c++) {
+                    const double ref_weight = upcast<double>(weight_ptr[r * num_cols() + c]);
+                    const double input_value = upcast<double>(input_ptr[t * num_cols() + c]);
+                    ref_sum = std::fma(input_value, ref_weight, ref_sum);
+                }
+                ref_row[r] = ref_sum;
+            }
+
+            const std::uint32_t token_idx = token_offset() + t;
+            for (std::uint32_t h = 0; h < num_q_heads() + 2 * num_kv_heads(); h++) {
+                for (std::uint32_t d = 0; d < head_dim(); d += 2) {
+                    double ref_real = ref_row[h * head_dim() + d];
+                    double ref_imag = ref_row[h * head_dim() + d + 1];
+                    if (h < num_q_heads() + num_kv_heads()) {
+                        const double inv_freq = 1.0 /
+                            std::pow(static_cast<double>(frequency_base()), static_cast<double>(d) / static_cast<double>(head_dim()));
+                        const double phi = static_cast<double>(token_idx) * inv_freq;
+                        const double real = ref_real;
+                        const double imag = ref_imag;
+                        ref_real = real * std::cos(phi) - imag * std::sin(phi);
+                        ref_imag = real * std::sin(phi) + imag * std::cos(phi);
+                    }
+
+                    const float* result_ptr;
+                    if (h < num_q_heads()) {
+                        result_ptr = output_ptr + t * num_rows() + h * head_dim();
+                    } else if (h < num_q_heads() + num_kv_heads()) {
+                        const std::uint32_t kv_head = h - num_q_heads();
+                        result_ptr = kv_ptr + (kv_head * max_tokens() + token_idx) * 2 * head_dim();
+                    } else {
+                        const std::uint32_t kv_head = h - num_q_heads() - num_kv_heads();
+                        result_ptr = kv_ptr + (kv_head * max_tokens() + token_idx) * 2 * head_dim() + head_dim();
+                    }
+                    ASSERT_NEAR_ABS_REL(upcast<double>(result_ptr[d]), ref_real, 2.0e-4, 1.0e-4)
+                        << "token " << t << ", head " << h << ", dim " << d;
+                    ASSERT_NEAR_ABS_REL(upcast<double>(result_ptr[d + 1]), ref_imag, 2.0e-4, 1.0e-4)
+                        << "token " << t << ", head " << h << ", dim " << d + 1;
+                }
+            }
+        }
+    }
+
     static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
     static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
     static constexpr float fp4e2m1_to_fp32[16] = {
@@ -268,6 +396,11 @@ private:
     std::uint32_t num_rows_{1};
     std::uint32_t num_cols_{32};
     std::size_t threadgroup_size_{32};
+    std::uint32_t num_q_heads_{64};
+    std::uint32_t num_kv_heads_{8};
+    std::uint32_t head_dim_{64};
+    std::uint32_t token_offset_{0};
+    float frequency_base_{50000.0f};
 };
 
 }  // namespace gptoss
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <internal/datatype.hpp>
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+
+namespace gptoss {
+
+class MoEMatMulKernelTester {
+public:
+    MoEMatMulKernelTester() { }
+
+    MoEMatMulKernelTester(const MoEMatMulKernelTester&) = delete;
+    MoEMatMulKernelTester(MoEMatMulKernelTester&&) = delete;
+    MoEMatMulKernelTester& operator=(const MoEMatMulKernelTester&) = delete;
+    MoEMatMulKernelTester& operator=(MoEMatMulKernelTester&&) = delete;
+
+    [[nodiscard]]
+    MoEMatMulKernelTester& num_rows(std::uint32_t num_rows) {
+        num_rows_ = num_rows;
+        return *this;
+    }
+
+    std::uint32_t num_rows() const {
+        return num_rows_;
+    }
+
+    [[nodiscard]]
+    MoEMatMulKernelTester& num_cols(std::uint32_t num_cols) {
+        num_cols_ = num_cols;
+        return *this;
+    }
+
+    std::uint32_t num_cols() const {
+        return num_cols_;
+    }
+
+    [[nodiscard]]
+    MoEMatMulKernelTester& num_tokens(std::uint32_t num_tokens) {
+        num_tokens_ = num_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_tokens() const {
+        return num_tokens_;
+    }
+
+    [[nodiscard]]
+    MoEMatMulKernelTester& num_experts(std::uint32_t num_experts) {
+        num_experts_ = num_experts;
+        return *this;
+    }
+
+    std::uint32_t num_experts() const {
+        return num_experts_;
+    }
+
+    [[nodiscard]]
+    MoEMatMulKernelTester& num_active_experts(std::uint32_t num_active_experts) {
+        num_active_experts_ = num_active_experts;
+        return *this;
+    }
+
+    std::uint32_t num_active_experts() const {
+        return num_active_experts_;
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_rows(), 0);
+        ASSERT_EQ(num_cols() % 32, 0);
+        // Every thread of a simdgroup reduces at least one block of 32 columns.
+        ASSERT_GE(num_cols(), 32 * 32);
+        ASSERT_NE(num_tokens(), 0);
+        ASSERT_GE(num_active_experts(), 2);
+        ASSERT_LE(num_active_experts(), 2 + kNumSharedExperts);
+        ASSERT_GE(num_experts(), 3 + kNumSharedExperts);
+    }
+
+    // Checks that gptoss_f32_mf4w_moe_grouped_matmul_swiglu computes the same outputs as
+    // gptoss_f32_mf4w_moe_matmul_swiglu.
+    void TestGroupedSwiGLU() const {
+        TestGrouped(/*swiglu=*/true);
+    }
+
+    // Checks that gptoss_f32_mf4w_moe_grouped_matmul computes the same outputs as gptoss_f32_mf4w_moe_matmul.
+    void TestGrouped() const {
+        TestGrouped(/*swiglu=*/false);
+    }
+
+private:
+    // Routes the tokens with a skewed distribution over the experts:
+    // - Every token goes to expert 0, which is split into several tasks, the last of them partial.
+    // - The first few tokens go to expert 1, which gets a single partial task, and the rest go to expert 2.
+    // - The other active experts of each token are spread over the next kNumSharedExperts experts.
+    // - The remaining experts get no tokens.
+    void InitializeRouting(gptoss_expert_prediction* expert_ptr) const {
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            gptoss_expert_prediction* token_experts = expert_ptr + t * num_active_experts();
+            token_experts[0] = gptoss_expert_prediction{.expert_id = 0, .score = 0.5f};
+            token_experts[1] = gptoss_expert_prediction{
+                .expert_id = t < kNumPartialGroupTokens ? 1u : 2u,
+                .score = 0.25f,
+            };
+            for (std::uint32_t k = 2; k < num_active_experts(); k++) {
+                token_experts[k] = gptoss_expert_prediction{
+                    .expert_id = 3 + (t + k) % kNumSharedExperts,
+                    .score = 0.25f / static_cast<float>(num_active_experts() - 2),
+                };
+            }
+        }
+    }
+
+    void TestGrouped(bool swiglu) const {
+        Validate();
+
+        const std::uint32_t num_assignments = num_tokens() * num_active_experts();
+        const std::uint32_t max_tasks = EXPERT_GROUP_MAX_TASKS(num_assignments, num_experts());
+        // The SwiGLU kernel computes a pair of interleaved swish and linear rows for each output channel.
+        const std::uint32_t num_weight_rows = swiglu ? 2 * num_rows() : num_rows();
+        const std::uint32_t num_blocks_per_row = num_cols() / 32;
+        // Each expert stores its MXFP4 weight blocks, then their scales, then the biases.
+        const std::size_t weight_block_size = num_weight_rows * num_blocks_per_row * 16;
+        const std::size_t weight_scale_size = num_weight_rows * num_blocks_per_row;
+        const std::size_t bias_size = num_weight_rows * sizeof(gptoss_bfloat16);
+        const std::uint32_t expert_stride =
+            static_cast<std::uint32_t>((weight_block_size + weight_scale_size + bias_size + 15) / 16 * 16);
+        // The down projection reads a separate input for every active expert of a token.
+        const std::size_t num_input_elements = (swiglu ? 1 : num_active_experts()) * num_tokens() * num_cols();
+        const std::size_t num_output_elements = num_active_experts() * num_tokens() * num_rows();
+
+        metal::Buffer input_buffer{device_, num_input_elements * sizeof(float)};
+        metal::Buffer expert_buffer{device_, num_assignments * sizeof(gptoss_expert_prediction)};
+        metal::Buffer expert_offset_buffer{device_, (num_experts() + 1) * sizeof(std::uint32_t)};
+        metal::Buffer expert_assignment_buffer{device_, num_assignments * sizeof(std::uint32_t)};
+        metal::Buffer expert_task_buffer{device_, max_tasks * sizeof(gptoss_expert_group_task)};
+        metal::Buffer weight_buffer{device_, static_cast<std::size_t>(num_experts()) * expert_stride};
+        metal::Buffer ref_output_buffer{device_, num_output_elements * sizeof(float)};
+        metal::Buffer output_buffer{device_, num_output_elements * sizeof(float)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        metal::CommandBuffer command_buffer_initialize{command_queue_};
+        command_buffer_initialize.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer, /*output_offset=*/0,
+            num_input_elements, kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0f);
+        // Any 4-bit value is a valid MXFP4 weight, and the scales and biases are overwritten below.
+        command_buffer_initialize.encode_launch_u32_fill_random(
+            u32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/weight_buffer, /*output_offset=*/0,
+            static_cast<std::size_t>(num_experts()) * expert_stride / sizeof(std::uint32_t), kSeed + 1, /*offset=*/0);
+        // Poison the output of the grouped kernel, so that any output it misses fails the comparison.
+        command_buffer_initialize.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/output_buffer, /*output_offset=*/0,
+            num_output_elements, kSeed + 2, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0f);
+        command_buffer_initialize.commit();
+        command_buffer_initialize.wait_completion();
+
+        std::byte* weight_ptr = static_cast<std::byte*>(weight_buffer.ptr());
+        for (std::uint32_t e = 0; e < num_experts(); e++) {
+            std::byte* expert_weight_ptr = weight_ptr + static_cast<std::size_t>(e) * expert_stride;
+            std::uint8_t* scale_ptr = reinterpret_cast<std::uint8_t*>(expert_weight_ptr + weight_block_size);
+            for (std::size_t i = 0; i < weight_scale_size; i++) {
+                // Power-of-two scales in [1/16, 1/2].
+                scale_ptr[i] = static_cast<std::uint8_t>(123 + (i + e) % 4);
+            }
+            gptoss_bfloat16* bias_ptr =
+                reinterpret_cast<gptoss_bfloat16*>(expert_weight_ptr + weight_block_size + weight_scale_size);
+            for (std::uint32_t r = 0; r < num_weight_rows; r++) {
+                const float bias = static_cast<float>(static_cast<int>((r + 3 * e) % 17) - 8) * 0.0625f;
+                bias_ptr[r] = gptoss_bfloat16{.bits = static_cast<std::uint16_t>(std::bit_cast<std::uint32_t>(bias) >> 16)};
+            }
+        }
+        InitializeRouting(static_cast<gptoss_expert_prediction*>(expert_buffer.ptr()));
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        Check(gptoss_metal_command_buffer_encode_launch_expert_group(
+                command_buffer.handle(),
+                expert_group_fn_.handle(),
+                expert_buffer.handle(),
+                /*expert_offset=*/0,
+                expert_offset_buffer.handle(),
+                /*expert_offset_offset=*/0,
+                expert_assignment_buffer.handle(),
+                /*expert_assignment_offset=*/0,
+                expert_task_buffer.handle(),
+                /*expert_task_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                num_tokens(),
+                num_experts(),
+                num_active_experts()),
+            "gptoss_metal_command_buffer_encode_launch_expert_group");
+
+        if (swiglu) {
+            Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu(
+                    command_buffer.handle(),
+                    f32_mf4w_moe_matmul_swiglu_fn_.handle(),
+                    /*threadgroup_size=*/0,
+                    input_buffer.handle(),
+                    /*input_offset=*/0,
+                    expert_buffer.handle(),
+                    /*expert_offset=*/0,
+                    weight_buffer.handle(),
+                    /*weight_block_offset=*/0,
+                    weight_buffer.handle(),
+                    /*weight_scale_offset=*/weight_block_size,
+                    weight_buffer.handle(),
+                    /*bias_offset=*/weight_block_size + weight_scale_size,
+                    ref_output_buffer.handle(),
+                    /*output_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    kSwiGLULimit,
+                    expert_stride,
+                    num_tokens(),
+                    num_active_experts(),
+                    num_cols(),
+                    num_rows()),
+                "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul_swiglu");
+            Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul_swiglu(
+                    command_buffer.handle(),
+                    f32_mf4w_moe_grouped_matmul_swiglu_fn_.handle(),
+                    /*threadgroup_size=*/0,
+                    input_buffer.handle(),
+                    /*input_offset=*/0,
+                    expert_task_buffer.handle(),
+                    /*expert_task_offset=*/0,
+                    expert_assignment_buffer.handle(),
+                    /*expert_assignment_offset=*/0,
+                    weight_buffer.handle(),
+                    /*weight_block_offset=*/0,
+                    weight_buffer.handle(),
+                    /*weight_scale_offset=*/weight_block_size,
+                    weight_buffer.handle(),
+                    /*bias_offset=*/weight_block_size + weight_scale_size,
+                    output_buffer.handle(),
+                    /*output_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    kSwiGLULimit,
+                    expert_stride,
+                    num_tokens(),
+                    num_experts(),
+                    num_active_experts(),
+                    num_cols(),
+                    num_rows()),
+                "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul_swiglu");
+        } else {
+            Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul(
+                    command_buffer.handle(),
+                    f32_mf4w_moe_matmul_fn_.handle(),
+                    /*threadgroup_size=*/0,
+                    input_buffer.handle(),
+                    /*input_offset=*/0,
+                    expert_buffer.handle(),
+                    /*expert_offset=*/0,
+                    weight_buffer.handle(),
+                    /*weight_block_offset=*/0,
+                    weight_buffer.handle(),
+                    /*weight_scale_offset=*/weight_block_size,
+                    weight_buffer.handle(),
+                    /*bias_offset=*/weight_block_size + weight_scale_size,
+                    ref_output_buffer.handle(),
+                    /*output_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    expert_stride,
+                    num_tokens(),
+                    num_active_experts(),
+                    num_cols(),
+                    num_rows()),
+                "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_matmul");
+            Check(gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul(
+                    command_buffer.handle(),
+                    f32_mf4w_moe_grouped_matmul_fn_.handle(),
+                    /*threadgroup_size=*/0,
+                    input_buffer.handle(),
+                    /*input_offset=*/0,
+                    expert_task_buffer.handle(),
+                    /*expert_task_offset=*/0,
+                    expert_assignment_buffer.handle(),
+                    /*expert_assignment_offset=*/0,
+                    weight_buffer.handle(),
+                    /*weight_block_offset=*/0,
+                    weight_buffer.handle(),
+                    /*weight_scale_offset=*/weight_block_size,
+                    weight_buffer.handle(),
+                    /*bias_offset=*/weight_block_size + weight_scale_size,
+                    output_buffer.handle(),
+                    /*output_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    expert_stride,
+                    num_tokens(),
+                    num_experts(),
+                    num_active_experts(),
+                    num_cols(),
+                    num_rows()),
+                "gptoss_metal_command_buffer_encode_launch_f32_mf4w_moe_grouped_matmul");
+        }
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        // Both kernels accumulate every output in the same order, so the outputs match exactly.
+        const float* ref_output_ptr = static_cast<const float*>(ref_output_buffer.ptr());
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        const gptoss_expert_prediction* expert_ptr = static_cast<const gptoss_expert_prediction*>(expert_buffer.ptr());
+        for (std::uint32_t k = 0; k < num_active_experts(); k++) {
+            for (std::uint32_t t = 0; t < num_tokens(); t++) {
+                const std::uint32_t expert_id = expert_ptr[t * num_active_experts() + k].expert_id;
+                for (std::uint32_t r = 0; r < num_rows(); r++) {
+                    const std::size_t i = (k * num_tokens() + t) * num_rows() + r;
+                    ASSERT_EQ(output_ptr[i], ref_output_ptr[i])
+                        << "at row " << r << " / " << num_rows() << ", token " << t << " / " << num_tokens()
+                        << ", active expert " << k << " (expert " << expert_id << ")";
+                }
+            }
+        }
+    }
+
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+    static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
+    static constexpr float kSwiGLULimit = 7.0f;
+    // Number of tokens routed to the expert with a single partial task.
+    static constexpr std::uint32_t kNumPartialGroupTokens = MOE_GROUP_Bt / 2 - 1;
+    // Number of experts that share the active experts of the tokens past the first two.
+    static constexpr std::uint32_t kNumSharedExperts = 7;
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
+    metal::Function u32_fill_random_fn_{library_, "gptoss_u32_fill_random"};
+    metal::Function expert_group_fn_{library_, "gptoss_expert_group"};
+    metal::Function f32_mf4w_moe_matmul_swiglu_fn_{library_, "gptoss_f32_mf4w_moe_matmul_swiglu"};
+    metal::Function f32_mf4w_moe_matmul_fn_{library_, "gptoss_f32_mf4w_moe_matmul"};
+    metal::Function f32_mf4w_moe_grouped_matmul_swiglu_fn_{library_, "gptoss_f32_mf4w_moe_grouped_matmul_swiglu"};
+    metal::Function f32_mf4w_moe_grouped_matmul_fn_{library_, "gptoss_f32_mf4w_moe_grouped_matmul"};
+    std::uint32_t num_rows_{1};
+    std::uint32_t num_cols_{32 * 32};
+    std::uint32_t num_tokens_{1};
+    std::uint32_t num_experts_{16};
+    std::uint32_t num_active_experts_{4};
+};
+
+}  // namespace gptoss
@@ -2,9 +2,11 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #include <internal/datatype.hpp>
 #include <internal/metal.hpp>
@@ -90,6 +92,16 @@ public:
         return token_offset_;
     }
 
+    [[nodiscard]]
+    RoPEKernelTester& max_tokens(std::uint32_t max_tokens) {
+        max_tokens_ = max_tokens;
+        return *this;
+    }
+
+    std::uint32_t max_tokens() const {
+        return max_tokens_ != 0 ? max_tokens_ : token_offset() + num_tokens();
+    }
+
     [[nodiscard]]
     RoPEKernelTester& frequency_base(float frequency_base) {
         frequency_base_ = frequency_base;
@@ -112,9 +124,12 @@ public:
 
         metal::Buffer activations_buffer{device_, (num_tokens() * num_qkv_heads() + num_qk_heads()) * head_dim() * sizeof(float)};
         metal::Buffer ref_activations_buffer{device_, (num_tokens() * num_qkv_heads() + num_qk_heads()) * head_dim() * sizeof(float)};
+        metal::Buffer rope_table_buffer{device_, (token_offset() + num_tokens()) * head_dim() * sizeof(float)};
         metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
         std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
 
+        InitRoPETable(static_cast<float*>(rope_table_buffer.ptr()));
+
         metal::CommandBuffer command_buffer{command_queue_};
 
         command_buffer.encode_launch_f32_fill_random(
@@ -141,13 +156,10 @@ public:
                 threadgroup_size(),
                 activations_buffer.handle(),
                 /*activations_offset=*/0,
+                rope_table_buffer.handle(),
+                /*rope_table_offset=*/0,
                 control_buffer.handle(),
                 /*control_offset=*/0,
-                frequency_base(),
-                /*interpolation_scale=*/1.0f,
-                /*yarn_offset=*/0.0f,
-                /*yarn_scale=*/1.0f,
-                /*yarn_multiplier=*/1.0f,
                 /*num_tokens=*/num_tokens(),
                 /*num_q_heads=*/num_q_heads(),
                 /*num_kv_heads=*/num_kv_heads(),
@@ -188,7 +200,115 @@ public:
         }
     }
 
+    void TestF32KVScatter() const {
+        Validate();
+        ASSERT_LE(token_offset() + num_tokens(), max_tokens());
+
+        const std::size_t num_activations = num_tokens() * num_qkv_heads() * head_dim();
+        const std::size_t num_kv_elements = num_kv_heads() * max_tokens() * 2 * head_dim();
+        metal::Buffer activations_buffer{device_, num_activations * sizeof(float)};
+        metal::Buffer ref_activations_buffer{device_, num_activations * sizeof(float)};
+        metal::Buffer kv_buffer{device_, std::max<std::size_t>(num_kv_elements, 1) * sizeof(float)};
+        metal::Buffer rope_table_buffer{device_, (token_offset() + num_tokens()) * head_dim() * sizeof(float)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+        std::memset(kv_buffer.ptr(), 0, num_kv_elements * sizeof(float));
+
+        InitRoPETable(static_cast<float*>(rope_table_buffer.ptr()));
+
+        metal::CommandBuffer command_buffer{command_queue_};
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/activations_buffer,
+            /*output_offset=*/0,
+            num_activations,
+            kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/ref_activations_buffer,
+            /*output_offset=*/0,
+            num_activations,
+            kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_rope_kv_scatter(
+                command_buffer.handle(),
+                f32_rope_kv_scatter_fn_.handle(),
+                threadgroup_size(),
+                activations_buffer.handle(),
+                /*activations_offset=*/0,
+                kv_buffer.handle(),
+                /*kv_offset=*/0,
+                rope_table_buffer.handle(),
+                /*rope_table_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                /*num_tokens=*/num_tokens(),
+                /*num_q_heads=*/num_q_heads(),
+                /*num_kv_heads=*/num_kv_heads(),
+                head_dim(),
+                /*token_offset=*/token_offset(),
+                /*max_tokens=*/max_tokens()),
+            "gptoss_metal_command_buffer_encode_launch_f32_rope_kv_scatter");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const float* ref_activations_ptr = static_cast<const float*>(ref_activations_buffer.ptr());
+        const float* activations_ptr = static_cast<const float*>(activations_buffer.ptr());
+        const float* kv_ptr = static_cast<const float*>(kv_buffer.ptr());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            for (std::uint32_t h = 0; h < num_qkv_heads(); h++) {
+                for (std::uint32_t d = 0; d < head_dim(); d += 2) {
+                    const double real = static_cast<double>(ref_activations_ptr[(t * num_qkv_heads() + h) * head_dim() + d]);
+                    const double imag = static_cast<double>(ref_activations_ptr[(t * num_qkv_heads() + h) * head_dim() + d + 1]);
+                    double ref_real = real;
+                    double ref_imag = imag;
+                    if (h < num_qk_heads()) {
+                        const double inv_freq = 1.0 /
+                            std::pow(static_cast<double>(frequency_base()), static_cast<double>(d) / static_cast<double>(head_dim()));
+                        const double phi = static_cast<double>(t + token_offset()) * inv_freq;
+                        ref_real = real * std::cos(phi) - imag * std::sin(phi);
+                        ref_imag = real * std::sin(phi) + imag * std::cos(phi);
+                    }
+
+                    const float* output_ptr;
+                    if (h < num_q_heads()) {
+                        output_ptr = activations_ptr + (t * num_qkv_heads() + h) * head_dim() + d;
+                    } else if (h < num_qk_heads()) {
+                        const std::uint32_t kv_head = h - num_q_heads();
+                        output_ptr = kv_ptr + (kv_head * max_tokens() + token_offset() + t) * 2 * head_dim() + d;
+                    } else {
+                        const std::uint32_t kv_head = h - num_qk_heads();
+                        output_ptr = kv_ptr + (kv_head * max_tokens() + token_offset() + t) * 2 * head_dim() + head_dim() + d;
+                    }
+                    ASSERT_NEAR(static_cast<double>(output_ptr[0]), ref_real, std::abs(ref_real) * 1.0e-4)
+                        << "at token " << t << " / " << num_tokens() << ", head " << h;
+                    ASSERT_NEAR(static_cast<double>(output_ptr[1]), ref_imag, std::abs(ref_imag) * 1.0e-4)
+                        << "at token " << t << " / " << num_tokens() << ", head " << h;
+                }
+            }
+        }
+    }
+
 private:
+    void InitRoPETable(float* rope_table_ptr) const {
+        for (std::uint32_t t = 0; t < token_offset() + num_tokens(); t++) {
+            for (std::uint32_t d = 0; d < head_dim(); d += 2) {
+                const double inv_freq = 1.0 /
+                    std::pow(static_cast<double>(frequency_base()), static_cast<double>(d) / static_cast<double>(head_dim()));
+                const double phi = static_cast<double>(t) * inv_freq;
+                rope_table_ptr[t * head_dim() + d] = static_cast<float>(std::cos(phi));
+                rope_table_ptr[t * head_dim() + d + 1] = static_cast<float>(std::sin(phi));
+            }
+        }
+    }
+
     static constexpr uint64_t kSeed{UINT64_C(1019827666124465388)};
     static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
 
@@ -197,12 +317,14 @@ private:
     metal::Library library_{device_};
     metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
     metal::Function f32_rope_fn_{library_, "gptoss_f32_rope"};
+    metal::Function f32_rope_kv_scatter_fn_{library_, "gptoss_f32_rope_kv_scatter"};
     std::size_t threadgroup_size_{32};
     std::uint32_t head_dim_{64};
     std::uint32_t num_q_heads_{1};
     std::uint32_t num_kv_heads_{0};
     std::uint32_t num_tokens_{1};
     std::uint32_t token_offset_{0};
+    std::uint32_t max_tokens_{0};
     float frequency_base_{50000.0f};
 };
 
@@ -0,0 +1,340 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+#include <internal/rng.hpp>
+
+
+namespace gptoss {
+
+class SampleKernelTester {
+public:
+    SampleKernelTester() { }
+
+    SampleKernelTester(const SampleKernelTester&) = delete;
+    SampleKernelTester(SampleKernelTester&&) = delete;
+    SampleKernelTester& operator=(const SampleKernelTester&) = delete;
+    SampleKernelTester& operator=(SampleKernelTester&&) = delete;
+
+    [[nodiscard]]
+    SampleKernelTester& num_channels(std::uint32_t num_channels) {
+        num_channels_ = num_channels;
+        return *this;
+    }
+
+    std::uint32_t num_channels() const {
+        return num_channels_;
+    }
+
+    [[nodiscard]]
+    SampleKernelTester& max_threadgroups(std::size_t max_threadgroups) {
+        max_threadgroups_ = max_threadgroups;
+        return *this;
+    }
+
+    std::size_t max_threadgroups() const {
+        return max_threadgroups_;
+    }
+
+    [[nodiscard]]
+    SampleKernelTester& temperature(float temperature) {
+        temperature_ = temperature;
+        return *this;
+    }
+
+    float temperature() const {
+        return temperature_;
+    }
+
+    [[nodiscard]]
+    SampleKernelTester& top_k(std::uint32_t top_k) {
+        top_k_ = top_k;
+        return *this;
+    }
+
+    std::uint32_t top_k() const {
+        return top_k_;
+    }
+
+    [[nodiscard]]
+    SampleKernelTester& min_p(float min_p) {
+        min_p_ = min_p;
+        return *this;
+    }
+
+    float min_p() const {
+        return min_p_;
+    }
+
+    [[nodiscard]]
+    SampleKernelTester& iterations(std::uint32_t iterations) {
+        iterations_ = iterations;
+        return *this;
+    }
+
+    std::uint32_t iterations() const {
+        return iterations_;
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_channels(), 0);
+        ASSERT_NE(max_threadgroups(), 0);
+        ASSERT_GT(temperature(), 0.0f);
+        ASSERT_LE(top_k(), 256);
+        ASSERT_GE(min_p(), 0.0f);
+        ASSERT_LE(min_p(), 1.0f);
+        ASSERT_NE(iterations(), 0);
+    }
+
+    void TestF32() const {
+        Validate();
+
+        metal::Buffer score_buffer{device_, num_channels() * sizeof(float)};
+        metal::Buffer argmax_buffer{device_, sizeof(std::uint64_t)};
+        metal::Buffer candidate_buffer{device_, max_threadgroups() * std::max<std::uint32_t>(top_k(), 1) * 2 * sizeof(std::uint32_t)};
+        metal::Buffer token_buffer{device_, iterations() * sizeof(std::uint32_t)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        InitScores(score_buffer, argmax_buffer);
+        const float* score_ptr = static_cast<const float*>(score_buffer.ptr());
+        const float max_score = *std::max_element(score_ptr, score_ptr + num_channels());
+
+        // Reference set of tokens allowed by min-p and top-k.
+        const float threshold = min_p() != 0.0f ? max_score + temperature() * std::log(min_p()) : -INFINITY;
+        std::vector<std::uint32_t> allowed;
+        for (std::uint32_t i = 0; i < num_channels(); i++) {
+            if (score_ptr[i] >= threshold) {
+                allowed.push_back(i);
+            }
+        }
+        if (top_k() != 0 && allowed.size() > top_k()) {
+            std::nth_element(allowed.begin(), allowed.begin() + (top_k() - 1), allowed.end(),
+                [score_ptr](std::uint32_t a, std::uint32_t b) { return score_ptr[a] > score_ptr[b]; });
+            allowed.resize(top_k());
+        }
+        std::sort(allowed.begin(), allowed.end());
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        for (std::uint32_t iteration = 0; iteration < iterations(); iteration++) {
+            std::uint32_t num_candidates = 0;
+            Check(gptoss_metal_command_buffer_encode_launch_f32_sample_filter(
+                    command_buffer.handle(),
+                    f32_sample_filter_fn_.handle(),
+                    /*threadgroup_size=*/512,
+                    max_threadgroups(),
+                    score_buffer.handle(),
+                    /*score_offset=*/0,
+                    argmax_buffer.handle(),
+                    /*argmax_offset=*/0,
+                    candidate_buffer.handle(),
+                    /*candidate_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    kSeed,
+                    /*rng_offset=*/iteration,
+                    num_channels(),
+                    temperature(),
+                    top_k(),
+                    min_p(),
+                    &num_candidates),
+                "gptoss_metal_command_buffer_encode_launch_f32_sample_filter");
+
+            Check(gptoss_metal_command_buffer_encode_launch_f32_sample_candidates(
+                    command_buffer.handle(),
+                    f32_sample_candidates_fn_.handle(),
+                    /*threadgroup_size=*/1024,
+                    candidate_buffer.handle(),
+                    /*candidate_offset=*/0,
+                    token_buffer.handle(),
+                    /*token_offset=*/iteration * sizeof(std::uint32_t),
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    kSeed,
+                    /*rng_offset=*/iteration,
+                    num_candidates,
+                    temperature(),
+                    top_k()),
+                "gptoss_metal_command_buffer_encode_launch_f32_sample_candidates");
+        }
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const std::uint32_t* token_ptr = static_cast<const std::uint32_t*>(token_buffer.ptr());
+        for (std::uint32_t iteration = 0; iteration < iterations(); iteration++) {
+            const std::uint32_t token = token_ptr[iteration];
+            ASSERT_TRUE(std::binary_search(allowed.begin(), allowed.end(), token))
+                << "token " << token << " is filtered out, iteration " << iteration;
+
+            // The sample must be the Gumbel-max sample among the allowed tokens.
+            double ref_max_key = -INFINITY;
+            double token_key = -INFINITY;
+            for (std::uint32_t i : allowed) {
+                const std::uint32_t word = rng::squares32((static_cast<std::uint64_t>(iteration) << 32) + i, kSeed);
+                const double uniform = (static_cast<double>(word >> 8) + 0.5) * 0x1.0p-24;
+                const double key = static_cast<double>(score_ptr[i]) / static_cast<double>(temperature()) - std::log(-std::log(uniform));
+                ref_max_key = std::max(ref_max_key, key);
+                if (i == token) {
+                    token_key = key;
+                }
+            }
+            ASSERT_NEAR(token_key, ref_max_key, 1.0e-4 * std::max(std::abs(ref_max_key), 1.0))
+                << "token " << token << ", iteration " << iteration;
+        }
+    }
+
+    // Runs a stop token check followed by a sampling step for each of the tokens, and verifies that the first stop
+    // token aborts its own sampling step and all steps after it.
+    void TestCheckStopToken(const std::vector<std::uint32_t>& tokens, const std::vector<std::uint32_t>& stop_tokens) const {
+        Validate();
+        ASSERT_FALSE(tokens.empty());
+
+        metal::Buffer score_buffer{device_, num_channels() * sizeof(float)};
+        metal::Buffer argmax_buffer{device_, sizeof(std::uint64_t)};
+        metal::Buffer candidate_buffer{device_, max_threadgroups() * std::max<std::uint32_t>(top_k(), 1) * 2 * sizeof(std::uint32_t)};
+        metal::Buffer token_buffer{device_, tokens.size() * sizeof(std::uint32_t), tokens.data()};
+        metal::Buffer stop_token_mask_buffer{device_, (num_channels() + 31) / 32 * sizeof(std::uint32_t)};
+        metal::Buffer sample_buffer{device_, tokens.size() * sizeof(std::uint32_t)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+        std::memset(sample_buffer.ptr(), 0xFF, sample_buffer.size());
+
+        std::uint32_t* stop_token_mask_ptr = static_cast<std::uint32_t*>(stop_token_mask_buffer.ptr());
+        std::memset(stop_token_mask_ptr, 0, stop_token_mask_buffer.size());
+        for (std::uint32_t token : stop_tokens) {
+            ASSERT_LT(token, num_channels());
+            stop_token_mask_ptr[token / 32] |= UINT32_C(1) << (token % 32);
+        }
+
+        InitScores(score_buffer, argmax_buffer);
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        for (std::uint32_t i = 0; i < tokens.size(); i++) {
+            Check(gptoss_metal_command_buffer_encode_launch_check_stop_token(
+                    command_buffer.handle(),
+                    check_stop_token_fn_.handle(),
+                    token_buffer.handle(),
+                    /*token_offset=*/i * sizeof(std::uint32_t),
+                    stop_token_mask_buffer.handle(),
+                    /*stop_token_mask_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    num_channels()),
+                "gptoss_metal_command_buffer_encode_launch_check_stop_token");
+
+            std::uint32_t num_candidates = 0;
+            Check(gptoss_metal_command_buffer_encode_launch_f32_sample_filter(
+                    command_buffer.handle(),
+                    f32_sample_filter_fn_.handle(),
+                    /*threadgroup_size=*/512,
+                    max_threadgroups(),
+                    score_buffer.handle(),
+                    /*score_offset=*/0,
+                    argmax_buffer.handle(),
+                    /*argmax_offset=*/0,
+                    candidate_buffer.handle(),
+                    /*candidate_offset=*/0,
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    kSeed,
+                    /*rng_offset=*/i,
+                    num_channels(),
+                    temperature(),
+                    top_k(),
+                    min_p(),
+                    &num_candidates),
+                "gptoss_metal_command_buffer_encode_launch_f32_sample_filter");
+
+            Check(gptoss_metal_command_buffer_encode_launch_f32_sample_candidates(
+                    command_buffer.handle(),
+                    f32_sample_candidates_fn_.handle(),
+                    /*threadgroup_size=*/1024,
+                    candidate_buffer.handle(),
+                    /*candidate_offset=*/0,
+                    sample_buffer.handle(),
+                    /*token_offset=*/i * sizeof(std::uint32_t),
+                    control_buffer.handle(),
+                    /*control_offset=*/0,
+                    kSeed,
+                    /*rng_offset=*/i,
+                    num_candidates,
+                    temperature(),
+                    top_k()),
+                "gptoss_metal_command_buffer_encode_launch_f32_sample_candidates");
+        }
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        std::size_t stop_index = 0;
+        while (stop_index < tokens.size() &&
+            std::find(stop_tokens.begin(), stop_tokens.end(), tokens[stop_index]) == stop_tokens.end())
+        {
+            stop_index++;
+        }
+
+        const std::uint32_t* sample_ptr = static_cast<const std::uint32_t*>(sample_buffer.ptr());
+        for (std::size_t i = 0; i < tokens.size(); i++) {
+            if (i < stop_index) {
+                ASSERT_LT(sample_ptr[i], num_channels()) << "sampling step " << i << " before the stop token was skipped";
+            } else {
+                ASSERT_EQ(sample_ptr[i], UINT32_MAX) << "sampling step " << i << " after the stop token was not skipped";
+            }
+        }
+        const gptoss_control* control = static_cast<const gptoss_control*>(control_buffer.ptr());
+        ASSERT_EQ(control->abort != 0, stop_index < tokens.size());
+    }
+
+private:
+    // Fills the scores with random values and stores their maximum in the packed argmax, as the unembedding does.
+    void InitScores(const metal::Buffer& score_buffer, const metal::Buffer& argmax_buffer) const {
+        {
+            metal::CommandBuffer command_buffer{command_queue_};
+            command_buffer.encode_launch_f32_fill_random(
+                f32_fill_random_fn_,
+                /*threadgroup_size=*/0,
+                /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+                /*output_buffer=*/score_buffer, /*output_offset=*/0,
+                num_channels(), kSeed, /*offset=*/0, /*min=*/-8.0f, /*max=*/8.0);
+            command_buffer.commit();
+            command_buffer.wait_completion();
+        }
+
+        const float* score_ptr = static_cast<const float*>(score_buffer.ptr());
+        const float max_score = *std::max_element(score_ptr, score_ptr + num_channels());
+        std::uint32_t max_bits;
+        std::memcpy(&max_bits, &max_score, sizeof(max_bits));
+        if (static_cast<std::int32_t>(max_bits) >= 0) {
+            max_bits ^= 0x7FFFFFFFu;
+        }
+        static_cast<std::uint32_t*>(argmax_buffer.ptr())[1] = max_bits;
+    }
+
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+    static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
+    metal::Function f32_sample_filter_fn_{library_, "gptoss_f32_sample_filter"};
+    metal::Function f32_sample_candidates_fn_{library_, "gptoss_f32_sample_candidates"};
+    metal::Function check_stop_token_fn_{library_, "gptoss_check_stop_token"};
+    std::uint32_t num_channels_{10000};
+    std::size_t max_threadgroups_{10};
+    float temperature_{1.0f};
+    std::uint32_t top_k_{0};
+    float min_p_{0.0f};
+    std::uint32_t iterations_{16};
+};
+
+}  // namespace gptoss
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <internal/datatype.hpp>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+
+namespace gptoss {
+
+class SDPAKernelTester {
+public:
+    SDPAKernelTester() { }
+
+    SDPAKernelTester(const SDPAKernelTester&) = delete;
+    SDPAKernelTester(SDPAKernelTester&&) = delete;
+    SDPAKernelTester& operator=(const SDPAKernelTester&) = delete;
+    SDPAKernelTester& operator=(SDPAKernelTester&&) = delete;
+
+    [[nodiscard]]
+    SDPAKernelTester& num_q_tokens(std::uint32_t num_q_tokens) {
+        num_q_tokens_ = num_q_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_q_tokens() const {
+        return num_q_tokens_;
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& num_kv_tokens(std::uint32_t num_kv_tokens) {
+        num_kv_tokens_ = num_kv_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_kv_tokens() const {
+        return num_kv_tokens_;
+    }
+
+    std::uint32_t max_tokens() const {
+        return num_kv_tokens() + num_q_tokens();
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& window(std::uint32_t window) {
+        window_ = window;
+        return *this;
+    }
+
+    std::uint32_t window() const {
+        return window_;
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& num_kv_splits(std::uint32_t num_kv_splits) {
+        num_kv_splits_ = num_kv_splits;
+        return *this;
+    }
+
+    std::uint32_t num_kv_splits() const {
+        return num_kv_splits_;
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& head_dim(std::uint32_t head_dim) {
+        head_dim_ = head_dim;
+        return *this;
+    }
+
+    std::uint32_t head_dim() const {
+        return head_dim_;
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& num_kv_heads(std::uint32_t num_kv_heads) {
+        num_kv_heads_ = num_kv_heads;
+        return *this;
+    }
+
+    std::uint32_t num_kv_heads() const {
+        return num_kv_heads_;
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& qmul(std::uint32_t qmul) {
+        qmul_ = qmul;
+        return *this;
+    }
+
+    std::uint32_t qmul() const {
+        return qmul_;
+    }
+
+    [[nodiscard]]
+    SDPAKernelTester& threadgroup_qmul(std::uint32_t threadgroup_qmul) {
+        threadgroup_qmul_ = threadgroup_qmul;
+        return *this;
+    }
+
+    std::uint32_t threadgroup_qmul() const {
+        return threadgroup_qmul_;
+    }
+
+    std::uint32_t num_q_heads() const {
+        return num_kv_heads() * qmul();
+    }
+
+    std::uint32_t kv_stride() const {
+        return 2 * max_tokens() * head_dim();
+    }
+
+    std::uint32_t qkv_dim() const {
+        return (num_q_heads() + 2 * num_kv_heads()) * head_dim();
+    }
+
+    // Specialized kernels exist for 64- and 128-dimensional heads; other head dimensions use the generic kernels.
+    std::string kernel_suffix() const {
+        if (head_dim() == 64 || head_dim() == 128) {
+            return "q" + std::to_string(threadgroup_qmul()) + "_d" + std::to_string(head_dim());
+        } else {
+            return "generic";
+        }
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_q_tokens(), 0);
+        ASSERT_NE(window(), 0);
+        ASSERT_NE(num_kv_splits(), 0);
+        ASSERT_NE(head_dim(), 0);
+        ASSERT_NE(num_kv_heads(), 0);
+        ASSERT_NE(threadgroup_qmul(), 0);
+        ASSERT_EQ(qmul() % threadgroup_qmul(), 0);
+        if (kernel_suffix() == "generic") {
+            ASSERT_EQ(threadgroup_qmul(), 1);
+        }
+    }
+
+    enum class SDPAKernelType {
+        DECODE_OPTIMIZED,
+        PREFILL_OPTIMIZED,
+    };
+
+    void TestF32(SDPAKernelType kernel_type = SDPAKernelType::DECODE_OPTIMIZED) const {
+        Validate();
+        if (kernel_type == SDPAKernelType::PREFILL_OPTIMIZED) {
+            ASSERT_EQ(num_kv_splits(), 1);
+        }
+
+        const std::size_t partial_size = (head_dim() + 2) * threadgroup_qmul();
+        const metal::Function f32_sdpa_fn{library_, ("gptoss_f32_sdpa_" + kernel_suffix()).c_str()};
+        const metal::Function f32_sdpa_reduce_fn{library_, ("gptoss_f32_sdpa_reduce_" + kernel_suffix()).c_str()};
+        const metal::Function f32_sdpa_prefill_fn{library_, ("gptoss_f32_sdpa_prefill_" + kernel_suffix()).c_str()};
+
+        metal::Buffer qkv_buffer{device_, num_q_tokens() * qkv_dim() * sizeof(float)};
+        metal::Buffer kv_buffer{device_, num_kv_heads() * kv_stride() * sizeof(float)};
+        metal::Buffer sink_buffer{device_, num_q_heads() * sizeof(gptoss_bfloat16)};
+        metal::Buffer output_buffer{device_, num_q_tokens() * num_q_heads() * head_dim() * sizeof(float)};
+        metal::Buffer partial_buffer{device_, num_q_tokens() * (num_q_heads() / threadgroup_qmul()) * num_kv_splits() * partial_size * sizeof(float)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        metal::CommandBuffer command_buffer_initialize{command_queue_};
+        command_buffer_initialize.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/qkv_buffer,
+            /*output_offset=*/0,
+            num_q_tokens() * qkv_dim(), kSeed, /*offset=*/0, /*min=*/-0.5f, /*max=*/0.5f);
+        command_buffer_initialize.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/kv_buffer,
+            /*output_offset=*/0,
+            num_kv_heads() * kv_stride(), kSeed + 1, /*offset=*/0, /*min=*/-0.5f, /*max=*/0.5f);
+        command_buffer_initialize.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/sink_buffer,
+            /*output_offset=*/0,
+            num_q_heads(), kSeed + 2, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0f);
+        command_buffer_initialize.commit();
+        command_buffer_initialize.wait_completion();
+
+        metal::CommandBuffer command_buffer{command_queue_};
+        switch (kernel_type) {
+            case SDPAKernelType::DECODE_OPTIMIZED:
+                Check(gptoss_metal_command_buffer_encode_launch_f32_sdpa(
+                        command_buffer.handle(),
+                        f32_sdpa_fn.handle(),
+                        qkv_buffer.handle(),
+                        /*q_offset=*/0,
+                        kv_buffer.handle(),
+                        /*kv_offset=*/0,
+                        sink_buffer.handle(),
+                        /*s_offset=*/0,
+                        output_buffer.handle(),
+                        /*output_offset=*/0,
+                        partial_buffer.handle(),
+                        /*partial_offset=*/0,
+                        control_buffer.handle(),
+                        /*control_offset=*/0,
+                        window(),
+                        kv_stride(),
+                        num_q_tokens(),
+                        num_kv_tokens(),
+                        num_q_heads(),
+                        num_kv_heads(),
+                        head_dim(),
+                        threadgroup_qmul(),
+                        num_kv_splits()),
+                    "gptoss_metal_command_buffer_encode_launch_f32_sdpa");
+                if (num_kv_splits() > 1) {
+                    Check(gptoss_metal_command_buffer_encode_launch_f32_sdpa_reduce(
+                            command_buffer.handle(),
+                            f32_sdpa_reduce_fn.handle(),
+                            partial_buffer.handle(),
+                            /*partial_offset=*/0,
+                            output_buffer.handle(),
+                            /*output_offset=*/0,
+                            control_buffer.handle(),
+                            /*control_offset=*/0,
+                            num_q_tokens(),
+                            num_q_heads(),
+                            num_kv_heads(),
+                            head_dim(),
+                            threadgroup_qmul(),
+                            num_kv_splits()),
+                        "gptoss_metal_command_buffer_encode_launch_f32_sdpa_reduce");
+                }
+                break;
+            case SDPAKernelType::PREFILL_OPTIMIZED:
+                Check(gptoss_metal_command_buffer_encode_launch_f32_sdpa_prefill(
+                        command_buffer.handle(),
+                        f32_sdpa_prefill_fn.handle(),
+                        qkv_buffer.handle(),
+                        /*q_offset=*/0,
+                        kv_buffer.handle(),
+                        /*kv_offset=*/0,
+                        sink_buffer.handle(),
+                        /*s_offset=*/0,
+                        output_buffer.handle(),
+                        /*output_offset=*/0,
+                        control_buffer.handle(),
+                        /*control_offset=*/0,
+                        window(),
+                        kv_stride(),
+                        num_q_tokens(),
+                        num_kv_tokens(),
+                        num_q_heads(),
+                        num_kv_heads(),
+                        head_dim(),
+                        threadgroup_qmul()),
+                    "gptoss_metal_command_buffer_encode_launch_f32_sdpa_prefill");
+                break;
+        }
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const float* qkv_ptr = static_cast<const float*>(qkv_buffer.ptr());
+        const float* kv_ptr = static_cast<const float*>(kv_buffer.ptr());
+        const gptoss_bfloat16* sink_ptr = static_cast<const gptoss_bfloat16*>(sink_buffer.ptr());
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        std::vector<double> scores;
+        std::vector<double> ref_output(head_dim());
+        for (std::uint32_t qt = 0; qt < num_q_tokens(); qt++) {
+            const std::uint32_t kt_end = qt + num_kv_tokens() + 1;
+            const std::uint32_t kt_start = kt_end - std::min(kt_end, window());
+            for (std::uint32_t h = 0; h < num_q_heads(); h++) {
+                const float* q = qkv_ptr + qt * qkv_dim() + h * head_dim();
+                const float* kv = kv_ptr + (h / qmul()) * kv_stride();
+
+                const double sink = upcast<double>(sink_ptr[h]);
+                double max_score = sink;
+                scores.clear();
+                for (std::uint32_t kt = kt_start; kt < kt_end; kt++) {
+                    double score = 0.0;
+                    for (std::uint32_t d = 0; d < head_dim(); d++) {
+                        score += static_cast<double>(q[d]) * static_cast<double>(kv[kt * 2 * head_dim() + d]);
+                    }
+                    scores.push_back(score);
+                    max_score = std::max(max_score, score);
+                }
+
+                double sum_exp = std::exp(sink - max_score);
+                std::fill(ref_output.begin(), ref_output.end(), 0.0);
+                for (std::uint32_t kt = kt_start; kt < kt_end; kt++) {
+                    const double p = std::exp(scores[kt - kt_start] - max_score);
+                    sum_exp += p;
+                    for (std::uint32_t d = 0; d < head_dim(); d++) {
+                        ref_output[d] += p * static_cast<double>(kv[(kt * 2 + 1) * head_dim() + d]);
+                    }
+                }
+
+                for (std::uint32_t d = 0; d < head_dim(); d++) {
+                    const double ref_value = ref_output[d] / sum_exp;
+                    ASSERT_NEAR(
+                            static_cast<double>(output_ptr[(qt * num_q_heads() + h) * head_dim() + d]),
+                            ref_value,
+                            std::max(std::abs(ref_value) * 1.0e-3, 1.0e-5))
+                        << "at token " << qt << " / " << num_q_tokens() << ", head " << h << ", element " << d;
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr uint64_t kSeed{UINT64_C(1019827666124465388)};
+    static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
+    metal::Function bf16_fill_random_fn_{library_, "gptoss_bf16_fill_random"};
+    std::uint32_t num_q_tokens_{1};
+    std::uint32_t num_kv_tokens_{0};
+    std::uint32_t window_{std::numeric_limits<std::uint32_t>::max()};
+    std::uint32_t num_kv_splits_{1};
+    std::uint32_t head_dim_{64};
+    std::uint32_t num_kv_heads_{8};
+    std::uint32_t qmul_{8};
+    std::uint32_t threadgroup_qmul_{8};
+};
+
+}  // namespace gptoss
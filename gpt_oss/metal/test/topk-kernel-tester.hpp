@@ -0,0 +1,242 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include <internal/kernel-args.h>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+
+
+namespace gptoss {
+
+class TopKKernelTester {
+public:
+    TopKKernelTester() { }
+
+    TopKKernelTester(const TopKKernelTester&) = delete;
+    TopKKernelTester(TopKKernelTester&&) = delete;
+    TopKKernelTester& operator=(const TopKKernelTester&) = delete;
+    TopKKernelTester& operator=(TopKKernelTester&&) = delete;
+
+    [[nodiscard]]
+    TopKKernelTester& num_tokens(std::uint32_t num_tokens) {
+        num_tokens_ = num_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_tokens() const {
+        return num_tokens_;
+    }
+
+    [[nodiscard]]
+    TopKKernelTester& num_experts(std::uint32_t num_experts) {
+        num_experts_ = num_experts;
+        return *this;
+    }
+
+    std::uint32_t num_experts() const {
+        return num_experts_;
+    }
+
+    [[nodiscard]]
+    TopKKernelTester& num_active_experts(std::uint32_t num_active_experts) {
+        num_active_experts_ = num_active_experts;
+        return *this;
+    }
+
+    std::uint32_t num_active_experts() const {
+        return num_active_experts_;
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_tokens(), 0);
+        ASSERT_NE(num_experts(), 0);
+        ASSERT_NE(num_active_experts(), 0);
+        ASSERT_LE(num_active_experts(), num_experts());
+    }
+
+    // A null kernel_name selects the specialized gptoss_f32_topk_softmax_e<experts>_k<active experts> kernel.
+    void TestF32(const char* kernel_name = nullptr) const {
+        Validate();
+
+        const std::string default_name = "gptoss_f32_topk_softmax_e" + std::to_string(num_experts()) +
+            "_k" + std::to_string(num_active_experts());
+        metal::Function f32_topk_fn{library_, kernel_name != nullptr ? kernel_name : default_name.c_str()};
+
+        metal::Buffer input_buffer{device_, num_tokens() * num_experts() * sizeof(float)};
+        metal::Buffer output_buffer{device_, num_tokens() * num_active_experts() * sizeof(gptoss_expert_prediction)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        metal::CommandBuffer command_buffer{command_queue_};
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer, /*output_offset=*/0,
+            num_tokens() * num_experts(), kSeed, /*offset=*/0, /*min=*/-4.0f, /*max=*/4.0);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_topk(
+                command_buffer.handle(),
+                f32_topk_fn.handle(),
+                input_buffer.handle(),
+                /*input_offset=*/0,
+                output_buffer.handle(),
+                /*output_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                num_tokens(),
+                num_experts(),
+                num_active_experts()),
+            "gptoss_metal_command_buffer_encode_launch_f32_topk");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const float* input_ptr = static_cast<const float*>(input_buffer.ptr());
+        const gptoss_expert_prediction* output_ptr = static_cast<const gptoss_expert_prediction*>(output_buffer.ptr());
+        std::vector<std::uint32_t> ref_experts(num_experts());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            const float* logits = input_ptr + t * num_experts();
+            std::iota(ref_experts.begin(), ref_experts.end(), 0);
+            std::stable_sort(ref_experts.begin(), ref_experts.end(),
+                [logits](std::uint32_t a, std::uint32_t b) { return logits[a] > logits[b]; });
+
+            double sum = 0.0;
+            for (std::uint32_t i = 0; i < num_active_experts(); i++) {
+                sum += std::exp(static_cast<double>(logits[ref_experts[i]]) - static_cast<double>(logits[ref_experts[0]]));
+            }
+            for (std::uint32_t i = 0; i < num_active_experts(); i++) {
+                const gptoss_expert_prediction& prediction = output_ptr[t * num_active_experts() + i];
+                const double ref_score =
+                    std::exp(static_cast<double>(logits[ref_experts[i]]) - static_cast<double>(logits[ref_experts[0]])) / sum;
+                ASSERT_EQ(prediction.expert_id, ref_experts[i])
+                    << "at rank " << i << " / " << num_active_experts() << ", token " << t << " / " << num_tokens();
+                ASSERT_NEAR(prediction.score, ref_score, 1.0e-5 * ref_score)
+                    << "at rank " << i << " / " << num_active_experts() << ", token " << t << " / " << num_tokens();
+            }
+        }
+    }
+
+    // Routes random router logits with the generic top-k kernel, and checks that gptoss_expert_group groups all
+    // (token, active expert) assignments by their expert, and splits the groups into tasks.
+    void TestExpertGroup() const {
+        Validate();
+
+        metal::Function f32_topk_fn{library_, "gptoss_f32_topk_softmax"};
+        metal::Function expert_group_fn{library_, "gptoss_expert_group"};
+
+        const std::uint32_t num_assignments = num_tokens() * num_active_experts();
+        metal::Buffer input_buffer{device_, num_tokens() * num_experts() * sizeof(float)};
+        metal::Buffer expert_buffer{device_, num_assignments * sizeof(gptoss_expert_prediction)};
+        metal::Buffer expert_offset_buffer{device_, (num_experts() + 1) * sizeof(std::uint32_t)};
+        metal::Buffer expert_assignment_buffer{device_, num_assignments * sizeof(std::uint32_t)};
+        const std::uint32_t max_tasks = EXPERT_GROUP_MAX_TASKS(num_assignments, num_experts());
+        metal::Buffer expert_task_buffer{device_, max_tasks * sizeof(gptoss_expert_group_task)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        metal::CommandBuffer command_buffer{command_queue_};
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer, /*output_offset=*/0,
+            num_tokens() * num_experts(), kSeed, /*offset=*/0, /*min=*/-4.0f, /*max=*/4.0);
+
+        Check(gptoss_metal_command_buffer_encode_launch_f32_topk(
+                command_buffer.handle(),
+                f32_topk_fn.handle(),
+                input_buffer.handle(),
+                /*input_offset=*/0,
+                expert_buffer.handle(),
+                /*output_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                num_tokens(),
+                num_experts(),
+                num_active_experts()),
+            "gptoss_metal_command_buffer_encode_launch_f32_topk");
+
+        Check(gptoss_metal_command_buffer_encode_launch_expert_group(
+                command_buffer.handle(),
+                expert_group_fn.handle(),
+                expert_buffer.handle(),
+                /*expert_offset=*/0,
+                expert_offset_buffer.handle(),
+                /*expert_offset_offset=*/0,
+                expert_assignment_buffer.handle(),
+                /*expert_assignment_offset=*/0,
+                expert_task_buffer.handle(),
+                /*expert_task_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                num_tokens(),
+                num_experts(),
+                num_active_experts()),
+            "gptoss_metal_command_buffer_encode_launch_expert_group");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        const gptoss_expert_prediction* expert_ptr = static_cast<const gptoss_expert_prediction*>(expert_buffer.ptr());
+        const std::uint32_t* offset_ptr = static_cast<const std::uint32_t*>(expert_offset_buffer.ptr());
+        const std::uint32_t* assignment_ptr = static_cast<const std::uint32_t*>(expert_assignment_buffer.ptr());
+        ASSERT_EQ(offset_ptr[0], 0);
+        ASSERT_EQ(offset_ptr[num_experts()], num_assignments);
+        std::vector<bool> seen(num_assignments);
+        for (std::uint32_t e = 0; e < num_experts(); e++) {
+            ASSERT_LE(offset_ptr[e], offset_ptr[e + 1]) << "at expert " << e << " / " << num_experts();
+            for (std::uint32_t i = offset_ptr[e]; i < offset_ptr[e + 1]; i++) {
+                const std::uint32_t assignment = assignment_ptr[i];
+                ASSERT_LT(assignment, num_assignments) << "at position " << i;
+                ASSERT_FALSE(seen[assignment]) << "assignment " << assignment << " is duplicated";
+                seen[assignment] = true;
+                ASSERT_EQ(expert_ptr[assignment].expert_id, e)
+                    << "assignment " << assignment << " is in the group of expert " << e;
+            }
+        }
+
+        // Tasks split each group into consecutive chunks of up to MOE_GROUP_Bt assignments, followed by empty tasks.
+        const gptoss_expert_group_task* task_ptr = static_cast<const gptoss_expert_group_task*>(expert_task_buffer.ptr());
+        std::uint32_t task = 0;
+        for (std::uint32_t e = 0; e < num_experts(); e++) {
+            for (std::uint32_t i = offset_ptr[e]; i < offset_ptr[e + 1]; i += MOE_GROUP_Bt) {
+                ASSERT_LT(task, max_tasks) << "at expert " << e << " / " << num_experts();
+                ASSERT_EQ(task_ptr[task].expert_id, e) << "at task " << task;
+                ASSERT_EQ(task_ptr[task].assignment_offset, i) << "at task " << task;
+                ASSERT_EQ(task_ptr[task].num_assignments, std::min<std::uint32_t>(offset_ptr[e + 1] - i, MOE_GROUP_Bt))
+                    << "at task " << task;
+                task++;
+            }
+        }
+        for (; task < max_tasks; task++) {
+            ASSERT_EQ(task_ptr[task].num_assignments, 0) << "at task " << task;
+        }
+    }
+
+private:
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+    static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
+    std::uint32_t num_tokens_{1};
+    std::uint32_t num_experts_{32};
+    std::uint32_t num_active_experts_{4};
+};
+
+}  // namespace gptoss
@@ -68,3 +68,15 @@ TEST(U32_FILL_RANDOM, partial_range) {
         .max_threadgroups(num_threadgroups)
         .TestU32();
 }
+
+TEST(U32_FILL_RANDOM, recorded) {
+    constexpr std::size_t num_iterations = 3;
+    constexpr std::size_t num_threadgroups = 2;
+
+    FillRandomKernelTester()
+        .num_elements(num_iterations * num_threadgroups * kThreadgroupSize)
+        .threadgroup_size(kThreadgroupSize)
+        .max_threadgroups(num_threadgroups)
+        .recorded(true)
+        .TestU32();
+}
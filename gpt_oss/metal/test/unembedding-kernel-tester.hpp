@@ -0,0 +1,331 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <internal/datatype.hpp>
+#include <internal/metal.hpp>
+#include <internal/metal-kernels.h>
+#include <internal/rng.hpp>
+
+
+namespace gptoss {
+
+class UnembeddingKernelTester {
+public:
+    UnembeddingKernelTester() { }
+
+    UnembeddingKernelTester(const UnembeddingKernelTester&) = delete;
+    UnembeddingKernelTester(UnembeddingKernelTester&&) = delete;
+    UnembeddingKernelTester& operator=(const UnembeddingKernelTester&) = delete;
+    UnembeddingKernelTester& operator=(UnembeddingKernelTester&&) = delete;
+
+    [[nodiscard]]
+    UnembeddingKernelTester& num_tokens(std::uint32_t num_tokens) {
+        num_tokens_ = num_tokens;
+        return *this;
+    }
+
+    std::uint32_t num_tokens() const {
+        return num_tokens_;
+    }
+
+    [[nodiscard]]
+    UnembeddingKernelTester& num_cols(std::uint32_t num_cols) {
+        num_cols_ = num_cols;
+        return *this;
+    }
+
+    std::uint32_t num_cols() const {
+        return num_cols_;
+    }
+
+    [[nodiscard]]
+    UnembeddingKernelTester& num_rows(std::uint32_t num_rows) {
+        num_rows_ = num_rows;
+        return *this;
+    }
+
+    std::uint32_t num_rows() const {
+        return num_rows_;
+    }
+
+    [[nodiscard]]
+    UnembeddingKernelTester& threadgroup_size(std::size_t threadgroup_size) {
+        threadgroup_size_ = threadgroup_size;
+        return *this;
+    }
+
+    std::size_t threadgroup_size() const {
+        return threadgroup_size_;
+    }
+
+    [[nodiscard]]
+    UnembeddingKernelTester& max_threadgroups(std::size_t max_threadgroups) {
+        max_threadgroups_ = max_threadgroups;
+        return *this;
+    }
+
+    std::size_t max_threadgroups() const {
+        return max_threadgroups_;
+    }
+
+    [[nodiscard]]
+    UnembeddingKernelTester& output_scores(bool output_scores) {
+        output_scores_ = output_scores;
+        return *this;
+    }
+
+    bool output_scores() const {
+        return output_scores_;
+    }
+
+    [[nodiscard]]
+    UnembeddingKernelTester& temperature(float temperature) {
+        temperature_ = temperature;
+        return *this;
+    }
+
+    float temperature() const {
+        return temperature_;
+    }
+
+    [[nodiscard]]
+    UnembeddingKernelTester& logit_bias(bool logit_bias) {
+        logit_bias_ = logit_bias;
+        return *this;
+    }
+
+    bool logit_bias() const {
+        return logit_bias_;
+    }
+
+    [[nodiscard]]
+    UnembeddingKernelTester& token_mask(bool token_mask) {
+        token_mask_ = token_mask;
+        return *this;
+    }
+
+    bool token_mask() const {
+        return token_mask_;
+    }
+
+    void Validate() const {
+        ASSERT_NE(num_tokens(), 0);
+        ASSERT_NE(num_cols(), 0);
+        ASSERT_EQ(num_cols() % 4, 0);
+        ASSERT_NE(num_rows(), 0);
+        ASSERT_NE(threadgroup_size(), 0);
+        ASSERT_EQ(threadgroup_size() % 32, 0);
+        ASSERT_NE(max_threadgroups(), 0);
+        ASSERT_GE(temperature(), 0.0f);
+    }
+
+    void TestF32_BF16W_RMSNorm() const {
+        Validate();
+
+        metal::Buffer input_buffer{device_, num_tokens() * num_cols() * sizeof(float)};
+        metal::Buffer norm_weight_buffer{device_, num_cols() * sizeof(gptoss_bfloat16)};
+        metal::Buffer weight_buffer{device_, num_rows() * num_cols() * sizeof(gptoss_bfloat16)};
+        metal::Buffer output_buffer{device_, num_tokens() * num_rows() * sizeof(float)};
+        metal::Buffer argmax_buffer{device_, num_tokens() * sizeof(std::uint64_t)};
+        metal::Buffer lse_buffer{device_, num_tokens() * max_threadgroups() * 2 * sizeof(float)};
+        metal::Buffer bias_buffer{device_, num_rows() * sizeof(float)};
+        metal::Buffer token_mask_buffer{device_, (num_rows() + 31) / 32 * sizeof(std::uint32_t)};
+        metal::Buffer control_buffer{device_, sizeof(gptoss_control)};
+        std::memset(argmax_buffer.ptr(), 0xFF, num_tokens() * sizeof(std::uint64_t));
+        std::memset(control_buffer.ptr(), 0, sizeof(gptoss_control));
+
+        float* bias_ptr = static_cast<float*>(bias_buffer.ptr());
+        for (std::uint32_t r = 0; r < num_rows(); r++) {
+            bias_ptr[r] = r % kBiasPeriod == 0 ? kBias : 0.0f;
+        }
+        std::uint32_t* token_mask_ptr = static_cast<std::uint32_t*>(token_mask_buffer.ptr());
+        std::memset(token_mask_ptr, 0, token_mask_buffer.size());
+        for (std::uint32_t r = 0; r < num_rows(); r += kMaskPeriod) {
+            token_mask_ptr[r / 32] |= UINT32_C(1) << (r % 32);
+        }
+
+        metal::CommandBuffer command_buffer{command_queue_};
+
+        command_buffer.encode_launch_f32_fill_random(
+            f32_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/input_buffer, /*output_offset=*/0,
+            num_tokens() * num_cols(), kSeed, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        command_buffer.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/norm_weight_buffer, /*output_offset=*/0,
+            num_cols(), kSeed + 1, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        command_buffer.encode_launch_bf16_fill_random(
+            bf16_fill_random_fn_,
+            /*threadgroup_size=*/0,
+            /*max_threadgroups=*/kFillRandomMaxThreadgroups,
+            /*output_buffer=*/weight_buffer, /*output_offset=*/0,
+            num_rows() * num_cols(), kSeed + 2, /*offset=*/0, /*min=*/-1.0f, /*max=*/1.0);
+
+        std::uint32_t num_lse_partials = 0;
+        Check(gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_unembedding(
+                command_buffer.handle(),
+                f32_bf16w_rmsnorm_unembedding_fn_.handle(),
+                threadgroup_size(),
+                max_threadgroups(),
+                input_buffer.handle(),
+                /*input_offset=*/0,
+                norm_weight_buffer.handle(),
+                /*norm_weight_offset=*/0,
+                weight_buffer.handle(),
+                /*weight_offset=*/0,
+                output_buffer.handle(),
+                /*output_offset=*/0,
+                argmax_buffer.handle(),
+                /*argmax_offset=*/0,
+                lse_buffer.handle(),
+                /*lse_offset=*/0,
+                bias_buffer.handle(),
+                /*bias_offset=*/0,
+                token_mask_buffer.handle(),
+                /*token_mask_offset=*/0,
+                control_buffer.handle(),
+                /*control_offset=*/0,
+                num_tokens(),
+                num_cols(),
+                num_rows(),
+                kEpsilon,
+                output_scores(),
+                temperature(),
+                kSeed,
+                kRngOffset,
+                logit_bias(),
+                token_mask(),
+                &num_lse_partials),
+            "gptoss_metal_command_buffer_encode_launch_f32_bf16w_rmsnorm_unembedding");
+
+        command_buffer.commit();
+        command_buffer.wait_completion();
+
+        ASSERT_NE(num_lse_partials, 0);
+        ASSERT_LE(num_lse_partials, max_threadgroups());
+
+        const float* input_ptr = static_cast<const float*>(input_buffer.ptr());
+        const gptoss_bfloat16* norm_weight_ptr = static_cast<const gptoss_bfloat16*>(norm_weight_buffer.ptr());
+        const gptoss_bfloat16* weight_ptr = static_cast<const gptoss_bfloat16*>(weight_buffer.ptr());
+        const float* output_ptr = static_cast<const float*>(output_buffer.ptr());
+        const std::uint32_t* argmax_ptr = static_cast<const std::uint32_t*>(argmax_buffer.ptr());
+        const float* lse_ptr = static_cast<const float*>(lse_buffer.ptr());
+        std::vector<double> normalized_input(num_cols());
+        std::vector<double> ref_scores(num_rows());
+        for (std::uint32_t t = 0; t < num_tokens(); t++) {
+            double sumsq = 0.0;
+            for (std::uint32_t c = 0; c < num_cols(); c++) {
+                const double val = static_cast<double>(input_ptr[t * num_cols() + c]);
+                sumsq = std::fma(val, val, sumsq);
+            }
+            const double scale = 1.0 / std::sqrt(sumsq / static_cast<double>(num_cols()) + kEpsilon);
+            for (std::uint32_t c = 0; c < num_cols(); c++) {
+                normalized_input[c] = scale * static_cast<double>(input_ptr[t * num_cols() + c]) * upcast<double>(norm_weight_ptr[c]);
+            }
+
+            double ref_max_score = -std::numeric_limits<double>::infinity();
+            for (std::uint32_t r = 0; r < num_rows(); r++) {
+                double ref_score = 0.0;
+                for (std::uint32_t c = 0; c < num_cols(); c++) {
+                    ref_score = std::fma(normalized_input[c], upcast<double>(weight_ptr[r * num_cols() + c]), ref_score);
+                }
+                if (logit_bias()) {
+                    ref_score += static_cast<double>(bias_ptr[r]);
+                }
+                if (token_mask() && r % kMaskPeriod != 0) {
+                    ref_score = -std::numeric_limits<double>::infinity();
+                }
+                ref_scores[r] = ref_score;
+                ref_max_score = std::max(ref_max_score, ref_score);
+                if (output_scores()) {
+                    const double output = static_cast<double>(output_ptr[t * num_rows() + r]);
+                    if (std::isinf(ref_score)) {
+                        ASSERT_EQ(output, ref_score)
+                            << "at row " << r << " / " << num_rows() << ", token " << t << " / " << num_tokens();
+                    } else {
+                        ASSERT_NEAR(output, ref_score, 1.0e-4 * std::max(std::abs(ref_score), 1.0))
+                            << "at row " << r << " / " << num_rows() << ", token " << t << " / " << num_tokens();
+                    }
+                }
+            }
+            double ref_sum_exp = 0.0;
+            for (std::uint32_t r = 0; r < num_rows(); r++) {
+                ref_sum_exp += std::exp(ref_scores[r] - ref_max_score);
+            }
+            const double ref_lse = ref_max_score + std::log(ref_sum_exp);
+
+            // With a temperature, the argmax is taken over the Gumbel-perturbed scaled scores.
+            if (temperature() != 0.0f) {
+                const double inv_temperature = static_cast<double>(1.0f / temperature());
+                for (std::uint32_t r = 0; r < num_rows(); r++) {
+                    const std::uint32_t word = rng::squares32((static_cast<std::uint64_t>(kRngOffset + t) << 32) + r, kSeed);
+                    const double uniform = (static_cast<double>(word >> 8) + 0.5) * 0x1.0p-24;
+                    ref_scores[r] = ref_scores[r] * inv_temperature - std::log(-std::log(uniform));
+                }
+            }
+            const double ref_max_key = *std::max_element(ref_scores.begin(), ref_scores.end());
+            const std::uint32_t argmax_row = argmax_ptr[t * 2];
+            ASSERT_LT(argmax_row, num_rows()) << "token " << t << " / " << num_tokens();
+            ASSERT_NEAR(ref_scores[argmax_row], ref_max_key, 1.0e-4 * std::max(std::abs(ref_max_key), 1.0))
+                << "argmax row " << argmax_row << ", token " << t << " / " << num_tokens();
+
+            double max_score = -std::numeric_limits<double>::infinity();
+            for (std::uint32_t i = 0; i < num_lse_partials; i++) {
+                max_score = std::max(max_score, static_cast<double>(lse_ptr[(t * num_lse_partials + i) * 2]));
+            }
+            double sum_exp = 0.0;
+            for (std::uint32_t i = 0; i < num_lse_partials; i++) {
+                const double partial_max_score = static_cast<double>(lse_ptr[(t * num_lse_partials + i) * 2]);
+                const double partial_sum_exp = static_cast<double>(lse_ptr[(t * num_lse_partials + i) * 2 + 1]);
+                if (partial_sum_exp != 0.0) {
+                    sum_exp += partial_sum_exp * std::exp(partial_max_score - max_score);
+                }
+            }
+            const double lse = max_score + std::log(sum_exp);
+            ASSERT_NEAR(lse, ref_lse, 1.0e-4 * std::max(std::abs(ref_lse), 1.0))
+                << "token " << t << " / " << num_tokens();
+        }
+    }
+
+private:
+    static constexpr std::uint64_t kSeed{UINT64_C(1019827666124465388)};
+    static constexpr std::size_t kFillRandomMaxThreadgroups = 10;
+    static constexpr float kEpsilon{1.0e-5f};
+    static constexpr std::uint32_t kRngOffset{42};
+    static constexpr std::uint32_t kBiasPeriod{7};
+    static constexpr float kBias{4.0f};
+    static constexpr std::uint32_t kMaskPeriod{3};
+
+    metal::Device device_{};
+    metal::CommandQueue command_queue_{device_};
+    metal::Library library_{device_};
+    metal::Function f32_fill_random_fn_{library_, "gptoss_f32_fill_random"};
+    metal::Function bf16_fill_random_fn_{library_, "gptoss_bf16_fill_random"};
+    metal::Function f32_bf16w_rmsnorm_unembedding_fn_{library_, "gptoss_f32_bf16w_rmsnorm_unembedding"};
+    std::uint32_t num_tokens_{1};
+    std::uint32_t num_cols_{256};
+    std::uint32_t num_rows_{1000};
+    std::size_t threadgroup_size_{128};
+    std::size_t max_threadgroups_{10};
+    bool output_scores_{true};
+    float temperature_{0.0f};
+    bool logit_bias_{false};
+    bool token_mask_{false};
+};
+
+}  // namespace gptoss